@@ -12,6 +12,7 @@
 
 #include "usb_cdc.h"
 #include "cmd.h"
+#include "crc16.h"
 
 #include "proxmark3.h"
 #include "apps.h"
@@ -620,6 +621,10 @@ void UsbPacketReceived(uint8_t *packet, int len)
 	UsbCommand *c = (UsbCommand *)packet;
 
 //  Dbprintf("received %d bytes, with command: 0x%04x and args: %d %d %d",len,c->cmd,c->arg[0],c->arg[1],c->arg[2]);
+
+	// Everything we send while handling this command carries its tag
+	cmd_set_tag(USB_CMD_TAG(c->cmd));
+	c->cmd = USB_CMD_ID(c->cmd);
   
 	switch(c->cmd) {
 #ifdef WITH_LF
@@ -627,6 +632,9 @@ void UsbPacketReceived(uint8_t *packet, int len)
 			AcquireRawAdcSamples125k(c->arg[0]);
 			cmd_send(CMD_ACK,0,0,0,0,0);
 			break;
+		case CMD_STREAM_RAW_ADC_SAMPLES_125K:
+			StreamRawAdcSamples125k(c->arg[0], c->arg[1]);
+			break;
 		case CMD_MOD_THEN_ACQUIRE_RAW_ADC_SAMPLES_125K:
 			ModThenAcquireRawAdcSamples125k(c->arg[0],c->arg[1],c->arg[2],c->d.asBytes);
 			break;
@@ -816,6 +824,9 @@ void UsbPacketReceived(uint8_t *packet, int len)
 		case CMD_MIFARE_CHKKEYS:
 			MifareChkKeys(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
 			break;
+		case CMD_MIFARE_CHKKEYS_SECTORS:
+			MifareChkKeysSectors(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
+			break;
 		case CMD_SIMULATE_MIFARE_CARD:
 			Mifare1ksim(c->arg[0], c->arg[1], c->arg[2], c->d.asBytes);
 			break;
@@ -917,6 +928,20 @@ void UsbPacketReceived(uint8_t *packet, int len)
 			LED_B_OFF();
 			break;
 
+		case CMD_DOWNLOAD_BIGBUF_BULK: {
+			// One contiguous write without per-frame headers, see usb_cmd.h
+			size_t offset = MIN(c->arg[0], BIGBUF_SIZE);
+			size_t len = MIN(c->arg[1], BIGBUF_SIZE - offset);
+			byte_t *data = ((byte_t*)BigBuf) + offset;
+			LED_B_ON();
+			uint16_t crc = update_crc16_buffer(USB_FRAME_CRC_INIT, data, len);
+			cmd_send(CMD_BULK_DATA,offset,len,0,0,0);
+			usb_write(data,len);
+			cmd_send(CMD_ACK,len,crc,0,0,0);
+			LED_B_OFF();
+			break;
+		}
+
 		case CMD_DOWNLOADED_SIM_SAMPLES_125K: {
 			uint8_t *b = (uint8_t *)BigBuf;
 			memcpy(b+c->arg[0], c->d.asBytes, 48);
@@ -947,6 +972,21 @@ void UsbPacketReceived(uint8_t *packet, int len)
 			SendVersion();
 			break;
 
+		case CMD_SET_FRAME_FORMAT:
+			cmd_set_frame_format(c->arg[0]);
+			cmd_send(CMD_ACK,c->arg[0],0,0,0,0);
+			break;
+
+		case CMD_USB_BENCHMARK:
+			// Stream arg0 frames carrying arg1 bytes each, then ACK
+			LED_B_ON();
+			for(size_t i=0; i<c->arg[0]; i++) {
+				cmd_send(CMD_USB_BENCHMARK,i,0,0,(byte_t*)BigBuf,c->arg[1]);
+			}
+			cmd_send(CMD_ACK,c->arg[0],0,0,0,0);
+			LED_B_OFF();
+			break;
+
 #ifdef WITH_LCD
 		case CMD_LCD_RESET:
 			LCDReset();
@@ -977,7 +1017,7 @@ void UsbPacketReceived(uint8_t *packet, int len)
 			break;
 
 		case CMD_DEVICE_INFO: {
-			uint32_t dev_info = DEVICE_INFO_FLAG_OSIMAGE_PRESENT | DEVICE_INFO_FLAG_CURRENT_MODE_OS;
+			uint32_t dev_info = DEVICE_INFO_FLAG_OSIMAGE_PRESENT | DEVICE_INFO_FLAG_CURRENT_MODE_OS | DEVICE_INFO_FLAG_UNDERSTANDS_CMD_TAG | DEVICE_INFO_FLAG_UNDERSTANDS_COMPACT_FRAMES | DEVICE_INFO_FLAG_UNDERSTANDS_BULK_DOWNLOAD | DEVICE_INFO_FLAG_UNDERSTANDS_LF_STREAM | DEVICE_INFO_FLAG_UNDERSTANDS_CHKKEYS_SECTORS;
 			if(common_area.flags.bootrom_present) dev_info |= DEVICE_INFO_FLAG_BOOTROM_PRESENT;
 //			UsbSendPacket((uint8_t*)&c, sizeof(c));
 			cmd_send(CMD_DEVICE_INFO,dev_info,0,0,0,0);	
@@ -987,6 +1027,9 @@ void UsbPacketReceived(uint8_t *packet, int len)
 			Dbprintf("%s: 0x%04x","unknown command:",c->cmd);
 			break;
 	}
+
+	// Frames sent on our own from here on don't belong to this command
+	cmd_set_tag(0);
 }
 
 void  __attribute__((noreturn)) AppMain(void)
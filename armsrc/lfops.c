@@ -15,6 +15,7 @@
 #include "crc16.h"
 #include "string.h"
 #include "lfdemod.h"
+#include "cmd.h"
 
 
 /**
@@ -106,6 +107,133 @@ void SnoopLFRawAdcSamples(int divisor, int trigger_threshold)
     DoAcquisition125k(trigger_threshold);
 }
 
+#define LF_STREAM_BLOCK_SIZE  512
+#define LF_STREAM_BLOCKS      64     // must be a power of two
+
+typedef struct {
+    UsbFrameHeader hdr;
+    uint8_t data[LF_STREAM_BLOCK_SIZE];
+} PACKED lf_stream_block_t;
+
+// The header of a full block, the last one is cut short when the stream ends
+static void LFStreamHeader(lf_stream_block_t *b, uint64_t cmd, uint32_t blockNo, uint32_t dropped)
+{
+    b->hdr.magic = USB_FRAME_MAGIC;
+    b->hdr.length = LF_STREAM_BLOCK_SIZE;
+    b->hdr.crc = 0;
+    b->hdr.cmd = cmd;
+    b->hdr.arg[0] = blockNo;
+    b->hdr.arg[1] = LF_STREAM_BLOCK_SIZE;
+    b->hdr.arg[2] = dropped;
+}
+
+/**
+* Streams samples to the client until max_samples (0 = unlimited) have been
+* taken, the button is pressed or the client sends anything.
+* Blocks are filled in a ring in BigBuf and pushed out one USB packet at a
+* time, so sampling never waits for the host. The CRC of each block is
+* computed one byte per loop iteration to keep up with the ADC; when the
+* ring is full, samples are dropped and counted instead of stalling.
+**/
+void StreamRawAdcSamples125k(int divisor, uint32_t max_samples)
+{
+    lf_stream_block_t *ring = (lf_stream_block_t *)BigBuf;
+    uint64_t cmd = CMD_STREAMED_RAW_ADC_SAMPLES_125K | ((uint64_t)cmd_get_tag() << USB_CMD_TAG_SHIFT);
+    uint32_t head = 0, fill = 0;            // block being filled
+    uint32_t crc_blk = 0, crc_pos = 0;      // block being checksummed
+    uint16_t crc = USB_FRAME_CRC_INIT;
+    uint32_t tail = 0, tail_pos = 0;        // block being sent
+    uint32_t total = 0, dropped = 0, iter = 0;
+    lf_stream_block_t *b;
+
+    LFSetupFPGAForADC(divisor, true);
+    LED_B_ON();
+
+    // A block's header is written before the checksum can get to it
+    LFStreamHeader(&ring[0], cmd, 0, 0);
+    for(;;) {
+        if (AT91C_BASE_SSC->SSC_SR & AT91C_SSC_TXRDY) {
+            AT91C_BASE_SSC->SSC_THR = 0x43;
+        }
+        if (AT91C_BASE_SSC->SSC_SR & AT91C_SSC_RXRDY) {
+            uint8_t sample = (uint8_t)AT91C_BASE_SSC->SSC_RHR;
+            if (fill == LF_STREAM_BLOCK_SIZE && head - tail < LF_STREAM_BLOCKS - 1) {
+                head++;
+                fill = 0;
+                LFStreamHeader(&ring[head & (LF_STREAM_BLOCKS - 1)], cmd, head, dropped);
+            }
+            if (fill == LF_STREAM_BLOCK_SIZE) {
+                dropped++;
+                LED_D_ON();
+            } else {
+                b = &ring[head & (LF_STREAM_BLOCKS - 1)];
+                b->data[fill++] = sample;
+                if (++total == max_samples) break;
+            }
+            continue;
+        }
+
+        // Checksum one byte of the oldest unfinished block, once it has samples
+        b = &ring[crc_blk & (LF_STREAM_BLOCKS - 1)];
+        if ((crc_blk != head || fill) && crc_pos < sizeof(UsbFrameHeader) + (crc_blk == head ? fill : LF_STREAM_BLOCK_SIZE)) {
+            crc = update_crc16(crc, ((uint8_t *)b)[crc_pos++]);
+        } else if (crc_blk != head) {
+            b->hdr.crc = crc;
+            crc = USB_FRAME_CRC_INIT;
+            crc_pos = 0;
+            crc_blk++;
+        }
+
+        // Hand the next packet of a finished block to the USB controller
+        if (tail != crc_blk) {
+            b = &ring[tail & (LF_STREAM_BLOCKS - 1)];
+            tail_pos += usb_write_packet((uint8_t *)b + tail_pos, sizeof(lf_stream_block_t) - tail_pos);
+            if (tail_pos == sizeof(lf_stream_block_t)) {
+                tail++;
+                tail_pos = 0;
+                LED_D_OFF();
+            }
+        }
+
+        if ((++iter & 0x3ff) == 0 && (BUTTON_PRESS() || usb_poll())) break;
+    }
+
+    // Close the last (partial) block and flush everything still queued
+    if (fill) {
+        b = &ring[head & (LF_STREAM_BLOCKS - 1)];
+        b->hdr.length = fill;
+        b->hdr.arg[1] = fill;
+        if (crc_blk == head) {
+            // its header went into the checksum with the full length
+            crc = USB_FRAME_CRC_INIT;
+            crc_pos = 0;
+        }
+        head++;
+    }
+    while (crc_blk != head) {
+        b = &ring[crc_blk & (LF_STREAM_BLOCKS - 1)];
+        crc = update_crc16_buffer(crc, (uint8_t *)b + crc_pos, sizeof(UsbFrameHeader) + b->hdr.length - crc_pos);
+        b->hdr.crc = crc;
+        crc = USB_FRAME_CRC_INIT;
+        crc_pos = 0;
+        crc_blk++;
+    }
+    while (tail != head && usb_check()) {
+        b = &ring[tail & (LF_STREAM_BLOCKS - 1)];
+        tail_pos += usb_write_packet((uint8_t *)b + tail_pos, sizeof(UsbFrameHeader) + b->hdr.length - tail_pos);
+        if (tail_pos == sizeof(UsbFrameHeader) + b->hdr.length) {
+            tail++;
+            tail_pos = 0;
+        }
+    }
+    while (usb_check() && !usb_write_idle());
+
+    FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+    LED_B_OFF();
+    LED_D_OFF();
+    cmd_send(CMD_ACK, total, dropped, head, 0, 0);
+}
+
 void ModThenAcquireRawAdcSamples125k(int delay_off, int period_0, int period_1, uint8_t *command)
 {
 
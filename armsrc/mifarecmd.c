@@ -741,6 +741,99 @@ void MifareChkKeys(uint8_t arg0, uint8_t arg1, uint8_t arg2, uint8_t *datain)
 	MF_DBGLEVEL = OLD_MF_DBGLEVEL;	
 }
 
+//-----------------------------------------------------------------------------
+// MIFARE check keys against many sectors in one field session.
+// arg0: sectors to check with key A, bit n for sector n (0..39)
+// arg1: sectors to check with key B
+// arg2: key count, up to 85
+// The card stays selected while keys work, the next sector is authenticated
+// nested; a wrong key halts it and only then it is selected again.
+// Answers CMD_ACK, arg0 is 1 if all was checked and 0 if the card was lost or
+// the button pressed, arg1 the number of keys found. Data: the index of the
+// key that worked for sectors 0..39 with key A, then with key B, 0xff if none.
+//-----------------------------------------------------------------------------
+void MifareChkKeysSectors(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint8_t *datain)
+{
+  // params
+	uint64_t sectors[2] = {arg0, arg1};
+	uint8_t keyCount = MIN(arg2, USB_CMD_DATA_SIZE / 6);
+	uint64_t ui64Key = 0;
+	
+	// variables
+	int i, sectorNo, keyType;
+	uint8_t blockNo;
+	uint8_t found = 0;
+	uint8_t keyIndex[2 * 40];
+	bool selected = false, authenticated = false, complete = true;
+	uint8_t uid[10];
+	uint32_t cuid = 0;
+	struct Crypto1State mpcs = {0, 0};
+	struct Crypto1State *pcs;
+	pcs = &mpcs;
+	
+	// clear debug level
+	int OLD_MF_DBGLEVEL = MF_DBGLEVEL;	
+	MF_DBGLEVEL = MF_DBG_NONE;
+	
+	// clear trace
+	iso14a_clear_trace();
+	iso14a_set_tracing(TRUE);
+
+	iso14443a_setup(FPGA_HF_ISO14443A_READER_LISTEN);
+
+	LED_A_ON();
+	LED_B_OFF();
+	LED_C_OFF();
+
+	memset(keyIndex, 0xff, sizeof(keyIndex));
+	for (keyType = 0; complete && keyType < 2; keyType++) {
+		for (sectorNo = 0; complete && sectorNo < 40; sectorNo++) {
+			if (!(sectors[keyType] & (1ULL << sectorNo))) continue;
+			blockNo = sectorNo < 32 ? sectorNo * 4 + 3 : 32 * 4 + (sectorNo - 32) * 16 + 15;
+			for (i = 0; i < keyCount; i++) {
+				if (BUTTON_PRESS()) {
+					complete = false;
+					break;
+				}
+				if (!selected) {
+					mifare_classic_halt(pcs, cuid);
+					if(!iso14443a_select_card(uid, NULL, &cuid)) {
+						if (OLD_MF_DBGLEVEL >= 1)	Dbprintf("ChkKeys: Can't select card");
+						complete = false;
+						break;
+					};
+					selected = true;
+					authenticated = false;
+				}
+
+				ui64Key = bytes_to_num(datain + i * 6, 6);
+				if(mifare_classic_auth(pcs, cuid, blockNo, keyType, ui64Key, authenticated ? AUTH_NESTED : AUTH_FIRST)) {
+					selected = false;
+					continue;
+				};
+				authenticated = true;
+				found++;
+				keyIndex[keyType * 40 + sectorNo] = i;
+				break;
+			}
+		}
+	}
+	
+	//  ----------------------------- crypto1 destroy
+	crypto1_destroy(pcs);
+	
+	LED_B_ON();
+	cmd_send(CMD_ACK, complete, found, 0, keyIndex, sizeof(keyIndex));
+	LED_B_OFF();
+
+  // Thats it...
+	FpgaWriteConfWord(FPGA_MAJOR_MODE_OFF);
+	LEDsoff();
+
+	// restore debug level
+	MF_DBGLEVEL = OLD_MF_DBGLEVEL;	
+}
+
 //-----------------------------------------------------------------------------
 // MIFARE commands set debug level
 // 
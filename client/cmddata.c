@@ -405,8 +405,7 @@ int CmdBitsamples(const char *Cmd)
   int cnt = 0;
   uint8_t got[12288];
   
-  GetFromBigBuf(got,sizeof(got),0);
-  WaitForResponse(CMD_ACK,NULL);
+  if (!GetFromBigBuf(got,sizeof(got),0)) return 0;
 
     for (int j = 0; j < sizeof(got); j++) {
       for (int k = 0; k < 8; k++) {
@@ -835,8 +834,7 @@ int CmdHexsamples(const char *Cmd)
     return 0;
   } 
 
-  GetFromBigBuf(got,requested,offset);
-  WaitForResponse(CMD_ACK,NULL);
+  if (!GetFromBigBuf(got,requested,offset)) return 0;
 
   i = 0;
   for (j = 0; j < requested; j++) {
@@ -890,8 +888,7 @@ int CmdSamples(const char *Cmd)
   if (n > sizeof(got)) n = sizeof(got);
   
   PrintAndLog("Reading %d samples\n", n);
-  GetFromBigBuf(got,n,0);
-  WaitForResponse(CMD_ACK,NULL);
+  if (!GetFromBigBuf(got,n,0)) return 0;
   for (int j = 0; j < n; j++) {
     GraphBuffer[cnt++] = ((int)got[j]) - 128;
   }
@@ -909,8 +906,7 @@ int CmdTuneSamples(const char *Cmd)
   uint8_t got[255];
 
   PrintAndLog("Reading %d samples\n", n);
-  GetFromBigBuf(got,n,7256); // armsrc/apps.h: #define FREE_BUFFER_OFFSET 7256
-  WaitForResponse(CMD_ACK,NULL);
+  if (!GetFromBigBuf(got,n,7256)) return 0; // armsrc/apps.h: #define FREE_BUFFER_OFFSET 7256
   for (int j = 0; j < n; j++) {
     GraphBuffer[cnt++] = ((int)got[j]) - 128;
   }
@@ -0,0 +1,226 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Device commands: several Proxmarks driven from one client
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "ui.h"
+#include "proxmark3.h"
+#include "cmdparser.h"
+#include "cmddev.h"
+#include "cmdmain.h"
+#include "util.h"
+#include "sleep.h"
+
+static int CmdHelp(const char *Cmd);
+
+// Set for the worker threads of 'dev run s ...', see GetDeviceShard()
+static __thread int shard_index;
+static __thread int shard_count;
+
+/**
+ * @brief Tells a command run on several devices with 'dev run s' which part
+ * of the work is this device's, e.g. which keys 'hf mf chk' tries.
+ * @return false if the work isn't split, index and count are 0 and 1 then
+ */
+bool GetDeviceShard(int *index, int *count)
+{
+  *index = shard_index;
+  *count = shard_count ? shard_count : 1;
+  return shard_count > 1;
+}
+
+typedef struct {
+  int dev;
+  int shard;
+  int shards;
+  char *cmd;
+  char prefix[8];
+  pthread_t thread;
+  uint64_t us;
+  commstats_t before;
+  commstats_t after;
+} dev_job;
+
+static void *devWorker(void *targ)
+{
+  dev_job *job = (dev_job*)targ;
+
+  SetThreadDevice(job->dev);
+  SetLogPrefix(job->prefix);
+  shard_index = job->shard;
+  shard_count = job->shards;
+  GetCommStats(&job->before);
+  uint64_t start = usclock();
+  CommandReceived(job->cmd);
+  job->us = usclock() - start;
+  GetCommStats(&job->after);
+  return NULL;
+}
+
+// Parses "all" or a list like "0,2" into a bitmap of devices
+static uint32_t parseDeviceSet(const char *s)
+{
+  uint32_t set = 0;
+
+  if (strcmp(s, "all") == 0) return (1 << GetDeviceCount()) - 1;
+  while (*s) {
+    char *end;
+    long dev = strtol(s, &end, 10);
+    if (end == s || dev < 0 || dev >= GetDeviceCount()) return 0;
+    set |= 1 << dev;
+    s = end;
+    if (*s == ',') s++;
+    else if (*s) return 0;
+  }
+  return set;
+}
+
+int CmdDevList(const char *Cmd)
+{
+  commstats_t st;
+  int selected = CurrentDevice();
+
+  if (GetDeviceCount() == 0) {
+    PrintAndLog("No device connected, use 'dev add <port>'");
+    return 0;
+  }
+  PrintAndLog("  # | port                           | sent cmds | received bytes");
+  PrintAndLog("----+--------------------------------+-----------+---------------");
+  int prev = SetThreadDevice(0);
+  for (int i = 0; i < GetDeviceCount(); i++) {
+    SetThreadDevice(i);
+    GetCommStats(&st);
+    PrintAndLog("%c%2d | %-30s | %9" PRIu64 " | %14" PRIu64,
+      i == selected ? '*' : ' ', i, GetDeviceName(i), st.sent, st.rx_bytes);
+  }
+  SetThreadDevice(prev);
+  return 0;
+}
+
+int CmdDevAdd(const char *Cmd)
+{
+  char port[256] = {0};
+
+  while (*Cmd == ' ') Cmd++;
+  size_t len = strcspn(Cmd, " ");
+  if (len < sizeof(port)) memcpy(port, Cmd, len);
+  if (port[0] == 0 || strcmp(port, "h") == 0) {
+    PrintAndLog("Usage:  dev add <port>");
+    PrintAndLog("        port - anything the client accepts on its command line, e.g. /dev/ttyACM1, tcp:host:port, emu");
+    return 0;
+  }
+  int dev = OpenDevice(port);
+  if (dev < 0) return 1;
+  PrintAndLog("Device %d: %s", dev, port);
+  return 0;
+}
+
+int CmdDevSelect(const char *Cmd)
+{
+  if (param_getchar(Cmd, 0) == 0 || param_getchar(Cmd, 0) == 'h') {
+    PrintAndLog("Usage:  dev select <n>");
+    PrintAndLog("        n - device the console talks to, see 'dev list'");
+    return 0;
+  }
+  if (!SelectDevice(param_get8ex(Cmd, 0, 0, 10))) {
+    PrintAndLog("No such device");
+    return 1;
+  }
+  PrintAndLog("Talking to device %d: %s", CurrentDevice(), GetDeviceName(CurrentDevice()));
+  return 0;
+}
+
+/*
+ * Runs a command on several devices at once, each in its own thread, and
+ * shows how long each device took compared to the whole run.
+ */
+int CmdDevRun(const char *Cmd)
+{
+  char devices[64] = {0};
+  dev_job jobs[MAX_DEVICES];
+  int njobs = 0;
+  bool shard = false;
+
+  // <devices> [s] <command>
+  while (*Cmd == ' ') Cmd++;
+  size_t len = strcspn(Cmd, " ");
+  if (len < sizeof(devices)) memcpy(devices, Cmd, len);
+  Cmd += len;
+  while (*Cmd == ' ') Cmd++;
+  if (Cmd[0] == 's' && (Cmd[1] == ' ' || Cmd[1] == 0)) {
+    shard = true;
+    Cmd++;
+    while (*Cmd == ' ') Cmd++;
+  }
+
+  uint32_t set = parseDeviceSet(devices);
+  if (devices[0] == 'h' || set == 0 || *Cmd == 0) {
+    PrintAndLog("Usage:  dev run <all|n[,n...]> [s] <command>");
+    PrintAndLog("        all|n - the devices to run the command on, see 'dev list'");
+    PrintAndLog("        s     - split the work between the devices (hf mf chk)");
+    PrintAndLog("Commands that use the graph buffer or 'lf stream' can only run on one device at a time.");
+    PrintAndLog("      sample: dev run all hw version");
+    PrintAndLog("              dev run 0,1 s hf mf chk *1 ? keys.dic");
+    return 0;
+  }
+
+  for (int i = 0; i < GetDeviceCount(); i++) {
+    if (set & (1 << i)) jobs[njobs++].dev = i;
+  }
+  uint64_t start = usclock();
+  for (int i = 0; i < njobs; i++) {
+    jobs[i].shard = shard ? i : 0;
+    jobs[i].shards = shard ? njobs : 0;
+    jobs[i].cmd = malloc(strlen(Cmd) + 1);
+    strcpy(jobs[i].cmd, Cmd);
+    snprintf(jobs[i].prefix, sizeof(jobs[i].prefix), "[%d] ", jobs[i].dev);
+    pthread_create(&jobs[i].thread, NULL, &devWorker, &jobs[i]);
+  }
+  uint64_t busy = 0;
+  for (int i = 0; i < njobs; i++) {
+    pthread_join(jobs[i].thread, NULL);
+    free(jobs[i].cmd);
+    busy += jobs[i].us;
+  }
+  uint64_t wall = usclock() - start;
+
+  PrintAndLog("");
+  PrintAndLog("  # |  time ms | sent cmds | received bytes");
+  PrintAndLog("----+----------+-----------+---------------");
+  for (int i = 0; i < njobs; i++) {
+    PrintAndLog(" %2d | %8" PRIu64 " | %9" PRIu64 " | %14" PRIu64, jobs[i].dev, jobs[i].us / 1000,
+      jobs[i].after.sent - jobs[i].before.sent, jobs[i].after.rx_bytes - jobs[i].before.rx_bytes);
+  }
+  PrintAndLog("%d devices: %" PRIu64 " ms wall clock, %" PRIu64 " ms device time (%.1fx)",
+    njobs, wall / 1000, busy / 1000, wall ? (double)busy / wall : 0.0);
+  return 0;
+}
+
+static command_t CommandTable[] =
+{
+  {"help",          CmdHelp,        1, "This help"},
+  {"add",           CmdDevAdd,      1, "<port> -- Connect to another device"},
+  {"list",          CmdDevList,     1, "List the connected devices"},
+  {"run",           CmdDevRun,      0, "<all|n[,n...]> [s] <command> -- Run a command on several devices in parallel"},
+  {"select",        CmdDevSelect,   1, "<n> -- Select the device the console talks to"},
+  {NULL, NULL, 0, NULL}
+};
+
+int CmdDev(const char *Cmd)
+{
+  CmdsParse(CommandTable, Cmd);
+  return 0;
+}
+
+int CmdHelp(const char *Cmd)
+{
+  CmdsHelp(CommandTable);
+  return 0;
+}
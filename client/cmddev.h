@@ -0,0 +1,23 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Device commands: several Proxmarks driven from one client
+//-----------------------------------------------------------------------------
+
+#ifndef CMDDEV_H__
+#define CMDDEV_H__
+
+#include <stdbool.h>
+
+int CmdDev(const char *Cmd);
+
+int CmdDevAdd(const char *Cmd);
+int CmdDevList(const char *Cmd);
+int CmdDevRun(const char *Cmd);
+int CmdDevSelect(const char *Cmd);
+
+bool GetDeviceShard(int *index, int *count);
+
+#endif
@@ -286,8 +286,7 @@ int CmdHFList(const char *Cmd)
 
 	uint8_t trace[TRACE_SIZE];
 	uint16_t tracepos = 0;
-	GetFromBigBuf(trace, TRACE_SIZE, 0);
-	WaitForResponse(CMD_ACK, NULL);
+	if (!GetFromBigBuf(trace, TRACE_SIZE, 0)) return 0;
 
 	PrintAndLog("Recorded Activity");
 	PrintAndLog("");
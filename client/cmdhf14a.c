@@ -544,7 +544,7 @@ static command_t CommandTable[] =
 
 int CmdHF14A(const char *Cmd) {
 	// flush
-	WaitForResponseTimeout(CMD_ACK,NULL,100);
+	clearStaleResponses();
 
 	// parse
   CmdsParse(CommandTable, Cmd);
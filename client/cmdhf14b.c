@@ -146,8 +146,7 @@ demodError:
 int CmdHF14BList(const char *Cmd)
 {
   uint8_t got[960];
-  GetFromBigBuf(got,sizeof(got),0);
-  WaitForResponse(CMD_ACK,NULL);
+  if (!GetFromBigBuf(got,sizeof(got),0)) return 0;
 
   PrintAndLog("recorded activity:");
   PrintAndLog(" time  :rssi: who bytes");
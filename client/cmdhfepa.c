@@ -87,7 +87,7 @@ int CmdHelp(const char *Cmd)
 int CmdHFEPA(const char *Cmd)
 {
 	// flush
-	WaitForResponseTimeout(CMD_ACK,NULL,100);
+	clearStaleResponses();
 
 	// parse
   CmdsParse(CommandTable, Cmd);
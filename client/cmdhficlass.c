@@ -14,6 +14,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <pthread.h>
 #include "iso14443crc.h" // Can also be used for iClass, using 0xE012 as CRC-type
 #include "data.h"
 //#include "proxusb.h"
@@ -24,6 +27,7 @@
 #include "common.h"
 #include "util.h"
 #include "cmdmain.h"
+#include "sleep.h"
 #include "loclass/des.h"
 #include "loclass/cipherutils.h"
 #include "loclass/cipher.h"
@@ -472,6 +476,103 @@ int CmdHFiClass_iso14443A_write(const char *Cmd)
 }
 
 
+static volatile bool loclass_running;
+
+// stops the bruteforce on a key press, it writes its checkpoint first
+static void *loclassKeyWatch(void *arg)
+{
+  (void)arg;
+  while (loclass_running) {
+    if (ukbhit() > 0) {
+      getchar();
+      stopBruteforce();
+      break;
+    }
+    msleep(100);
+  }
+  return NULL;
+}
+
+// the longest file name or option CmdHFiClassLoclass takes
+#define LOCLASS_ARG_MAX 255
+
+int CmdHFiClassLoclass(const char *Cmd)
+{
+  char opt = param_getchar(Cmd, 0);
+  char fileName[LOCLASS_ARG_MAX + 1] = {0}, checkpoint[LOCLASS_ARG_MAX + 1] = {0}, arg[LOCLASS_ARG_MAX + 1];
+  int shard = 0, shards = 1, errors, i;
+
+  for (i = 1; param_getlength(Cmd, i) > 0; i++) {
+    if (param_getlength(Cmd, i) > LOCLASS_ARG_MAX) {
+      PrintAndLog("Argument %d is longer than %d characters", i, LOCLASS_ARG_MAX);
+      return 1;
+    }
+  }
+
+  if (opt == 'm' || opt == 'M') {
+    char inputs[16][LOCLASS_ARG_MAX + 1], *in[16];
+    int n = 0;
+    if (param_getstr(Cmd, 1, fileName) == 0) n = -1;
+    while (n >= 0 && n < 16 && param_getstr(Cmd, n + 2, inputs[n]) > 0) {
+      in[n] = inputs[n];
+      n++;
+    }
+    if (n <= 0) {
+      PrintAndLog("Usage:  hf iclass loclass m <out> <checkpoint> ...");
+      return 1;
+    }
+    return mergeCheckpoints(fileName, in, n);
+  }
+
+  if (opt != 'f' && opt != 'F') {
+    PrintAndLog("Usage:  hf iclass loclass f <dumpfile> [c <checkpoint>] [s <i>/<n>] [j <threads>]");
+    PrintAndLog("        hf iclass loclass m <out> <checkpoint> ...");
+    PrintAndLog("        f - recover the custom key from the MACs of a dump ('hf iclass sim 2'),");
+    PrintAndLog("            resuming from the checkpoint, <dumpfile>.ckpt unless c says otherwise");
+    PrintAndLog("        s - search only part i (0..n-1) of the candidates, e.g. on one of n machines");
+    PrintAndLog("        m - merge the checkpoints of the shards into one to resume from");
+    PrintAndLog("        Any key stops the search, after writing the checkpoint.");
+    PrintAndLog("        sample: hf iclass loclass f iclass_mac_attack.bin s 0/2");
+    return 0;
+  }
+
+  param_getstr(Cmd, 1, fileName);
+  for (i = 2; param_getstr(Cmd, i, arg) > 0; i += 2) {
+    char o = tolower((unsigned char)arg[0]);
+    char value[LOCLASS_ARG_MAX + 1] = {0};
+    if (param_getstr(Cmd, i + 1, value) == 0 || arg[1]) {
+      PrintAndLog("Option %s wants a value", arg);
+      return 1;
+    }
+    if (o == 'c') {
+      snprintf(checkpoint, sizeof(checkpoint), "%s", value);
+    } else if (o == 's') {
+      if (sscanf(value, "%d/%d", &shard, &shards) != 2 || shards < 1 || shard < 0 || shard >= shards || shards > 64) {
+        PrintAndLog("s wants <i>/<n>, 0 <= i < n <= 64");
+        return 1;
+      }
+    } else if (o == 'j') {
+      setBruteforceThreads(atoi(value));
+    } else {
+      PrintAndLog("Unknown option %s", arg);
+      return 1;
+    }
+  }
+
+  pthread_t watcher;
+  setBruteforceCheckpoint(checkpoint);
+  setBruteforceShard(shard, shards);
+  loclass_running = true;
+  bool watching = pthread_create(&watcher, NULL, loclassKeyWatch, NULL) == 0;
+  PrintAndLog("Press any key to stop, the checkpoint is kept to resume from");
+  errors = bruteforceFileNoKeys(fileName);
+  loclass_running = false;
+  if (watching) pthread_join(watcher, NULL);
+  setBruteforceCheckpoint(NULL);
+  setBruteforceShard(0, 1);
+  return errors;
+}
+
 static command_t CommandTable[] = 
 {
   {"help",	CmdHelp,			1,	"This help"},
@@ -482,6 +583,7 @@ static command_t CommandTable[] =
   {"replay",CmdHFiClassReader_Replay,	0,	"Read an iClass tag via Reply Attack"},
   {"dump",	CmdHFiClassReader_Dump,	0,		"Authenticate and Dump iClass tag"},
   {"write",	CmdHFiClass_iso14443A_write,	0,	"Authenticate and Write iClass block"},
+  {"loclass",	CmdHFiClassLoclass,	1,	"Recover the custom key from a MAC dump, resumable and sharded"},
   {NULL, NULL, 0, NULL}
 };
 
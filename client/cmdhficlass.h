@@ -19,5 +19,6 @@ int CmdHFiClassSim(const char *Cmd);
 int CmdHFiClassList(const char *Cmd);
 int CmdHFiClassReader(const char *Cmd);
 int CmdHFiClassReader_Replay(const char *Cmd);
+int CmdHFiClassLoclass(const char *Cmd);
 
 #endif
@@ -64,8 +64,7 @@ int CmdLegicDecode(const char *Cmd)
   char token_type[4];
   
   // copy data from proxmark into buffer
-   GetFromBigBuf(data_buf,sizeof(data_buf),0);
-   WaitForResponse(CMD_ACK,NULL);
+   if (!GetFromBigBuf(data_buf,sizeof(data_buf),0)) return 0;
     
   // Output CDF System area (9 bytes) plus remaining header area (12 bytes)
   
@@ -278,8 +277,10 @@ int CmdLegicSave(const char *Cmd)
     return -1;
   }
 
-  GetFromBigBuf(got,requested,offset);
-  WaitForResponse(CMD_ACK,NULL);
+  if (!GetFromBigBuf(got,requested,offset)) {
+    fclose(f);
+    return 0;
+  }
 
   for (int j = 0; j < requested; j += 8) {
     fprintf(f, "%02x %02x %02x %02x %02x %02x %02x %02x\n",
@@ -9,6 +9,10 @@
 //-----------------------------------------------------------------------------
 
 #include "cmdhfmf.h"
+#include <pthread.h>
+#include "sleep.h"
+#include "mfkeystore.h"
+#include "mfdictionary.h"
 
 static int CmdHelp(const char *Cmd);
 
@@ -78,8 +82,15 @@ start:
 		num_to_bytes(r_key, 6, keyBlock);
 		isOK = mfCheckKeys(0, 0, 1, keyBlock, &r_key);
 	}
-	if (!isOK) 
+	if (!isOK) {
 		PrintAndLog("Found valid key:%012"llx, r_key);
+		uint8_t uidBytes[10], uidlen;
+		if (mfReadUid(uidBytes, &uidlen)) {
+			num_to_bytes(uid, 4, uidBytes);
+			uidlen = 4;
+		}
+		mfKeyStorePut(uidBytes, uidlen, 0, 0, r_key, "darkside");
+	}
 	else
 	{
 		if (isOK != 2) PrintAndLog("Found invalid key. ");	
@@ -448,6 +459,16 @@ uint8_t FirstBlockOfSector(uint8_t sectorNo)
 }
 
 
+uint8_t SectorOfBlock(uint8_t blockNo)
+{
+	if (blockNo < 32 * 4) {
+		return blockNo / 4;
+	} else {
+		return 32 + (blockNo - 32 * 4) / 16;
+	}
+}
+
+
 uint8_t NumBlocksPerSector(uint8_t sectorNo)
 {
 	if (sectorNo < 32) {
@@ -467,6 +488,7 @@ int CmdHF14AMfDump(const char *Cmd)
 	uint8_t rights[40][4];
 	uint8_t carddata[256][16];
 	uint8_t numSectors = 16;
+	bool haveKey[40][2] = {{false}};
 	
 	FILE *fin;
 	FILE *fout;
@@ -492,29 +514,58 @@ int CmdHF14AMfDump(const char *Cmd)
 		return 0;
 	}
 	
-	if ((fin = fopen("dumpkeys.bin","rb")) == NULL) {
-		PrintAndLog("Could not find file dumpkeys.bin");
-		return 1;
-	}
-	
-	// Read key file
+	// Read key file, the key store overrides it for the sectors it knows
 
-	for (sectorNo=0; sectorNo<numSectors; sectorNo++) {
-		if (fread( keyA[sectorNo], 1, 6, fin ) == 0) {
-			PrintAndLog("File reading error.");
-			fclose(fin);
-			return 2;
+	memset(keyA, 0xff, sizeof(keyA));
+	memset(keyB, 0xff, sizeof(keyB));
+	if ((fin = fopen("dumpkeys.bin","rb")) != NULL) {
+		for (sectorNo=0; sectorNo<numSectors; sectorNo++) {
+			if (fread( keyA[sectorNo], 1, 6, fin ) == 0) {
+				PrintAndLog("File reading error.");
+				fclose(fin);
+				return 2;
+			}
+		}
+		
+		for (sectorNo=0; sectorNo<numSectors; sectorNo++) {
+			if (fread( keyB[sectorNo], 1, 6, fin ) == 0) {
+				PrintAndLog("File reading error.");
+				fclose(fin);
+				return 2;
+			}
+		}
+		fclose(fin);
+	}
+
+	uint8_t uid[10], uidlen;
+	uint64_t key64;
+	int storedKeys = 0;
+	if (mfReadUid(uid, &uidlen) == 0) {
+		for (sectorNo = 0; sectorNo < numSectors; sectorNo++) {
+			if (mfKeyStoreGet(uid, uidlen, sectorNo, 0, &key64) == 0) {
+				num_to_bytes(key64, 6, keyA[sectorNo]);
+				haveKey[sectorNo][0] = true;
+				storedKeys++;
+			}
+			if (mfKeyStoreGet(uid, uidlen, sectorNo, 1, &key64) == 0) {
+				num_to_bytes(key64, 6, keyB[sectorNo]);
+				haveKey[sectorNo][1] = true;
+				storedKeys++;
+			}
 		}
 	}
-	
-	for (sectorNo=0; sectorNo<numSectors; sectorNo++) {
-		if (fread( keyB[sectorNo], 1, 6, fin ) == 0) {
-			PrintAndLog("File reading error.");
-			fclose(fin);
-			return 2;
+	if (fin == NULL && storedKeys == 0) {
+		PrintAndLog("Could not find file dumpkeys.bin, and %s has no keys of this card", mfKeyStoreFile());
+		return 1;
+	}
+	if (storedKeys) PrintAndLog("%d keys from %s", storedKeys, mfKeyStoreFile());
+	if (fin == NULL) {
+		for (sectorNo = 0; sectorNo < numSectors; sectorNo++) {
+			if (!haveKey[sectorNo][0] || !haveKey[sectorNo][1])
+				PrintAndLog("No key %s for sector %2d, trying FFFFFFFFFFFF", haveKey[sectorNo][0] ? "B" :
+					haveKey[sectorNo][1] ? "A" : "A and B", sectorNo);
 		}
 	}
-	fclose(fin);
 	// Read access rights to sectors
 
 	PrintAndLog("|-----------------------------------------|");
@@ -738,9 +789,201 @@ int CmdHF14AMfRestore(const char *Cmd)
 }
 
 
+// at most this many targets wait for or are in key recovery
+#define NESTED_PIPELINE_DEPTH	4
+
+typedef struct nestedJob {
+	nestedNonces nonces;
+	int target;
+	int count;				// key candidates, -1 if the recovery ran out of memory
+	uint64_t *keys;
+	struct nestedJob *next;
+} nestedJob;
+
+// nonces travel from the console thread to the recovery thread and back
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	nestedJob *todo, *done;
+	bool closed;
+	uint64_t recover_us;
+} nestedPipeline;
+
+static void nestedPush(nestedPipeline *p, nestedJob **list, nestedJob *job)
+{
+	pthread_mutex_lock(&p->lock);
+	job->next = NULL;
+	while (*list) list = &(*list)->next;
+	*list = job;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *nestedRecoveryThread(void *arg)
+{
+	nestedPipeline *p = arg;
+	nestedJob *job;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->todo == NULL && !p->closed)
+			pthread_cond_wait(&p->cond, &p->lock);
+		if (p->todo == NULL) break;
+		job = p->todo;
+		p->todo = job->next;
+		pthread_mutex_unlock(&p->lock);
+
+		uint64_t start = usclock();
+		job->count = mfNestedRecover(&job->nonces, &job->keys);
+		uint64_t us = usclock() - start;
+
+		pthread_mutex_lock(&p->lock);
+		p->recover_us += us;
+		job->next = p->done;
+		p->done = job;
+		pthread_cond_broadcast(&p->cond);
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/*
+ * The nested attack on all sectors whose keys aren't known yet. The console
+ * thread keeps the device busy: it collects nonces for the next targets and
+ * tests the key candidates, while a second thread recovers the candidates
+ * of the nonces collected before.
+ */
+static int nestedSectors(uint8_t blockNo, uint8_t keyType, uint8_t *key, sector *e_sector, uint8_t SectorsCnt)
+{
+	nestedPipeline p = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, false, 0};
+	pthread_t thread;
+	int tries[40][2] = {{0}};
+	bool busy[40][2] = {{false}};
+	int inflight = 0, nonces = 0, checks = 0, iterations = 0, res = 0;
+	uint64_t start = usclock(), acquire_us = 0, check_us = 0, wait_us = 0, t;
+	bool calibrate = true;
+	uint8_t keyBlock[6];
+
+	if (pthread_create(&thread, NULL, nestedRecoveryThread, &p)) return 2;
+
+	for (;;) {
+		nestedJob *job = NULL;
+
+		// test the candidates of finished recoveries first, they may save work
+		pthread_mutex_lock(&p.lock);
+		if (p.done) {
+			job = p.done;
+			p.done = job->next;
+		}
+		pthread_mutex_unlock(&p.lock);
+		if (job) {
+			int sectorNo = job->target / 2, trgKeyType = job->target % 2;
+			inflight--;
+			busy[sectorNo][trgKeyType] = false;
+			if (job->count < 0) {
+				PrintAndLog("Cannot allocate memory for the key recovery");
+				res = 2;
+				free(job->keys);
+				free(job);
+				break;
+			}
+			iterations++;
+			t = usclock();
+			if (!e_sector[sectorNo].foundKey[trgKeyType] &&
+				!mfNestedCheck(&job->nonces, job->keys, job->count, keyBlock, &checks)) {
+				uint64_t key64 = bytes_to_num(keyBlock, 6);
+				PrintAndLog("sector %02d key %c: %d candidates, found valid key:%012"llx,
+					sectorNo, trgKeyType ? 'B' : 'A', job->count, key64);
+				e_sector[sectorNo].foundKey[trgKeyType] = 1;
+				e_sector[sectorNo].Key[trgKeyType] = key64;
+			} else {
+				PrintAndLog("sector %02d key %c: %d candidates, none valid", sectorNo, trgKeyType ? 'B' : 'A', job->count);
+			}
+			check_us += usclock() - t;
+			free(job->keys);
+			free(job);
+			continue;
+		}
+
+		// then collect nonces for the next target, unless enough are waiting
+		int target = -1;
+		for (int i = 0; i < SectorsCnt * 2 && inflight < NESTED_PIPELINE_DEPTH; i++) {
+			if (!e_sector[i / 2].foundKey[i % 2] && !busy[i / 2][i % 2] && tries[i / 2][i % 2] < NESTED_SECTOR_RETRY) {
+				target = i;
+				break;
+			}
+		}
+		if (target >= 0) {
+			job = calloc(1, sizeof(nestedJob));
+			if (job == NULL) {
+				res = 2;
+				break;
+			}
+			t = usclock();
+			if (mfNestedNonces(blockNo, keyType, key, FirstBlockOfSector(target / 2), target % 2, calibrate, &job->nonces)) {
+				free(job);
+				res = 2;
+				break;
+			}
+			acquire_us += usclock() - t;
+			calibrate = false;
+			nonces++;
+			job->target = target;
+			tries[target / 2][target % 2]++;
+			busy[target / 2][target % 2] = true;
+			inflight++;
+			nestedPush(&p, &p.todo, job);
+			continue;
+		}
+
+		if (inflight == 0) break;
+
+		// nothing to do for the device until a recovery finishes
+		t = usclock();
+		pthread_mutex_lock(&p.lock);
+		while (p.done == NULL)
+			pthread_cond_wait(&p.cond, &p.lock);
+		pthread_mutex_unlock(&p.lock);
+		wait_us += usclock() - t;
+	}
+
+	pthread_mutex_lock(&p.lock);
+	p.closed = true;
+	pthread_cond_broadcast(&p.cond);
+	pthread_mutex_unlock(&p.lock);
+	pthread_join(thread, NULL);
+	while (p.todo) {
+		nestedJob *job = p.todo;
+		p.todo = job->next;
+		free(job);
+	}
+	while (p.done) {
+		nestedJob *job = p.done;
+		p.done = job->next;
+		free(job->keys);
+		free(job);
+	}
+
+	uint64_t wall = usclock() - start;
+	if (res) {
+		PrintAndLog("Nested error.\n");
+		return res;
+	}
+	PrintAndLog("-----------------------------------------------");
+	PrintAndLog("Time in nested: %1.3f (%1.3f sec per key)", wall / 1e6, iterations ? wall / 1e6 / iterations : 0.0);
+	PrintAndLog("  device   %7.3f s %3.0f%%  %d nonce pairs, %d key checks", (acquire_us + check_us) / 1e6,
+		wall ? 100.0 * (acquire_us + check_us) / wall : 0.0, nonces, checks);
+	PrintAndLog("  recovery %7.3f s %3.0f%%  %d targets", p.recover_us / 1e6,
+		wall ? 100.0 * p.recover_us / wall : 0.0, iterations);
+	PrintAndLog("  idle     %7.3f s %3.0f%%  device waiting for the recovery", wait_us / 1e6,
+		wall ? 100.0 * wait_us / wall : 0.0);
+	PrintAndLog("\nIterations count: %d\n\n", iterations);
+	return 0;
+}
+
 int CmdHF14AMfNested(const char *Cmd)
 {
-	int i, j, res, iterations;
+	int i, j, res;
 	sector *e_sector = NULL;
 	uint8_t blockNo = 0;
 	uint8_t keyType = 0;
@@ -825,6 +1068,10 @@ int CmdHF14AMfNested(const char *Cmd)
 		if (key64) {
 			PrintAndLog("Found valid key:%012"llx, key64);
 
+			uint8_t uid[10], uidlen;
+			if (!mfReadUid(uid, &uidlen))
+				mfKeyStorePut(uid, uidlen, SectorOfBlock(trgBlockNo), trgKeyType, key64, "nested");
+
 			// transfer key to the emulator
 			if (transferToEml) {
 				uint8_t sectortrailer;
@@ -846,11 +1093,23 @@ int CmdHF14AMfNested(const char *Cmd)
 		}
 	}
 	else { // ------------------------------------  multiple sectors working
-		clock_t time1;
-		time1 = clock();
-
 		e_sector = calloc(SectorsCnt, sizeof(sector));
 		if (e_sector == NULL) return 1;
+
+		// keys found on this card before, if they still work
+		uint8_t uid[10], uidlen = 0;
+		int missing = 0;
+		if (mfReadUid(uid, &uidlen)) uidlen = 0;
+		for (i = 0; uidlen && i < SectorsCnt; i++) {
+			for (j = 0; j < 2; j++) {
+				if (mfKeyStoreGet(uid, uidlen, i, j, &key64)) continue;
+				num_to_bytes(key64, 6, tempkey);
+				if (!mfCheckKeys(FirstBlockOfSector(i), j, 1, tempkey, &key64)) {
+					e_sector[i].Key[j] = key64;
+					e_sector[i].foundKey[j] = 1;
+				}
+			}
+		}
 		
 		//test current key and additional standard keys first
 		memcpy(keyBlock, key, 6);
@@ -870,43 +1129,38 @@ int CmdHF14AMfNested(const char *Cmd)
 				if (!res) {
 					e_sector[i].Key[j] = key64;
 					e_sector[i].foundKey[j] = 1;
+					// the key given on the command line, or one of the standard keys
+					if (uidlen) mfKeyStorePut(uid, uidlen, i, j, key64, key64 == bytes_to_num(key, 6) ? "user" : "chk");
 				}
 			}
 		}
-		
+		bool known[40][2];
+		for (i = 0; i < SectorsCnt; i++) {
+			for (j = 0; j < 2; j++) {
+				known[i][j] = e_sector[i].foundKey[j];
+				missing += !known[i][j];
+			}
+		}
 		
 		// nested sectors
-		iterations = 0;
-		PrintAndLog("nested...");
-		bool calibrate = true;
-		for (i = 0; i < NESTED_SECTOR_RETRY; i++) {
-			for (uint8_t sectorNo = 0; sectorNo < SectorsCnt; sectorNo++) {
-				for (trgKeyType = 0; trgKeyType < 2; trgKeyType++) { 
-					if (e_sector[sectorNo].foundKey[trgKeyType]) continue;
-					PrintAndLog("-----------------------------------------------");
-					if(mfnested(blockNo, keyType, key, FirstBlockOfSector(sectorNo), trgKeyType, keyBlock, calibrate)) {
-						PrintAndLog("Nested error.\n");
-						return 2;
-					}
-					else {
-						calibrate = false;
-					}
-					
-					iterations++;
-
-					key64 = bytes_to_num(keyBlock, 6);
-					if (key64) {
-						PrintAndLog("Found valid key:%012"llx, key64);
-						e_sector[sectorNo].foundKey[trgKeyType] = 1;
-						e_sector[sectorNo].Key[trgKeyType] = key64;
-					}
+		if (missing) {
+			PrintAndLog("nested...");
+			res = nestedSectors(blockNo, keyType, key, e_sector, SectorsCnt);
+			lfsr_recovery_pool_free();
+			if (res) {
+				free(e_sector);
+				return 2;
+			}
+			for (i = 0; uidlen && i < SectorsCnt; i++) {
+				for (j = 0; j < 2; j++) {
+					if (e_sector[i].foundKey[j] && !known[i][j])
+						mfKeyStorePut(uid, uidlen, i, j, e_sector[i].Key[j], "nested");
 				}
 			}
+		} else {
+			PrintAndLog("All keys known, nothing to do for nested.");
 		}
 
-		printf("Time in nested: %1.3f (%1.3f sec per key)\n\n", ((float)clock() - time1)/CLOCKS_PER_SEC, ((float)clock() - time1)/iterations/CLOCKS_PER_SEC);
-		
-		PrintAndLog("-----------------------------------------------\nIterations count: %d\n\n", iterations);
 		//print them
 		PrintAndLog("|---|----------------|---|----------------|---|");
 		PrintAndLog("|sec|key A           |res|key B           |res|");
@@ -961,27 +1215,157 @@ int CmdHF14AMfNested(const char *Cmd)
 		free(e_sector);
 	}
 
+	// the recovery tables stay allocated between keys, give them back now
+	lfsr_recovery_pool_free();
 	return 0;
 }
 
 
+// what hf mf chk knows about the sectors it checks
+typedef struct {
+	uint8_t blocks[40];
+	int sectors;
+	int first, last;		// key types
+	bool valid[2][40];
+	uint8_t key[2][40][6];
+	uint64_t everywhere[80];	// keys tried on all sectors already
+	int everywhereCnt;
+	uint8_t uid[10];
+	uint8_t uidlen;
+	bool multi;			// the device checks all sectors in one command
+	int commands;
+} chkState;
+
+static void chkFound(chkState *st, int t, int i, uint64_t key64, const char *source)
+{
+	num_to_bytes(key64, 6, st->key[t][i]);
+	st->valid[t][i] = true;
+	if (st->uidlen) mfKeyStorePut(st->uid, st->uidlen, SectorOfBlock(st->blocks[i]), t, key64, source);
+}
+
+// the keys against every sector still missing its key, in one command
+static void chkMulti(chkState *st, uint8_t *keys, int keycnt, const char *what)
+{
+	uint64_t sectors[2] = {0, 0};
+	uint8_t keyIndex[80];
+
+	for (int t = st->first; t <= st->last; t++) {
+		for (int i = 0; i < st->sectors; i++) {
+			if (!st->valid[t][i]) sectors[t] |= 1ULL << SectorOfBlock(st->blocks[i]);
+		}
+	}
+	if (sectors[0] == 0 && sectors[1] == 0) return;
+
+	st->commands++;
+	int res = mfCheckKeysSectors(sectors, keycnt, keys, keyIndex);
+	if (res == 1) {
+		PrintAndLog("Command execute timeout");
+		return;
+	}
+	for (int t = st->first; t <= st->last; t++) {
+		for (int i = 0; i < st->sectors; i++) {
+			uint8_t k = keyIndex[t * 40 + SectorOfBlock(st->blocks[i])];
+			if (st->valid[t][i] || k >= keycnt) continue;
+			uint64_t key64 = bytes_to_num(keys + 6 * k, 6);
+			PrintAndLog("--sector:%2d, block:%3d, key type:%C, %s:[%012"llx"]", i, st->blocks[i], t?'B':'A', what, key64);
+			chkFound(st, t, i, key64, "chk");
+		}
+	}
+	if (res == 2) PrintAndLog("Card lost or button pressed, not all sectors were checked");
+}
+
+// cards tend to use one key for many sectors, so a key that was found is
+// tried on every sector still missing its key before the dictionary goes on
+static void chkEverywhere(chkState *st, uint64_t key64)
+{
+	uint8_t key[6];
+	uint64_t found;
+
+	for (int i = 0; i < st->everywhereCnt; i++)
+		if (st->everywhere[i] == key64) return;
+	if (st->everywhereCnt < 80) st->everywhere[st->everywhereCnt++] = key64;
+
+	num_to_bytes(key64, 6, key);
+	if (st->multi) {
+		chkMulti(st, key, 1, "same key");
+		return;
+	}
+	for (int t = st->first; t <= st->last; t++) {
+		for (int i = 0; i < st->sectors; i++) {
+			if (st->valid[t][i]) continue;
+			st->commands++;
+			if (mfCheckKeys(st->blocks[i], t, 1, key, &found)) continue;
+			PrintAndLog("--sector:%2d, block:%3d, key type:%C, same key:[%012"llx"]", i, st->blocks[i], t?'B':'A', found);
+			chkFound(st, t, i, found, "chk");
+		}
+	}
+}
+
+static void chkSectors(chkState *st, uint8_t *keyBlock, int keycnt)
+{
+	uint64_t key64;
+	int max_keys = MIN(keycnt, USB_CMD_DATA_SIZE / 6);
+
+	// the keys this card had before
+	for (int t = st->first; st->uidlen && t <= st->last; t++) {
+		for (int i = 0; i < st->sectors; i++) {
+			uint8_t storedKey[6];
+			if (st->valid[t][i] || mfKeyStoreGet(st->uid, st->uidlen, SectorOfBlock(st->blocks[i]), t, &key64)) continue;
+			num_to_bytes(key64, 6, storedKey);
+			st->commands++;
+			if (!mfCheckKeys(st->blocks[i], t, 1, storedKey, &key64)) {
+				PrintAndLog("--sector:%2d, block:%3d, key type:%C, stored key:[%012"llx"]", i, st->blocks[i], t?'B':'A', key64);
+				chkFound(st, t, i, key64, "chk");
+				chkEverywhere(st, key64);
+			}
+		}
+	}
+
+	// then the dictionary, up to the first key that works
+	if (st->multi) {
+		PrintAndLog("--%d sectors, key type:%s, key count:%2d ", st->sectors,
+			st->first == st->last ? (st->first ? "B" : "A") : "A+B", keycnt);
+		for (int c = 0; c < keycnt; c += max_keys)
+			chkMulti(st, &keyBlock[6*c], MIN(keycnt - c, max_keys), "key");
+		return;
+	}
+	for (int t = st->first; t <= st->last; t++) {
+		for (int i = 0; i < st->sectors; i++) {
+			if (st->valid[t][i]) continue;
+			PrintAndLog("--sector:%2d, block:%3d, key type:%C, key count:%2d ", i, st->blocks[i], t?'B':'A', keycnt);
+			for (int c = 0; c < keycnt && !st->valid[t][i]; c += max_keys) {
+				int size = MIN(keycnt - c, max_keys);
+				int res = mfCheckKeys(st->blocks[i], t, size, &keyBlock[6*c], &key64);
+				st->commands++;
+				if (res == 1) {
+					PrintAndLog("Command execute timeout");
+				} else if (!res) {
+					PrintAndLog("Found valid key:[%012"llx"]",key64);
+					chkFound(st, t, i, key64, "chk");
+					chkEverywhere(st, key64);
+				}
+			}
+		}
+	}
+}
+
 int CmdHF14AMfChk(const char *Cmd)
 {
 	if (strlen(Cmd)<3) {
-		PrintAndLog("Usage:  hf mf chk <block number>|<*card memory> <key type (A/B/?)> [t] [<key (12 hex symbols)>] [<dic (*.dic)>]");
+		PrintAndLog("Usage:  hf mf chk <block number>|<*card memory> <key type (A/B/?)> [t] [<key (12 hex symbols)>] [<dic (*.dic|*.bdic)>]");
 		PrintAndLog("          * - all sectors");
 		PrintAndLog("card memory - 0 - MINI(320 bytes), 1 - 1K, 2 - 2K, 4 - 4K, <other> - 1K");
 		PrintAndLog("d - write keys to binary file\n");
+		PrintAndLog("Duplicate keys are dropped, keys found on other cards (see 'hf mf keystore') go first.");
+		PrintAndLog("Large dictionaries load faster compiled with 'hf mf dict'.\n");
 		PrintAndLog("      sample: hf mf chk 0 A 1234567890ab keys.dic");
 		PrintAndLog("              hf mf chk *1 ? t");
 		return 0;
 	}	
 
-	FILE * f;
 	char filename[256]={0};
-	char buf[13];
-	uint8_t *keyBlock = NULL, *p;
-	uint8_t stKeyBlock = 20;
+	uint8_t *keyBlock = NULL;
+	int keySize = 0;
 	
 	int i, res;
 	int	keycnt = 0;
@@ -989,15 +1373,10 @@ int CmdHF14AMfChk(const char *Cmd)
 	uint8_t blockNo = 0;
 	uint8_t SectorsCnt = 1;
 	uint8_t keyType = 0;
-	uint64_t key64 = 0;
 	
 	int transferToEml = 0;
 	int createDumpFile = 0;
 
-
-	keyBlock = calloc(stKeyBlock, 6);
-	if (keyBlock == NULL) return 1;
-
 	uint64_t defaultKeys[] =
 	{
 		0xffffffffffff, // Default key (first key used by program if no user defined key)
@@ -1016,6 +1395,10 @@ int CmdHF14AMfChk(const char *Cmd)
 	};
 	int defaultKeysSize = sizeof(defaultKeys) / sizeof(uint64_t);
 
+	keyBlock = calloc(defaultKeysSize, 6);
+	if (keyBlock == NULL) return 1;
+	keySize = defaultKeysSize;
+
 	for (int defaultKeyCounter = 0; defaultKeyCounter < defaultKeysSize; defaultKeyCounter++)
 	{
 		num_to_bytes(defaultKeys[defaultKeyCounter], 6, (uint8_t*)(keyBlock + defaultKeyCounter * 6));
@@ -1048,6 +1431,7 @@ int CmdHF14AMfChk(const char *Cmd)
 		break;
 	default:
 		PrintAndLog("Key type must be A , B or ?");
+		free(keyBlock);
 		return 1;
 	};
 	
@@ -1056,9 +1440,10 @@ int CmdHF14AMfChk(const char *Cmd)
 	else if (ctmp == 'd' || ctmp == 'D') createDumpFile = 1;
 	
 	for (i = transferToEml || createDumpFile; param_getchar(Cmd, 2 + i); i++) {
-		if (!param_gethex(Cmd, 2 + i, keyBlock + 6 * keycnt, 12)) {
-			if ( stKeyBlock - keycnt < 2) {
-				p = realloc(keyBlock, 6*(stKeyBlock+=10));
+		uint8_t key[6];
+		if (!param_gethex(Cmd, 2 + i, key, 12)) {
+			if (keycnt == keySize) {
+				uint8_t *p = realloc(keyBlock, 6 * (keySize *= 2));
 				if (!p) {
 					PrintAndLog("Cannot allocate memory for Keys");
 					free(keyBlock);
@@ -1066,6 +1451,7 @@ int CmdHF14AMfChk(const char *Cmd)
 				}
 				keyBlock = p;
 			}
+			memcpy(keyBlock + 6 * keycnt, key, 6);
 			PrintAndLog("chk key[%2d] %02x%02x%02x%02x%02x%02x", keycnt,
 			(keyBlock + 6*keycnt)[0],(keyBlock + 6*keycnt)[1], (keyBlock + 6*keycnt)[2],
 			(keyBlock + 6*keycnt)[3], (keyBlock + 6*keycnt)[4],	(keyBlock + 6*keycnt)[5], 6);
@@ -1078,43 +1464,14 @@ int CmdHF14AMfChk(const char *Cmd)
 				return 2;
 			}
 			
-			if ( (f = fopen( filename , "r")) ) {
-				while( fgets(buf, sizeof(buf), f) ){
-					if (strlen(buf) < 12 || buf[11] == '\n')
-						continue;
-				
-					while (fgetc(f) != '\n' && !feof(f)) ;  //goto next line
-					
-					if( buf[0]=='#' ) continue;	//The line start with # is comment, skip
-
-					if (!isxdigit(buf[0])){
-						PrintAndLog("File content error. '%s' must include 12 HEX symbols",buf);
-						continue;
-					}
-					
-					buf[12] = 0;
-
-					if ( stKeyBlock - keycnt < 2) {
-						p = realloc(keyBlock, 6*(stKeyBlock+=10));
-						if (!p) {
-							PrintAndLog("Cannot allocate memory for defKeys");
-							free(keyBlock);
-							return 2;
-						}
-						keyBlock = p;
-					}
-					memset(keyBlock + 6 * keycnt, 0, 6);
-					num_to_bytes(strtoll(buf, NULL, 16), 6, keyBlock + 6*keycnt);
-					PrintAndLog("chk custom key[%2d] %012"llx, keycnt, bytes_to_num(keyBlock + 6*keycnt, 6));
-					keycnt++;
-					memset(buf, 0, sizeof(buf));
-				}
-				fclose(f);
-			} else {
+			uint64_t t = usclock();
+			int added = mfDictLoad(filename, &keyBlock, &keycnt, &keySize);
+			if (added < 0) {
 				PrintAndLog("File: %s: not found or locked.", filename);
 				free(keyBlock);
 				return 1;
 			}
+			PrintAndLog("%d keys from %s in %1.3f sec", added, filename, (usclock() - t) / 1e6);
 		}
 	}
 	
@@ -1125,49 +1482,54 @@ int CmdHF14AMfChk(const char *Cmd)
 				(keyBlock + 6*keycnt)[0],(keyBlock + 6*keycnt)[1], (keyBlock + 6*keycnt)[2],
 				(keyBlock + 6*keycnt)[3], (keyBlock + 6*keycnt)[4],	(keyBlock + 6*keycnt)[5], 6);
 	}
+
+	res = mfDictDedup(keyBlock, keycnt);
+	if (res != keycnt) PrintAndLog("%d duplicate keys dropped", keycnt - res);
+	keycnt = res;
+
+	// keys that opened more sectors of the cards seen so far first
+	mfKeyStoreRank(keyBlock, keycnt);
 	
-	// initialize storage for found keys
-	bool validKey[2][40];
-	uint8_t foundKey[2][40][6];
-	for (uint16_t t = 0; t < 2; t++) {
-		for (uint16_t sectorNo = 0; sectorNo < SectorsCnt; sectorNo++) {
-			validKey[t][sectorNo] = false;
-			for (uint16_t i = 0; i < 6; i++) {
-				foundKey[t][sectorNo][i] = 0xff;
-			}
-		}
-	}
-	
-	for ( int t = !keyType; t < 2; keyType==2?(t++):(t=2) ) {
-		int b=blockNo;
-		for (int i = 0; i < SectorsCnt; ++i) {
-			PrintAndLog("--sector:%2d, block:%3d, key type:%C, key count:%2d ", i, b, t?'B':'A', keycnt);
-			uint32_t max_keys = keycnt>USB_CMD_DATA_SIZE/6?USB_CMD_DATA_SIZE/6:keycnt;
-			for (uint32_t c = 0; c < keycnt; c+=max_keys) {
-				uint32_t size = keycnt-c>max_keys?max_keys:keycnt-c;
-				res = mfCheckKeys(b, t, size, &keyBlock[6*c], &key64);
-				if (res != 1) {
-					if (!res) {
-						PrintAndLog("Found valid key:[%012"llx"]",key64);
-						num_to_bytes(key64, 6, foundKey[t][i]);
-						validKey[t][i] = true;
-					} 
-				} else {
-					PrintAndLog("Command execute timeout");
-				}
-			}
-			b<127?(b+=4):(b+=16);	
+	// run on several devices with 'dev run s', this one tries its share of the keys
+	int shard, shards;
+	if (GetDeviceShard(&shard, &shards)) {
+		int total = keycnt;
+		keycnt = 0;
+		for (i = shard; i < total; i += shards) {
+			memmove(keyBlock + 6 * keycnt++, keyBlock + 6 * i, 6);
 		}
+		PrintAndLog("Device share %d/%d: %d of %d keys", shard + 1, shards, keycnt, total);
 	}
 
+	// initialize storage for found keys
+	chkState *st = calloc(1, sizeof(chkState));
+	if (st == NULL) {
+		free(keyBlock);
+		return 2;
+	}
+	memset(st->key, 0xff, sizeof(st->key));
+	st->sectors = SectorsCnt;
+	st->first = !keyType;
+	st->last = keyType == 2 ? 1 : st->first;
+	for (int i = 0, b = blockNo; i < SectorsCnt; ++i) {
+		st->blocks[i] = b;
+		b<127?(b+=4):(b+=16);
+	}
+	if (mfReadUid(st->uid, &st->uidlen)) st->uidlen = 0;
+	st->multi = ChkKeysSectorsSupported();
+
+	uint64_t start = usclock();
+	chkSectors(st, keyBlock, keycnt);
+	PrintAndLog("%d check commands in %1.3f sec", st->commands, (usclock() - start) / 1e6);
+
 	if (transferToEml) {
 		uint8_t block[16];
 		for (uint16_t sectorNo = 0; sectorNo < SectorsCnt; sectorNo++) {
-			if (validKey[0][sectorNo] || validKey[1][sectorNo]) {
+			if (st->valid[0][sectorNo] || st->valid[1][sectorNo]) {
 				mfEmlGetMem(block, FirstBlockOfSector(sectorNo) + NumBlocksPerSector(sectorNo) - 1, 1);
 				for (uint16_t t = 0; t < 2; t++) {
-					if (validKey[t][sectorNo]) {
-						memcpy(block + t*10, foundKey[t][sectorNo], 6);
+					if (st->valid[t][sectorNo]) {
+						memcpy(block + t*10, st->key[t][sectorNo], 6);
 					}
 				}
 				mfEmlSetMem(block, FirstBlockOfSector(sectorNo) + NumBlocksPerSector(sectorNo) - 1, 1);
@@ -1180,21 +1542,51 @@ int CmdHF14AMfChk(const char *Cmd)
 		FILE *fkeys = fopen("dumpkeys.bin","wb");
 		if (fkeys == NULL) { 
 			PrintAndLog("Could not create file dumpkeys.bin");
+			free(st);
 			free(keyBlock);
 			return 1;
 		}
 		for (uint16_t t = 0; t < 2; t++) {
-			fwrite(foundKey[t], 1, 6*SectorsCnt, fkeys);
+			fwrite(st->key[t], 1, 6*SectorsCnt, fkeys);
 		}
 		fclose(fkeys);
 		PrintAndLog("Found keys have been dumped to file dumpkeys.bin. 0xffffffffffff has been inserted for unknown keys.");
 	}
 
+	free(st);
 	free(keyBlock);
 
 	return 0;
 }
 
+int CmdHF14AMfDict(const char *Cmd)
+{
+	char in[256] = {0}, out[256] = {0};
+
+	if (param_getchar(Cmd, 0) == 'h' || param_getlength(Cmd, 0) == 0 || param_getlength(Cmd, 1) == 0) {
+		PrintAndLog("Usage:  hf mf dict <dictionary> <compiled dictionary>");
+		PrintAndLog("Drops the duplicate keys of a dictionary and writes the rest, in their order,");
+		PrintAndLog("in the binary format 'hf mf chk' loads without parsing.");
+		PrintAndLog("      sample: hf mf dict default_keys.dic default_keys.bdic");
+		return 0;
+	}
+	if (param_getlength(Cmd, 0) > 255 || param_getlength(Cmd, 1) > 250) {
+		PrintAndLog("File name too long");
+		return 2;
+	}
+	param_getstr(Cmd, 0, in);
+	param_getstr(Cmd, 1, out);
+
+	uint64_t start = usclock();
+	int n = mfDictCompile(in, out);
+	if (n < 0) {
+		PrintAndLog("Could not compile %s to %s", in, out);
+		return 1;
+	}
+	PrintAndLog("%d keys written to %s in %1.3f sec", n, out, (usclock() - start) / 1e6);
+	return 0;
+}
+
 
 int CmdHF14AMf1kSim(const char *Cmd)
 {
@@ -2002,6 +2394,205 @@ int CmdHF14AMfSniff(const char *Cmd){
 	return 0;
 }
 
+static uint32_t benchWord(void)
+{
+	return (uint32_t)rand() << 16 ^ rand();
+}
+
+static uint64_t benchKey(void)
+{
+	return ((uint64_t)rand() << 32 ^ (uint64_t)rand() << 16 ^ rand()) & 0xffffffffffffULL;
+}
+
+// The batch functions against the scalar ones, on random states and input.
+// tools/mfkey/recoverytest checks that they give the same results.
+static int benchBatch(void)
+{
+	const size_t n = 1 << 16;
+	struct Crypto1State *a = malloc(n * sizeof(*a)), *b = malloc(n * sizeof(*b));
+	uint32_t *ksa = malloc(n * sizeof(uint32_t)), *ksb = malloc(n * sizeof(uint32_t));
+	uint64_t start, us[2];
+	uint32_t in = benchWord();
+
+	if (a == NULL || b == NULL || ksa == NULL || ksb == NULL) {
+		free(a); free(b); free(ksa); free(ksb);
+		return 1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		a[i].odd = benchWord();
+		a[i].even = benchWord();
+	}
+	memcpy(b, a, n * sizeof(*a));
+
+	PrintAndLog("crypto1 batch functions (%s), %u states:", crypto1_batch_backend(), (unsigned)n);
+	for (int fn = 0; fn < 4; fn++) {
+		// rollback without and with feedback, word plain and encrypted
+		int fb = fn & 1;
+		start = usclock();
+		for (size_t i = 0; i < n; i++) {
+			if (fn < 2)
+				lfsr_rollback_word(a + i, in, fb);
+			else
+				ksa[i] = crypto1_word(a + i, in, fb);
+		}
+		us[0] = usclock() - start;
+		start = usclock();
+		if (fn < 2)
+			lfsr_rollback_word_batch(b, n, in, fb);
+		else
+			crypto1_word_batch(b, n, in, fb, ksb);
+		us[1] = usclock() - start;
+
+		PrintAndLog("  %-26s %6.1f ms scalar, %6.1f ms batch", (const char *[]){
+			"lfsr_rollback_word", "lfsr_rollback_word fb", "crypto1_word", "crypto1_word encrypted"}[fn],
+			us[0] / 1000.0, us[1] / 1000.0);
+	}
+	free(a); free(b); free(ksa); free(ksb);
+	return 0;
+}
+
+// The intersection of the statelists of pairs of nested nonces for random keys
+static int benchIntersect(int pairs)
+{
+	struct Crypto1Recovery *ctx[2] = {lfsr_recovery_create(), lfsr_recovery_create()};
+	struct Crypto1State *sl[2], *s;
+	uint64_t us = 0, start;
+	uint32_t uid, len[2], in[2], n, i;
+	int res = 1;
+
+	if (ctx[0] == NULL || ctx[1] == NULL) goto out;
+
+	for (int p = 0; p < pairs; p++) {
+		uint64_t key = benchKey();
+		uid = benchWord();
+		for (i = 0; i < 2; i++) {
+			in[i] = benchWord() ^ uid;
+			s = crypto1_create(key);
+			sl[i] = lfsr_recovery32_ctx(ctx[i], crypto1_word(s, in[i], 0), in[i]);
+			crypto1_destroy(s);
+			for (s = sl[i]; s->odd || s->even; s++);
+			len[i] = s - sl[i];
+		}
+		start = usclock();
+		n = lfsr_nested_intersect(sl, len, in);
+		us += usclock() - start;
+		PrintAndLog("  pair %d: %6u and %6u states, %u candidates", p, len[0], len[1], n);
+	}
+	PrintAndLog("nested intersection, %d pairs: %8.1f ms", pairs, us / 1000.0);
+	res = 0;
+out:
+	lfsr_recovery_destroy(ctx[0]);
+	lfsr_recovery_destroy(ctx[1]);
+	return res;
+}
+
+// The darkside recovery on nonces of random keys, like ReaderMifare() gets
+// them, with and without parities, on one thread and on several
+static int benchDarkside(int rounds, int threads)
+{
+	uint64_t us[2] = {0, 0}, start, key;
+	uint32_t uid, nt, nr, count[2] = {0, 0};
+	uint8_t ks[8], par[8][8];
+	struct Crypto1State *sl, *s;
+	int prev;
+
+	prev = lfsr_prefix_threads(0);
+	for (int r = 0; r < rounds; r++) {
+		bool no_par = r & 1;
+		key = benchKey();
+		uid = benchWord();
+		nt = benchWord();
+		nr = benchWord() & 0xffffff1f;
+		for (int diff = 0; diff < 8; diff++) {
+			uint32_t nr_diff = nr | diff << 5;
+			s = crypto1_create(key);
+			crypto1_word(s, uid ^ nt, 0);
+			for (int i = 0; i < 8; i++) {
+				uint8_t c = i < 4 ? nr_diff >> (24 - 8 * i) : 0;
+				uint8_t plain = c ^ crypto1_byte(s, c, i < 4);
+				par[diff][i] = no_par ? 0 : !parity(plain) ^ filter(s->odd);
+			}
+			ks[diff] = 0;
+			for (int i = 0; i < 4; i++)
+				ks[diff] |= crypto1_bit(s, 0, 0) << i;
+			crypto1_destroy(s);
+		}
+		for (int m = 0; m < 2; m++) {
+			lfsr_prefix_threads(m ? threads : 1);
+			start = usclock();
+			sl = lfsr_common_prefix(nr, 0, ks, par, no_par);
+			us[m] += usclock() - start;
+			for (s = sl; s && s->odd != -1; s++);
+			count[m] += s - sl;
+			free(sl);
+		}
+	}
+	lfsr_prefix_threads(prev);
+
+	PrintAndLog("darkside common prefix, %d rounds, half of them without parities:", rounds);
+	PrintAndLog("  1 thread   : %8.1f ms, %u states", us[0] / 1000.0, count[0]);
+	PrintAndLog("  %2d threads : %8.1f ms, %u states", threads, us[1] / 1000.0, count[1]);
+	return 0;
+}
+
+// Recovers n random keys the way 'hf mf nested' does, first with freshly
+// allocated tables for every key, then with one reused recovery context on
+// one thread and on several threads. Only times them, the results are
+// checked by tools/mfkey/recoverytest.
+int CmdHF14AMfBench(const char *Cmd)
+{
+	int n = param_get32ex(Cmd, 0, 50, 10);
+	int threads = param_get32ex(Cmd, 1, 0, 10);
+	struct Crypto1Recovery *ctx;
+	struct Crypto1State *s;
+	uint64_t start, us[3];
+	uint32_t uid, nt, ks1;
+
+	if (param_getchar(Cmd, 0) == 'h' || n <= 0) {
+		PrintAndLog("Usage:  hf mf bench [<count> [<threads>]]");
+		PrintAndLog("        count   - number of keys to recover, default 50");
+		PrintAndLog("        threads - threads for the threaded runs, default one per core");
+		return 0;
+	}
+
+	for (int pass = 0; pass < 3; pass++) {
+		srand(n);
+		ctx = pass ? lfsr_recovery_create() : NULL;
+		if (pass) lfsr_recovery_threads(ctx, pass == 1 ? 1 : threads);
+		start = usclock();
+		for (int i = 0; i < n; i++) {
+			s = crypto1_create(benchKey());
+			uid = benchWord();
+			nt = benchWord();
+			ks1 = crypto1_word(s, uid ^ nt, 0);
+			crypto1_destroy(s);
+
+			if (!pass) {
+				ctx = lfsr_recovery_create();
+				if (ctx) lfsr_recovery_threads(ctx, 1);
+			}
+			if (ctx == NULL) {
+				PrintAndLog("Cannot allocate memory for the key recovery");
+				return 1;
+			}
+			lfsr_recovery32_ctx(ctx, ks1, nt ^ uid);
+			if (!pass) lfsr_recovery_destroy(ctx);
+		}
+		us[pass] = usclock() - start;
+		if (pass) lfsr_recovery_destroy(ctx);
+	}
+	lfsr_recovery_pool_free();
+
+	PrintAndLog("lfsr_recovery32, %d keys:", n);
+	PrintAndLog("  allocated per call: %8.1f ms, %6.2f calls/s", us[0] / 1000.0, n * 1e6 / us[0]);
+	PrintAndLog("  reused context    : %8.1f ms, %6.2f calls/s", us[1] / 1000.0, n * 1e6 / us[1]);
+	PrintAndLog("  %2d threads        : %8.1f ms, %6.2f calls/s", threads, us[2] / 1000.0, n * 1e6 / us[2]);
+
+	if (benchBatch()) return 1;
+	if (benchIntersect((n + 1) / 2)) return 1;
+	return benchDarkside((n + 1) / 2, threads);
+}
+
 static command_t CommandTable[] =
 {
   {"help",		CmdHelp,				1, "This help"},
@@ -2015,8 +2606,11 @@ static command_t CommandTable[] =
   {"restore",	CmdHF14AMfRestore,		0, "Restore MIFARE classic binary file to BLANK tag"},
   {"wrbl",		CmdHF14AMfWrBl,			0, "Write MIFARE classic block"},
   {"chk",		CmdHF14AMfChk,			0, "Test block keys"},
+  {"dict",		CmdHF14AMfDict,			1, "<dic> <bdic> -- Compile a key dictionary for chk"},
   {"mifare",	CmdHF14AMifare,			0, "Read parity error messages."},
   {"nested",	CmdHF14AMfNested,		0, "Test nested authentication"},
+  {"keystore",	CmdHF14AMfKeyStore,		1, "[l [<uid>] | r | f <file>] -- Keys found before, per card and sector"},
+  {"bench",		CmdHF14AMfBench,		1, "[<count> [<threads>]] -- Benchmark the nested key recovery, offline"},
   {"sniff",		CmdHF14AMfSniff,		0, "Sniff card-reader communication"},
   {"sim",		CmdHF14AMf1kSim,		0, "Simulate MIFARE card"},
   {"eclr",		CmdHF14AMfEClear,		0, "Clear simulator memory block"},
@@ -2038,7 +2632,7 @@ static command_t CommandTable[] =
 int CmdHFMF(const char *Cmd)
 {
 	// flush
-	WaitForResponseTimeout(CMD_ACK,NULL,100);
+	clearStaleResponses();
 
   CmdsParse(CommandTable, Cmd);
   return 0;
@@ -24,6 +24,7 @@
 #include "common.h"
 #include "util.h"
 #include "mifarehost.h"
+#include "cmddev.h"
 
 int CmdHFMF(const char *Cmd);
 
@@ -37,8 +38,10 @@ int CmdHF14AMfRestore(const char* cmd);
 int CmdHF14AMfWrBl(const char* cmd);
 int CmdHF14AMfUWrBl(const char* cmd);
 int CmdHF14AMfChk(const char* cmd);
+int CmdHF14AMfDict(const char* cmd);
 int CmdHF14AMifare(const char* cmd);
 int CmdHF14AMfNested(const char* cmd);
+int CmdHF14AMfBench(const char* cmd);
 int CmdHF14AMfSniff(const char* cmd);
 int CmdHF14AMf1kSim(const char* cmd);
 int CmdHF14AMfEClear(const char* cmd);
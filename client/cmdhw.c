@@ -19,6 +19,8 @@
 #include "cmdhw.h"
 #include "cmdmain.h"
 #include "cmddata.h"
+#include "util.h"
+#include "sleep.h"
 
 /* low-level hardware control */
 
@@ -406,9 +408,109 @@ int CmdVersion(const char *Cmd)
   return 0;
 }
 
+int CmdStats(const char *Cmd)
+{
+  commstats_t st;
+
+  if (param_getchar(Cmd, 0) == 'r') {
+    ResetCommStats();
+    ResetLatencyStats();
+    PrintAndLog("Statistics cleared");
+    return 0;
+  }
+  if (param_getchar(Cmd, 0) == 'h') {
+    PrintAndLog("Usage:  hw stats [r]");
+    PrintAndLog("        r - reset the counters");
+    return 0;
+  }
+
+  GetCommStats(&st);
+  PrintAndLog("Send queue:");
+  PrintAndLog("  commands queued    : %" PRIu64, st.queued);
+  PrintAndLog("  commands sent      : %" PRIu64 " (%" PRIu64 " bytes)", st.sent, st.bytes);
+  PrintAndLog("  send errors        : %" PRIu64, st.errors);
+  PrintAndLog("  dropped            : %" PRIu64 " (producer waits: %" PRIu64 ")", st.dropped, st.full_waits);
+  PrintAndLog("  queue depth        : %u (max %u)", (unsigned int)st.depth, (unsigned int)st.max_depth);
+  if (st.sent && st.busy_us) {
+    PrintAndLog("  write throughput   : %.0f cmds/s, %.1f kB/s while sending",
+      st.sent * 1e6 / st.busy_us, st.bytes * 1e6 / 1024 / st.busy_us);
+  }
+  if (st.sent && st.last_us > st.first_us) {
+    PrintAndLog("  overall throughput : %.1f cmds/s over %.1f s",
+      st.sent * 1e6 / (st.last_us - st.first_us), (st.last_us - st.first_us) / 1e6);
+  }
+  PrintAndLog("Receive:");
+  PrintAndLog("  frames received    : %" PRIu64 " full, %" PRIu64 " compact (%" PRIu64 " bytes)",
+    st.rx_frames, st.rx_compact_frames, st.rx_bytes);
+  PrintAndLog("  bulk data          : %" PRIu64 " bytes", st.rx_bulk_bytes);
+  PrintAndLog("  bad frames         : %" PRIu64, st.rx_errors);
+  PrintAndLog("  receive ring       : %u bytes pending (max %u, overruns: %" PRIu64 ")",
+    (unsigned int)st.rx_buffered, (unsigned int)st.rx_max_buffered, st.rx_full);
+  PrintAndLog("  responses queued   : %" PRIu64 ", waiting %u (max %u)",
+    st.resp_queued, (unsigned int)st.resp_depth, (unsigned int)st.resp_max_depth);
+  PrintAndLog("  queue overflows    : %" PRIu64 " dropped (receiver waits: %" PRIu64 ")",
+    st.resp_overflows, st.resp_full_waits);
+  PrintAndLog("  frame format       : %s", GetFrameFormat() == USB_FRAME_FORMAT_COMPACT ? "compact" : "legacy");
+  PrintAndLog("");
+  PrintLatencyStats();
+  return 0;
+}
+
+/*
+ * Has the device stream frames to us, once with full UsbCommand frames and
+ * once with compact frames, and compares the throughput.
+ */
+int CmdBench(const char *Cmd)
+{
+  uint32_t frames = param_get32ex(Cmd, 0, 1000, 10);
+  uint32_t len = param_get32ex(Cmd, 1, 0, 10);
+  uint32_t restore = GetFrameFormat();
+  commstats_t before, after;
+
+  if (param_getchar(Cmd, 0) == 'h' || len > USB_CMD_DATA_SIZE || frames == 0) {
+    PrintAndLog("Usage:  hw bench [frames] [bytes]");
+    PrintAndLog("        frames - number of frames to receive per format (default 1000)");
+    PrintAndLog("        bytes  - payload per frame, 0..%d (default 0)", USB_CMD_DATA_SIZE);
+    return 0;
+  }
+
+  if (!CompactFramesSupported()) {
+    PrintAndLog("The device firmware is too old for this benchmark");
+    return 0;
+  }
+
+  PrintAndLog("format  |   frames | frames/s | bytes/frame |     kB/s");
+  PrintAndLog("--------+----------+----------+-------------+---------");
+  for (uint32_t format = USB_FRAME_FORMAT_LEGACY; format <= USB_FRAME_FORMAT_COMPACT; format++) {
+    if (!SetFrameFormat(format)) {
+      PrintAndLog("%-7s | not supported by the device", format == USB_FRAME_FORMAT_COMPACT ? "compact" : "legacy");
+      continue;
+    }
+    UsbCommand c = {CMD_USB_BENCHMARK, {frames, len, 0}};
+    ResetBenchmarkFrames();
+    GetCommStats(&before);
+    uint64_t start = usclock();
+    SendCommand(&c);
+    if (!WaitForResponseTimeout(CMD_ACK, NULL, 20000)) {
+      PrintAndLog("timeout while waiting for the device");
+      break;
+    }
+    uint64_t elapsed = MAX(usclock() - start, 1);
+    GetCommStats(&after);
+    uint32_t received = GetBenchmarkFrames();
+    uint64_t bytes = after.rx_bytes - before.rx_bytes;
+    PrintAndLog("%-7s | %8u | %8.0f | %11.1f | %8.1f",
+      format == USB_FRAME_FORMAT_COMPACT ? "compact" : "legacy", received,
+      received * 1e6 / elapsed, (double)bytes / (received + 1), bytes * 1e6 / 1024 / elapsed);
+  }
+  SetFrameFormat(restore);
+  return 0;
+}
+
 static command_t CommandTable[] = 
 {
   {"help",          CmdHelp,        1, "This help"},
+  {"bench",         CmdBench,       0, "[frames] [bytes] -- Compare USB throughput of legacy and compact frames"},
   {"detectreader",  CmdDetectReader,0, "['l'|'h'] -- Detect external reader field (option 'l' or 'h' to limit to LF or HF)"},
   {"fpgaoff",       CmdFPGAOff,     0, "Set FPGA off"},
   {"lcd",           CmdLCD,         0, "<HEX command> <count> -- Send command/data to LCD"},
@@ -417,6 +519,7 @@ static command_t CommandTable[] =
   {"reset",         CmdReset,       0, "Reset the Proxmark3"},
   {"setlfdivisor",  CmdSetDivisor,  0, "<19 - 255> -- Drive LF antenna at 12Mhz/(divisor+1)"},
   {"setmux",        CmdSetMux,      0, "<loraw|hiraw|lopkd|hipkd> -- Set the ADC mux to a specific value"},
+  {"stats",         CmdStats,       1, "['r'] -- Show (or reset) communication statistics"},
   {"tune",          CmdTune,        0, "Measure antenna tuning"},
   {"version",       CmdVersion,     0, "Show version inforation about the connected Proxmark"},
   {NULL, NULL, 0, NULL}
@@ -13,6 +13,7 @@
 
 int CmdHW(const char *Cmd);
 
+int CmdBench(const char *Cmd);
 int CmdDetectReader(const char *Cmd);
 int CmdFPGAOff(const char *Cmd);
 int CmdLCD(const char *Cmd);
@@ -21,6 +22,7 @@ int CmdReadmem(const char *Cmd);
 int CmdReset(const char *Cmd);
 int CmdSetDivisor(const char *Cmd);
 int CmdSetMux(const char *Cmd);
+int CmdStats(const char *Cmd);
 int CmdTune(const char *Cmd);
 int CmdVersion(const char *Cmd);
 
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <pthread.h>
 //#include "proxusb.h"
 #include "proxmark3.h"
 #include "data.h"
@@ -28,6 +29,8 @@
 #include "cmdlft55xx.h"
 #include "cmdlfpcf7931.h"
 #include "cmdlfio.h"
+#include "util.h"
+#include "sleep.h"
 
 static int CmdHelp(const char *Cmd);
 
@@ -373,6 +376,159 @@ int CmdLFRead(const char *Cmd)
   return 0;
 }
 
+// Samples kept in memory while streaming, about 30 s at 134 kHz. Everything
+// beyond that only survives in the spool file.
+#define LF_STREAM_RING_SIZE (1 << 22)
+
+static struct {
+  pthread_mutex_t lock;
+  bool active;
+  uint8_t *ring;
+  uint64_t samples;
+  uint32_t next_seq;
+  uint32_t lost_blocks;
+  uint32_t dropped;
+  FILE *spool;
+  bool spool_error;
+} lf_stream = { PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * @brief Called from the receiver thread for every CMD_STREAMED_RAW_ADC_SAMPLES_125K
+ * block. Gaps in the sequence numbers are blocks that were lost on the way,
+ * arg2 counts the samples the device had to drop because we were too slow.
+ */
+void LFStreamReceived(UsbCommand *c)
+{
+  size_t len = MIN(c->arg[1], USB_CMD_DATA_SIZE);
+
+  pthread_mutex_lock(&lf_stream.lock);
+  if (lf_stream.active) {
+    if (c->arg[0] != lf_stream.next_seq) {
+      lf_stream.lost_blocks += (uint32_t)c->arg[0] - lf_stream.next_seq;
+    }
+    lf_stream.next_seq = c->arg[0] + 1;
+    lf_stream.dropped = c->arg[2];
+    for (size_t i = 0; i < len; i++) {
+      lf_stream.ring[(lf_stream.samples + i) % LF_STREAM_RING_SIZE] = c->d.asBytes[i];
+    }
+    lf_stream.samples += len;
+    if (lf_stream.spool && fwrite(c->d.asBytes, 1, len, lf_stream.spool) != len) {
+      lf_stream.spool_error = true;
+    }
+  }
+  pthread_mutex_unlock(&lf_stream.lock);
+}
+
+int CmdLFStream(const char *Cmd)
+{
+  UsbCommand c = {CMD_STREAM_RAW_ADC_SAMPLES_125K};
+  UsbCommand resp;
+  commstats_t before, after;
+  char filename[256] = {0};
+  char cmdp = param_getchar(Cmd, 0);
+  uint32_t seconds = param_get32ex(Cmd, 1, 0, 10);
+  bool done = false;
+
+  if (cmdp == 'H') {
+    PrintAndLog("Usage:  lf stream [l|h|<divisor>] [<seconds>] [<spool file>]");
+    PrintAndLog("        streams LF samples until <seconds> have passed (0: until a key is pressed)");
+    PrintAndLog("        all samples are written to <spool file>, the last %d are loaded into the graph", MAX_GRAPH_TRACE_LEN);
+    PrintAndLog("  sample: lf stream h 60 tag.raw");
+    return 0;
+  }
+  if (param_getlength(Cmd, 2) >= (int)sizeof(filename)) {
+    PrintAndLog("File name too long");
+    return 0;
+  }
+  if (!LFStreamSupported()) {
+    PrintAndLog("Streaming is not supported by this firmware, use 'lf read'");
+    return 0;
+  }
+
+  if (cmdp == 'h') {
+    c.arg[0] = 1;
+  } else if (cmdp == 'l' || cmdp == 0x00) {
+    c.arg[0] = 0;
+  } else {
+    c.arg[0] = param_get32ex(Cmd, 0, 0, 10);
+  }
+  param_getstr(Cmd, 2, filename);
+
+  pthread_mutex_lock(&lf_stream.lock);
+  if (!lf_stream.ring) lf_stream.ring = malloc(LF_STREAM_RING_SIZE);
+  lf_stream.spool = NULL;
+  if (*filename && (lf_stream.spool = fopen(filename, "wb")) == NULL) {
+    pthread_mutex_unlock(&lf_stream.lock);
+    PrintAndLog("Could not create spool file %s", filename);
+    return 0;
+  }
+  if (!lf_stream.ring) {
+    if (lf_stream.spool) fclose(lf_stream.spool);
+    pthread_mutex_unlock(&lf_stream.lock);
+    PrintAndLog("Cannot allocate memory for the stream");
+    return 0;
+  }
+  lf_stream.samples = 0;
+  lf_stream.next_seq = 0;
+  lf_stream.lost_blocks = 0;
+  lf_stream.dropped = 0;
+  lf_stream.spool_error = false;
+  lf_stream.active = true;
+  pthread_mutex_unlock(&lf_stream.lock);
+
+  GetCommStats(&before);
+  uint64_t start = msclock();
+  uint32_t tag = SendCommandTagged(&c);
+
+  PrintAndLog("Streaming, press any key to stop...");
+  while (ukbhit() > 0) getchar();
+  while (!done) {
+    done = WaitForResponseTagTimeout(CMD_ACK, tag, &resp, 1000);
+    if (!done && (ukbhit() > 0 || (seconds && msclock() - start >= seconds * 1000ULL))) {
+      while (ukbhit() > 0) getchar();
+      UsbCommand stop = {CMD_FPGA_MAJOR_MODE_OFF};
+      SendCommand(&stop);
+      done = WaitForResponseTagTimeout(CMD_ACK, tag, &resp, 2000);
+      if (!done) PrintAndLog("No answer from the device after stopping the stream");
+      break;
+    }
+    pthread_mutex_lock(&lf_stream.lock);
+    printf("\r%"PRIu64" samples, %"PRIu64" kS/s, %u dropped   ", lf_stream.samples,
+           lf_stream.samples / (msclock() - start + 1), lf_stream.dropped);
+    fflush(stdout);
+    pthread_mutex_unlock(&lf_stream.lock);
+  }
+  uint64_t elapsed = msclock() - start;
+  GetCommStats(&after);
+
+  pthread_mutex_lock(&lf_stream.lock);
+  lf_stream.active = false;
+  if (done) lf_stream.dropped = resp.arg[1];
+  if (lf_stream.spool) fclose(lf_stream.spool);
+  lf_stream.spool = NULL;
+
+  size_t n = MIN(lf_stream.samples, MAX_GRAPH_TRACE_LEN);
+  for (size_t i = 0; i < n; i++) {
+    GraphBuffer[i] = (int)lf_stream.ring[(lf_stream.samples - n + i) % LF_STREAM_RING_SIZE] - 128;
+  }
+  GraphTraceLen = n;
+
+  printf("\n");
+  PrintAndLog("Received %"PRIu64" samples in %.1f s (%.1f kS/s)", lf_stream.samples,
+              elapsed / 1000.0, lf_stream.samples / (elapsed + 1.0));
+  if (done && resp.arg[0] != lf_stream.samples) {
+    PrintAndLog("Device sent %u samples in %u blocks", (uint32_t)resp.arg[0], (uint32_t)resp.arg[2]);
+  }
+  PrintAndLog("Dropped on the device: %u samples, lost in transfer: %u blocks, bad frames: %"PRIu64,
+              lf_stream.dropped, lf_stream.lost_blocks, after.rx_errors - before.rx_errors);
+  if (lf_stream.spool_error) PrintAndLog("Writing the spool file %s failed", filename);
+  else if (*filename) PrintAndLog("Saved all samples to %s", filename);
+  pthread_mutex_unlock(&lf_stream.lock);
+
+  RepaintGraphWindow();
+  return 0;
+}
+
 static void ChkBitstream(const char *str)
 {
   int i;
@@ -589,6 +745,7 @@ static command_t CommandTable[] =
   {"sim",         CmdLFSim,           0, "[GAP] -- Simulate LF tag from buffer with optional GAP (in microseconds)"},
   {"simbidir",    CmdLFSimBidir,      0, "Simulate LF tag (with bidirectional data transmission between reader and tag)"},
   {"simman",      CmdLFSimManchester, 0, "<Clock> <Bitstream> [GAP] Simulate arbitrary Manchester LF tag"},
+  {"stream",      CmdLFStream,        0, "['l'|'h'|<divisor>] [seconds] [spool file] -- Stream samples continuously ('H' for help)"},
   {"snoop",       CmdLFSnoop,         0, "['l'|'h'|<divisor>] [trigger threshold]-- Snoop LF (l:125khz, h:134khz)"},
   {"ti",          CmdLFTI,            1, "{ TI RFIDs... }"},
   {"hitag",       CmdLFHitag,         1, "{ Hitag tags and transponders... }"},
@@ -11,6 +11,8 @@
 #ifndef CMDLF_H__
 #define CMDLF_H__
 
+#include "usb_cmd.h"
+
 int CmdLF(const char *Cmd);
 
 int CmdLFCommandRead(const char *Cmd);
@@ -18,6 +20,8 @@ int CmdFlexdemod(const char *Cmd);
 int CmdIndalaDemod(const char *Cmd);
 int CmdIndalaClone(const char *Cmd);
 int CmdLFRead(const char *Cmd);
+int CmdLFStream(const char *Cmd);
+void LFStreamReceived(UsbCommand *c);
 int CmdLFSim(const char *Cmd);
 int CmdLFSimBidir(const char *Cmd);
 int CmdLFSimManchester(const char *Cmd);
@@ -31,8 +31,7 @@ size_t nbytes(size_t nbits) {
 int CmdLFHitagList(const char *Cmd)
 {
   uint8_t got[3000];
-  GetFromBigBuf(got,sizeof(got),0);
-  WaitForResponse(CMD_ACK,NULL);
+  if (!GetFromBigBuf(got,sizeof(got),0)) return 0;
 
   PrintAndLog("recorded activity:");
   PrintAndLog(" ETU     :nbits: who bytes");
@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include "sleep.h"
 #include "cmdparser.h"
 #include "proxmark3.h"
@@ -20,6 +21,7 @@
 #include "ui.h"
 #include "cmdhf.h"
 #include "cmddata.h"
+#include "cmddev.h"
 #include "cmdhw.h"
 #include "cmdlf.h"
 #include "cmdmain.h"
@@ -35,18 +37,109 @@ unsigned int current_command = CMD_UNKNOWN;
 static int CmdHelp(const char *Cmd);
 static int CmdQuit(const char *Cmd);
 
-//For storing command that are received from the device
-#define CMD_BUFFER_SIZE 50
-static UsbCommand cmdBuffer[CMD_BUFFER_SIZE];
-//Points to the next empty position to write to
-static int cmd_head;//Starts as 0
-//Points to the position of the last unread command
-static int cmd_tail;//Starts as 0
+// Responses received from the device, oldest first. The receiver decodes
+// each frame straight into an entry from AllocResponse() and the waiter that
+// takes it gets the entry itself, so a response is never copied on its way.
+// Nothing is overwritten: with CMD_BUFFER_SIZE responses waiting, the
+// receiver holds back for CMD_BUFFER_WAIT_MS before it drops the oldest one.
+#define CMD_BUFFER_SIZE 1024
+#define CMD_BUFFER_WAIT_MS 100
+typedef struct stored_command {
+  UsbCommand cmd;  // first, so a UsbCommand* handed out is the entry itself
+  uint32_t tag;    // tag echoed by the firmware, 0 if untagged
+  struct stored_command *next;
+} stored_command;
+
+// A thread blocked in WaitForResponseTimeout() registers itself here and is
+// only woken by storeCommand() when a response with the expected cmd arrives.
+typedef struct response_waiter {
+  uint32_t cmd;
+  bool signalled;
+  pthread_cond_t cond;
+  struct response_waiter *next;
+} response_waiter;
+
+// Every command sent gets a sequence number. When the firmware understands
+// tagged commands the sequence number goes out as the frame's tag; either way
+// it remembers which command was sent when, for the latency statistics.
+// Responses carrying a tag that is no longer pending are stale.
+#define PENDING_TAGS 64
+typedef struct {
+  uint32_t tag;
+  uint32_t cmd;
+  uint64_t sent_us;
+  pthread_t owner;   // thread that sent it
+} pending_command;
+
+// Round trip latency statistics, kept per command ID. Each histogram has
+// LATENCY_SUB_BUCKETS buckets per power of two microseconds.
+#define LATENCY_SLOTS 32
+#define LATENCY_SUB_BUCKETS 4
+#define LATENCY_BUCKETS (32 * LATENCY_SUB_BUCKETS)
+typedef struct {
+  uint32_t cmd;
+  uint32_t count;
+  uint64_t sum_us;
+  uint64_t max_us;
+  uint32_t buckets[LATENCY_BUCKETS];
+} latency_hist;
+
+// All of the above, and what the device told us it supports, is kept for
+// each device separately; deviceState() gives the current device's.
+typedef struct {
+  pthread_mutex_t cmdBufferMutex;
+  pthread_cond_t cmdBufferSpace;
+  stored_command *cmd_first;   // oldest waiting response
+  stored_command *cmd_last;    // newest waiting response
+  stored_command *cmd_free;    // entries ready for reuse
+  size_t cmd_count;
+  bool cmd_overflowing;        // dropping responses until a waiter takes one
+  commstats_t respstats;
+  response_waiter *waiters;
+  pending_command pending[PENDING_TAGS];
+  int pending_next;
+  uint32_t next_tag;
+  bool tagged_commands;
+  bool compact_frames_supported;
+  bool bulk_download_supported;
+  bool lf_stream_supported;
+  bool chkkeys_sectors_supported;
+  uint32_t frame_format;
+  // frames received by 'hw bench'
+  volatile uint32_t benchmark_frames;
+  latency_hist latencies[LATENCY_SLOTS];
+} device_state;
+static device_state devstate[MAX_DEVICES];
+static pthread_once_t devstate_once = PTHREAD_ONCE_INIT;
+
+// tag of the last command sent by the current thread
+static __thread uint32_t thread_tag;
+
+// passed as the tag to wait for a response to any command the calling
+// thread still has in flight; real tags are never 0
+#define TAG_OWN_PENDING 0
+
+static void initDeviceStates(void)
+{
+  for (int i = 0; i < MAX_DEVICES; i++) {
+    pthread_mutex_init(&devstate[i].cmdBufferMutex, NULL);
+    pthread_cond_init(&devstate[i].cmdBufferSpace, NULL);
+    devstate[i].next_tag = 1;
+    devstate[i].frame_format = USB_FRAME_FORMAT_LEGACY;
+  }
+}
+
+static device_state *deviceState(void)
+{
+  pthread_once(&devstate_once, initDeviceStates);
+  return &devstate[CurrentDevice()];
+}
 
 static command_t CommandTable[] = 
 {
   {"help",  CmdHelp,  1, "This help. Use '<command> help' for details of a particular command."},
   {"data",  CmdData,  1, "{ Plot window / data buffer manipulation... }"},
+  {"dev",   CmdDev,   1, "{ Device commands, for several connected Proxmarks... }"},
   {"hf",    CmdHF,    1, "{ HF commands... }"},
   {"hw",    CmdHW,    1, "{ Hardware commands... }"},
   {"lf",    CmdLF,    1, "{ LF commands... }"},
@@ -79,91 +172,544 @@ int CmdQuit(const char *Cmd)
  */
 void clearCommandBuffer()
 {
-    //This is a very simple operation
-    cmd_tail = cmd_head;
+    device_state *ds = deviceState();
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    while (ds->cmd_first != NULL) {
+        stored_command *sc = ds->cmd_first;
+        ds->cmd_first = sc->next;
+        sc->next = ds->cmd_free;
+        ds->cmd_free = sc;
+    }
+    ds->cmd_last = NULL;
+    ds->cmd_count = 0;
+    ds->cmd_overflowing = false;
+    pthread_cond_broadcast(&ds->cmdBufferSpace);
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+}
+
+// the queue entry a response handed out by AllocResponse() lives in
+static stored_command *responseEntry(const UsbCommand *response)
+{
+    uintptr_t addr = (uintptr_t)response - offsetof(stored_command, cmd);
+    return (stored_command*)addr;
 }
 
 /**
- * @brief storeCommand stores a USB command in a circular buffer
- * @param UC
+ * @brief Hands out an entry for the receiver to decode the next frame into.
+ * It goes back with UsbCommandReceived() or ReleaseResponse().
  */
-void storeCommand(UsbCommand *command)
+UsbCommand *AllocResponse()
 {
-    if( ( cmd_head+1) % CMD_BUFFER_SIZE == cmd_tail)
-    {
-        //If these two are equal, we're about to overwrite in the
-        // circular buffer.
-        PrintAndLog("WARNING: Command buffer about to overwrite command! This needs to be fixed!");
+    device_state *ds = deviceState();
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    stored_command *sc = ds->cmd_free;
+    if (sc != NULL) ds->cmd_free = sc->next;
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+    if (sc == NULL) {
+        sc = malloc(sizeof(stored_command));
+        if (sc == NULL) {
+            PrintAndLog("Cannot allocate memory for a response");
+            exit(1);
+        }
     }
-    //Store the command at the 'head' location
-    UsbCommand* destination = &cmdBuffer[cmd_head];
-    memcpy(destination, command, sizeof(UsbCommand));
+    return &sc->cmd;
+}
 
-    cmd_head = (cmd_head +1) % CMD_BUFFER_SIZE; //increment head and wrap
+/**
+ * @brief Gives back a response taken with WaitForResponseRef() or one that
+ * AllocResponse() handed out and that wasn't stored.
+ */
+void ReleaseResponse(const UsbCommand *response)
+{
+    if (response == NULL) return;
+    device_state *ds = deviceState();
+    stored_command *sc = responseEntry(response);
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    sc->next = ds->cmd_free;
+    ds->cmd_free = sc;
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+}
 
+// Must be called with cmdBufferMutex held
+static void unlinkCommand(device_state *ds, stored_command *sc, stored_command *prev)
+{
+    if (prev == NULL) {
+        ds->cmd_first = sc->next;
+    } else {
+        prev->next = sc->next;
+    }
+    if (ds->cmd_last == sc) ds->cmd_last = prev;
+    ds->cmd_count--;
+    pthread_cond_signal(&ds->cmdBufferSpace);
 }
+
 /**
- * @brief getCommand gets a command from an internal circular buffer.
- * @param response location to write command
- * @return 1 if response was returned, 0 if nothing has been received
+ * @brief storeCommand queues a response and wakes up the threads waiting
+ * for this kind of response
+ * @param command entry from AllocResponse(), the queue takes it over
+ * @param tag the tag the firmware echoed with it
  */
-int getCommand(UsbCommand* response)
+static void storeCommand(UsbCommand *command, uint32_t tag)
 {
-    //If head == tail, there's nothing to read, or if we just got initialized
-    if(cmd_head == cmd_tail){
-        return 0;
+    device_state *ds = deviceState();
+    stored_command *sc = responseEntry(command);
+
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    if (ds->cmd_count >= CMD_BUFFER_SIZE) {
+        // Nobody is taking the responses out; give the waiters a moment
+        // before anything is lost, the device is held back meanwhile.
+        // Once responses are being dropped, don't wait for each one.
+        if (!ds->cmd_overflowing) {
+            struct timespec ts;
+            deadline(&ts, CMD_BUFFER_WAIT_MS);
+            ds->respstats.resp_full_waits++;
+            while (ds->cmd_count >= CMD_BUFFER_SIZE) {
+                if (pthread_cond_timedwait(&ds->cmdBufferSpace, &ds->cmdBufferMutex, &ts) != 0) break;
+            }
+        }
+        if (ds->cmd_count >= CMD_BUFFER_SIZE) {
+            stored_command *oldest = ds->cmd_first;
+            unlinkCommand(ds, oldest, NULL);
+            oldest->next = ds->cmd_free;
+            ds->cmd_free = oldest;
+            ds->respstats.resp_overflows++;
+            ds->cmd_overflowing = true;
+        }
     }
-    //Pick out the next unread command
-    UsbCommand* last_unread = &cmdBuffer[cmd_tail];
-    memcpy(response, last_unread, sizeof(UsbCommand));
-    //Increment tail - this is a circular buffer, so modulo buffer size
-    cmd_tail = (cmd_tail +1 ) % CMD_BUFFER_SIZE;
 
-    return 1;
+    sc->tag = tag;
+    sc->next = NULL;
+    if (ds->cmd_last == NULL) {
+        ds->cmd_first = sc;
+    } else {
+        ds->cmd_last->next = sc;
+    }
+    ds->cmd_last = sc;
+    ds->cmd_count++;
+    ds->respstats.resp_queued++;
+    ds->respstats.resp_max_depth = MAX(ds->respstats.resp_max_depth, ds->cmd_count);
+
+    for (response_waiter *w = ds->waiters; w != NULL; w = w->next) {
+        if (w->cmd == command->cmd) {
+            w->signalled = true;
+            pthread_cond_signal(&w->cond);
+        }
+    }
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+}
 
+void GetResponseStats(commstats_t *stats)
+{
+    device_state *ds = deviceState();
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    stats->resp_queued = ds->respstats.resp_queued;
+    stats->resp_depth = ds->cmd_count;
+    stats->resp_max_depth = ds->respstats.resp_max_depth;
+    stats->resp_full_waits = ds->respstats.resp_full_waits;
+    stats->resp_overflows = ds->respstats.resp_overflows;
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+}
+
+void ResetResponseStats()
+{
+    device_state *ds = deviceState();
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    memset(&ds->respstats, 0, sizeof(ds->respstats));
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+}
+
+// Must be called with cmdBufferMutex held
+static pending_command *findPending(device_state *ds, uint32_t tag)
+{
+    if (tag == 0) return NULL;
+    for (int i = 0; i < PENDING_TAGS; i++) {
+        if (ds->pending[i].tag == tag) return &ds->pending[i];
+    }
+    return NULL;
+}
+
+// Whether a response tagged resp_tag is one the waiter for tag is after.
+// Must be called with cmdBufferMutex held
+static bool tagMatches(device_state *ds, uint32_t resp_tag, uint32_t tag)
+{
+    if (resp_tag == 0 || resp_tag == tag) return true;
+    if (tag != TAG_OWN_PENDING) return false;
+    pending_command *p = findPending(ds, resp_tag);
+    return p != NULL && pthread_equal(p->owner, pthread_self());
 }
 
 /**
- * Waits for a certain response type. This method waits for a maximum of
- * ms_timeout milliseconds for a specified response command.
- *@brief WaitForResponseTimeout
+ * @brief getCommand takes the next response for a waiter out of the queue.
+ * Must be called with cmdBufferMutex held.
+ * Responses for the waiter's own command, untagged and stale responses that
+ * don't match are discarded on the way, like they always were. Responses
+ * that belong to another command still in flight are left for their owner.
+ * @param cmd the expected response command
+ * @param tag the tag of the command the response belongs to, or
+ * TAG_OWN_PENDING for any command the calling thread has in flight
+ * @return the response, now owned by the caller, or NULL if nothing has been received
+ */
+static stored_command *getCommand(device_state *ds, uint32_t cmd, uint32_t tag)
+{
+    stored_command *prev = NULL;
+    stored_command *sc = ds->cmd_first;
+    while (sc != NULL) {
+        stored_command *next = sc->next;
+        if (sc->cmd.cmd == cmd && tagMatches(ds, sc->tag, tag)) {
+            //Pick out the matching command
+            unlinkCommand(ds, sc, prev);
+            ds->cmd_overflowing = false;
+            return sc;
+        } else if (sc->tag == 0 || sc->tag == tag || findPending(ds, sc->tag) == NULL) {
+            unlinkCommand(ds, sc, prev);
+            sc->next = ds->cmd_free;
+            ds->cmd_free = sc;
+        } else {
+            prev = sc;
+        }
+        sc = next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief NoteCommandSent assigns the next tag to a command about to be sent
+ * and remembers which command went out when, so the round trip can be
+ * accounted to it once its response arrives.
+ * @param c the command handed to SendCommand()
+ * @return the tag; it only goes on the wire if TaggedCommandsSupported()
+ */
+uint32_t NoteCommandSent(UsbCommand *c)
+{
+    device_state *ds = deviceState();
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    uint32_t tag = ds->next_tag++;
+    if (ds->next_tag == 0) ds->next_tag = 1;
+    ds->pending[ds->pending_next].tag = tag;
+    ds->pending[ds->pending_next].cmd = c->cmd;
+    ds->pending[ds->pending_next].sent_us = usclock();
+    ds->pending[ds->pending_next].owner = pthread_self();
+    ds->pending_next = (ds->pending_next + 1) % PENDING_TAGS;
+    thread_tag = tag;
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+    return tag;
+}
+
+static int latencyBucket(uint64_t us)
+{
+    int msb = 0;
+    if (us < LATENCY_SUB_BUCKETS) return us;
+    while ((us >> msb) >= 2 * LATENCY_SUB_BUCKETS) msb++;
+    int bucket = (msb + 1) * LATENCY_SUB_BUCKETS + (int)((us >> msb) - LATENCY_SUB_BUCKETS);
+    return MIN(bucket, LATENCY_BUCKETS - 1);
+}
+
+// upper bound (in us) of the values counted in a bucket
+static uint64_t latencyBucketLimit(int bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS) return bucket;
+    int msb = bucket / LATENCY_SUB_BUCKETS - 1;
+    return ((uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS + 1) << msb) - 1;
+}
+
+// Must be called with cmdBufferMutex held
+static void recordLatency(device_state *ds, uint32_t cmd, uint64_t us)
+{
+    latency_hist *h = NULL;
+    for (int i = 0; i < LATENCY_SLOTS; i++) {
+        if (ds->latencies[i].count == 0 || ds->latencies[i].cmd == cmd) {
+            h = &ds->latencies[i];
+            break;
+        }
+    }
+    if (h == NULL) return; // table full, don't track any more command IDs
+    h->cmd = cmd;
+    h->count++;
+    h->sum_us += us;
+    h->max_us = MAX(h->max_us, us);
+    h->buckets[latencyBucket(us)]++;
+}
+
+static uint64_t latencyPercentile(latency_hist *h, uint32_t percent)
+{
+    uint64_t rank = ((uint64_t)h->count * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) return MIN(latencyBucketLimit(i), h->max_us);
+    }
+    return h->max_us;
+}
+
+void PrintLatencyStats()
+{
+    device_state *ds = deviceState();
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    PrintAndLog("Round trip latency per command:");
+    PrintAndLog("   cmd |  count |   mean us |    p50 us |    p99 us |    max us");
+    PrintAndLog("-------+--------+-----------+-----------+-----------+----------");
+    for (int i = 0; i < LATENCY_SLOTS && ds->latencies[i].count; i++) {
+        latency_hist *h = &ds->latencies[i];
+        PrintAndLog("0x%04x | %6u | %9" PRIu64 " | %9" PRIu64 " | %9" PRIu64 " | %9" PRIu64,
+            h->cmd, h->count, h->sum_us / h->count,
+            latencyPercentile(h, 50), latencyPercentile(h, 99), h->max_us);
+    }
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+}
+
+void ResetLatencyStats()
+{
+    device_state *ds = deviceState();
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    memset(ds->latencies, 0, sizeof(ds->latencies));
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+}
+
+// The command is no longer in flight, later responses to it are stale.
+// Must be called with cmdBufferMutex held
+static void retireCommand(device_state *ds, uint32_t tag, bool answered)
+{
+    pending_command *p = findPending(ds, tag);
+    if (p != NULL) {
+        if (answered) recordLatency(ds, p->cmd, usclock() - p->sent_us);
+        p->tag = 0;
+    }
+}
+
+/**
+ * Waits for a certain response to the command sent with the given tag. This
+ * method waits for a maximum of ms_timeout milliseconds.
+ * The waiting thread sleeps until storeCommand() signals that a response
+ * with the expected cmd has arrived.
+ *@brief WaitForResponseRef
  * @param cmd command to wait for
- * @param response struct to copy received command into.
+ * @param tag tag returned by SendCommandTagged(), or TAG_OWN_PENDING
  * @param ms_timeout
- * @return true if command was returned, otherwise false
+ * @return the response itself, to be given back with ReleaseResponse(),
+ * or NULL if nothing arrived in time
  */
-bool WaitForResponseTimeout(uint32_t cmd, UsbCommand* response, size_t ms_timeout) {
+const UsbCommand *WaitForResponseRef(uint32_t cmd, uint32_t tag, size_t ms_timeout) {
   
-  UsbCommand resp;
+  device_state *ds = deviceState();
+  response_waiter self;
+  struct timespec ts;
+  stored_command *found = NULL;
+  bool warned = false;
+  uint64_t start = msclock();
 
-  if (response == NULL) {
-    response = &resp;
-  }
+  self.cmd = cmd;
+  self.signalled = false;
+  pthread_cond_init(&self.cond, NULL);
 
-  // Wait until the command is received
-  for(size_t dm_seconds=0; dm_seconds < ms_timeout/10; dm_seconds++) {
+  pthread_mutex_lock(&ds->cmdBufferMutex);
+  self.next = ds->waiters;
+  ds->waiters = &self;
 
-      while(getCommand(response))
-      {
-          if(response->cmd == cmd){
+  while (true) {
+      if ((found = getCommand(ds, cmd, tag)) != NULL) {
           //We got what we expected
-          return true;
-          }
+          break;
+      }
 
+      uint64_t elapsed = msclock() - start;
+      if (elapsed >= ms_timeout) break;
+
+      // Wake up after two seconds to tell the user we're still waiting
+      uint64_t wait = ms_timeout - elapsed;
+      if (!warned && ms_timeout > 2000) wait = MIN(wait, 2000 - MIN(elapsed, 2000));
+      if (wait > 0) {
+          deadline(&ts, (uint32_t)MIN(wait, 0x7fffffff));
+          while (!self.signalled) {
+              if (pthread_cond_timedwait(&self.cond, &ds->cmdBufferMutex, &ts) != 0) break;
+          }
+          self.signalled = false;
       }
-        msleep(10); // XXX ugh
-        if (dm_seconds == 200) { // Two seconds elapsed
+      if (!warned && ms_timeout > 2000 && msclock() - start >= 2000) {
+          warned = true;
+          pthread_mutex_unlock(&ds->cmdBufferMutex);
           PrintAndLog("Waiting for a response from the proxmark...");
           PrintAndLog("Don't forget to cancel its operation first by pressing on the button");
-        }
-	}
-    return false;
+          pthread_mutex_lock(&ds->cmdBufferMutex);
+      }
+  }
+
+  // Without a tag to go by, an untagged response or a timeout is accounted
+  // to the last command this thread sent
+  uint32_t done = tag;
+  if (tag == TAG_OWN_PENDING) done = (found != NULL && found->tag != 0) ? found->tag : thread_tag;
+  retireCommand(ds, done, found != NULL);
+
+  for (response_waiter **w = &ds->waiters; *w != NULL; w = &(*w)->next) {
+      if (*w == &self) {
+          *w = self.next;
+          break;
+      }
+  }
+  pthread_mutex_unlock(&ds->cmdBufferMutex);
+  pthread_cond_destroy(&self.cond);
+  return (found != NULL) ? &found->cmd : NULL;
+}
+
+/**
+ * @brief Takes the response to the command sent with the given tag if it has
+ * arrived already. Unlike WaitForResponseRef() with a zero timeout, the
+ * command stays in flight when there is nothing yet.
+ * @param cmd command to wait for
+ * @param tag tag returned by SendCommandTagged()
+ * @return the response, to be given back with ReleaseResponse(), or NULL
+ */
+const UsbCommand *PollResponseRef(uint32_t cmd, uint32_t tag) {
+  device_state *ds = deviceState();
+
+  pthread_mutex_lock(&ds->cmdBufferMutex);
+  stored_command *found = getCommand(ds, cmd, tag);
+  if (found != NULL) retireCommand(ds, tag, true);
+  pthread_mutex_unlock(&ds->cmdBufferMutex);
+  return (found != NULL) ? &found->cmd : NULL;
+}
+
+/**
+ * Waits for a certain response to the command sent with the given tag and
+ * copies it out, see WaitForResponseRef().
+ *@brief WaitForResponseTagTimeout
+ * @param cmd command to wait for
+ * @param tag tag returned by SendCommandTagged()
+ * @param response struct to copy received command into.
+ * @param ms_timeout
+ * @return true if command was returned, otherwise false
+ */
+bool WaitForResponseTagTimeout(uint32_t cmd, uint32_t tag, UsbCommand* response, size_t ms_timeout) {
+  const UsbCommand *resp = WaitForResponseRef(cmd, tag, ms_timeout);
+  if (resp == NULL) return false;
+  if (response != NULL) memcpy(response, resp, sizeof(UsbCommand));
+  ReleaseResponse(resp);
+  return true;
+}
+
+/**
+ * Waits for a certain response type to a command sent by the calling thread.
+ * This method waits for a maximum of ms_timeout milliseconds for a specified
+ * response command.
+ * Any command of this thread still in flight qualifies, not just the last
+ * one, so a thread may send A and B and then wait for A's response. Use
+ * SendCommandTagged() and WaitForResponseTagTimeout() to tell the responses
+ * of two such commands apart when they share a response cmd.
+ *@brief WaitForResponseTimeout
+ * @param cmd command to wait for
+ * @param response struct to copy received command into.
+ * @param ms_timeout
+ * @return true if command was returned, otherwise false
+ */
+bool WaitForResponseTimeout(uint32_t cmd, UsbCommand* response, size_t ms_timeout) {
+  return WaitForResponseTagTimeout(cmd, TAG_OWN_PENDING, response, ms_timeout);
 }
 
 bool WaitForResponse(uint32_t cmd, UsbCommand* response) {
 	return WaitForResponseTimeout(cmd,response,-1);
 }
 
+/**
+ * @brief Asks the current device what it supports and enables tagged
+ * commands if the firmware echoes tags. Called once after connecting.
+ */
+void CheckDeviceCapabilities()
+{
+  device_state *ds = deviceState();
+  UsbCommand c = {CMD_DEVICE_INFO};
+  UsbCommand resp;
+  SendCommand(&c);
+  if (!WaitForResponseTimeout(CMD_DEVICE_INFO, &resp, 1000)) return;
+  if (!(resp.arg[0] & DEVICE_INFO_FLAG_CURRENT_MODE_OS)) return;
+  if (resp.arg[0] & DEVICE_INFO_FLAG_UNDERSTANDS_CMD_TAG) {
+    pthread_mutex_lock(&ds->cmdBufferMutex);
+    ds->tagged_commands = true;
+    pthread_mutex_unlock(&ds->cmdBufferMutex);
+  }
+  if (resp.arg[0] & DEVICE_INFO_FLAG_UNDERSTANDS_BULK_DOWNLOAD) {
+    ds->bulk_download_supported = true;
+  }
+  if (resp.arg[0] & DEVICE_INFO_FLAG_UNDERSTANDS_LF_STREAM) {
+    ds->lf_stream_supported = true;
+  }
+  if (resp.arg[0] & DEVICE_INFO_FLAG_UNDERSTANDS_CHKKEYS_SECTORS) {
+    ds->chkkeys_sectors_supported = true;
+  }
+  if (resp.arg[0] & DEVICE_INFO_FLAG_UNDERSTANDS_COMPACT_FRAMES) {
+    ds->compact_frames_supported = true;
+    SetFrameFormat(USB_FRAME_FORMAT_COMPACT);
+  }
+}
+
+bool TaggedCommandsSupported()
+{
+  return deviceState()->tagged_commands;
+}
+
+bool BulkDownloadSupported()
+{
+  return deviceState()->bulk_download_supported;
+}
+
+bool CompactFramesSupported()
+{
+  return deviceState()->compact_frames_supported;
+}
+
+bool LFStreamSupported()
+{
+  return deviceState()->lf_stream_supported;
+}
+
+bool ChkKeysSectorsSupported()
+{
+  return deviceState()->chkkeys_sectors_supported;
+}
+
+/**
+ * @brief Switches the format of the frames the device sends us. Incoming
+ * frames are recognized either way, so this only changes what goes over USB.
+ * @return true if the device acknowledged the new format
+ */
+bool SetFrameFormat(uint32_t format)
+{
+  device_state *ds = deviceState();
+  UsbCommand c = {CMD_SET_FRAME_FORMAT, {format, 0, 0}};
+  if (!ds->compact_frames_supported) return (format == USB_FRAME_FORMAT_LEGACY);
+  SendCommand(&c);
+  if (!WaitForResponseTimeout(CMD_ACK, NULL, 1000)) return false;
+  ds->frame_format = format;
+  return true;
+}
+
+uint32_t GetFrameFormat()
+{
+  return deviceState()->frame_format;
+}
+
+void ResetBenchmarkFrames()
+{
+  deviceState()->benchmark_frames = 0;
+}
+
+uint32_t GetBenchmarkFrames()
+{
+  return deviceState()->benchmark_frames;
+}
+
+/**
+ * @brief Gets rid of responses to earlier commands before starting a new
+ * operation. With tagged commands stale responses are recognized as such, so
+ * this is immediate; older firmware needs a grace period for late ACKs.
+ */
+void clearStaleResponses()
+{
+  if (deviceState()->tagged_commands) {
+    clearCommandBuffer();
+  } else {
+    WaitForResponseTimeout(CMD_ACK,NULL,100);
+  }
+}
+
 //-----------------------------------------------------------------------------
 // Entry point into our code: called whenever the user types a command and
 // then presses Enter, which the full command line that they typed.
@@ -175,9 +721,13 @@ void CommandReceived(char *Cmd) {
 //-----------------------------------------------------------------------------
 // Entry point into our code: called whenever we received a packet over USB
 // that we weren't necessarily expecting, for example a debug print.
+// UC comes from AllocResponse() and is either stored or released here.
 //-----------------------------------------------------------------------------
 void UsbCommandReceived(UsbCommand *UC)
 {
+  uint32_t tag = USB_CMD_TAG(UC->cmd);
+  UC->cmd = USB_CMD_ID(UC->cmd);
+
   /*
   //  Debug
   printf("UsbCommand length[len=%zd]\n",sizeof(UsbCommand));
@@ -198,11 +748,32 @@ void UsbCommandReceived(UsbCommand *UC)
       memcpy(s,UC->d.asBytes,len);
       s[len] = 0x00;
       PrintAndLog("#db# %s       ", s);
+      ReleaseResponse(UC);
+      return;
+    } break;
+
+    case CMD_BULK_DATA: {
+      // raw data follows, see BulkBytesExpected()
+      BulkTransferStarted(UC->arg[0], UC->arg[1]);
+      ReleaseResponse(UC);
+      return;
+    } break;
+
+    case CMD_USB_BENCHMARK: {
+      deviceState()->benchmark_frames++;
+      ReleaseResponse(UC);
+      return;
+    } break;
+
+    case CMD_STREAMED_RAW_ADC_SAMPLES_125K: {
+      LFStreamReceived(UC);
+      ReleaseResponse(UC);
       return;
     } break;
 
     case CMD_DEBUG_PRINT_INTEGERS: {
       PrintAndLog("#db# %08x, %08x, %08x       \r\n", UC->arg[0], UC->arg[1], UC->arg[2]);
+      ReleaseResponse(UC);
       return;
     } break;
 
@@ -232,9 +803,12 @@ void UsbCommandReceived(UsbCommand *UC)
     case CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K: {
 //      printf("received samples: ");
 //      print_hex(UC->d.asBytes,512);
-      sample_buf_len += UC->arg[1];
+      if (!SamplesReceived(UC)) {
+        PrintAndLog("Dropping samples outside of the requested range");
+        ReleaseResponse(UC);
+      return;
+      }
 //      printf("samples: %zd offset: %d\n",sample_buf_len,UC->arg[0]);
-      memcpy(sample_buf+(UC->arg[0]),UC->d.asBytes,UC->arg[1]);
     } break;
 
 
@@ -266,7 +840,7 @@ void UsbCommandReceived(UsbCommand *UC)
       break;
   }
 
-  storeCommand(UC);
+  storeCommand(UC, tag);
 
 }
 
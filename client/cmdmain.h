@@ -13,10 +13,32 @@
 
 #include "usb_cmd.h"
 #include "cmdparser.h"
+#include "proxmark3.h"
+UsbCommand *AllocResponse();
+void ReleaseResponse(const UsbCommand *response);
 void UsbCommandReceived(UsbCommand *UC);
 void CommandReceived(char *Cmd);
 bool WaitForResponseTimeout(uint32_t cmd, UsbCommand* response, size_t ms_timeout);
 bool WaitForResponse(uint32_t cmd, UsbCommand* response);
+bool WaitForResponseTagTimeout(uint32_t cmd, uint32_t tag, UsbCommand* response, size_t ms_timeout);
+const UsbCommand *WaitForResponseRef(uint32_t cmd, uint32_t tag, size_t ms_timeout);
+const UsbCommand *PollResponseRef(uint32_t cmd, uint32_t tag);
 void clearCommandBuffer();
+void clearStaleResponses();
+void CheckDeviceCapabilities();
+bool TaggedCommandsSupported();
+bool CompactFramesSupported();
+bool BulkDownloadSupported();
+bool LFStreamSupported();
+bool ChkKeysSectorsSupported();
+bool SetFrameFormat(uint32_t format);
+uint32_t GetFrameFormat();
+void ResetBenchmarkFrames();
+uint32_t GetBenchmarkFrames();
+uint32_t NoteCommandSent(UsbCommand *c);
+void PrintLatencyStats();
+void ResetLatencyStats();
+void GetResponseStats(commstats_t *stats);
+void ResetResponseStats();
 command_t* getTopLevelCommandTable();
 #endif
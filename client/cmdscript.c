@@ -157,7 +157,8 @@ int CmdRun(const char *Cmd)
 
 
 
-    // run the Lua script
+    // run the Lua script, core.selectDevice() only lasts as long as it does
+    int prev_device = SetThreadDevice(CurrentDevice());
 
     int error = luaL_loadfile(lua_state, buf);
     if(!error)
@@ -184,6 +185,7 @@ int CmdRun(const char *Cmd)
     //luaL_dofile(lua_state, buf);
     // close the Lua state
     lua_close(lua_state);
+    SetThreadDevice(prev_device);
     printf("\n-----Finished\n");
     return 0;
 }
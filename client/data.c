@@ -10,35 +10,220 @@
 
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
 #include "data.h"
 #include "ui.h"
-//#include "proxusb.h"
 #include "proxmark3.h"
 #include "cmdmain.h"
+#include "crc16.h"
+#include "util.h"
+#include "sleep.h"
 
-uint8_t* sample_buf;
-size_t sample_buf_len;
-
-void GetFromBigBuf(uint8_t *dest, int bytes, int start_index)
-{
-  sample_buf_len = 0;
-  sample_buf = dest;
-//	start_index = ((start_index/12)*12);
-//    int n = start_index + bytes;
-    /*
-     if (n % 48 != 0) {
-     PrintAndLog("bad len in GetFromBigBuf");
-     return;
-     }
-     */
+// State of a download from BigBuf, kept per device. After the CMD_BULK_DATA
+// frame announcing a bulk transfer, the device's receiver thread hands the
+// raw bytes that follow to BulkDataReceived(). Older firmware sends the
+// samples in CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K frames instead, they go to
+// SamplesReceived().
+// Raw bytes nobody waits for any more, of a transfer that timed out or
+// wasn't asked for, are still counted off and discarded; parsed as frames
+// they would throw the receiver off.
+typedef struct {
+  pthread_mutex_t mutex;
+  uint8_t *bulk_dest;    // NULL discards the raw bytes
+  size_t bulk_size;      // bytes we are prepared to receive
+  bool bulk_announced;
+  size_t bulk_offset;    // BigBuf offset announced by the device
+  size_t bulk_expected;  // bytes announced by the device
+  size_t bulk_received;
+  uint8_t *sample_buf;
+  size_t sample_buf_len;
+  size_t sample_buf_size; // size of the buffer sample_buf points to
+} transfer_state;
+static transfer_state transfers[MAX_DEVICES];
+static pthread_once_t transfers_once = PTHREAD_ONCE_INIT;
+
+static void initTransfers(void)
+{
+  for (int i = 0; i < MAX_DEVICES; i++) {
+    pthread_mutex_init(&transfers[i].mutex, NULL);
+  }
+}
+
+static transfer_state *currentTransfer(void)
+{
+  pthread_once(&transfers_once, initTransfers);
+  return &transfers[CurrentDevice()];
+}
+
+void BulkTransferStarted(size_t offset, size_t len)
+{
+  transfer_state *t = currentTransfer();
+  pthread_mutex_lock(&t->mutex);
+  if (t->bulk_dest == NULL || len > t->bulk_size) {
+    PrintAndLog("Unexpected bulk transfer of %d bytes, discarding it", (int)len);
+    t->bulk_dest = NULL;
+  }
+  t->bulk_announced = true;
+  t->bulk_offset = offset;
+  t->bulk_expected = len;
+  t->bulk_received = 0;
+  pthread_mutex_unlock(&t->mutex);
+}
+
+size_t BulkBytesExpected()
+{
+  transfer_state *t = currentTransfer();
+  pthread_mutex_lock(&t->mutex);
+  size_t n = t->bulk_expected - t->bulk_received;
+  pthread_mutex_unlock(&t->mutex);
+  return n;
+}
+
+void BulkDataReceived(const uint8_t *data, size_t len)
+{
+  transfer_state *t = currentTransfer();
+  pthread_mutex_lock(&t->mutex);
+  len = MIN(len, t->bulk_expected - t->bulk_received);
+  if (t->bulk_dest != NULL) memcpy(t->bulk_dest + t->bulk_received, data, len);
+  t->bulk_received += len;
+  pthread_mutex_unlock(&t->mutex);
+}
+
+/**
+ * @brief Stops routing raw bytes to the destination. If the device is still
+ * sending, the rest of the transfer is waited for and discarded, so the
+ * receiver is back on frame boundaries before the next command goes out.
+ * @param offset receives the offset the device announced, if it did
+ * @return how many bytes arrived in the destination
+ */
+static size_t bulkTransferFinish(transfer_state *t, bool *announced, size_t *offset)
+{
+  pthread_mutex_lock(&t->mutex);
+  size_t n = t->bulk_received;
+  *announced = t->bulk_announced;
+  *offset = t->bulk_offset;
+  t->bulk_dest = NULL;
+  pthread_mutex_unlock(&t->mutex);
+
+  // give up when nothing came in for a while, the transfer is lost then
+  size_t last = n;
+  uint64_t idle_since = msclock();
+  while (BulkBytesExpected() > 0 && msclock() - idle_since < BULK_DRAIN_IDLE_MS) {
+    msleep(10);
+    pthread_mutex_lock(&t->mutex);
+    if (t->bulk_received != last) {
+      last = t->bulk_received;
+      idle_since = msclock();
+    }
+    pthread_mutex_unlock(&t->mutex);
+  }
+
+  pthread_mutex_lock(&t->mutex);
+  if (t->bulk_expected != t->bulk_received) {
+    PrintAndLog("Bulk transfer stalled after %d of %d bytes", (int)t->bulk_received, (int)t->bulk_expected);
+  }
+  t->bulk_announced = false;
+  t->bulk_expected = t->bulk_received = 0;
+  pthread_mutex_unlock(&t->mutex);
+  return n;
+}
+
+/**
+ * @brief Stores the samples of a CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K frame
+ * in the buffer of the legacy download in progress.
+ * @return false if they don't fit the requested range
+ */
+bool SamplesReceived(const UsbCommand *UC)
+{
+  transfer_state *t = currentTransfer();
+  pthread_mutex_lock(&t->mutex);
+  if (t->sample_buf == NULL || UC->arg[1] > USB_CMD_DATA_SIZE || UC->arg[0] + UC->arg[1] > t->sample_buf_size) {
+    pthread_mutex_unlock(&t->mutex);
+    return false;
+  }
+  t->sample_buf_len += UC->arg[1];
+  memcpy(t->sample_buf + UC->arg[0], UC->d.asBytes, UC->arg[1]);
+  pthread_mutex_unlock(&t->mutex);
+  return true;
+}
+
+/**
+ * @brief Downloads one chunk of BigBuf with a bulk transfer and checks it
+ * against the CRC the device sends along.
+ * @return true if the complete chunk arrived intact
+ */
+static bool getBulkChunk(uint8_t *dest, size_t bytes, size_t start_index)
+{
+  transfer_state *t = currentTransfer();
+  UsbCommand resp;
+  UsbCommand c = {CMD_DOWNLOAD_BIGBUF_BULK, {start_index, bytes, 0}};
+
+  bool announced;
+  size_t offset;
+
+  pthread_mutex_lock(&t->mutex);
+  t->bulk_dest = dest;
+  t->bulk_size = bytes;
+  t->bulk_announced = false;
+  t->bulk_expected = t->bulk_received = 0;
+  pthread_mutex_unlock(&t->mutex);
+
+  uint32_t tag = SendCommandTagged(&c);
+  bool acked = WaitForResponseTagTimeout(CMD_ACK, tag, &resp, 2000);
+  size_t received = bulkTransferFinish(t, &announced, &offset);
+
+  if (!acked) return false;
+  if (!announced || offset != start_index) return false;
+  if (received != bytes || resp.arg[0] != bytes) return false;
+  return (update_crc16_buffer(USB_FRAME_CRC_INIT, dest, bytes) == resp.arg[1]);
+}
+
+/**
+ * @brief Downloads part of the device's BigBuf. The data is fetched in
+ * chunks with bulk transfers if the firmware supports them; each chunk is
+ * verified and fetched again if it didn't arrive intact. Older firmware
+ * sends the data in CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K frames.
+ * @return true if all requested bytes were received
+ */
+bool GetFromBigBuf(uint8_t *dest, int bytes, int start_index)
+{
+  if (BulkDownloadSupported()) {
+    for (size_t done = 0; done < bytes; ) {
+      size_t len = MIN(bytes - done, BULK_CHUNK_SIZE);
+      int tries = 0;
+      while (!getBulkChunk(dest + done, len, start_index + done)) {
+        if (++tries == BULK_RETRIES) {
+          PrintAndLog("Downloading samples failed at offset %d", (int)(start_index + done));
+          return false;
+        }
+        PrintAndLog("Downloading samples %d..%d failed, retrying", (int)(start_index + done), (int)(start_index + done + len - 1));
+      }
+      done += len;
+    }
+    return true;
+  }
+
+  transfer_state *t = currentTransfer();
+  pthread_mutex_lock(&t->mutex);
+  t->sample_buf_len = 0;
+  t->sample_buf_size = bytes;
+  t->sample_buf = dest;
+  pthread_mutex_unlock(&t->mutex);
   UsbCommand c = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {start_index, bytes, 0}};
   SendCommand(&c);
-/*
-  for (int i = start_index; i < n; i += 48) {
-        UsbCommand c = {CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K, {i, 0, 0}};
-        SendCommand(&c);
-//        WaitForResponse(CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K);
-//        memcpy(dest+(i*4), sample_buf, 48);
-    }
-*/
+  // no end in sight for a slow link, allow some 16 kB/s
+  bool acked = WaitForResponseTimeout(CMD_ACK, NULL, 2500 + bytes / 16);
+  pthread_mutex_lock(&t->mutex);
+  size_t received = t->sample_buf_len;
+  t->sample_buf = NULL;
+  pthread_mutex_unlock(&t->mutex);
+  if (!acked) {
+    PrintAndLog("Downloading samples timed out");
+    return false;
+  }
+  if (received != bytes) {
+    PrintAndLog("Downloading samples incomplete, got %d of %d bytes", (int)received, bytes);
+    return false;
+  }
+  return true;
 }
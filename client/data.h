@@ -12,13 +12,25 @@
 #define DATA_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "usb_cmd.h"
 
 #define SAMPLE_BUFFER_SIZE 64
 
-extern uint8_t* sample_buf;
-extern size_t sample_buf_len;
+// BigBuf is downloaded in chunks of this size, each verified by its own CRC
+#define BULK_CHUNK_SIZE 8192
+#define BULK_RETRIES 3
+// the rest of a failed transfer is discarded until the device is quiet this long
+#define BULK_DRAIN_IDLE_MS 500
+
 #define arraylen(x) (sizeof(x)/sizeof((x)[0]))
 
-void GetFromBigBuf(uint8_t *dest, int bytes, int start_index);
+bool GetFromBigBuf(uint8_t *dest, int bytes, int start_index);
+
+void BulkTransferStarted(size_t offset, size_t len);
+size_t BulkBytesExpected();
+void BulkDataReceived(const uint8_t *data, size_t len);
+bool SamplesReceived(const UsbCommand *UC);
 
 #endif
@@ -0,0 +1,482 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Scripted Proxmark3 device emulator, for running the client without hardware
+//-----------------------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <inttypes.h>
+#include "usb_cmd.h"
+#include "mifare.h"
+#include "util.h"
+#include "crc16.h"
+#include "sleep.h"
+#include "emucard.h"
+#include "devemu.h"
+
+#define EMU_BIGBUF_SIZE  40000
+#define EMU_MAX_REPLIES  256
+#define EMU_CHIP_ID      0x270B0A40  // AT91SAM7S512 Rev A
+#define EMU_UID          0xd4a4c8b3
+
+#define EMU_DEFAULT_FLAGS (DEVICE_INFO_FLAG_OSIMAGE_PRESENT | DEVICE_INFO_FLAG_CURRENT_MODE_OS | \
+                           DEVICE_INFO_FLAG_UNDERSTANDS_CMD_TAG | DEVICE_INFO_FLAG_UNDERSTANDS_COMPACT_FRAMES | \
+                           DEVICE_INFO_FLAG_UNDERSTANDS_BULK_DOWNLOAD | DEVICE_INFO_FLAG_UNDERSTANDS_CHKKEYS_SECTORS)
+
+typedef struct {
+  uint8_t *data;
+  size_t len;
+  size_t size;
+} emu_buffer;
+
+typedef struct {
+  uint32_t cmd;
+  UsbCommand answer;
+  size_t len;
+} emu_reply;
+
+struct devemu {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t in_cond;
+  pthread_cond_t out_cond;
+  bool running;
+  emu_buffer in;     // host -> device
+  emu_buffer out;    // device -> host
+
+  uint32_t flags;
+  uint32_t delay_ms;
+  bool compact;
+  uint32_t tag;      // tag of the command being answered
+  uint8_t bigbuf[EMU_BIGBUF_SIZE];
+  emu_reply replies[EMU_MAX_REPLIES];
+  int reply_count;
+  emucard card;      // what the MIFARE commands talk to
+};
+
+static bool buffer_append(emu_buffer *b, const uint8_t *data, size_t len)
+{
+  if (b->len + len > b->size) {
+    size_t size = b->size ? b->size : 4096;
+    while (size < b->len + len) size *= 2;
+    uint8_t *p = realloc(b->data, size);
+    if (!p) return false;
+    b->data = p;
+    b->size = size;
+  }
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  return true;
+}
+
+static void buffer_consume(emu_buffer *b, size_t len)
+{
+  memmove(b->data, b->data + len, b->len - len);
+  b->len -= len;
+}
+
+static void emu_send_raw(devemu *emu, const uint8_t *data, size_t len)
+{
+  pthread_mutex_lock(&emu->lock);
+  buffer_append(&emu->out, data, len);
+  pthread_cond_broadcast(&emu->out_cond);
+  pthread_mutex_unlock(&emu->lock);
+}
+
+// Same framing as cmd_send() in the firmware
+static void emu_send(devemu *emu, uint32_t cmd, uint64_t arg0, uint64_t arg1, uint64_t arg2, const void *data, size_t len)
+{
+  uint64_t tagged = cmd | ((uint64_t)emu->tag << USB_CMD_TAG_SHIFT);
+
+  len = data ? MIN(len, USB_CMD_DATA_SIZE) : 0;
+  if (emu->compact) {
+    struct {
+      UsbFrameHeader hdr;
+      uint8_t data[USB_CMD_DATA_SIZE];
+    } PACKED frame;
+    frame.hdr.magic = USB_FRAME_MAGIC;
+    frame.hdr.length = len;
+    frame.hdr.crc = 0;
+    frame.hdr.cmd = tagged;
+    frame.hdr.arg[0] = arg0;
+    frame.hdr.arg[1] = arg1;
+    frame.hdr.arg[2] = arg2;
+    if (len) memcpy(frame.data, data, len);
+    frame.hdr.crc = update_crc16_buffer(USB_FRAME_CRC_INIT, (uint8_t*)&frame, sizeof(UsbFrameHeader) + len);
+    emu_send_raw(emu, (uint8_t*)&frame, sizeof(UsbFrameHeader) + len);
+  } else {
+    UsbCommand c;
+    memset(&c, 0, sizeof(c));
+    c.cmd = tagged;
+    c.arg[0] = arg0;
+    c.arg[1] = arg1;
+    c.arg[2] = arg2;
+    if (len) memcpy(c.d.asBytes, data, len);
+    emu_send_raw(emu, (uint8_t*)&c, sizeof(c));
+  }
+}
+
+static void emu_print(devemu *emu, const char *s)
+{
+  emu_send(emu, CMD_DEBUG_PRINT_STRING, strlen(s), 0, 0, s, strlen(s));
+}
+
+// the key at position i of a CMD_MIFARE_CHKKEYS(_SECTORS) key list
+static uint64_t emu_chkkey(UsbCommand *c, size_t i)
+{
+  return bytes_to_num(c->d.asBytes + i * 6, 6);
+}
+
+static void emu_chkkeys(devemu *emu, UsbCommand *c)
+{
+  int block = c->arg[0] & 0xff;
+  size_t count = MIN(c->arg[2] & 0xff, USB_CMD_DATA_SIZE / 6);
+
+  for (size_t i = 0; i < count; i++) {
+    if (emucard_key_valid(&emu->card, emu_chkkey(c, i), block)) {
+      emu_send(emu, CMD_ACK, 1, 0, 0, c->d.asBytes + i * 6, 6);
+      return;
+    }
+  }
+  emu_send(emu, CMD_ACK, 0, 0, 0, NULL, 0);
+}
+
+static void emu_chkkeys_sectors(devemu *emu, UsbCommand *c)
+{
+  size_t count = MIN(c->arg[2] & 0xff, USB_CMD_DATA_SIZE / 6);
+  uint8_t index[80];
+  int found = 0;
+
+  memset(index, 0xff, sizeof(index));
+  for (int t = 0; t < 2; t++) {
+    for (int sector = 0; sector < 40; sector++) {
+      if (!(c->arg[t] & (1ULL << sector))) continue;
+      int block = sector < 32 ? sector * 4 + 3 : 32 * 4 + (sector - 32) * 16 + 15;
+      for (size_t i = 0; i < count; i++) {
+        if (emucard_key_valid(&emu->card, emu_chkkey(c, i), block)) {
+          index[t * 40 + sector] = i;
+          found++;
+          break;
+        }
+      }
+    }
+  }
+  emu_send(emu, CMD_ACK, 1, found, 0, index, sizeof(index));
+}
+
+static void emu_select(devemu *emu, UsbCommand *c)
+{
+  iso14a_card_select_t card;
+
+  if (!(c->arg[0] & ISO14A_CONNECT) || !emucard_select(&emu->card, &card)) {
+    emu_send(emu, CMD_ACK, 0, 0, 0, NULL, 0);
+    return;
+  }
+  emu_send(emu, CMD_ACK, 2, 0, 0, &card, offsetof(iso14a_card_select_t, ats));
+}
+
+static void emu_nested(devemu *emu, UsbCommand *c)
+{
+  uint32_t buf[5];
+
+  if (!emucard_nested(&emu->card, c->arg[1] & 0xff, buf)) {
+    emu_send(emu, CMD_ACK, 0, 0, c->arg[1], NULL, 0);
+    return;
+  }
+  emu_send(emu, CMD_ACK, 0, 2, c->arg[1], buf, sizeof(buf));
+}
+
+static void emu_darkside(devemu *emu, UsbCommand *c)
+{
+  uint8_t buf[28];
+
+  if (!emucard_darkside(&emu->card, c->arg[0], buf)) {
+    emu_send(emu, CMD_ACK, 0, 0, 0, NULL, 0);
+    return;
+  }
+  emu_send(emu, CMD_ACK, 1, 0, 0, buf, sizeof(buf));
+}
+
+static void emu_handle(devemu *emu, UsbCommand *c)
+{
+  uint32_t cmd = USB_CMD_ID(c->cmd);
+  bool replied = false;
+
+  emu->tag = (emu->flags & DEVICE_INFO_FLAG_UNDERSTANDS_CMD_TAG) ? USB_CMD_TAG(c->cmd) : 0;
+  if (emu->delay_ms) msleep(emu->delay_ms);
+
+  for (int i = 0; i < emu->reply_count; i++) {
+    emu_reply *r = &emu->replies[i];
+    if (r->cmd != cmd) continue;
+    emu_send(emu, r->answer.cmd, r->answer.arg[0], r->answer.arg[1], r->answer.arg[2], r->answer.d.asBytes, r->len);
+    replied = true;
+  }
+  if (replied) return;
+
+  switch (cmd) {
+    case CMD_DEVICE_INFO:
+      emu_send(emu, CMD_DEVICE_INFO, emu->flags, 0, 0, NULL, 0);
+      break;
+
+    case CMD_SET_FRAME_FORMAT:
+      emu_send(emu, CMD_ACK, c->arg[0], 0, 0, NULL, 0);
+      emu->compact = (c->arg[0] == USB_FRAME_FORMAT_COMPACT) && (emu->flags & DEVICE_INFO_FLAG_UNDERSTANDS_COMPACT_FRAMES);
+      break;
+
+    case CMD_VERSION:
+      emu_print(emu, "Prox/RFID mark3 RFID instrument");
+      emu_print(emu, "os: emulated device");
+      emu_send(emu, CMD_ACK, EMU_CHIP_ID, 0, 0, NULL, 0);
+      break;
+
+    case CMD_USB_BENCHMARK:
+      for (size_t i = 0; i < c->arg[0]; i++) {
+        emu_send(emu, CMD_USB_BENCHMARK, i, 0, 0, emu->bigbuf, c->arg[1]);
+      }
+      emu_send(emu, CMD_ACK, c->arg[0], 0, 0, NULL, 0);
+      break;
+
+    case CMD_DOWNLOAD_RAW_ADC_SAMPLES_125K: {
+      size_t start = MIN(c->arg[0], EMU_BIGBUF_SIZE);
+      size_t len = MIN(c->arg[1], EMU_BIGBUF_SIZE - start);
+      for (size_t i = 0; i < len; i += USB_CMD_DATA_SIZE) {
+        size_t n = MIN(len - i, USB_CMD_DATA_SIZE);
+        emu_send(emu, CMD_DOWNLOADED_RAW_ADC_SAMPLES_125K, i, n, 0, emu->bigbuf + start + i, n);
+      }
+      emu_send(emu, CMD_ACK, 0, 0, 0, NULL, 0);
+      break;
+    }
+
+    case CMD_DOWNLOAD_BIGBUF_BULK: {
+      size_t offset = MIN(c->arg[0], EMU_BIGBUF_SIZE);
+      size_t len = MIN(c->arg[1], EMU_BIGBUF_SIZE - offset);
+      emu_send(emu, CMD_BULK_DATA, offset, len, 0, NULL, 0);
+      emu_send_raw(emu, emu->bigbuf + offset, len);
+      emu_send(emu, CMD_ACK, len, update_crc16_buffer(USB_FRAME_CRC_INIT, emu->bigbuf + offset, len), 0, NULL, 0);
+      break;
+    }
+
+    case CMD_MIFARE_CHKKEYS:
+      emu_chkkeys(emu, c);
+      break;
+
+    case CMD_MIFARE_CHKKEYS_SECTORS:
+      emu_chkkeys_sectors(emu, c);
+      break;
+
+    case CMD_MIFARE_NESTED:
+      emu_nested(emu, c);
+      break;
+
+    case CMD_READER_ISO_14443a:
+      emu_select(emu, c);
+      break;
+
+    case CMD_READER_MIFARE:
+      emu_darkside(emu, c);
+      break;
+
+    case CMD_FPGA_MAJOR_MODE_OFF:
+    case CMD_SET_LF_DIVISOR:
+      // fire and forget on the real device too
+      break;
+
+    default:
+      emu_send(emu, CMD_ACK, 0, 0, 0, NULL, 0);
+      break;
+  }
+}
+
+static void *emu_thread(void *arg)
+{
+  devemu *emu = arg;
+  UsbCommand c;
+
+  pthread_mutex_lock(&emu->lock);
+  while (emu->running) {
+    if (emu->in.len < sizeof(UsbCommand)) {
+      pthread_cond_wait(&emu->in_cond, &emu->lock);
+      continue;
+    }
+    memcpy(&c, emu->in.data, sizeof(UsbCommand));
+    buffer_consume(&emu->in, sizeof(UsbCommand));
+    pthread_mutex_unlock(&emu->lock);
+    emu_handle(emu, &c);
+    pthread_mutex_lock(&emu->lock);
+  }
+  pthread_mutex_unlock(&emu->lock);
+  return NULL;
+}
+
+static size_t parse_hex(const char *s, uint8_t *data, size_t max)
+{
+  size_t len = 0;
+  unsigned int b;
+  while (len < max && sscanf(s, "%2x", &b) == 1) {
+    data[len++] = b;
+    s += 2;
+  }
+  return len;
+}
+
+static bool emu_load_script(devemu *emu, const char *script)
+{
+  char line[1024], word[32], arg[512];
+  int lineno = 0;
+  FILE *f = fopen(script, "r");
+
+  if (!f) {
+    fprintf(stderr, "devemu: cannot open %s\n", script);
+    return false;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    if (sscanf(line, "%31s", word) != 1 || word[0] == '#') continue;
+
+    if (strcmp(word, "flags") == 0 && sscanf(line, "%*s %i", (int*)&emu->flags) == 1) {
+      continue;
+    } else if (strcmp(word, "delay") == 0 && sscanf(line, "%*s %u", &emu->delay_ms) == 1) {
+      continue;
+    } else if (strcmp(word, "darkside") == 0 && sscanf(line, "%*s %511s", arg) == 1 && strcmp(arg, "noparity") == 0) {
+      emu->card.darkside_noparity = true;
+      continue;
+    } else if (strcmp(word, "bigbuf") == 0 && sscanf(line, "%*s %511s", arg) == 1) {
+      FILE *b = fopen(arg, "rb");
+      if (!b) {
+        fprintf(stderr, "devemu: %s:%d: cannot open %s\n", script, lineno, arg);
+        break;
+      }
+      memset(emu->bigbuf, 0, EMU_BIGBUF_SIZE);
+      fread(emu->bigbuf, 1, EMU_BIGBUF_SIZE, b);
+      bool failed = ferror(b);
+      fclose(b);
+      if (failed) {
+        fprintf(stderr, "devemu: %s:%d: cannot read %s\n", script, lineno, arg);
+        break;
+      }
+      continue;
+    } else if (strcmp(word, "mfkey") == 0) {
+      uint8_t key[6];
+      int block = -1;
+      if (sscanf(line, "%*s %12s %i", arg, &block) >= 1 && strlen(arg) == 12 && parse_hex(arg, key, 6) == 6
+          && emucard_add_key(&emu->card, bytes_to_num(key, 6), block)) {
+        continue;
+      }
+    } else if (strcmp(word, "reply") == 0 && emu->reply_count < EMU_MAX_REPLIES) {
+      emu_reply *r = &emu->replies[emu->reply_count];
+      unsigned int cmd, answer;
+      memset(r, 0, sizeof(*r));
+      arg[0] = 0;
+      if (sscanf(line, "%*s %i %i %"SCNi64" %"SCNi64" %"SCNi64" %511s", (int*)&cmd, (int*)&answer,
+                 &r->answer.arg[0], &r->answer.arg[1], &r->answer.arg[2], arg) >= 2) {
+        r->cmd = cmd;
+        r->answer.cmd = answer;
+        r->len = parse_hex(arg, r->answer.d.asBytes, USB_CMD_DATA_SIZE);
+        emu->reply_count++;
+        continue;
+      }
+    }
+    fprintf(stderr, "devemu: %s:%d: cannot parse '%s'\n", script, lineno, word);
+    break;
+  }
+  bool ok = feof(f);
+  fclose(f);
+  return ok;
+}
+
+devemu *devemu_open(const char *script)
+{
+  devemu *emu = calloc(1, sizeof(devemu));
+  if (!emu) return NULL;
+
+  emu->flags = EMU_DEFAULT_FLAGS;
+  emucard_init(&emu->card, EMU_UID, time(NULL));
+  if (script && *script && !emu_load_script(emu, script)) {
+    free(emu);
+    return NULL;
+  }
+
+  pthread_mutex_init(&emu->lock, NULL);
+  pthread_cond_init(&emu->in_cond, NULL);
+  pthread_cond_init(&emu->out_cond, NULL);
+  emu->running = true;
+  if (pthread_create(&emu->thread, NULL, &emu_thread, emu) != 0) {
+    free(emu);
+    return NULL;
+  }
+  return emu;
+}
+
+void devemu_close(devemu *emu)
+{
+  pthread_mutex_lock(&emu->lock);
+  emu->running = false;
+  pthread_cond_broadcast(&emu->in_cond);
+  pthread_mutex_unlock(&emu->lock);
+  pthread_join(emu->thread, NULL);
+
+  pthread_mutex_destroy(&emu->lock);
+  pthread_cond_destroy(&emu->in_cond);
+  pthread_cond_destroy(&emu->out_cond);
+  free(emu->in.data);
+  free(emu->out.data);
+  free(emu);
+}
+
+void devemu_write(devemu *emu, const uint8_t *data, size_t len)
+{
+  pthread_mutex_lock(&emu->lock);
+  buffer_append(&emu->in, data, len);
+  pthread_cond_signal(&emu->in_cond);
+  pthread_mutex_unlock(&emu->lock);
+}
+
+size_t devemu_read(devemu *emu, uint8_t *data, size_t len, uint32_t timeout_ms)
+{
+  struct timespec ts;
+  size_t n;
+
+  deadline(&ts, timeout_ms);
+  pthread_mutex_lock(&emu->lock);
+  while (emu->out.len == 0) {
+    if (pthread_cond_timedwait(&emu->out_cond, &emu->lock, &ts) != 0) break;
+  }
+  n = MIN(len, emu->out.len);
+  memcpy(data, emu->out.data, n);
+  buffer_consume(&emu->out, n);
+  pthread_mutex_unlock(&emu->lock);
+  return n;
+}
+
+static void *devemu_uart_open(const char *script)
+{
+  return devemu_open(script);
+}
+
+static void devemu_uart_close(void *emu)
+{
+  devemu_close(emu);
+}
+
+static void devemu_uart_write(void *emu, const byte_t *data, size_t len)
+{
+  devemu_write(emu, data, len);
+}
+
+static size_t devemu_uart_read(void *emu, byte_t *data, size_t len, uint32_t timeout_ms)
+{
+  return devemu_read(emu, data, len, timeout_ms);
+}
+
+const uart_emulator devemu_uart = {
+  devemu_uart_open,
+  devemu_uart_close,
+  devemu_uart_write,
+  devemu_uart_read
+};
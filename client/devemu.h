@@ -0,0 +1,49 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Scripted Proxmark3 device emulator, for running the client without hardware
+//-----------------------------------------------------------------------------
+
+#ifndef DEVEMU_H__
+#define DEVEMU_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "uart.h"
+
+typedef struct devemu devemu;
+
+/**
+ * @brief Starts an emulated device. The script is a text file with one
+ * directive per line, NULL gives a device with default answers:
+ *
+ *   flags <n>                   DEVICE_INFO flags to report
+ *   delay <ms>                  latency before every answer
+ *   bigbuf <file>               BigBuf contents served by the download commands
+ *   mfkey <key> [<block>]       key accepted by CMD_MIFARE_CHKKEYS(_SECTORS) (12 hex digits), for
+ *                               the sector of the block or for all of them,
+ *                               CMD_MIFARE_NESTED answers with nonces for it and
+ *                               CMD_READER_ISO_14443a selects a 1k card with these keys,
+ *                               CMD_READER_MIFARE gives the darkside nonces for block 0
+ *   darkside noparity           the card NACKs whatever the parities, for the special attack
+ *   reply <cmd> <answer> [<arg0> [<arg1> [<arg2> [<hex data>]]]]
+ *                               canned answer to a command, may be repeated
+ *                               to send several frames
+ *
+ * Commands without a built-in or scripted answer get an empty CMD_ACK.
+ */
+devemu *devemu_open(const char *script);
+void devemu_close(devemu *emu);
+
+// host -> device, any number of bytes
+void devemu_write(devemu *emu, const uint8_t *data, size_t len);
+// device -> host, waits up to timeout_ms for data, returns the number of bytes read
+size_t devemu_read(devemu *emu, uint8_t *data, size_t len, uint32_t timeout_ms);
+
+// the emulator as a transport for uart_set_emulator()
+extern const uart_emulator devemu_uart;
+
+#endif
@@ -0,0 +1,140 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE Classic card model behind the device emulator
+//-----------------------------------------------------------------------------
+
+#include <string.h>
+#include "util.h"
+#include "nonce2key/crapto1.h"
+#include "emucard.h"
+
+void emucard_init(emucard *card, uint32_t uid, uint32_t seed)
+{
+  memset(card, 0, sizeof(*card));
+  card->uid = uid;
+  card->seed = seed | 1;
+}
+
+bool emucard_add_key(emucard *card, uint64_t key, int block)
+{
+  if (card->key_count == EMUCARD_MAX_KEYS) return false;
+  card->keys[card->key_count].key = key;
+  card->keys[card->key_count].block = block;
+  card->key_count++;
+  return true;
+}
+
+bool emucard_present(const emucard *card)
+{
+  return card->key_count > 0;
+}
+
+// keys belong to a sector, any block of it takes them
+static bool keyForBlock(const emucard_key *k, int block)
+{
+  if (k->block < 0) return true;
+  if (block < 32 * 4) return k->block / 4 == block / 4;
+  return k->block >= 32 * 4 && (k->block - 32 * 4) / 16 == (block - 32 * 4) / 16;
+}
+
+bool emucard_key_valid(const emucard *card, uint64_t key, int block)
+{
+  for (int k = 0; k < card->key_count; k++) {
+    if (card->keys[k].key == key && keyForBlock(&card->keys[k], block)) return true;
+  }
+  return false;
+}
+
+// The key of the block, the one given for its sector before one for any block
+static const emucard_key *findKey(const emucard *card, int block)
+{
+  const emucard_key *key = NULL;
+
+  for (int k = 0; k < card->key_count; k++) {
+    bool exact = card->keys[k].block >= 0 && keyForBlock(&card->keys[k], block);
+    if (exact || (card->keys[k].block < 0 && key == NULL)) key = &card->keys[k];
+    if (exact) break;
+  }
+  return key;
+}
+
+static uint32_t nextNonce(emucard *card)
+{
+  // xorshift, the nonces only need to differ
+  card->seed ^= card->seed << 13;
+  card->seed ^= card->seed >> 17;
+  card->seed ^= card->seed << 5;
+  return card->seed;
+}
+
+bool emucard_select(const emucard *card, iso14a_card_select_t *sel)
+{
+  if (!emucard_present(card)) return false;
+  memset(sel, 0, sizeof(*sel));
+  num_to_bytes(card->uid, 4, sel->uid);
+  sel->uidlen = 4;
+  sel->atqa[0] = 0x04;
+  sel->sak = 0x08;
+  return true;
+}
+
+// Like MifareNested() sends them: the uid, then each tag nonce followed by
+// the nonce as it goes out encrypted in the nested authentication
+bool emucard_nested(emucard *card, int block, uint32_t buf[5])
+{
+  const emucard_key *key = findKey(card, block);
+
+  if (key == NULL) return false;
+  buf[0] = card->uid;
+  for (int i = 0; i < 2; i++) {
+    uint32_t nt = nextNonce(card);
+    struct Crypto1State *s = crypto1_create(key->key);
+    buf[1 + i * 2] = nt;
+    buf[2 + i * 2] = crypto1_word(s, card->uid ^ nt, 0);
+    crypto1_destroy(s);
+  }
+  return true;
+}
+
+// For the eight reader nonces that differ in the top 3 bits of the last
+// byte, the parities that make the card answer with an encrypted NACK, and
+// that NACK's keystream. The nonce stays the same, every retry takes the
+// next reader nonce. With darkside_noparity the card NACKs whatever the
+// parities are, like the cards the special attack is for.
+bool emucard_darkside(emucard *card, bool first, uint8_t buf[28])
+{
+  const emucard_key *key = findKey(card, 0);
+  uint8_t nr_ar[8] = {0};
+
+  if (key == NULL) return false;
+  if (first) {
+    card->darkside_nt = nextNonce(card);
+    card->darkside_nr = 0;
+  } else {
+    card->darkside_nr++;
+  }
+  for (int diff = 0; diff < 8; diff++) {
+    struct Crypto1State *s = crypto1_create(key->key);
+    uint8_t par = 0, ks = 0;
+    nr_ar[3] = (card->darkside_nr & 0x1f) | diff << 5;
+    crypto1_word(s, card->uid ^ card->darkside_nt, 0);
+    for (int i = 0; i < 8; i++) {
+      // {nr} is fed in decrypted, {ar} isn't looked at
+      uint8_t plain = nr_ar[i] ^ crypto1_byte(s, i < 4 ? nr_ar[i] : 0, i < 4);
+      par |= (!parity(plain) ^ filter(s->odd)) << i;
+    }
+    for (int i = 0; i < 4; i++)
+      ks |= crypto1_bit(s, 0, 0) << i;
+    crypto1_destroy(s);
+    buf[8 + diff] = card->darkside_noparity ? 0 : par;
+    buf[16 + diff] = ks;
+  }
+  num_to_bytes(card->uid, 4, buf);
+  num_to_bytes(card->darkside_nt, 4, buf + 4);
+  memcpy(buf + 24, nr_ar, 4);
+  buf[27] &= 0x1f;
+  return true;
+}
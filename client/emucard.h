@@ -0,0 +1,54 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE Classic card model behind the device emulator
+//-----------------------------------------------------------------------------
+
+#ifndef EMUCARD_H__
+#define EMUCARD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mifare.h"
+
+#define EMUCARD_MAX_KEYS 256
+
+typedef struct {
+  uint64_t key;
+  int block;         // -1 for any block
+} emucard_key;
+
+/**
+ * A MIFARE Classic 1k with a fixed UID. It is only there once it has keys;
+ * a key given for a block belongs to that block's sector, one without a
+ * block opens every sector that has no key of its own.
+ */
+typedef struct {
+  uint32_t uid;
+  emucard_key keys[EMUCARD_MAX_KEYS];
+  int key_count;
+  uint32_t seed;     // for the tag nonces
+  uint32_t darkside_nt;
+  uint8_t darkside_nr;
+  bool darkside_noparity; // NACKs whatever the parities, see emucard_darkside()
+} emucard;
+
+void emucard_init(emucard *card, uint32_t uid, uint32_t seed);
+bool emucard_add_key(emucard *card, uint64_t key, int block);
+bool emucard_present(const emucard *card);
+
+// whether key authenticates to block
+bool emucard_key_valid(const emucard *card, uint64_t key, int block);
+
+// the answer to a select, false if there is no card
+bool emucard_select(const emucard *card, iso14a_card_select_t *sel);
+
+// uid and two (nt, {nt}) pairs of a nested authentication to block
+bool emucard_nested(emucard *card, int block, uint32_t buf[5]);
+
+// what ReaderMifare() sends for the key of block 0, first starts a new attack
+bool emucard_darkside(emucard *card, bool first, uint8_t buf[28]);
+
+#endif
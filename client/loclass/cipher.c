@@ -205,11 +205,108 @@ void MAC(uint8_t* k, BitstreamIn input, BitstreamOut out)
 	output(k,initState,&input_32_zeroes,&out);
 }
 
+/**
+ * The same cipher without the bitstreams: the state is kept in registers and
+ * the MAC is computed bit by bit in a loop, byte by byte over the input.
+ * select(x, y, r) is select_table[r], with x ^ y added to z1 and x to z2.
+**/
+static const uint8_t select_table[256] = {
+	0,3,2,1,2,3,0,1,4,7,7,4,6,7,5,4,
+	1,2,3,0,2,3,0,1,5,6,6,5,6,7,5,4,
+	6,5,4,7,4,5,6,7,6,5,5,6,4,5,7,6,
+	7,4,5,6,4,5,6,7,7,4,4,7,4,5,7,6,
+	6,5,4,7,4,5,6,7,2,1,1,2,0,1,3,2,
+	3,0,1,2,0,1,2,3,7,4,4,7,4,5,7,6,
+	0,3,2,1,2,3,0,1,0,3,3,0,2,3,1,0,
+	5,6,7,4,6,7,4,5,5,6,6,5,6,7,5,4,
+	2,1,0,3,0,1,2,3,6,5,5,6,4,5,7,6,
+	3,0,1,2,0,1,2,3,7,4,4,7,4,5,7,6,
+	2,1,0,3,0,1,2,3,2,1,1,2,0,1,3,2,
+	3,0,1,2,0,1,2,3,3,0,0,3,0,1,3,2,
+	4,7,6,5,6,7,4,5,0,3,3,0,2,3,1,0,
+	1,2,3,0,2,3,0,1,5,6,6,5,6,7,5,4,
+	4,7,6,5,6,7,4,5,4,7,7,4,6,7,5,4,
+	1,2,3,0,2,3,0,1,1,2,2,1,2,3,1,0,
+};
+
+// the parity of the low 16 bits
+static inline uint8_t parity16(uint32_t x)
+{
+	x ^= x >> 8;
+	x ^= x >> 4;
+	return (0x6996 >> (x & 0xf)) & 1;
+}
+
+static inline void successor_fast(const uint8_t *k, State *s, uint8_t y)
+{
+	uint8_t Tt = parity16(s->t & 0xC533);		// T(t): x0 x1 x5 x7 x10 x11 x14 x15
+	uint8_t Bb = parity16(s->b & 0x71);		// B(b): x1 x2 x3 x7
+	uint8_t z = select_table[s->r] ^ ((Tt ^ y) << 1) ^ Tt;
+
+	s->t = (s->t >> 1) | ((Tt ^ (s->r >> 7) ^ (s->r >> 3)) & 1) << 15;
+	s->b = (s->b >> 1) | ((Bb ^ s->r) & 1) << 7;
+
+	uint8_t v = k[z] ^ s->b;
+	uint8_t l = s->l;
+	s->l = v + l + s->r;
+	s->r = v + l;
+}
+
+static inline void mac_fast(const uint8_t *cc_nr, int length, const uint8_t *k, uint8_t mac[4])
+{
+	State s = init((uint8_t *)k);
+	int i, j;
+
+	// the input goes in least significant bit first
+	for(i = 0; i < length; i++)
+		for(j = 0; j < 8; j++)
+			successor_fast(k, &s, (cc_nr[i] >> j) & 1);
+	// 32 output bits, r5 of the state before each zero bit
+	for(i = 0; i < 4; i++)
+	{
+		mac[i] = 0;
+		for(j = 0; j < 8; j++)
+		{
+			mac[i] |= ((s.r >> 2) & 1) << j;
+			successor_fast(k, &s, 0);
+		}
+	}
+}
+
 void doMAC(uint8_t *cc_nr_p, int length, uint8_t *div_key_p, uint8_t mac[4])
 {
-    uint8_t *cc_nr;
+	mac_fast(cc_nr_p, length, div_key_p, mac);
+}
+
+/**
+ * @brief The MAC of one cc_nr for many keys, the loop of a bruteforce
+ * @param cc_nr_p
+ * @param length of cc_nr
+ * @param div_keys n diversified keys
+ * @param n
+ * @param macs the n MACs
+ */
+void doMACBatch(uint8_t *cc_nr_p, int length, uint8_t (*div_keys)[8], size_t n, uint8_t (*macs)[4])
+{
+	size_t i;
+
+	for(i = 0; i < n; i++)
+		mac_fast(cc_nr_p, length, div_keys[i], macs[i]);
+}
+
+/**
+ * The MAC as the definitions above give it, to test doMAC against.
+ * Takes up to 16 bytes of cc_nr, the MAC is all zeros for more.
+ **/
+static void doMAC_reference(uint8_t *cc_nr_p, int length, uint8_t *div_key_p, uint8_t mac[4])
+{
+    uint8_t cc_nr[16];
     uint8_t div_key[8];
-    cc_nr=(uint8_t*)malloc(length+1);
+    if(length < 0 || length > (int)sizeof(cc_nr))
+    {
+        memset(mac, 0, 4);
+        return;
+    }
     memcpy(cc_nr,cc_nr_p,length);
     memcpy(div_key,div_key_p,8);
 
@@ -221,9 +318,6 @@ void doMAC(uint8_t *cc_nr_p, int length, uint8_t *div_key_p, uint8_t mac[4])
     //The output MAC must also be reversed
     reverse_arraybytes(dest, sizeof(dest));
     memcpy(mac, dest, 4);
-    //printf("Calculated_MAC\t%02x%02x%02x%02x\n", dest[0],dest[1],dest[2],dest[3]);
-    free(cc_nr);
-    return;
 }
 
 int testMAC()
@@ -251,5 +345,28 @@ int testMAC()
 		return 1;
 	}
 
+	// Random keys and input, one by one and in a batch, against the reference
+	uint8_t keys[64][8], macs[64][4], reference_mac[4];
+	int i, j, errors = 0;
+	for(i = 0; i < 12; i++)
+		cc_nr[i] = rand();
+	for(i = 0; i < 64; i++)
+		for(j = 0; j < 8; j++)
+			keys[i][j] = rand();
+	doMACBatch(cc_nr, 12, keys, 64, macs);
+	for(i = 0; i < 64; i++)
+	{
+		doMAC_reference(cc_nr, 12, keys[i], reference_mac);
+		doMAC(cc_nr, 12, keys[i], calculated_mac);
+		if(memcmp(reference_mac, calculated_mac, 4) != 0 || memcmp(reference_mac, macs[i], 4) != 0)
+			errors++;
+	}
+	if(errors)
+	{
+		prnlog("[+] FAILED: %d of 64 MACs differ from the reference", errors);
+		return 1;
+	}
+	prnlog("[+] MAC engine matches the reference MAC");
+
 	return 0;
 }
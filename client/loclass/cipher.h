@@ -24,8 +24,10 @@
 #ifndef CIPHER_H
 #define CIPHER_H
 #include <stdint.h>
+#include <stddef.h>
 
 void doMAC(uint8_t *cc_nr_p, int length, uint8_t *div_key_p, uint8_t mac[4]);
+void doMACBatch(uint8_t *cc_nr_p, int length, uint8_t (*div_keys)[8], size_t n, uint8_t (*macs)[4]);
 int testMAC();
 
 #endif // CIPHER_H
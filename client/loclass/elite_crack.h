@@ -61,6 +61,30 @@ typedef struct {
  * @return
  */
 int bruteforceItem(dumpdata item, uint16_t keytable[]);
+/**
+ * @brief Sets how many threads bruteforceItem uses, 0 (the default) for one per core.
+ * @return the previous setting
+ */
+int setBruteforceThreads(int threads);
+/**
+ * @brief The checkpoint bruteforceFile and bruteforceDump resume from and
+ * write to, periodically and after every dump entry. NULL for the default
+ * of bruteforceFile, the dump file name with .ckpt added.
+ */
+void setBruteforceCheckpoint(const char *filename);
+/**
+ * @brief Splits the search of every dump entry in shards parts, of which
+ * this one searches part shard (from 0). The checkpoints of the shards can
+ * be merged with mergeCheckpoints and resumed from.
+ * @return 0, 1 if the numbers make no sense
+ */
+int setBruteforceShard(int shard, int shards);
+int mergeCheckpoints(const char *out, char *const in[], int count);
+/**
+ * @brief Stops the running bruteforce, e.g. from a signal handler. Its
+ * checkpoint is written before it returns.
+ */
+void stopBruteforce(void);
 /**
  * Hash1 takes CSN as input, and determines what bytes in the keytable will be used
  * when constructing the K_sel.
@@ -58,10 +58,10 @@ int saveFile(const char *preferredName, const char *suffix, const void* data, si
 void prnlog(char *fmt, ...)
 {
 
+	char buf[1024];
 	va_list args;
 	va_start(args,fmt);
-    PrintAndLog(fmt, args);
-    //vprintf(fmt,args);
+	vsnprintf(buf, sizeof(buf), fmt, args);
 	va_end(args);
-    //printf("\n");
+	PrintAndLog("%s", buf);
 }
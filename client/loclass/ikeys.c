@@ -54,7 +54,9 @@ From "Dismantling iclass":
 #include <stdbool.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include "fileutils.h"
 #include "cipherutils.h"
 #include "des.h"
@@ -226,31 +228,6 @@ void permute(BitstreamIn *p_in, uint64_t z,int l,int r, BitstreamOut* out)
 		permute(p_in,z,l,r+1,out);
 	}
 }
-void printbegin()
-{
-	if(debug_print <2)
-		return ;
-
-	prnlog("          | x| y|z0|z1|z2|z3|z4|z5|z6|z7|");
-}
-
-void printState(char* desc, uint64_t c)
-{
-	if(debug_print < 2)
-		return ;
-
-	printf("%s : ", desc);
-	uint8_t x = 	(c & 0xFF00000000000000 ) >> 56;
-	uint8_t y = 	(c & 0x00FF000000000000 ) >> 48;
-	printf("  %02x %02x", x,y);
-	int i ;
-	for(i =0 ; i < 8 ; i++)
-	{
-		printf(" %02x", getSixBitByte(c,i));
-	}
-	printf("\n");
-}
-
 /**
  * @brief
  *Definition 11. Let the function hash0 : F 82 × F 82 × (F 62 ) 8 → (F 82 ) 8 be defined as
@@ -262,12 +239,10 @@ void printState(char* desc, uint64_t c)
  * @param k this is where the diversified key is put (should be 8 bytes)
  * @return
  */
-void hash0(uint64_t c, uint8_t k[8])
+static void hash0_reference(uint64_t c, uint8_t k[8])
 {
 	c = swapZvalues(c);
 
-	printbegin();
-	printState("origin",c);
 	//These 64 bits are divided as c = x, y, z [0] , . . . , z [7]
 	// x = 8 bits
 	// y = 8 bits
@@ -292,10 +267,8 @@ void hash0(uint64_t c, uint8_t k[8])
 		pushbackSixBitByte(&zP, _zn4,n+4);
 
 	}
-	printState("0|0|z'",zP);
 
 	uint64_t zCaret = check(zP);
-	printState("0|0|z^",zP);
 
 
 	uint8_t p = pi[x % 35];
@@ -305,7 +278,6 @@ void hash0(uint64_t c, uint8_t k[8])
 		p = ~p;
 	}
 
-	if(debug_print >= 2) prnlog("p:%02x", p);
 
 	BitstreamIn p_in = { &p, 8,0 };
 	uint8_t outbuffer[] = {0,0,0,0,0,0,0,0};
@@ -320,7 +292,6 @@ void hash0(uint64_t c, uint8_t k[8])
 
 	zTilde >>= 16;
 
-	printState("0|0|z~", zTilde);
 
 	int i;
 	int zerocounter =0 ;
@@ -372,6 +343,53 @@ void hash0(uint64_t c, uint8_t k[8])
 		}
 	}
 }
+// hash0_reference() without the bitstreams, this is the one the keys are diversified with
+void hash0(uint64_t c, uint8_t k[8])
+{
+	//These 64 bits are divided as c = x, y, z [0] , . . . , z [7]
+	uint8_t x = c >> 56;
+	uint8_t y = c >> 48;
+	uint8_t z[8], zTilde[8];
+	int i, j, n, l, r;
+
+	// z', taking the z values in swapped order like swapZvalues() does
+	for(n = 0; n < 4; n++)
+	{
+		z[n] = getSixBitByte(c, 7-n) % (63-n) + n;
+		z[n+4] = getSixBitByte(c, 3-n) % (64-n) + n;
+	}
+
+	// ẑ = check(z'), ck(3, 2, ...) on each half
+	for(n = 0; n < 8; n += 4)
+		for(i = 3; i > 0; i--)
+			for(j = i-1; j >= 0; j--)
+				if(z[n+i] == z[n+j])
+					z[n+i] = j;
+
+	uint8_t p = pi[x % 35];
+	if(x & 1) //Check if x7 is 1
+	{
+		p = ~p;
+	}
+
+	// z~ = permute(p, ẑ), the bits of p least significant first. p always
+	// has four bits set, so l stays in z[0..3] and r in z[4..7]
+	for(i = 0, l = 0, r = 4; i < 8; i++)
+		zTilde[i] = (p >> i & 1) ? (z[l++] + 1) & 0x3F : z[r++];
+
+	for(i = 0; i < 8; i++)
+	{
+		// the key on index i is first a bit from y
+		// then six bits from z,
+		// then a bit from p
+		uint8_t p_i = p >> i & 1;
+		if(y >> i & 1)
+			k[i] = (0x80 | (~(zTilde[i] << 1) & 0x7E) | p_i) + 1;
+		else
+			k[i] = ((zTilde[i] << 1) & 0x7E) | (~p_i & 1);
+	}
+}
+
 /**
  * @brief Performs Elite-class key diversification
  * @param csn
@@ -380,14 +398,16 @@ void hash0(uint64_t c, uint8_t k[8])
  */
 void diversifyKey(uint8_t csn[8], uint8_t key[8], uint8_t div_key[8])
 {
+	// A context of its own, the bruteforce calls this on several threads
+	des_context ctx = {DES_ENCRYPT,{0}};
 
 	// Prepare the DES key
-	des_setkey_enc( &ctx_enc, key);
+	des_setkey_enc( &ctx, key);
 
 	uint8_t crypted_csn[8] = {0};
 
 	// Calculate DES(CSN, KEY)
-	des_crypt_ecb(&ctx_enc,csn, crypted_csn);
+	des_crypt_ecb(&ctx,csn, crypted_csn);
 
 	//Calculate HASH0(DES))
     uint64_t crypt_csn = x_bytes_to_num(crypted_csn, 8);
@@ -396,6 +416,225 @@ void diversifyKey(uint8_t csn[8], uint8_t key[8], uint8_t div_key[8])
 	hash0(crypt_csn,div_key);
 }
 
+/**
+ * Bitsliced DES, for diversifying many keys against one CSN.
+ *
+ * Bit i of every word belongs to key i of the batch, a DES bit (1..64, the
+ * numbering of the standard) is a word. The permutations cost nothing that
+ * way, the key schedule is a table of which key bit goes where, and the
+ * S-boxes are evaluated as XORs of the AND products of their inputs (their
+ * algebraic normal form), computed from the standard tables once.
+ * The words are as wide as the vector unit the compiler targets.
+ **/
+#if defined(__AVX2__)
+typedef uint64_t bs_word __attribute__ ((vector_size (32)));
+#elif defined(__SSE2__)
+typedef uint64_t bs_word __attribute__ ((vector_size (16)));
+#else
+typedef uint64_t bs_word;
+#endif
+
+#define BS_LANES	(sizeof(bs_word) * 8)
+#define BS_WORDS	(sizeof(bs_word) / sizeof(uint64_t))
+
+static const uint8_t des_ip[64] = {
+	58,50,42,34,26,18,10,2, 60,52,44,36,28,20,12,4,
+	62,54,46,38,30,22,14,6, 64,56,48,40,32,24,16,8,
+	57,49,41,33,25,17, 9,1, 59,51,43,35,27,19,11,3,
+	61,53,45,37,29,21,13,5, 63,55,47,39,31,23,15,7
+};
+static const uint8_t des_e[48] = {
+	32, 1, 2, 3, 4, 5,  4, 5, 6, 7, 8, 9,  8, 9,10,11,12,13, 12,13,14,15,16,17,
+	16,17,18,19,20,21, 20,21,22,23,24,25, 24,25,26,27,28,29, 28,29,30,31,32, 1
+};
+static const uint8_t des_p[32] = {
+	16, 7,20,21,29,12,28,17, 1,15,23,26, 5,18,31,10,
+	 2, 8,24,14,32,27, 3, 9, 19,13,30, 6,22,11, 4,25
+};
+static const uint8_t des_pc1[56] = {
+	57,49,41,33,25,17, 9, 1,58,50,42,34,26,18, 10, 2,59,51,43,35,27,19,11, 3,60,52,44,36,
+	63,55,47,39,31,23,15, 7,62,54,46,38,30,22, 14, 6,61,53,45,37,29,21,13, 5,28,20,12, 4
+};
+static const uint8_t des_pc2[48] = {
+	14,17,11,24, 1, 5, 3,28,15, 6,21,10, 23,19,12, 4,26, 8,16, 7,27,20,13, 2,
+	41,52,31,37,47,55, 30,40,51,45,33,48, 44,49,39,56,34,53, 46,42,50,36,29,32
+};
+static const uint8_t des_shifts[16] = {1,1,2,2,2,2,2,2,1,2,2,2,2,2,2,1};
+static const uint8_t des_sbox[8][64] = {
+	{14, 4,13, 1, 2,15,11, 8, 3,10, 6,12, 5, 9, 0, 7,  0,15, 7, 4,14, 2,13, 1,10, 6,12,11, 9, 5, 3, 8,
+	  4, 1,14, 8,13, 6, 2,11,15,12, 9, 7, 3,10, 5, 0, 15,12, 8, 2, 4, 9, 1, 7, 5,11, 3,14,10, 0, 6,13},
+	{15, 1, 8,14, 6,11, 3, 4, 9, 7, 2,13,12, 0, 5,10,  3,13, 4, 7,15, 2, 8,14,12, 0, 1,10, 6, 9,11, 5,
+	  0,14, 7,11,10, 4,13, 1, 5, 8,12, 6, 9, 3, 2,15, 13, 8,10, 1, 3,15, 4, 2,11, 6, 7,12, 0, 5,14, 9},
+	{10, 0, 9,14, 6, 3,15, 5, 1,13,12, 7,11, 4, 2, 8, 13, 7, 0, 9, 3, 4, 6,10, 2, 8, 5,14,12,11,15, 1,
+	 13, 6, 4, 9, 8,15, 3, 0,11, 1, 2,12, 5,10,14, 7,  1,10,13, 0, 6, 9, 8, 7, 4,15,14, 3,11, 5, 2,12},
+	{ 7,13,14, 3, 0, 6, 9,10, 1, 2, 8, 5,11,12, 4,15, 13, 8,11, 5, 6,15, 0, 3, 4, 7, 2,12, 1,10,14, 9,
+	 10, 6, 9, 0,12,11, 7,13,15, 1, 3,14, 5, 2, 8, 4,  3,15, 0, 6,10, 1,13, 8, 9, 4, 5,11,12, 7, 2,14},
+	{ 2,12, 4, 1, 7,10,11, 6, 8, 5, 3,15,13, 0,14, 9, 14,11, 2,12, 4, 7,13, 1, 5, 0,15,10, 3, 9, 8, 6,
+	  4, 2, 1,11,10,13, 7, 8,15, 9,12, 5, 6, 3, 0,14, 11, 8,12, 7, 1,14, 2,13, 6,15, 0, 9,10, 4, 5, 3},
+	{12, 1,10,15, 9, 2, 6, 8, 0,13, 3, 4,14, 7, 5,11, 10,15, 4, 2, 7,12, 9, 5, 6, 1,13,14, 0,11, 3, 8,
+	  9,14,15, 5, 2, 8,12, 3, 7, 0, 4,10, 1,13,11, 6,  4, 3, 2,12, 9, 5,15,10,11,14, 1, 7, 6, 0, 8,13},
+	{ 4,11, 2,14,15, 0, 8,13, 3,12, 9, 7, 5,10, 6, 1, 13, 0,11, 7, 4, 9, 1,10,14, 3, 5,12, 2,15, 8, 6,
+	  1, 4,11,13,12, 3, 7,14,10,15, 6, 8, 0, 5, 9, 2,  6,11,13, 8, 1, 4,10, 7, 9, 5, 0,15,14, 2, 3,12},
+	{13, 2, 8, 4, 6,15,11, 1,10, 9, 3,14, 5, 0,12, 7,  1,15,13, 8,10, 3, 7, 4,12, 5, 6,11, 0,14, 9, 2,
+	  7,11, 4, 1, 9,12,14, 2, 0, 6,10,13,15, 3, 5, 8,  2, 1,14, 7, 4,10, 8,13,15,12, 9, 0, 3, 5, 6,11}
+};
+
+// filled in once by bs_init()
+static pthread_once_t bs_once = PTHREAD_ONCE_INIT;
+static uint8_t bs_subkey[16][48];		// the key bit (0..63) of each subkey bit of each round
+static uint8_t bs_fp[64];				// the final permutation, the inverse of des_ip
+static uint8_t bs_terms[8][4][64];		// the products XORed for each S-box output bit
+static uint8_t bs_nterms[8][4];
+
+static void bs_init(void)
+{
+	uint8_t cd[56], rotated[56];
+	int round, shift = 0, i, j, v, x;
+
+	for(i = 0; i < 64; i++)
+		bs_fp[des_ip[i]-1] = i + 1;
+
+	for(i = 0; i < 56; i++)
+		cd[i] = des_pc1[i] - 1;
+	for(round = 0; round < 16; round++)
+	{
+		shift += des_shifts[round];
+		for(i = 0; i < 28; i++)
+		{
+			rotated[i] = cd[(i + shift) % 28];
+			rotated[28+i] = cd[28 + (i + shift) % 28];
+		}
+		for(i = 0; i < 48; i++)
+			bs_subkey[round][i] = rotated[des_pc2[i]-1];
+	}
+
+	// The S-box input x is b1..b6, b1 the most significant bit. Row b1b6, column b2..b5.
+	// Product x is the AND of the inputs whose bits are set in x.
+	for(i = 0; i < 8; i++)
+	{
+		for(j = 0; j < 4; j++)
+		{
+			uint8_t anf[64];
+			for(x = 0; x < 64; x++)
+				anf[x] = des_sbox[i][(x & 0x20) | (x & 1) << 4 | (x >> 1 & 0xF)] >> (3-j) & 1;
+			for(v = 1; v < 64; v <<= 1)
+				for(x = 0; x < 64; x++)
+					if(x & v)
+						anf[x] ^= anf[x ^ v];
+			bs_nterms[i][j] = 0;
+			for(x = 0; x < 64; x++)
+				if(anf[x])
+					bs_terms[i][j][bs_nterms[i][j]++] = x;
+		}
+	}
+}
+
+// 64x64 bit matrix transpose: bit j of a[i] swaps with bit i of a[j], bits
+// counted from the most significant one
+static void transpose64(uint64_t a[64])
+{
+	int j, k;
+	uint64_t m, t;
+
+	for(j = 32, m = 0x00000000FFFFFFFFULL; j; j >>= 1, m ^= m << j)
+	{
+		for(k = 0; k < 64; k = ((k | j) + 1) & ~j)
+		{
+			t = (a[k] ^ (a[k | j] >> j)) & m;
+			a[k] ^= t;
+			a[k | j] ^= t << j;
+		}
+	}
+}
+
+/**
+ * DES of one block with up to BS_LANES keys. DES bit b of the keys is in
+ * key[b-1], the block is the same for all of them.
+ */
+static void bs_des_encrypt(const bs_word key[64], const uint8_t block[8], bs_word out[64])
+{
+	bs_word zero = {0}, ones = ~zero;
+	bs_word lr[64], f[32], in[6], prod[64];
+	bs_word *l = lr, *r = lr + 32, *t;
+	int round, i, j, k, x;
+
+	for(i = 0; i < 64; i++)
+		lr[i] = (block[(des_ip[i]-1) >> 3] >> (7 - ((des_ip[i]-1) & 7)) & 1) ? ones : zero;
+
+	for(round = 0; round < 16; round++)
+	{
+		for(i = 0; i < 8; i++)
+		{
+			// b1 is the most significant bit of the S-box input
+			for(k = 0; k < 6; k++)
+				in[5-k] = r[des_e[6*i+k]-1] ^ key[bs_subkey[round][6*i+k]];
+			prod[0] = ones;
+			for(x = 1; x < 64; x++)
+				prod[x] = prod[x & (x-1)] & in[__builtin_ctz(x)];
+			for(j = 0; j < 4; j++)
+			{
+				bs_word o = zero;
+				for(k = 0; k < bs_nterms[i][j]; k++)
+					o ^= prod[bs_terms[i][j][k]];
+				f[4*i+j] = o;
+			}
+		}
+		// L' = R, R' = L ^ P(f), in place of L
+		for(i = 0; i < 32; i++)
+			l[i] ^= f[des_p[i]-1];
+		t = l; l = r; r = t;
+	}
+
+	// R16 L16 through the final permutation
+	for(i = 0; i < 64; i++)
+		out[i] = bs_fp[i] <= 32 ? r[bs_fp[i]-1] : l[bs_fp[i]-33];
+}
+
+/**
+ * @brief Elite-class key diversification of many keys against one CSN,
+ * the same as diversifyKey() on each of them
+ * @param csn
+ * @param keys n keys
+ * @param n
+ * @param div_keys the n diversified keys
+ */
+void diversifyKeyBatch(uint8_t csn[8], uint8_t (*keys)[8], size_t n, uint8_t (*div_keys)[8])
+{
+	bs_word key_slices[64], crypted_slices[64];
+	uint64_t rows[BS_WORDS][64];
+	size_t done, lanes, i;
+	int b, w;
+
+	pthread_once(&bs_once, bs_init);
+	for(done = 0; done < n; done += lanes)
+	{
+		lanes = n - done < BS_LANES ? n - done : BS_LANES;
+
+		// one key per row, turned into one DES bit per row
+		memset(rows, 0, sizeof(rows));
+		for(i = 0; i < lanes; i++)
+			rows[i >> 6][i & 63] = x_bytes_to_num(keys[done+i], 8);
+		for(w = 0; w < (int)BS_WORDS; w++)
+		{
+			transpose64(rows[w]);
+			for(b = 0; b < 64; b++)
+				((uint64_t *)&key_slices[b])[w] = rows[w][b];
+		}
+
+		bs_des_encrypt(key_slices, csn, crypted_slices);
+
+		for(w = 0; w < (int)BS_WORDS; w++)
+		{
+			for(b = 0; b < 64; b++)
+				rows[w][b] = ((uint64_t *)&crypted_slices[b])[w];
+			transpose64(rows[w]);
+		}
+		//Calculate HASH0(DES))
+		for(i = 0; i < lanes; i++)
+			hash0(rows[i >> 6][i & 63], div_keys[done+i]);
+	}
+}
+
 
 
 
@@ -723,6 +962,53 @@ int doTestsWithKnownInputs()
 	return errors;
 }
 
+/**
+ * @brief hash0 and diversifyKeyBatch against the reference implementations,
+ * on random input
+ * @return 0 if they agree, 1 otherwise
+ */
+int testDiversifyKeyBatch()
+{
+	uint8_t csn[8], keys[300][8], div_keys[300][8], div_key[8], k[8], k_ref[8];
+	int i, j, errors = 0;
+
+	prnlog("[+] Testing hash0 against the reference");
+	for(i = 0; i < 100000; i++)
+	{
+		uint64_t c = (uint64_t)rand() << 62 ^ (uint64_t)rand() << 31 ^ rand();
+		hash0(c, k);
+		hash0_reference(c, k_ref);
+		if(memcmp(k, k_ref, 8) != 0)
+		{
+			if(errors++ == 0) print64bits("    input ", c);
+		}
+	}
+
+	prnlog("[+] Testing batch key diversification");
+	for(i = 0; i < 8; i++)
+		csn[i] = rand();
+	for(i = 0; i < 300; i++)
+		for(j = 0; j < 8; j++)
+			keys[i][j] = rand();
+	diversifyKeyBatch(csn, keys, 300, div_keys);
+	for(i = 0; i < 300; i++)
+	{
+		diversifyKey(csn, keys[i], div_key);
+		if(memcmp(div_key, div_keys[i], 8) != 0)
+		{
+			if(errors++ == 0) printarr("    key ", keys[i], 8);
+		}
+	}
+
+	if(errors)
+	{
+		prnlog("[+] FAILED: %d errors occurred", errors);
+		return 1;
+	}
+	prnlog("[+] Batch key diversification seems to work");
+	return 0;
+}
+
 int readKeyFile(uint8_t key[8])
 {
 
@@ -777,8 +1063,9 @@ int doKeyTests(uint8_t debuglevel)
 		}
 	}
 	prnlog("[+] Testing key diversification with non-sensitive keys...");
-	doTestsWithKnownInputs();
-	return 0;
+	int errors = doTestsWithKnownInputs() != 0;
+	errors += testDiversifyKeyBatch();
+	return errors;
 }
 
 /**
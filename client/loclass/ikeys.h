@@ -1,6 +1,9 @@
 #ifndef IKEYS_H
 #define IKEYS_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 
 /**
  * @brief
@@ -23,6 +26,14 @@ int doKeyTests(uint8_t debuglevel);
  */
 
 void diversifyKey(uint8_t csn[8], uint8_t key[8], uint8_t div_key[8]);
+/**
+ * @brief Diversifies n keys against the same csn, with a bitsliced DES
+ * @param csn
+ * @param keys
+ * @param n
+ * @param div_keys
+ */
+void diversifyKeyBatch(uint8_t csn[8], uint8_t (*keys)[8], size_t n, uint8_t (*div_keys)[8]);
 /**
  * @brief Permutes a key from standard NIST format to Iclass specific format
  * @param key
@@ -27,7 +27,10 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
 #include <ctype.h>
+#include <stdlib.h>
 #include "cipherutils.h"
 #include "cipher.h"
 #include "ikeys.h"
@@ -48,7 +51,15 @@ int showHelp()
 	prnlog("Options:");
 	prnlog("-t                 Perform self-test");
 	prnlog("-h                 Show this help");
-	prnlog("-f <filename>      Bruteforce iclass dumpfile");
+	prnlog("-j <threads>       Threads for the bruteforce, before -f. Default one per core");
+	prnlog("-c, --checkpoint <file>");
+	prnlog("                   Checkpoint of the bruteforce, before -f. Default <filename>.ckpt");
+	prnlog("-s, --shard <i>/<n>");
+	prnlog("                   Search only part i (0..n-1) of the candidates, before -f");
+	prnlog("-m, --merge <out> <checkpoint> ...");
+	prnlog("                   Merge the checkpoints of the shards into one to resume from");
+	prnlog("-f <filename>      Bruteforce iclass dumpfile, resuming from the checkpoint if there is one.");
+	prnlog("                   Ctrl-C stops it, after writing the checkpoint");
 	prnlog("                   An iclass dumpfile is assumed to consist of an arbitrary number of malicious CSNs, and their protocol responses");
 	prnlog("                   The the binary format of the file is expected to be as follows: ");
 	prnlog("                   <8 byte CSN><8 byte CC><4 byte NR><4 byte MAC>");
@@ -60,25 +71,57 @@ int showHelp()
 	return 0;
 }
 
+static void stopOnSignal(int sig)
+{
+	(void)sig;
+	stopBruteforce();
+}
+
 int main (int argc, char **argv)
 {
+	static const struct option long_options[] = {
+		{"checkpoint", required_argument, NULL, 'c'},
+		{"shard", required_argument, NULL, 's'},
+		{"merge", required_argument, NULL, 'm'},
+		{NULL, 0, NULL, 0}
+	};
+	int shard, shards;
 	prnlog("IClass Cipher version 1.2, Copyright (C) 2014 Martin Holst Swende\n");
 	prnlog("Comes with ABSOLUTELY NO WARRANTY");
 	prnlog("This is free software, and you are welcome to use, abuse and repackage, please keep the credits\n");
 	char *fileName = NULL;
 	int c;
-	while ((c = getopt (argc, argv, "thf:")) != -1)
+	while ((c = getopt_long (argc, argv, "thj:c:s:m:f:", long_options, NULL)) != -1)
 	  switch (c)
 		{
 		case 't':
 		  return unitTests();
 		case 'h':
 		  return showHelp();
+		case 'j':
+		  setBruteforceThreads(atoi(optarg));
+		  break;
+		case 'c':
+		  setBruteforceCheckpoint(optarg);
+		  break;
+		case 's':
+		  if (sscanf(optarg, "%d/%d", &shard, &shards) != 2 || setBruteforceShard(shard, shards)) {
+			fprintf (stderr, "Option -s wants <i>/<n>, 0 <= i < n <= 64\n");
+			return 1;
+		  }
+		  break;
+		case 'm':
+		  if (optind >= argc) {
+			fprintf (stderr, "Option -m wants the checkpoints to merge after the output file\n");
+			return 1;
+		  }
+		  return mergeCheckpoints(optarg, argv + optind, argc - optind);
 		case 'f':
 		  fileName = optarg;
+		  signal(SIGINT, stopOnSignal);
 		  return bruteforceFileNoKeys(fileName);
 		case '?':
-		  if (optopt == 'f')
+		  if (optopt == 'f' || optopt == 'j' || optopt == 'c' || optopt == 's' || optopt == 'm')
 			fprintf (stderr, "Option -%c requires an argument.\n", optopt);
 		  else if (isprint (optopt))
 			fprintf (stderr, "Unknown option `-%c'.\n", optopt);
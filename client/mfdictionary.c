@@ -0,0 +1,223 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE Classic key dictionaries, text (.dic) and compiled (.bdic)
+//
+// Text dictionaries have one key per line, 12 hex digits, anything after them
+// and lines starting with '#' are ignored. Compiling one drops the duplicates,
+// the keys keep their order, so the most likely ones can stay in front.
+// Loading it again is a single copy out of the mapped file.
+//-----------------------------------------------------------------------------
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "ui.h"
+#include "util.h"
+#include "mfdictionary.h"
+
+static int growKeyBlock(uint8_t **keyBlock, int *size, int needed)
+{
+	if (needed <= *size) return 0;
+	int newsize = *size ? *size : 64;
+	while (newsize < needed) newsize *= 2;
+	uint8_t *p = realloc(*keyBlock, 6 * newsize);
+	if (p == NULL) return 1;
+	*keyBlock = p;
+	*size = newsize;
+	return 0;
+}
+
+static int hexValue(char c)
+{
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// the whole file, NUL terminated. Mapped where that works, *mapped tells
+static char *readFile(const char *filename, size_t *len, int *mapped)
+{
+	struct stat st;
+	char *data;
+
+	*mapped = 0;
+	if (stat(filename, &st) != 0) return NULL;
+	*len = st.st_size;
+#ifndef _WIN32
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return NULL;
+	data = *len ? mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data != MAP_FAILED) {
+		madvise(data, *len, MADV_SEQUENTIAL);
+		*mapped = 1;
+		return data;
+	}
+#endif
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) return NULL;
+	data = malloc(*len + 1);
+	if (data == NULL || fread(data, 1, *len, f) != *len) {
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	data[*len] = 0;
+	fclose(f);
+	return data;
+}
+
+static void releaseFile(char *data, size_t len, int mapped)
+{
+#ifndef _WIN32
+	if (mapped) {
+		munmap(data, len);
+		return;
+	}
+#endif
+	free(data);
+}
+
+static int loadCompiled(const char *data, size_t len, uint8_t **keyBlock, int *keycnt, int *size)
+{
+	uint32_t count = (uint8_t)data[8] | (uint8_t)data[9] << 8 | (uint8_t)data[10] << 16 | (uint32_t)(uint8_t)data[11] << 24;
+
+	if (count > (len - MFDICT_HEADER_SIZE) / 6) return -1;
+	if (growKeyBlock(keyBlock, size, *keycnt + count)) return -1;
+	memcpy(*keyBlock + 6 * *keycnt, data + MFDICT_HEADER_SIZE, 6 * count);
+	*keycnt += count;
+	return count;
+}
+
+static int loadText(const char *data, size_t len, uint8_t **keyBlock, int *keycnt, int *size)
+{
+	const char *p = data, *end = data + len;
+	int added = 0, bad = 0;
+
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (eol == NULL) eol = end;
+		while (p < eol && (*p == ' ' || *p == '\t')) p++;
+		if (p < eol && *p != '#' && *p != '\r') {
+			uint64_t key = 0;
+			int i;
+			for (i = 0; i < 12 && p + i < eol && hexValue(p[i]) >= 0; i++)
+				key = key << 4 | hexValue(p[i]);
+			if (i == 12 && (p + i == eol || !isxdigit((unsigned char)p[i]))) {
+				if (growKeyBlock(keyBlock, size, *keycnt + 1)) return -1;
+				num_to_bytes(key, 6, *keyBlock + 6 * (*keycnt)++);
+				added++;
+			} else {
+				bad++;
+			}
+		}
+		p = eol + 1;
+	}
+	if (bad) PrintAndLog("%d lines without a key (12 HEX symbols) ignored", bad);
+	return added;
+}
+
+int mfDictLoad(const char *filename, uint8_t **keyBlock, int *keycnt, int *size)
+{
+	size_t len;
+	int mapped, res;
+	char *data = readFile(filename, &len, &mapped);
+
+	if (data == NULL) return -1;
+	if (len >= MFDICT_HEADER_SIZE && !memcmp(data, MFDICT_MAGIC, 8))
+		res = loadCompiled(data, len, keyBlock, keycnt, size);
+	else
+		res = loadText(data, len, keyBlock, keycnt, size);
+	releaseFile(data, len, mapped);
+	return res;
+}
+
+typedef struct {
+	uint64_t key;
+	int index;
+} dictEntry;
+
+static int compareEntries(const void *a, const void *b)
+{
+	const dictEntry *x = a, *y = b;
+	if (x->key != y->key) return x->key < y->key ? -1 : 1;
+	return x->index - y->index;
+}
+
+static int compareIndex(const void *a, const void *b)
+{
+	return ((const dictEntry *)a)->index - ((const dictEntry *)b)->index;
+}
+
+int mfDictDedup(uint8_t *keyBlock, int keycnt)
+{
+	dictEntry *e = malloc(keycnt * sizeof(dictEntry));
+	int i, n = 0;
+
+	if (e == NULL || keycnt < 2) {
+		free(e);
+		return keycnt;
+	}
+	for (i = 0; i < keycnt; i++) {
+		e[i].key = bytes_to_num(keyBlock + 6 * i, 6);
+		e[i].index = i;
+	}
+	qsort(e, keycnt, sizeof(dictEntry), compareEntries);
+	for (i = 0; i < keycnt; i++) {
+		if (n == 0 || e[i].key != e[n - 1].key) e[n++] = e[i];
+	}
+	// back to the order they came in
+	qsort(e, n, sizeof(dictEntry), compareIndex);
+	for (i = 0; i < n; i++)
+		num_to_bytes(e[i].key, 6, keyBlock + 6 * i);
+	free(e);
+	return n;
+}
+
+int mfDictCompile(const char *in, const char *out)
+{
+	uint8_t *keyBlock = NULL, header[MFDICT_HEADER_SIZE] = MFDICT_MAGIC;
+	int keycnt = 0, size = 0, n;
+	char tmp[256];
+
+	if (mfDictLoad(in, &keyBlock, &keycnt, &size) < 0) {
+		free(keyBlock);
+		return -1;
+	}
+	n = mfDictDedup(keyBlock, keycnt);
+
+	header[8] = n;
+	header[9] = n >> 8;
+	header[10] = n >> 16;
+	header[11] = n >> 24;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) {
+		free(keyBlock);
+		return -1;
+	}
+	bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header) && (n == 0 || fwrite(keyBlock, 6, n, f) == (size_t)n);
+	ok = (fclose(f) == 0) && ok;
+	free(keyBlock);
+#ifdef _WIN32
+	if (ok) remove(out);
+#endif
+	if (!ok || rename(tmp, out) != 0) {
+		remove(tmp);
+		return -1;
+	}
+	return n;
+}
@@ -0,0 +1,43 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// MIFARE Classic key dictionaries, text (.dic) and compiled (.bdic)
+//-----------------------------------------------------------------------------
+
+#ifndef MFDICTIONARY_H__
+#define MFDICTIONARY_H__
+
+#include <stdint.h>
+
+/*
+ * A compiled dictionary is a 16 byte header, the magic, the number of keys
+ * (little endian) and 4 zero bytes, followed by the keys: 6 bytes each, most
+ * significant byte first like in keyBlock, in the order of the dictionary
+ * and without duplicates. Named .bdic, .mfd is what card dumps are called.
+ */
+#define MFDICT_MAGIC		"MFDICT01"
+#define MFDICT_HEADER_SIZE	16
+
+/**
+ * @brief Appends the keys of a dictionary, text or compiled, to keyBlock.
+ * keyBlock grows as needed, *size is the number of keys it has room for.
+ * @return the number of keys added, -1 if the file can't be read
+ */
+int mfDictLoad(const char *filename, uint8_t **keyBlock, int *keycnt, int *size);
+
+/**
+ * @brief Removes the keys that are in keyBlock more than once, the first one
+ * stays where it is.
+ * @return the number of keys left
+ */
+int mfDictDedup(uint8_t *keyBlock, int keycnt);
+
+/**
+ * @brief Writes the keys of the dictionary in to a compiled dictionary.
+ * @return the number of keys written, -1 on errors
+ */
+int mfDictCompile(const char *in, const char *out);
+
+#endif
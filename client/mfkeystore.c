@@ -0,0 +1,446 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Persistent store of the MIFARE Classic keys found, per card and sector
+//
+// A text file, one key per line:
+//   <uid> <sector> <A|B> <key> <source> <unix time>
+// It is read again whenever another client changed it, and every change
+// writes a new file that replaces the old one, so that several clients can
+// share one store. Changes are made holding a lock on <file>.lock, from
+// reading the file again to renaming the new one over it, so that no
+// client loses the keys another one has just added.
+//-----------------------------------------------------------------------------
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "ui.h"
+#include "util.h"
+#include "cmdparser.h"
+#include "mfkeystore.h"
+
+typedef struct {
+	char uid[21];
+	uint8_t sector;
+	uint8_t keyType;
+	uint64_t key;
+	char source[16];
+	uint32_t time;
+} keyEntry;
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static char store_file[256] = MFKEYSTORE_DEFAULT_FILE;
+static keyEntry *entries;
+static int entry_count, entry_size;
+static bool loaded;
+
+// what tells whether the file changed since it was read: every save makes
+// a new file, so another inode, and the time of it to the nanosecond
+typedef struct {
+	dev_t dev;
+	ino_t ino;
+	long long size;
+	time_t mtime;
+	long mtime_ns;
+} fileVersion;
+
+static fileVersion loaded_version;
+
+static void getVersion(const struct stat *st, fileVersion *v)
+{
+	memset(v, 0, sizeof(*v));
+	v->dev = st->st_dev;
+	v->ino = st->st_ino;
+	v->size = st->st_size;
+	v->mtime = st->st_mtime;
+#if defined(__APPLE__)
+	v->mtime_ns = st->st_mtimespec.tv_nsec;
+#elif !defined(_WIN32)
+	v->mtime_ns = st->st_mtim.tv_nsec;
+#endif
+}
+
+static bool sameVersion(const fileVersion *a, const fileVersion *b)
+{
+	return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+		a->mtime == b->mtime && a->mtime_ns == b->mtime_ns;
+}
+
+void mfKeyStoreSetFile(const char *filename)
+{
+	pthread_mutex_lock(&store_lock);
+	snprintf(store_file, sizeof(store_file), "%s", filename);
+	loaded = false;
+	pthread_mutex_unlock(&store_lock);
+}
+
+const char *mfKeyStoreFile(void)
+{
+	return store_file;
+}
+
+static void uidString(const uint8_t *uid, uint8_t uidlen, char *s)
+{
+	if (uidlen > 10) uidlen = 10;
+	for (int i = 0; i < uidlen; i++)
+		sprintf(s + 2 * i, "%02x", uid[i]);
+	s[2 * uidlen] = 0;
+}
+
+static keyEntry *findEntry(const char *uid, uint8_t sectorNo, uint8_t keyType)
+{
+	for (int i = 0; i < entry_count; i++) {
+		if (entries[i].sector == sectorNo && entries[i].keyType == keyType && !strcmp(entries[i].uid, uid))
+			return &entries[i];
+	}
+	return NULL;
+}
+
+static keyEntry *addEntry(void)
+{
+	if (entry_count == entry_size) {
+		int size = entry_size ? entry_size * 2 : 256;
+		keyEntry *p = realloc(entries, size * sizeof(keyEntry));
+		if (!p) return NULL;
+		entries = p;
+		entry_size = size;
+	}
+	return &entries[entry_count++];
+}
+
+// (re)reads the file if it changed since the last time, store_lock held
+static void loadStore(void)
+{
+	struct stat st;
+	fileVersion v;
+	char line[128], type;
+	keyEntry e;
+	FILE *f;
+
+	if (stat(store_file, &st) != 0) {
+		entry_count = 0;
+		loaded = true;
+		memset(&loaded_version, 0, sizeof(loaded_version));
+		return;
+	}
+	getVersion(&st, &v);
+	if (loaded && sameVersion(&v, &loaded_version)) return;
+	if ((f = fopen(store_file, "r")) == NULL) return;
+
+	entry_count = 0;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned int sector;
+		memset(&e, 0, sizeof(e));
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%20s %u %c %"SCNx64" %15s %u", e.uid, &sector, &type, &e.key, e.source, &e.time) < 4) continue;
+		if (sector > 39 || (type != 'A' && type != 'B')) continue;
+		e.sector = sector;
+		e.keyType = type == 'B';
+		keyEntry *p = findEntry(e.uid, e.sector, e.keyType);
+		if (p == NULL) p = addEntry();
+		if (p) *p = e;
+	}
+	fclose(f);
+	loaded = true;
+	loaded_version = v;
+}
+
+// Takes the lock that other clients changing the store wait for, returns
+// what unlockStore() needs or -1. store_lock held.
+static int lockStore(void)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	char name[sizeof(store_file) + 8];
+	int fd;
+
+	snprintf(name, sizeof(name), "%s.lock", store_file);
+	if ((fd = open(name, O_RDWR | O_CREAT, 0644)) < 0) return -1;
+	if (lockf(fd, F_LOCK, 0) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+#endif
+}
+
+static void unlockStore(int fd)
+{
+#ifndef _WIN32
+	if (fd < 0) return;
+	lockf(fd, F_ULOCK, 0);
+	close(fd);
+#endif
+}
+
+// Opens a new file in the directory of the store, its name in tmp
+static FILE *createTemp(char *tmp, size_t size)
+{
+#ifdef _WIN32
+	snprintf(tmp, size, "%s.tmp", store_file);
+	return fopen(tmp, "w");
+#else
+	struct stat st;
+	FILE *f;
+	int fd;
+
+	snprintf(tmp, size, "%s.XXXXXX", store_file);
+	if ((fd = mkstemp(tmp)) < 0) return NULL;
+	// mkstemp() makes it private, the store keeps the mode it had
+	fchmod(fd, stat(store_file, &st) == 0 ? st.st_mode & 0777 : 0644);
+	if ((f = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		remove(tmp);
+	}
+	return f;
+#endif
+}
+
+// writes a new file next to the old one and renames it over it, store_lock
+// and the lock of the file held
+static int saveStore(void)
+{
+	char tmp[sizeof(store_file) + 8];
+	struct stat st;
+	FILE *f;
+
+	if ((f = createTemp(tmp, sizeof(tmp))) == NULL) return 1;
+	fprintf(f, "# uid sector A/B key source time, written by the proxmark3 client\n");
+	for (int i = 0; i < entry_count; i++) {
+		keyEntry *e = &entries[i];
+		fprintf(f, "%s %2u %c %012"PRIx64" %s %u\n", e->uid, e->sector, e->keyType ? 'B' : 'A', e->key,
+			e->source[0] ? e->source : "-", e->time);
+	}
+	if (fclose(f) != 0) {
+		remove(tmp);
+		return 1;
+	}
+#ifdef _WIN32
+	// rename() doesn't replace an existing file on Windows
+	remove(store_file);
+#endif
+	if (rename(tmp, store_file) != 0) {
+		remove(tmp);
+		return 1;
+	}
+	if (stat(store_file, &st) == 0)
+		getVersion(&st, &loaded_version);
+	return 0;
+}
+
+int mfKeyStoreGet(const uint8_t *uid, uint8_t uidlen, uint8_t sectorNo, uint8_t keyType, uint64_t *key)
+{
+	char s[21];
+	int res = 1;
+
+	uidString(uid, uidlen, s);
+	pthread_mutex_lock(&store_lock);
+	loadStore();
+	keyEntry *e = findEntry(s, sectorNo, keyType);
+	if (e) {
+		*key = e->key;
+		res = 0;
+	}
+	pthread_mutex_unlock(&store_lock);
+	return res;
+}
+
+int mfKeyStorePut(const uint8_t *uid, uint8_t uidlen, uint8_t sectorNo, uint8_t keyType, uint64_t key, const char *source)
+{
+	char s[21];
+	int res = 0;
+
+	uidString(uid, uidlen, s);
+	pthread_mutex_lock(&store_lock);
+	int lock = lockStore();
+	loadStore();
+	keyEntry *e = findEntry(s, sectorNo, keyType);
+	if (e == NULL || e->key != key) {
+		if (e == NULL && (e = addEntry()) == NULL) {
+			res = 1;
+		} else {
+			memset(e, 0, sizeof(*e));
+			strcpy(e->uid, s);
+			e->sector = sectorNo;
+			e->keyType = keyType;
+			e->key = key;
+			snprintf(e->source, sizeof(e->source), "%s", source);
+			e->time = time(NULL);
+			res = saveStore();
+		}
+	}
+	unlockStore(lock);
+	pthread_mutex_unlock(&store_lock);
+	if (res) PrintAndLog("Could not update the key store %s", store_file);
+	return res;
+}
+
+typedef struct {
+	uint64_t key;
+	int hits;	// sectors of all the cards seen that use the key
+	int index;
+} keyRank;
+
+static int compareRankKey(const void *a, const void *b)
+{
+	const keyRank *x = a, *y = b;
+	return x->key < y->key ? -1 : x->key > y->key ? 1 : 0;
+}
+
+static int compareRankHits(const void *a, const void *b)
+{
+	const keyRank *x = a, *y = b;
+	if (x->hits != y->hits) return y->hits - x->hits;
+	return x->index - y->index;
+}
+
+void mfKeyStoreRank(uint8_t *keyBlock, int keycnt)
+{
+	keyRank *known = NULL, *ranked = NULL;
+	uint8_t *rest = NULL;
+	int nknown = 0, nranked = 0, nrest = 0;
+
+	// the keys in the store with their counts, sorted to be looked up
+	pthread_mutex_lock(&store_lock);
+	loadStore();
+	if (entry_count) known = malloc(entry_count * sizeof(keyRank));
+	for (int i = 0; known && i < entry_count; i++) {
+		known[i].key = entries[i].key;
+		known[i].hits = 1;
+	}
+	if (known) {
+		qsort(known, entry_count, sizeof(keyRank), compareRankKey);
+		for (int i = 0; i < entry_count; i++) {
+			if (nknown && known[nknown - 1].key == known[i].key)
+				known[nknown - 1].hits++;
+			else
+				known[nknown++] = known[i];
+		}
+	}
+	pthread_mutex_unlock(&store_lock);
+	if (nknown == 0) {
+		free(known);
+		return;
+	}
+
+	ranked = malloc(keycnt * sizeof(keyRank));
+	rest = malloc(keycnt * 6);
+	if (ranked && rest) {
+		for (int i = 0; i < keycnt; i++) {
+			keyRank k = {bytes_to_num(keyBlock + 6 * i, 6), 0, i};
+			keyRank *r = bsearch(&k, known, nknown, sizeof(keyRank), compareRankKey);
+			if (r) {
+				k.hits = r->hits;
+				ranked[nranked++] = k;
+			} else {
+				memcpy(rest + 6 * nrest++, keyBlock + 6 * i, 6);
+			}
+		}
+		// most used first, the dictionary order among equal counts
+		qsort(ranked, nranked, sizeof(keyRank), compareRankHits);
+		for (int i = 0; i < nranked; i++)
+			num_to_bytes(ranked[i].key, 6, keyBlock + 6 * i);
+		memcpy(keyBlock + 6 * nranked, rest, 6 * nrest);
+	}
+	free(known);
+	free(ranked);
+	free(rest);
+}
+
+static int compareHits(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+	// hits in the upper 16 bits, more first
+	return (x[0] >> 48) < (y[0] >> 48) ? 1 : (x[0] >> 48) > (y[0] >> 48) ? -1 : 0;
+}
+
+int CmdHF14AMfKeyStore(const char *Cmd)
+{
+	char ctmp = param_getchar(Cmd, 0);
+	char filename[256] = {0};
+
+	if (ctmp == 'h' || ctmp == 'H') {
+		PrintAndLog("Usage:  hf mf keystore [l [<uid>] | r | f <file>]");
+		PrintAndLog("        l - list the keys, of all cards or of one");
+		PrintAndLog("        r - the keys ranked by how many sectors use them, the order 'hf mf chk' tries them in");
+		PrintAndLog("        f - use another store, e.g. one per site. Now: %s", mfKeyStoreFile());
+		PrintAndLog("'hf mf chk', 'nested', 'dump' and 'mifare' look up keys in the store and add the keys they find.");
+		return 0;
+	}
+
+	if (ctmp == 'f' || ctmp == 'F') {
+		const char *p = Cmd;
+		while (*p == ' ') p++;
+		p++;
+		while (*p == ' ') p++;
+		size_t len = strcspn(p, " ");
+		if (len == 0 || len >= sizeof(filename)) {
+			PrintAndLog("Usage:  hf mf keystore f <file>");
+			return 1;
+		}
+		memcpy(filename, p, len);
+		mfKeyStoreSetFile(filename);
+		PrintAndLog("Key store: %s", mfKeyStoreFile());
+		return 0;
+	}
+
+	pthread_mutex_lock(&store_lock);
+	loadStore();
+	if (ctmp == 'r' || ctmp == 'R') {
+		uint64_t *ranked = malloc((entry_count + 1) * sizeof(uint64_t));
+		int n = 0;
+		for (int i = 0; ranked && i < entry_count; i++) {
+			int j;
+			for (j = 0; j < n && (ranked[j] & 0xffffffffffffULL) != entries[i].key; j++);
+			if (j == n) ranked[n++] = entries[i].key;
+			ranked[j] += 1ULL << 48;
+		}
+		if (ranked) qsort(ranked, n, sizeof(uint64_t), compareHits);
+		PrintAndLog("key          | sectors");
+		PrintAndLog("-------------+--------");
+		for (int i = 0; i < n; i++)
+			PrintAndLog("%012"PRIx64" | %7u", ranked[i] & 0xffffffffffffULL, (unsigned)(ranked[i] >> 48));
+		free(ranked);
+	} else {
+		char uid[21] = {0};
+		if (ctmp == 'l' || ctmp == 'L') {
+			if (param_getlength(Cmd, 1) >= (int)sizeof(uid)) {
+				PrintAndLog("The uid is at most %d hex digits", (int)sizeof(uid) - 1);
+				pthread_mutex_unlock(&store_lock);
+				return 1;
+			}
+			param_getstr(Cmd, 1, uid);
+			// the store writes the uids in lowercase
+			for (char *c = uid; *c; c++) *c = tolower((unsigned char)*c);
+		}
+		PrintAndLog("uid                  |sec|key|key           |source  |found");
+		PrintAndLog("---------------------+---+---+--------------+--------+-------------------");
+		for (int i = 0; i < entry_count; i++) {
+			keyEntry *e = &entries[i];
+			char date[32] = "-";
+			time_t t = e->time;
+			if (uid[0] && strcmp(uid, e->uid)) continue;
+			if (t) strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+			PrintAndLog("%-20s |%3u| %c | %012"PRIx64" |%-8s|%s", e->uid, e->sector, e->keyType ? 'B' : 'A',
+				e->key, e->source, date);
+		}
+		PrintAndLog("%d keys in %s", entry_count, mfKeyStoreFile());
+	}
+	pthread_mutex_unlock(&store_lock);
+	return 0;
+}
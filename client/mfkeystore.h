@@ -0,0 +1,41 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Persistent store of the MIFARE Classic keys found, per card and sector
+//-----------------------------------------------------------------------------
+
+#ifndef MFKEYSTORE_H__
+#define MFKEYSTORE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// in the current directory unless 'hf mf keystore f <file>' says otherwise
+#define MFKEYSTORE_DEFAULT_FILE		"mfkeys.txt"
+
+void mfKeyStoreSetFile(const char *filename);
+const char *mfKeyStoreFile(void);
+
+/**
+ * @brief The key of one sector of a card, if it was found before.
+ * @return 0 and the key in *key if the store has it
+ */
+int mfKeyStoreGet(const uint8_t *uid, uint8_t uidlen, uint8_t sectorNo, uint8_t keyType, uint64_t *key);
+
+/**
+ * @brief Remembers a key that worked, and how it was found ("chk", "nested",
+ * "darkside"...). The file is rewritten at once and replaced atomically.
+ */
+int mfKeyStorePut(const uint8_t *uid, uint8_t uidlen, uint8_t sectorNo, uint8_t keyType, uint64_t key, const char *source);
+
+/**
+ * @brief Sorts a dictionary, keys used by more of the cards in the store
+ * first. Keys the store doesn't know keep their order.
+ */
+void mfKeyStoreRank(uint8_t *keyBlock, int keycnt);
+
+int CmdHF14AMfKeyStore(const char *Cmd);
+
+#endif
@@ -14,44 +14,16 @@
 #include <pthread.h>
 #include "mifarehost.h"
 #include "proxmark3.h"
-
-// MIFARE
-int compar_int(const void * a, const void * b) {
-	// didn't work: (the result is truncated to 32 bits)
-	//return (*(uint64_t*)b - *(uint64_t*)a);
-
-	// better:
-	if (*(uint64_t*)b == *(uint64_t*)a) return 0;
-	else if (*(uint64_t*)b > *(uint64_t*)a) return 1;
-	else return -1;
-}
-
-
-
-// Compare 16 Bits out of cryptostate
-int Compare16Bits(const void * a, const void * b) {
-	if ((*(uint64_t*)b & 0x00ff000000ff0000) == (*(uint64_t*)a & 0x00ff000000ff0000)) return 0;
-	else if ((*(uint64_t*)b & 0x00ff000000ff0000) > (*(uint64_t*)a & 0x00ff000000ff0000)) return 1;
-	else return -1;
-}
-
+#include "mifare.h"
 
 typedef 
 	struct {
-		union {
-			struct Crypto1State *slhead;
-			uint64_t *keyhead;
-		} head;
-		union {
-			struct Crypto1State *sltail;
-			uint64_t *keytail;
-		} tail;
+		struct Crypto1State *slhead;
 		uint32_t len;
 		uint32_t uid;
-		uint32_t blockNo;
-		uint32_t keyType;
 		uint32_t nt;
 		uint32_t ks1;
+		struct Crypto1Recovery *recovery;	// owns the statelist
 	} StateList_t;
 
 
@@ -61,59 +33,70 @@ void* nested_worker_thread(void *arg)
 	struct Crypto1State *p1;
 	StateList_t *statelist = arg;
 
-	statelist->head.slhead = lfsr_recovery32(statelist->ks1, statelist->nt ^ statelist->uid);
-	for (p1 = statelist->head.slhead; *(uint64_t *)p1 != 0; p1++);
-	statelist->len = p1 - statelist->head.slhead;
-	statelist->tail.sltail = --p1;
-	qsort(statelist->head.slhead, statelist->len, sizeof(uint64_t), Compare16Bits);
+	statelist->slhead = lfsr_recovery32_ctx(statelist->recovery, statelist->ks1, statelist->nt ^ statelist->uid);
+	for (p1 = statelist->slhead; *(uint64_t *)p1 != 0; p1++);
+	statelist->len = p1 - statelist->slhead;
 	
-	return statelist->head.slhead;
+	return statelist->slhead;
 }
 
 
-
-
-int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t * resultKey, bool calibrate) 
+// Asks the Proxmark for two nested nonces of the target block, the
+// device part of the nested attack
+int mfNestedNonces(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo, uint8_t trgKeyType, bool calibrate, nestedNonces *nonces)
 {
-	uint16_t i, len;
-	uint32_t uid;
 	UsbCommand resp;
-
-	
-	StateList_t statelists[2];
-	struct Crypto1State *p1, *p2, *p3, *p4;
-	
-	// flush queue
-	WaitForResponseTimeout(CMD_ACK,NULL,100);
-	
 	UsbCommand c = {CMD_MIFARE_NESTED, {blockNo + keyType * 0x100, trgBlockNo + trgKeyType * 0x100, calibrate}};
 	memcpy(c.d.asBytes, key, 6);
-	SendCommand(&c);
+	// a stale ACK from an earlier command can't be mistaken for ours
+	// when the firmware tags its responses
+	if (!TaggedCommandsSupported()) clearStaleResponses();
+	uint32_t tag = SendCommandTagged(&c);
 
-	if (WaitForResponseTimeout(CMD_ACK,&resp,1500)) {
-		len = resp.arg[1];
-		if (len == 2) {	
-			memcpy(&uid, resp.d.asBytes, 4);
-			PrintAndLog("uid:%08x len=%d trgbl=%d trgkey=%x", uid, len, (uint16_t)resp.arg[2] & 0xff, (uint16_t)resp.arg[2] >> 8);
-			
-			for (i = 0; i < 2; i++) {
-				statelists[i].blockNo = resp.arg[2] & 0xff;
-				statelists[i].keyType = (resp.arg[2] >> 8) & 0xff;
-				statelists[i].uid = uid;
+	if (!WaitForResponseTagTimeout(CMD_ACK,tag,&resp,1500)) {
+		PrintAndLog("No answer from proxmark.");
+		return 1;
+	}
+	if (resp.arg[1] != 2) {
+		PrintAndLog("Got 0 keys from proxmark."); 
+		return 1;
+	}
 
-				memcpy(&statelists[i].nt,  (void *)(resp.d.asBytes + 4 + i * 8 + 0), 4);
-				memcpy(&statelists[i].ks1, (void *)(resp.d.asBytes + 4 + i * 8 + 4), 4);
-			}
-		}
-		else {
-			PrintAndLog("Got 0 keys from proxmark."); 
-			return 1;
-		}
+	memcpy(&nonces->uid, resp.d.asBytes, 4);
+	nonces->blockNo = resp.arg[2] & 0xff;
+	nonces->keyType = (resp.arg[2] >> 8) & 0xff;
+	for (int i = 0; i < 2; i++) {
+		memcpy(&nonces->nt[i],  (void *)(resp.d.asBytes + 4 + i * 8 + 0), 4);
+		memcpy(&nonces->ks1[i], (void *)(resp.d.asBytes + 4 + i * 8 + 4), 4);
 	}
-	
-	// calc keys
-	
+	PrintAndLog("uid:%08x len=%d trgbl=%d trgkey=%x", nonces->uid, 2, nonces->blockNo, nonces->keyType);
+	return 0;
+}
+
+// Recovers the key candidates of two nested nonces, the host part of the
+// nested attack. Doesn't talk to the device, so it can run in any thread.
+// Returns the number of candidates in *keys, which the caller frees
+// whatever the result, or -1 if there isn't enough memory
+int mfNestedRecover(nestedNonces *nonces, uint64_t **keys)
+{
+	StateList_t statelists[2];
 	pthread_t thread_id[2];
+	int i, count;
+
+	*keys = NULL;
+
+	// the working memory of the recovery is reused from earlier calls
+	for (i = 0; i < 2; i++) {
+		statelists[i].uid = nonces->uid;
+		statelists[i].nt = nonces->nt[i];
+		statelists[i].ks1 = nonces->ks1[i];
+		statelists[i].recovery = lfsr_recovery_acquire();
+	}
+	if (!statelists[0].recovery || !statelists[1].recovery) {
+		lfsr_recovery_release(statelists[0].recovery);
+		lfsr_recovery_release(statelists[1].recovery);
+		return -1;
+	}
 		
 	// create and run worker threads
 	for (i = 0; i < 2; i++) {
@@ -122,83 +105,70 @@ int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo
 	
 	// wait for threads to terminate:
 	for (i = 0; i < 2; i++) {
-		pthread_join(thread_id[i], (void*)&statelists[i].head.slhead);
+		pthread_join(thread_id[i], (void*)&statelists[i].slhead);
 	}
 
 
 	// the first 16 Bits of the cryptostate already contain part of our key.
-	// Create the intersection of the two lists based on these 16 Bits and
-	// roll back the cryptostate
-	p1 = p3 = statelists[0].head.slhead; 
-	p2 = p4 = statelists[1].head.slhead;
-	while (p1 <= statelists[0].tail.sltail && p2 <= statelists[1].tail.sltail) {
-		if (Compare16Bits(p1, p2) == 0) {
-			struct Crypto1State savestate, *savep = &savestate;
-			savestate = *p1;
-			while(Compare16Bits(p1, savep) == 0 && p1 <= statelists[0].tail.sltail) {
-				*p3 = *p1;
-				lfsr_rollback_word(p3, statelists[0].nt ^ statelists[0].uid, 0);
-				p3++;
-				p1++;
-			}
-			savestate = *p2;
-			while(Compare16Bits(p2, savep) == 0 && p2 <= statelists[1].tail.sltail) {
-				*p4 = *p2;
-				lfsr_rollback_word(p4, statelists[1].nt ^ statelists[1].uid, 0);
-				p4++;
-				p2++;
-			}
-		}
-		else {
-			while (Compare16Bits(p1, p2) == -1) p1++;
-			while (Compare16Bits(p1, p2) == 1) p2++;
-		}
-	}
-	p3->even = 0; p3->odd = 0;
-	p4->even = 0; p4->odd = 0;
-	statelists[0].len = p3 - statelists[0].head.slhead;
-	statelists[1].len = p4 - statelists[1].head.slhead;
-	statelists[0].tail.sltail=--p3;
-	statelists[1].tail.sltail=--p4;
-
-	// the statelists now contain possible keys. The key we are searching for must be in the
-	// intersection of both lists. Create the intersection:
-	qsort(statelists[0].head.keyhead, statelists[0].len, sizeof(uint64_t), compar_int);
-	qsort(statelists[1].head.keyhead, statelists[1].len, sizeof(uint64_t), compar_int);
-
-	uint64_t *p5, *p6, *p7;
-	p5 = p7 = statelists[0].head.keyhead; 
-	p6 = statelists[1].head.keyhead;
-	while (p5 <= statelists[0].tail.keytail && p6 <= statelists[1].tail.keytail) {
-		if (compar_int(p5, p6) == 0) {
-			*p7++ = *p5++;
-			p6++;
-		}
-		else {
-			while (compar_int(p5, p6) == -1) p5++;
-			while (compar_int(p5, p6) == 1) p6++;
-		}
+	// The key we are searching for must be in the intersection of both lists.
+	struct Crypto1State *sl[2] = {statelists[0].slhead, statelists[1].slhead};
+	uint32_t sllen[2] = {statelists[0].len, statelists[1].len};
+	uint32_t slin[2] = {nonces->nt[0] ^ nonces->uid, nonces->nt[1] ^ nonces->uid};
+	count = lfsr_nested_intersect(sl, sllen, slin);
+
+	*keys = malloc(count * sizeof(uint64_t) + 1);
+	if (*keys == NULL) {
+		count = -1;
+	} else {
+		for (i = 0; i < count; i++)
+			crypto1_get_lfsr(statelists[0].slhead + i, &(*keys)[i]);
 	}
-	statelists[0].len = p7 - statelists[0].head.keyhead;
-	statelists[0].tail.keytail=--p7;
+	
+	lfsr_recovery_release(statelists[0].recovery);
+	lfsr_recovery_release(statelists[1].recovery);
+	return count;
+}
+
+// Tests the key candidates on the card, as many per CMD_MIFARE_CHKKEYS as fit.
+// Returns 0 and the key in resultKey if one of them is valid.
+int mfNestedCheck(nestedNonces *nonces, uint64_t *keys, int count, uint8_t *resultKey, int *commands)
+{
+	uint8_t keyBlock[MIFARE_CHKKEYS_MAX * 6];
+	uint64_t key64;
+	int i, n;
 
 	memset(resultKey, 0, 6);
-	// The list may still contain several key candidates. Test each of them with mfCheckKeys
-	for (i = 0; i < statelists[0].len; i++) {
-		uint8_t keyBlock[6];
-		uint64_t key64;
-		crypto1_get_lfsr(statelists[0].head.slhead + i, &key64);
-		num_to_bytes(key64, 6, keyBlock);
-		key64 = 0;
-		if (!mfCheckKeys(statelists[0].blockNo, statelists[0].keyType, 1, keyBlock, &key64)) {
+	for (i = 0; i < count; i += n) {
+		n = count - i < MIFARE_CHKKEYS_MAX ? count - i : MIFARE_CHKKEYS_MAX;
+		for (int j = 0; j < n; j++)
+			num_to_bytes(keys[i + j], 6, keyBlock + j * 6);
+		if (commands) (*commands)++;
+		if (!mfCheckKeys(nonces->blockNo, nonces->keyType, n, keyBlock, &key64)) {
 			num_to_bytes(key64, 6, resultKey);
-			break;
+			return 0;
 		}
 	}
+	return 1;
+}
+
+int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t * resultKey, bool calibrate) 
+{
+	nestedNonces nonces;
+	uint64_t *keys;
+	int count;
+
+	if (mfNestedNonces(blockNo, keyType, key, trgBlockNo, trgKeyType, calibrate, &nonces))
+		return 1;
 	
-	free(statelists[0].head.slhead);
-	free(statelists[1].head.slhead);
-	
+	count = mfNestedRecover(&nonces, &keys);
+	if (count < 0) {
+		PrintAndLog("Cannot allocate memory for the key recovery");
+		return 2;
+	}
+
+	// The list may still contain several key candidates. Test them with mfCheckKeys
+	mfNestedCheck(&nonces, keys, count, resultKey, NULL);
+	free(keys);
 	return 0;
 }
 
@@ -217,6 +187,44 @@ int mfCheckKeys (uint8_t blockNo, uint8_t keyType, uint8_t keycnt, uint8_t * key
 	return 0;
 }
 
+/**
+ * @brief Checks keys against many sectors in one command, see
+ * DEVICE_INFO_FLAG_UNDERSTANDS_CHKKEYS_SECTORS.
+ * @param sectors sectors to check with key A and with key B, bit n for sector n
+ * @param keyIndex index of the key that worked for sectors 0..39 with key A,
+ * then with key B, 0xff if none
+ * @return 0 if all was checked, 1 on timeout, 2 if the device stopped early
+ * (card lost, button), keyIndex has what was found until then
+ */
+int mfCheckKeysSectors(uint64_t sectors[2], uint8_t keycnt, uint8_t *keyBlock, uint8_t keyIndex[80]) {
+	int targets = 0;
+	for (int i = 0; i < 40; i++)
+		targets += ((sectors[0] >> i) & 1) + ((sectors[1] >> i) & 1);
+
+	UsbCommand c = {CMD_MIFARE_CHKKEYS_SECTORS, {sectors[0], sectors[1], keycnt}};
+	memcpy(c.d.asBytes, keyBlock, 6 * keycnt);
+	SendCommand(&c);
+
+	// a wrong key costs a select and an authentication, a few ms
+	UsbCommand resp;
+	if (!WaitForResponseTimeout(CMD_ACK,&resp,3000 + 10 * targets * keycnt)) return 1;
+	memcpy(keyIndex, resp.d.asBytes, 80);
+	return (resp.arg[0] & 0xff) == 1 ? 0 : 2;
+}
+
+int mfReadUid(uint8_t *uid, uint8_t *uidlen) {
+	UsbCommand c = {CMD_READER_ISO_14443a, {ISO14A_CONNECT, 0, 0}};
+	SendCommand(&c);
+
+	UsbCommand resp;
+	if (!WaitForResponseTimeout(CMD_ACK,&resp,1500)) return 1;
+	if (resp.arg[0] == 0) return 2;
+	iso14a_card_select_t *card = (iso14a_card_select_t *)resp.d.asBytes;
+	*uidlen = MIN(card->uidlen, 10);
+	memcpy(uid, card->uid, *uidlen);
+	return 0;
+}
+
 // EMULATOR
 
 int mfEmlGetMem(uint8_t *data, int blockNum, int blocksCount) {
@@ -43,15 +43,32 @@
 
 #define TRACE_ERROR		 					0xFF
 
+// keys one CMD_MIFARE_CHKKEYS can carry
+#define MIFARE_CHKKEYS_MAX				85
+
 typedef struct {
 	uint64_t Key[2];
 	int foundKey[2];
 } sector;
+
+// what the device finds out for a nested attack on one block
+typedef struct {
+	uint32_t uid;
+	uint8_t blockNo;
+	uint8_t keyType;
+	uint32_t nt[2];
+	uint32_t ks1[2];
+} nestedNonces;
  
 extern char logHexFileName[200];
 
+int mfNestedNonces(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo, uint8_t trgKeyType, bool calibrate, nestedNonces *nonces);
+int mfNestedRecover(nestedNonces *nonces, uint64_t **keys);
+int mfNestedCheck(nestedNonces *nonces, uint64_t *keys, int count, uint8_t *resultKey, int *commands);
 int mfnested(uint8_t blockNo, uint8_t keyType, uint8_t * key, uint8_t trgBlockNo, uint8_t trgKeyType, uint8_t * ResultKeys, bool calibrate);
 int mfCheckKeys (uint8_t blockNo, uint8_t keyType, uint8_t keycnt, uint8_t * keyBlock, uint64_t * key);
+int mfCheckKeysSectors(uint64_t sectors[2], uint8_t keycnt, uint8_t *keyBlock, uint8_t keyIndex[80]);
+int mfReadUid(uint8_t *uid, uint8_t *uidlen);
 
 int mfEmlGetMem(uint8_t *data, int blockNum, int blocksCount);
 int mfEmlSetMem(uint8_t *data, int blockNum, int blocksCount);
@@ -17,8 +17,19 @@
 
     Copyright (C) 2008-2008 bla <blapost@gmail.com>
 */
+#define _DEFAULT_SOURCE
 #include "crapto1.h"
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 #if !defined LOWMEM && defined __GNUC__
 static uint8_t filterlut[1 << 20];
@@ -215,17 +226,409 @@ recover(uint32_t *o_head, uint32_t *o_tail, uint32_t oks,
 	
 	return sl;
 }
-/** lfsr_recovery
+/** Crypto1Recovery
+ * the working memory of lfsr_recovery32: odd and even tables, the buckets
+ * for sorting them and the resulting statelist, all in one block
+ */
+#define RECOVERY_TABLE_SIZE (sizeof(uint32_t) << 21)
+#define RECOVERY_STATELIST_SIZE (sizeof(struct Crypto1State) << 18)
+#define RECOVERY_BUCKET_SIZE (sizeof(uint32_t) << 14)
+#define RECOVERY_SIZE (2 * RECOVERY_TABLE_SIZE + RECOVERY_STATELIST_SIZE + 2 * 0x100 * RECOVERY_BUCKET_SIZE)
+
+struct Crypto1Recovery {
+	void *mem;
+	uint32_t *odd, *even;
+	struct Crypto1State *statelist;
+	bucket_array_t bucket;
+	int threads;
+	struct Crypto1Recovery *next;
+};
+
+static int cpu_count(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n > 0 ? n : 1;
+#endif
+}
+
+// contexts released by lfsr_recovery_release, ready for the next caller;
+// no more are kept than there are cores
+static pthread_mutex_t recovery_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Crypto1Recovery *recovery_pool;
+static int recovery_pooled;
+
+/** lfsr_recovery_create
+ * allocate the working memory of lfsr_recovery32 in one page aligned block,
+ * backed by huge pages where the system supports it
+ */
+struct Crypto1Recovery* lfsr_recovery_create(void)
+{
+	struct Crypto1Recovery *ctx = calloc(1, sizeof(*ctx));
+	uint8_t *p;
+
+	if(!ctx)
+		return 0;
+#ifdef __linux__
+	ctx->mem = mmap(0, RECOVERY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ctx->mem == MAP_FAILED)
+		ctx->mem = 0;
+#ifdef MADV_HUGEPAGE
+	else
+		madvise(ctx->mem, RECOVERY_SIZE, MADV_HUGEPAGE);
+#endif
+#else
+	ctx->mem = malloc(RECOVERY_SIZE);
+#endif
+	if(!ctx->mem) {
+		free(ctx);
+		return 0;
+	}
+
+	p = ctx->mem;
+	ctx->odd = (uint32_t *)p;
+	p += RECOVERY_TABLE_SIZE;
+	ctx->even = (uint32_t *)p;
+	p += RECOVERY_TABLE_SIZE;
+	ctx->statelist = (struct Crypto1State *)p;
+	p += RECOVERY_STATELIST_SIZE;
+	for (uint32_t i = 0; i < 2; i++)
+		for (uint32_t j = 0; j <= 0xff; j++) {
+			ctx->bucket[i][j].head = (uint32_t *)p;
+			p += RECOVERY_BUCKET_SIZE;
+		}
+	return ctx;
+}
+
+void lfsr_recovery_destroy(struct Crypto1Recovery *ctx)
+{
+	if(!ctx)
+		return;
+#ifdef __linux__
+	munmap(ctx->mem, RECOVERY_SIZE);
+#else
+	free(ctx->mem);
+#endif
+	free(ctx);
+}
+
+/** lfsr_recovery_acquire
+ * take a context from the pool, or create one if all are in use
+ */
+struct Crypto1Recovery* lfsr_recovery_acquire(void)
+{
+	struct Crypto1Recovery *ctx;
+
+	pthread_mutex_lock(&recovery_pool_lock);
+	ctx = recovery_pool;
+	if(ctx) {
+		recovery_pool = ctx->next;
+		recovery_pooled--;
+	}
+	pthread_mutex_unlock(&recovery_pool_lock);
+
+	return ctx ? ctx : lfsr_recovery_create();
+}
+
+/** lfsr_recovery_release
+ * give a context back to the pool; its statelist becomes invalid
+ */
+void lfsr_recovery_release(struct Crypto1Recovery *ctx)
+{
+	if(!ctx)
+		return;
+	ctx->threads = 0;
+	pthread_mutex_lock(&recovery_pool_lock);
+	if(recovery_pooled < cpu_count()) {
+		ctx->next = recovery_pool;
+		recovery_pool = ctx;
+		recovery_pooled++;
+		ctx = 0;
+	}
+	pthread_mutex_unlock(&recovery_pool_lock);
+	lfsr_recovery_destroy(ctx);
+}
+
+static void recovery_workers_free(void);
+
+/** lfsr_recovery_pool_free
+ * return the memory of all pooled contexts to the system
+ */
+void lfsr_recovery_pool_free(void)
+{
+	struct Crypto1Recovery *ctx;
+
+	pthread_mutex_lock(&recovery_pool_lock);
+	ctx = recovery_pool;
+	recovery_pool = 0;
+	recovery_pooled = 0;
+	pthread_mutex_unlock(&recovery_pool_lock);
+
+	while(ctx) {
+		struct Crypto1Recovery *next = ctx->next;
+		lfsr_recovery_destroy(ctx);
+		ctx = next;
+	}
+	recovery_workers_free();
+}
+
+/** lfsr_recovery_threads
+ * set how many threads lfsr_recovery32_ctx may use, 0 for one per core.
+ * returns the previous setting
+ */
+int lfsr_recovery_threads(struct Crypto1Recovery *ctx, int threads)
+{
+	int prev = ctx->threads;
+
+	ctx->threads = threads < 0 ? 0 : threads;
+	return prev;
+}
+
+/** recovery_task
+ * one pair of intersecting buckets of the first level of recover(); each is
+ * an independent subtree of the search
+ */
+struct recovery_task {
+	uint32_t *o_head, *o_tail, *e_head, *e_tail;
+	struct Crypto1State *sl;	// results, malloced by the worker
+	uint32_t count;
+	int done;					// 0 if the worker had no memory for the results
+};
+
+struct recovery_job {
+	struct recovery_task *task;
+	uint32_t numtasks;
+	uint32_t next;				// next task to take
+	uint32_t finished;
+	int active, threads;		// workers on it now, and at most
+	uint32_t oks, eks, in;
+	int rem;
+	struct recovery_job *queued;
+};
+
+/** recovery_workers
+ * one set of threads, no more than there are cores, takes the tasks of every
+ * recover_parallel() in the process. They are started with the first job and
+ * each keeps its own context, so the memory used doesn't grow with the number
+ * of callers
+ */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;		// a job was queued
+	pthread_cond_t done;		// a task was finished
+	struct recovery_job *jobs;	// jobs with tasks left to take
+	int count;
+	struct Crypto1Recovery *ctx[64];
+	int busy[64];
+} recovery_workers = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER };
+static pthread_once_t recovery_workers_once = PTHREAD_ONCE_INIT;
+
+// Must be called with recovery_workers.lock held
+static struct recovery_job *next_recovery_job(void)
+{
+	struct recovery_job *job;
+
+	for(job = recovery_workers.jobs; job; job = job->queued)
+		if(job->next < job->numtasks && job->active < job->threads)
+			return job;
+	return 0;
+}
+
+// Must be called with recovery_workers.lock held
+static void unqueue_recovery_job(struct recovery_job *job)
+{
+	struct recovery_job **j;
+
+	for(j = &recovery_workers.jobs; *j; j = &(*j)->queued)
+		if(*j == job) {
+			*j = job->queued;
+			break;
+		}
+}
+
+/** recovery_worker_thread
+ * takes tasks of whatever job is queued and runs recover() on a private copy
+ * of their tables: recover() extends the tables in place, past their tail
+ */
+static void *recovery_worker_thread(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	struct recovery_job *job;
+	struct recovery_task *t;
+	struct Crypto1State *sl;
+	uint32_t on, en;
+
+	pthread_mutex_lock(&recovery_workers.lock);
+	while(1) {
+		while(!(job = next_recovery_job()))
+			pthread_cond_wait(&recovery_workers.work, &recovery_workers.lock);
+		t = &job->task[job->next++];
+		if(job->next == job->numtasks)
+			unqueue_recovery_job(job);
+		job->active++;
+		recovery_workers.busy[id] = 1;
+		pthread_mutex_unlock(&recovery_workers.lock);
+
+		if(!recovery_workers.ctx[id])
+			recovery_workers.ctx[id] = lfsr_recovery_create();
+		if(recovery_workers.ctx[id]) {
+			struct Crypto1Recovery *ctx = recovery_workers.ctx[id];
+
+			on = t->o_tail - t->o_head + 1;
+			en = t->e_tail - t->e_head + 1;
+			memcpy(ctx->odd, t->o_head, on * sizeof(uint32_t));
+			memcpy(ctx->even, t->e_head, en * sizeof(uint32_t));
+			sl = recover(ctx->odd, ctx->odd + on - 1, job->oks,
+				ctx->even, ctx->even + en - 1, job->eks,
+				job->rem, ctx->statelist, job->in, ctx->bucket);
+			t->count = sl - ctx->statelist;
+			if(t->count)
+				t->sl = malloc(t->count * sizeof(struct Crypto1State));
+			if(t->sl)
+				memcpy(t->sl, ctx->statelist, t->count * sizeof(struct Crypto1State));
+			t->done = !t->count || t->sl;
+		}
+
+		pthread_mutex_lock(&recovery_workers.lock);
+		recovery_workers.busy[id] = 0;
+		job->active--;
+		job->finished++;
+		pthread_cond_broadcast(&recovery_workers.done);
+	}
+	return NULL;
+}
+
+static void start_recovery_workers(void)
+{
+	pthread_attr_t attr;
+	int i, n = cpu_count();
+
+	if(n > (int)(sizeof(recovery_workers.ctx) / sizeof(recovery_workers.ctx[0])))
+		n = sizeof(recovery_workers.ctx) / sizeof(recovery_workers.ctx[0]);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for(i = 0; i < n; i++) {
+		pthread_t thread;
+
+		if(pthread_create(&thread, &attr, recovery_worker_thread, (void *)(intptr_t)i))
+			break;
+		recovery_workers.count++;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/** recovery_workers_free
+ * return the contexts of the idle workers to the system, they get new ones
+ * with their next task
+ */
+static void recovery_workers_free(void)
+{
+	int i;
+
+	pthread_mutex_lock(&recovery_workers.lock);
+	for(i = 0; i < recovery_workers.count; i++)
+		if(!recovery_workers.busy[i]) {
+			lfsr_recovery_destroy(recovery_workers.ctx[i]);
+			recovery_workers.ctx[i] = 0;
+		}
+	pthread_mutex_unlock(&recovery_workers.lock);
+}
+
+/** recover_parallel
+ * the first level of recover(), with the subtrees spread over the worker
+ * threads. The results are put together in the order recover() produces
+ * them, so the statelist is the same whatever the number of threads
+ */
+static struct Crypto1State*
+recover_parallel(uint32_t *o_head, uint32_t *o_tail, uint32_t oks,
+	uint32_t *e_head, uint32_t *e_tail, uint32_t eks, int rem,
+	struct Crypto1State *sl, uint32_t in, bucket_array_t bucket, int threads)
+{
+	struct recovery_task task[0x100];
+	struct recovery_job job;
+	bucket_info_t bucket_info;
+	int i;
+
+	for(i = 0; i < 4 && rem--; i++) {
+		extend_table(o_head, &o_tail, (oks >>= 1) & 1,
+			LF_POLY_EVEN << 1 | 1, LF_POLY_ODD << 1, 0);
+		if(o_head > o_tail)
+			return sl;
+
+		extend_table(e_head, &e_tail, (eks >>= 1) & 1,
+			LF_POLY_ODD, LF_POLY_EVEN << 1 | 1, (in >>= 2) & 3);
+		if(e_head > e_tail)
+			return sl;
+	}
+
+	bucket_sort_intersect(e_head, e_tail, o_head, o_tail, &bucket_info, bucket);
+
+	memset(&job, 0, sizeof(job));
+	job.task = task;
+	job.numtasks = bucket_info.numbuckets;
+	job.threads = threads;
+	job.oks = oks;
+	job.eks = eks;
+	job.in = in;
+	job.rem = rem;
+	for(i = bucket_info.numbuckets - 1; i >= 0; i--) {
+		struct recovery_task *t = &task[bucket_info.numbuckets - 1 - i];
+
+		t->o_head = bucket_info.bucket_info[1][i].head;
+		t->o_tail = bucket_info.bucket_info[1][i].tail;
+		t->e_head = bucket_info.bucket_info[0][i].head;
+		t->e_tail = bucket_info.bucket_info[0][i].tail;
+		t->sl = 0;
+		t->count = 0;
+		t->done = 0;
+	}
+
+	pthread_once(&recovery_workers_once, start_recovery_workers);
+	if(recovery_workers.count && job.numtasks) {
+		pthread_mutex_lock(&recovery_workers.lock);
+		job.queued = recovery_workers.jobs;
+		recovery_workers.jobs = &job;
+		pthread_cond_broadcast(&recovery_workers.work);
+		while(job.finished < job.numtasks)
+			pthread_cond_wait(&recovery_workers.done, &recovery_workers.lock);
+		pthread_mutex_unlock(&recovery_workers.lock);
+	}
+
+	// tasks no worker could do are done right here, in place and in order
+	for(i = 0; i < (int)job.numtasks; i++) {
+		if(task[i].done) {
+			memcpy(sl, task[i].sl, task[i].count * sizeof(struct Crypto1State));
+			sl += task[i].count;
+			free(task[i].sl);
+		} else {
+			free(task[i].sl);
+			sl = recover(task[i].o_head, task[i].o_tail, oks,
+				task[i].e_head, task[i].e_tail, eks, rem, sl, in, bucket);
+		}
+	}
+	sl->odd = sl->even = 0;
+
+	return sl;
+}
+
+/** lfsr_recovery32_ctx
  * recover the state of the lfsr given 32 bits of the keystream
  * additionally you can use the in parameter to specify the value
- * that was fed into the lfsr at the time the keystream was generated
+ * that was fed into the lfsr at the time the keystream was generated.
+ * The statelist returned lives in ctx and is valid until its next use.
  */
-struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in)
+struct Crypto1State* lfsr_recovery32_ctx(struct Crypto1Recovery *ctx, uint32_t ks2, uint32_t in)
 {
-	struct Crypto1State *statelist;
-	uint32_t *odd_head = 0, *odd_tail = 0, oks = 0;
-	uint32_t *even_head = 0, *even_tail = 0, eks = 0;
-	int i;
+	struct Crypto1State *statelist = ctx->statelist;
+	uint32_t *odd_head = ctx->odd, *odd_tail = ctx->odd - 1, oks = 0;
+	uint32_t *even_head = ctx->even, *even_tail = ctx->even - 1, eks = 0;
+	int i, threads;
 
 	// split the keystream into an odd and even part
 	for(i = 31; i >= 0; i -= 2)
@@ -233,25 +636,8 @@ struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in)
 	for(i = 30; i >= 0; i -= 2)
  		eks = eks << 1 | BEBIT(ks2, i);
 
-	odd_head = odd_tail = malloc(sizeof(uint32_t) << 21);
-	even_head = even_tail = malloc(sizeof(uint32_t) << 21);
-	statelist =  malloc(sizeof(struct Crypto1State) << 18);
-	if(!odd_tail-- || !even_tail-- || !statelist) {
-		goto out;
-	}
 	statelist->odd = statelist->even = 0;
 
-	// allocate memory for out of place bucket_sort
-	bucket_array_t bucket;
-	for (uint32_t i = 0; i < 2; i++)
-		for (uint32_t j = 0; j <= 0xff; j++) {
-			bucket[i][j].head = malloc(sizeof(uint32_t)<<14);
-			if (!bucket[i][j].head) {
-				goto out;
-			}
-		}
-
-	
 	// initialize statelists: add all possible states which would result into the rightmost 2 bits of the keystream
 	for(i = 1 << 20; i >= 0; --i) {
 		if(filter(i) == (oks & 1))
@@ -272,17 +658,39 @@ struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in)
 
 	in = (in >> 16 & 0xff) | (in << 16) | (in & 0xff00);		// Byte swapping
 
-	recover(odd_head, odd_tail, oks,
-		even_head, even_tail, eks, 11, statelist, in << 1, bucket);
+	threads = ctx->threads ? ctx->threads : cpu_count();
+	if(threads > 1)
+		recover_parallel(odd_head, odd_tail, oks,
+			even_head, even_tail, eks, 11, statelist, in << 1, ctx->bucket, threads);
+	else
+		recover(odd_head, odd_tail, oks,
+			even_head, even_tail, eks, 11, statelist, in << 1, ctx->bucket);
 
+	return statelist;
+}
 
-out:
-	free(odd_head);
-	free(even_head);
-	for (uint32_t i = 0; i < 2; i++)
-		for (uint32_t j = 0; j <= 0xff; j++)
-			free(bucket[i][j].head);
-	
+/** lfsr_recovery
+ * recover the state of the lfsr given 32 bits of the keystream
+ * additionally you can use the in parameter to specify the value
+ * that was fed into the lfsr at the time the keystream was generated.
+ * The statelist returned is the caller's to free.
+ */
+struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in)
+{
+	struct Crypto1Recovery *ctx = lfsr_recovery_acquire();
+	struct Crypto1State *sl, *statelist = 0;
+
+	if(!ctx)
+		return 0;
+
+	sl = lfsr_recovery32_ctx(ctx, ks2, in);
+	while(sl->odd || sl->even)
+		sl++;
+	statelist = malloc((sl - ctx->statelist + 1) * sizeof(struct Crypto1State));
+	if(statelist)
+		memcpy(statelist, ctx->statelist, (sl - ctx->statelist + 1) * sizeof(struct Crypto1State));
+
+	lfsr_recovery_release(ctx);
 	return statelist;
 }
 
@@ -438,42 +846,112 @@ static uint32_t fastfwd[2][8] = {
 	{ 0, 0x1D962, 0x4BC53, 0x56531, 0xECB1, 0x135D3, 0x450E2, 0x58980}};
 
 
+static int prefix_threads;
+
+/** lfsr_prefix_threads
+ * set how many threads lfsr_prefix_ks and lfsr_common_prefix may use, 0 for
+ * one per core. returns the previous setting
+ */
+int lfsr_prefix_threads(int threads)
+{
+	int prev = prefix_threads;
+
+	prefix_threads = threads < 0 ? 0 : threads;
+	return prev;
+}
+
+/** run_workers
+ * run fn(arg) on up to threads threads, no more than there are tasks, and
+ * wait for them. fn takes the tasks from arg until none are left; without
+ * a single thread it is run right here
+ */
+static void run_workers(void *(*fn)(void *), void *arg, int threads, uint32_t tasks)
+{
+	pthread_t thread[64];
+	int i, started = 0;
+
+	if(!threads)
+		threads = cpu_count();
+	if(threads > (int)tasks)
+		threads = tasks;
+	if(threads > (int)(sizeof(thread) / sizeof(thread[0])))
+		threads = sizeof(thread) / sizeof(thread[0]);
+	for(i = 0; threads > 1 && i < threads; i++)
+		if(!pthread_create(&thread[started], NULL, fn, arg))
+			started++;
+	if(!started)
+		fn(arg);
+	for(i = 0; i < started; i++)
+		pthread_join(thread[i], NULL);
+}
+
+#define PREFIX_CHUNK (1 << 16)
+#define PREFIX_CHUNKS ((1 << 21) / PREFIX_CHUNK)
+
+struct prefix_ks_job {
+	uint8_t *ks;
+	int isodd;
+	uint32_t *candidates;
+	uint32_t count[PREFIX_CHUNKS];
+	uint32_t next;				// next chunk to take, shared by the workers
+};
+
+/** prefix_ks_thread
+ * filters chunks of the 21 bit candidates; the ones of chunk k that are left
+ * go to the start of its own part of the candidates
+ */
+static void *prefix_ks_thread(void *arg)
+{
+	struct prefix_ks_job *job = arg;
+	uint32_t k, i, c, entry, *out;
+
+	while((k = __sync_fetch_and_add(&job->next, 1)) < PREFIX_CHUNKS) {
+		out = job->candidates + k * PREFIX_CHUNK;
+		for(i = k * PREFIX_CHUNK; i < (k + 1) * PREFIX_CHUNK; ++i) {
+			for(c = 0; c < 8; ++c) {
+				entry = i ^ fastfwd[job->isodd][c];
+				if(filter(entry >> 1) != BIT(job->ks[c], job->isodd) ||
+				   filter(entry) != BIT(job->ks[c], job->isodd + 2))
+					break;
+			}
+			if(c == 8)
+				*out++ = i;
+		}
+		job->count[k] = out - (job->candidates + k * PREFIX_CHUNK);
+	}
+	return NULL;
+}
+
 /** lfsr_prefix_ks
  *
  * Is an exported helper function from the common prefix attack
  * Described in the "dark side" paper. It returns an -1 terminated array
- * of possible partial(21 bit) secret state.
+ * of possible partial(21 bit) secret state, in ascending order.
  * The required keystream(ks) needs to contain the keystream that was used to
  * encrypt the NACK which is observed when varying only the 4 last bits of Nr
  * only correct iff [NR_3] ^ NR_3 does not depend on Nr_3
  */
 uint32_t *lfsr_prefix_ks(uint8_t ks[8], int isodd)
 {
-	uint32_t *candidates = malloc(4 << 21);
-	uint32_t c,  entry;
-	int size, i;
+	struct prefix_ks_job job;
+	uint32_t k, size = 0;
 
-	if(!candidates)
+	job.candidates = malloc((4 << 21) + 4);
+	if(!job.candidates)
 		return 0;
+	job.ks = ks;
+	job.isodd = isodd;
+	job.next = 0;
+	run_workers(prefix_ks_thread, &job, prefix_threads, PREFIX_CHUNKS);
+
+	// put the chunks together, in order
+	for(k = 0; k < PREFIX_CHUNKS; ++k) {
+		memmove(job.candidates + size, job.candidates + k * PREFIX_CHUNK, job.count[k] * sizeof(uint32_t));
+		size += job.count[k];
+	}
+	job.candidates[size] = -1;
 
-	size = (1 << 21) - 1;
-	for(i = 0; i <= size; ++i)
-		candidates[i] = i;
-
-	for(c = 0;  c < 8; ++c)
-		for(i = 0;i <= size; ++i) {
-			entry = candidates[i] ^ fastfwd[isodd][c];
-
-			if(filter(entry >> 1) == BIT(ks[c], isodd))
-				if(filter(entry) == BIT(ks[c], isodd + 2))
-					continue;
-
-			candidates[i--] = candidates[size--];
-		}
-
-	candidates[size + 1] = -1;
-
-	return candidates;
+	return job.candidates;
 }
 
 /** brute_top
@@ -524,48 +1002,96 @@ brute_top(uint32_t prefix, uint32_t rresp, unsigned char parities[8][8],
 } 
 
 
+struct common_prefix_job {
+	uint32_t pfx, rr;
+	uint8_t (*par)[8];
+	uint8_t no_par;
+	uint32_t *odd, *even;
+	uint32_t numodd, numeven;
+	struct Crypto1State *statelist;
+	uint32_t *count;			// states found per odd candidate
+	uint32_t next;				// next odd candidate to take, shared by the workers
+};
+
+/** common_prefix_thread
+ * tries all even candidates and top bits with one odd candidate at a time;
+ * the states of odd candidate k go to the start of its own part of the
+ * statelist, which has room for all of them
+ */
+static void *common_prefix_thread(void *arg)
+{
+	struct common_prefix_job *job = arg;
+	struct Crypto1State *head, *sl;
+	uint32_t k, e, top;
+
+	while((k = __sync_fetch_and_add(&job->next, 1)) < job->numodd) {
+		head = sl = job->statelist + (size_t)k * job->numeven * 64;
+		for(e = 0; e < job->numeven; ++e)
+			for(top = 0; top < 64; ++top)
+				sl = brute_top(job->pfx, job->rr, job->par,
+					(job->odd[k] & 0x1fffff) | top << 21,
+					(job->even[e] & 0x1fffff) | (top >> 3) << 21,
+					sl, job->no_par);
+		job->count[k] = sl - head;
+	}
+	return NULL;
+}
+
 /** lfsr_common_prefix
  * Implentation of the common prefix attack.
  * Requires the 28 bit constant prefix used as reader nonce (pfx)
  * The reader response used (rr)
  * The keystream used to encrypt the observed NACK's (ks)
  * The parity bits (par)
- * It returns a zero terminated list of possible cipher states after the
- * tag nonce was fed in
+ * It returns a -1 terminated list of possible cipher states after the
+ * tag nonce was fed in. The odd candidates are shared out over
+ * lfsr_prefix_threads() threads, the list is the same for any number of them
  */
 struct Crypto1State*
 lfsr_common_prefix(uint32_t pfx, uint32_t rr, uint8_t ks[8], uint8_t par[8][8], uint8_t no_par)
 {
-	struct Crypto1State *statelist, *s;
-	uint32_t *odd, *even, *o, *e, top;
-
-	odd = lfsr_prefix_ks(ks, 1);
-	even = lfsr_prefix_ks(ks, 0);
-
-	statelist = malloc((sizeof *statelist) << 21);	//how large should be? 
-	if(!statelist || !odd || !even)
-	{
-				free(statelist);
-				free(odd);
-				free(even);
-                return 0;
+	struct common_prefix_job job;
+	struct Crypto1State *s;
+	uint32_t k;
+
+	memset(&job, 0, sizeof(job));
+	job.odd = lfsr_prefix_ks(ks, 1);
+	job.even = lfsr_prefix_ks(ks, 0);
+	if(!job.odd || !job.even)
+		goto out;
 
+	while(job.odd[job.numodd] != (uint32_t)-1)
+		++job.numodd;
+	while(job.even[job.numeven] != (uint32_t)-1)
+		++job.numeven;
+
+	// without parities every combination gives a state, that is the most there can be
+	job.statelist = malloc(sizeof(struct Crypto1State) * ((size_t)job.numodd * job.numeven * 64 + 1));
+	job.count = malloc(sizeof(uint32_t) * (job.numodd + 1));
+	if(!job.statelist || !job.count) {
+		free(job.statelist);
+		job.statelist = 0;
+		goto out;
 	}
 
-	s = statelist;
-	for(o = odd; *o != -1; ++o)
-		for(e = even; *e != -1; ++e)
-			for(top = 0; top < 64; ++top) {
-				*o = (*o & 0x1fffff) | (top << 21);
-				*e = (*e & 0x1fffff) | (top >> 3) << 21;
-				s = brute_top(pfx, rr, par, *o, *e, s, no_par);
-			}
-
-	s->odd = s->even = -1;	
-	//printf("state count = %d\n",s-statelist);
+	job.pfx = pfx;
+	job.rr = rr;
+	job.par = par;
+	job.no_par = no_par;
+	run_workers(common_prefix_thread, &job, prefix_threads, job.numodd);
+
+	// put the parts together, in the order of the odd candidates
+	s = job.statelist;
+	for(k = 0; k < job.numodd; ++k) {
+		memmove(s, job.statelist + (size_t)k * job.numeven * 64, job.count[k] * sizeof(struct Crypto1State));
+		s += job.count[k];
+	}
+	s->odd = s->even = -1;
 
-	free(odd);
-	free(even);
+out:
+	free(job.count);
+	free(job.odd);
+	free(job.even);
 
-	return statelist;
+	return job.statelist;
 }
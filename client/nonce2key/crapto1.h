@@ -20,6 +20,7 @@
 #ifndef CRAPTO1_INCLUDED
 #define CRAPTO1_INCLUDED
 #include <stdint.h>
+#include <stddef.h>
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -34,7 +35,17 @@ uint32_t crypto1_word(struct Crypto1State*, uint32_t, int);
 uint32_t prng_successor(uint32_t x, uint32_t n);
 
 struct Crypto1State* lfsr_recovery32(uint32_t ks2, uint32_t in);
+
+struct Crypto1Recovery;
+struct Crypto1Recovery* lfsr_recovery_create(void);
+void lfsr_recovery_destroy(struct Crypto1Recovery*);
+struct Crypto1Recovery* lfsr_recovery_acquire(void);
+void lfsr_recovery_release(struct Crypto1Recovery*);
+void lfsr_recovery_pool_free(void);
+int lfsr_recovery_threads(struct Crypto1Recovery*, int threads);
+struct Crypto1State* lfsr_recovery32_ctx(struct Crypto1Recovery*, uint32_t ks2, uint32_t in);
 struct Crypto1State* lfsr_recovery64(uint32_t ks2, uint32_t ks3);
+int lfsr_prefix_threads(int threads);
 uint32_t *lfsr_prefix_ks(uint8_t ks[8], int isodd);
 struct Crypto1State*
 lfsr_common_prefix(uint32_t pfx, uint32_t rr, uint8_t ks[8], uint8_t par[8][8], uint8_t no_par);
@@ -43,6 +54,12 @@ lfsr_common_prefix(uint32_t pfx, uint32_t rr, uint8_t ks[8], uint8_t par[8][8],
 void lfsr_rollback_bit(struct Crypto1State* s, uint32_t in, int fb);
 void lfsr_rollback_byte(struct Crypto1State* s, uint32_t in, int fb);
 void lfsr_rollback_word(struct Crypto1State* s, uint32_t in, int fb);
+
+const char *crypto1_batch_backend(void);
+void crypto1_word_batch(struct Crypto1State* s, size_t n, uint32_t in, int is_encrypted, uint32_t *out);
+void lfsr_rollback_word_batch(struct Crypto1State* s, size_t n, uint32_t in, int fb);
+uint32_t lfsr_nested_intersect(struct Crypto1State *sl[2], uint32_t len[2], uint32_t in[2]);
+
 int nonce_distance(uint32_t from, uint32_t to);
 #define SWAPENDIAN(x)\
 	(x = (x >> 8 & 0xff00ff) | (x & 0xff00ff) << 8, x = x >> 16 | x << 16)
@@ -0,0 +1,434 @@
+/*  crypto1_batch.c
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License
+    as published by the Free Software Foundation; either version 2
+    of the License, or (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+    MA  02110-1301, US
+
+    Bitsliced versions of crypto1_word and lfsr_rollback_word: many
+    states that see the same input are run side by side, one bit of each
+    state per lane. The results are the same as the scalar functions give,
+    including the bits above bit 23 of odd and even. Also the intersection
+    of the two statelists of a nested authentication, which is built on
+    the batch rollback.
+*/
+#include "crapto1.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// below this many states the transposition costs more than it saves
+#define BATCH_MIN 16
+
+#if defined __GNUC__ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || defined __clang__)
+
+#define LANES 256
+#define GROUPS (LANES / 64)
+
+typedef uint64_t bs_t __attribute__((vector_size(LANES / 8)));
+
+#define BS_INLINE static inline __attribute__((always_inline))
+
+/** transpose64
+ * transpose a 64x64 bit matrix, bit c of a[r] becomes bit r of a[c]
+ */
+BS_INLINE void transpose64(uint64_t a[64])
+{
+	uint64_t m = 0x00000000ffffffffULL, t;
+	int j, k;
+
+	for(j = 32; j; j >>= 1, m ^= m << j)
+		for(k = 0; k < 64; k = ((k | j) + 1) & ~j) {
+			t = ((a[k] >> j) ^ a[k | j]) & m;
+			a[k] ^= t << j;
+			a[k | j] ^= t;
+		}
+}
+
+/** load
+ * turn up to LANES states into 32 bit planes for odd and even
+ */
+BS_INLINE void load(const struct Crypto1State *s, size_t n, bs_t odd[32], bs_t even[32])
+{
+	uint64_t o[64], e[64];
+	size_t g, l, i;
+
+	for(g = 0; g < GROUPS; g++) {
+		for(l = 0; l < 64; l++) {
+			i = g * 64 + l;
+			o[l] = i < n ? s[i].odd : 0;
+			e[l] = i < n ? s[i].even : 0;
+		}
+		transpose64(o);
+		transpose64(e);
+		for(l = 0; l < 32; l++) {
+			odd[l][g] = o[l];
+			even[l][g] = e[l];
+		}
+	}
+}
+
+BS_INLINE void store(struct Crypto1State *s, size_t n, const bs_t odd[32], const bs_t even[32])
+{
+	uint64_t o[64], e[64];
+	size_t g, l, i;
+
+	for(g = 0; g < GROUPS && g * 64 < n; g++) {
+		for(l = 0; l < 32; l++) {
+			o[l] = odd[l][g];
+			e[l] = even[l][g];
+		}
+		memset(o + 32, 0, sizeof(o) / 2);
+		memset(e + 32, 0, sizeof(e) / 2);
+		transpose64(o);
+		transpose64(e);
+		for(l = 0; l < 64 && (i = g * 64 + l) < n; l++) {
+			s[i].odd = o[l];
+			s[i].even = e[l];
+		}
+	}
+}
+
+/** lut
+ * evaluate the boolean function with truth table t on the planes
+ * x[0..inputs-1], x[0] being the least significant input. t is a
+ * constant, the mux tree folds down to a handful of operations
+ */
+BS_INLINE void lut(uint32_t t, int inputs, const bs_t *x, bs_t *out)
+{
+	bs_t v[32], zero = {0};
+	int i, k, w = 1 << inputs;
+
+	for(i = 0; i < w; i++)
+		v[i] = (t >> i & 1) ? ~zero : zero;
+	for(k = 0; k < inputs; k++, w >>= 1)
+		for(i = 0; i < w / 2; i++)
+			v[i] = (v[2 * i] & ~x[k]) | (v[2 * i + 1] & x[k]);
+	*out = v[0];
+}
+
+/** filter_bs
+ * filter() on the low 20 bits of x
+ */
+BS_INLINE void filter_bs(const bs_t x[32], bs_t *out)
+{
+	bs_t f[5];
+
+	lut(0x0d938, 4, x + 16, f + 0);
+	lut(0x0f22c, 4, x + 12, f + 1);
+	lut(0x0f22c, 4, x + 8, f + 2);
+	lut(0x0d938, 4, x + 4, f + 3);
+	lut(0x0f22c, 4, x + 0, f + 4);
+	lut(0xEC57E80A, 5, f, out);
+}
+
+BS_INLINE void word_chunk(struct Crypto1State *s, size_t n, uint32_t in, int is_encrypted, uint32_t *out)
+{
+	bs_t odd[32], even[32], tmp[32], ks[32], zero = {0}, fb;
+	uint64_t r[64];
+	int i, k;
+
+	load(s, n, odd, even);
+	for(i = 0; i < 32; i++) {
+		filter_bs(odd, &ks[i]);
+
+		fb = is_encrypted ? ks[i] : zero;
+		if(BEBIT(in, i))
+			fb = ~fb;
+		for(k = 0; k < 24; k++) {
+			if(BIT(LF_POLY_ODD, k))
+				fb ^= odd[k];
+			if(BIT(LF_POLY_EVEN, k))
+				fb ^= even[k];
+		}
+		// even = even << 1 | fb, then odd and even swap places
+		memcpy(tmp, odd, sizeof(tmp));
+		odd[0] = fb;
+		for(k = 1; k < 32; k++)
+			odd[k] = even[k - 1];
+		memcpy(even, tmp, sizeof(tmp));
+	}
+	store(s, n, odd, even);
+
+	if(!out)
+		return;
+	// keystream bit i is bit i ^ 24 of the result, like crypto1_word
+	for(int g = 0; g < GROUPS && g * 64 < (int)n; g++) {
+		for(i = 0; i < 32; i++)
+			r[i ^ 24] = ks[i][g];
+		memset(r + 32, 0, sizeof(r) / 2);
+		transpose64(r);
+		for(k = 0; k < 64 && g * 64 + k < (int)n; k++)
+			out[g * 64 + k] = r[k];
+	}
+}
+
+BS_INLINE void rollback_chunk(struct Crypto1State *s, size_t n, uint32_t in, int fb)
+{
+	bs_t odd[32], even[32], tmp[32], f, out, zero = {0};
+	int i, k;
+
+	load(s, n, odd, even);
+	for(i = 31; i >= 0; --i) {
+		// odd &= 0xffffff, then odd and even swap places
+		memcpy(tmp, even, sizeof(tmp));
+		memcpy(even, odd, sizeof(tmp));
+		for(k = 24; k < 32; k++)
+			even[k] = zero;
+		memcpy(odd, tmp, sizeof(tmp));
+
+		out = even[0];
+		for(k = 0; k < 31; k++)
+			even[k] = even[k + 1];
+		even[31] = zero;
+		for(k = 0; k < 24; k++) {
+			if(BIT(LF_POLY_EVEN, k))
+				out ^= even[k];
+			if(BIT(LF_POLY_ODD, k))
+				out ^= odd[k];
+		}
+		if(BEBIT(in, i))
+			out = ~out;
+		if(fb) {
+			filter_bs(odd, &f);
+			out ^= f;
+		}
+		even[23] |= out;
+	}
+	store(s, n, odd, even);
+}
+
+static void word_chunk_sse2(struct Crypto1State *s, size_t n, uint32_t in, int is_encrypted, uint32_t *out)
+{
+	word_chunk(s, n, in, is_encrypted, out);
+}
+
+static void rollback_chunk_sse2(struct Crypto1State *s, size_t n, uint32_t in, int fb)
+{
+	rollback_chunk(s, n, in, fb);
+}
+
+#if defined __x86_64__ || defined __i386__
+#define HAVE_AVX2
+__attribute__((target("avx2")))
+static void word_chunk_avx2(struct Crypto1State *s, size_t n, uint32_t in, int is_encrypted, uint32_t *out)
+{
+	word_chunk(s, n, in, is_encrypted, out);
+}
+
+__attribute__((target("avx2")))
+static void rollback_chunk_avx2(struct Crypto1State *s, size_t n, uint32_t in, int fb)
+{
+	rollback_chunk(s, n, in, fb);
+}
+#endif
+
+static void (*word_batch)(struct Crypto1State*, size_t, uint32_t, int, uint32_t*);
+static void (*rollback_batch)(struct Crypto1State*, size_t, uint32_t, int);
+static const char *backend;
+
+static void choose_backend(void)
+{
+	word_batch = word_chunk_sse2;
+	rollback_batch = rollback_chunk_sse2;
+#if defined __x86_64__ || defined __i386__
+	backend = "sse2";
+#else
+	backend = "generic vector";
+#endif
+#ifdef HAVE_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		word_batch = word_chunk_avx2;
+		rollback_batch = rollback_chunk_avx2;
+		backend = "avx2";
+	}
+#endif
+}
+
+#else
+
+#define LANES 64
+
+static void word_batch_scalar(struct Crypto1State *s, size_t n, uint32_t in, int is_encrypted, uint32_t *out)
+{
+	for(size_t i = 0; i < n; i++) {
+		uint32_t ks = crypto1_word(s + i, in, is_encrypted);
+		if(out)
+			out[i] = ks;
+	}
+}
+
+static void rollback_batch_scalar(struct Crypto1State *s, size_t n, uint32_t in, int fb)
+{
+	for(size_t i = 0; i < n; i++)
+		lfsr_rollback_word(s + i, in, fb);
+}
+
+static void (*word_batch)(struct Crypto1State*, size_t, uint32_t, int, uint32_t*);
+static void (*rollback_batch)(struct Crypto1State*, size_t, uint32_t, int);
+static const char *backend;
+
+static void choose_backend(void)
+{
+	word_batch = word_batch_scalar;
+	rollback_batch = rollback_batch_scalar;
+	backend = "scalar";
+}
+
+#endif
+
+// the batch functions are called from the recovery threads, the first
+// caller picks the backend for all of them
+static pthread_once_t backend_once = PTHREAD_ONCE_INIT;
+
+/** crypto1_batch_backend
+ * name of the implementation the batch functions use on this machine
+ */
+const char *crypto1_batch_backend(void)
+{
+	pthread_once(&backend_once, choose_backend);
+	return backend;
+}
+
+/** crypto1_word_batch
+ * crypto1_word(&s[i], in, is_encrypted) for n states; if out isn't NULL the
+ * keystream of state i is stored in out[i]
+ */
+void crypto1_word_batch(struct Crypto1State *s, size_t n, uint32_t in, int is_encrypted, uint32_t *out)
+{
+	size_t i, chunk;
+
+	pthread_once(&backend_once, choose_backend);
+	for(i = 0; n - i >= BATCH_MIN; i += chunk) {
+		chunk = n - i < LANES ? n - i : LANES;
+		word_batch(s + i, chunk, in, is_encrypted, out ? out + i : 0);
+	}
+	for(; i < n; i++) {
+		uint32_t ks = crypto1_word(s + i, in, is_encrypted);
+		if(out)
+			out[i] = ks;
+	}
+}
+
+/** lfsr_rollback_word_batch
+ * lfsr_rollback_word(&s[i], in, fb) for n states
+ */
+void lfsr_rollback_word_batch(struct Crypto1State *s, size_t n, uint32_t in, int fb)
+{
+	size_t i, chunk;
+
+	pthread_once(&backend_once, choose_backend);
+	for(i = 0; n - i >= BATCH_MIN; i += chunk) {
+		chunk = n - i < LANES ? n - i : LANES;
+		rollback_batch(s + i, chunk, in, fb);
+	}
+	for(; i < n; i++)
+		lfsr_rollback_word(s + i, in, fb);
+}
+
+// the 16 bits of a state that already hold part of the key: bits 16..23
+// of odd and of even
+#define STATE16(x)	((x) & 0x00ff000000ff0000ULL)
+
+/*
+ * LSD radix sort of n states, seen as uint64_t, by the bytes given in
+ * shifts, least significant first. tmp must have room for n values.
+ * Ends with the sorted values in a.
+ */
+static void radix_sort(uint64_t *a, uint64_t *tmp, uint32_t n, const int *shifts, int passes)
+{
+	uint32_t count[8][0x100];
+	uint64_t *src = a, *dst = tmp, *t;
+	uint32_t i, sum;
+	int p;
+
+	memset(count, 0, passes * sizeof(count[0]));
+	for (i = 0; i < n; i++)
+		for (p = 0; p < passes; p++)
+			count[p][src[i] >> shifts[p] & 0xff]++;
+
+	for (p = 0; p < passes; p++) {
+		for (i = 0, sum = 0; i < 0x100; i++) {
+			uint32_t c = count[p][i];
+			count[p][i] = sum;
+			sum += c;
+		}
+		for (i = 0; i < n; i++)
+			dst[count[p][src[i] >> shifts[p] & 0xff]++] = src[i];
+		t = src; src = dst; dst = t;
+	}
+	if (src != a)
+		memcpy(a, src, n * sizeof(uint64_t));
+}
+
+/*
+ * The key candidates of a nested authentication: the states both lists
+ * agree on. Each list is sorted by the 16 bits that already hold part of
+ * the key, the states whose 16 bits appear in both lists are kept and
+ * rolled back to the key, then the keys are sorted and intersected.
+ * The candidates are left in sl[0], as many as returned; sl[1] is used
+ * as scratch space.
+ */
+uint32_t lfsr_nested_intersect(struct Crypto1State *sl[2], uint32_t len[2], uint32_t in[2])
+{
+	static const int shifts16[] = {16, 48};
+	static const int shifts48[] = {0, 8, 16, 24, 32, 40};
+	uint64_t *a = (uint64_t *)sl[0], *b = (uint64_t *)sl[1], *tmp;
+	uint32_t i, j, n0, n1, n;
+
+	tmp = malloc((len[0] > len[1] ? len[0] : len[1]) * sizeof(uint64_t));
+	if (tmp == NULL) return 0;
+
+	radix_sort(a, tmp, len[0], shifts16, 2);
+	radix_sort(b, tmp, len[1], shifts16, 2);
+
+	// merge join on the 16 bits, compacting both lists in place
+	for (i = j = n0 = n1 = 0; i < len[0] && j < len[1]; ) {
+		uint64_t k = STATE16(a[i]);
+		if (k < STATE16(b[j])) {
+			i++;
+		} else if (k > STATE16(b[j])) {
+			j++;
+		} else {
+			while (i < len[0] && STATE16(a[i]) == k) a[n0++] = a[i++];
+			while (j < len[1] && STATE16(b[j]) == k) b[n1++] = b[j++];
+		}
+	}
+	lfsr_rollback_word_batch(sl[0], n0, in[0], 0);
+	lfsr_rollback_word_batch(sl[1], n1, in[1], 0);
+
+	// a rolled back state is 24 bits of odd and even, the key in another order
+	for (i = 0; i < n0; i++) a[i] = (uint64_t)sl[0][i].even << 24 | sl[0][i].odd;
+	for (i = 0; i < n1; i++) b[i] = (uint64_t)sl[1][i].even << 24 | sl[1][i].odd;
+	radix_sort(a, tmp, n0, shifts48, 6);
+	radix_sort(b, tmp, n1, shifts48, 6);
+	free(tmp);
+
+	for (i = j = n = 0; i < n0 && j < n1; ) {
+		if (a[i] < b[j]) {
+			i++;
+		} else if (a[i] > b[j]) {
+			j++;
+		} else {
+			a[n++] = a[i++];
+			j++;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		uint64_t x = a[i];
+		sl[0][i].odd = x & 0xffffff;
+		sl[0][i].even = x >> 24;
+	}
+	return n;
+}
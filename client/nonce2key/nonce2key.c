@@ -14,6 +14,7 @@
 #include <inttypes.h>
 #define llx PRIx64
 
+#include <pthread.h>
 #include "nonce2key.h"
 #include "mifarehost.h"
 #include "ui.h"
@@ -28,25 +29,138 @@ int compar_state(const void * a, const void * b) {
 	else return -1;
 }
 
+// The key candidates of the cards attacked before, kept between runs of
+// 'hf mf mifare'. Without parities one round of the attack leaves tens of
+// thousands of keys, every further round of the same card narrows them down.
+#define KEYLIST_CARDS	8
+#define KEYLIST_ROUNDS	32
+
+typedef struct {
+	uint32_t nt, nr;
+	uint64_t par_info, ks_info;
+} darksideRound;
+
+typedef struct {
+	uint32_t uid;
+	int64_t *keys;		// sorted like compar_state does, no duplicates
+	uint32_t count;
+	int special;		// rounds without parities in keys
+	darksideRound round[KEYLIST_ROUNDS];	// done before, all keys of them failed
+	int rounds;
+	uint32_t used;
+} keylistCache;
+
+static keylistCache keylists[KEYLIST_CARDS];
+static uint32_t keylists_clock;
+static pthread_mutex_t keylists_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the entry of the card, a new one in place of the card not seen for longest
+static keylistCache *keylistFor(uint32_t uid)
+{
+	keylistCache *c = &keylists[0];
+
+	for (int i = 0; i < KEYLIST_CARDS; i++) {
+		if (keylists[i].used && keylists[i].uid == uid) {
+			c = &keylists[i];
+			c->used = ++keylists_clock;
+			return c;
+		}
+		if (keylists[i].used < c->used) c = &keylists[i];
+	}
+	free(c->keys);
+	memset(c, 0, sizeof(*c));
+	c->uid = uid;
+	c->used = ++keylists_clock;
+	return c;
+}
+
+static void keylistForget(keylistCache *c)
+{
+	free(c->keys);
+	memset(c, 0, sizeof(*c));
+}
+
+static bool roundSeen(keylistCache *c, darksideRound *r)
+{
+	for (int i = 0; i < c->rounds && i < KEYLIST_ROUNDS; i++)
+		if (!memcmp(&c->round[i], r, sizeof(*r))) return true;
+	return false;
+}
+
+// the keys in both lists, into a; both sorted the same way
+static uint32_t intersectKeys(int64_t *a, uint32_t na, const int64_t *b, uint32_t nb)
+{
+	uint32_t i = 0, j = 0, n = 0;
+
+	while (i < na && j < nb) {
+		int c = compar_state(a + i, b + j);
+		if (c == 0) {
+			a[n++] = a[i++];
+			j++;
+		} else if (c < 0) {
+			i++;
+		} else {
+			j++;
+		}
+	}
+	return n;
+}
+
+// all keys the common prefix attack leaves, sorted, no duplicates
+static int recoverKeys(uint32_t uid, uint32_t nt, uint32_t nr, byte_t ks3x[8], byte_t par[8][8], bool no_par, int64_t **keys)
+{
+	struct Crypto1State *state;
+	uint64_t key_recovered;
+	uint32_t i, n = 0, key_count;
+	int64_t *state_s;
+
+	state = lfsr_common_prefix(nr, 0, ks3x, par, no_par);
+	if (!state) return -1;
+	state_s = (int64_t*)state;
+
+	for (key_count = 0; (state + key_count)->odd != -1; key_count++);
+	lfsr_rollback_word_batch(state, key_count, uid^nt, 0);
+	for (i = 0; i < key_count; i++) {
+		crypto1_get_lfsr(state + i, &key_recovered);
+		*(state_s + i) = key_recovered;
+	}
+	qsort(state_s, key_count, sizeof(*state_s), compar_state);
+	for (i = 0; i < key_count; i++)
+		if (n == 0 || state_s[i] != state_s[n - 1]) state_s[n++] = state_s[i];
+	*keys = state_s;
+	return n;
+}
+
+// Tests the candidates on the card, as many per CMD_MIFARE_CHKKEYS as fit
+static int checkKeys(int64_t *keys, uint32_t count, uint64_t *key)
+{
+	uint8_t keyBlock[MIFARE_CHKKEYS_MAX * 6];
+	uint64_t key64;
+	uint32_t i, n;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i < MIFARE_CHKKEYS_MAX ? count - i : MIFARE_CHKKEYS_MAX;
+		for (uint32_t j = 0; j < n; j++)
+			num_to_bytes(keys[i + j], 6, keyBlock + j * 6);
+		key64 = 0;
+		if (!mfCheckKeys(0, 0, n, keyBlock, &key64)) {
+			*key = key64;
+			return 0;
+		}
+	}
+	return 1;
+}
+
 int nonce2key(uint32_t uid, uint32_t nt, uint32_t nr, uint64_t par_info, uint64_t ks_info, uint64_t * key) {
-  struct Crypto1State *state;
-  uint32_t i, pos, rr, nr_diff, key_count;//, ks1, ks2;
+  uint32_t i, pos, nr_diff;
   byte_t bt, ks3x[8], par[8][8];
-  uint64_t key_recovered;
-  int64_t *state_s;
-  static uint32_t last_uid;
-  static int64_t *last_keylist;
-  rr = 0;
-  
-  if (last_uid != uid && last_keylist != NULL)
-  {
-	free(last_keylist);
-	last_keylist = NULL;
-  }
-  last_uid = uid;
+  keylistCache *card;
+  int64_t *keys;
+  int key_count, res = 1;
 
   // Reset the last three significant bits of the reader nonce
   nr &= 0xffffff1f;
+  darksideRound round = {nt, nr, par_info, ks_info};
   
   PrintAndLog("\nuid(%08x) nt(%08x) par(%016"llx") ks(%016"llx") nr(%08"llx")\n\n",uid,nt,par_info,ks_info,nr);
 
@@ -70,82 +184,50 @@ int nonce2key(uint32_t uid, uint32_t nt, uint32_t nr, uint64_t par_info, uint64_
     for (pos=0; pos<7; pos++) printf("%01x,", par[i][pos]);
     printf("%01x|\n", par[i][7]);
   }
-  
+
+	// one attack at a time, they share the candidates of the cards
+	pthread_mutex_lock(&keylists_lock);
+	card = keylistFor(uid);
+	if (roundSeen(card, &round)) {
+		PrintAndLog("Same nonces as in an earlier round, its keys were tried already");
+		goto out;
+	}
+
 	if (par_info==0)
 		PrintAndLog("parity is all zero,try special attack!just wait for few more seconds...");
-  
-	state = lfsr_common_prefix(nr, rr, ks3x, par, par_info==0);
-	state_s = (int64_t*)state;
-	
-	//char filename[50] ;
-    //sprintf(filename, "nt_%08x_%d.txt", nt, nr);
-    //printf("name %s\n", filename);
-	//FILE* fp = fopen(filename,"w");
-	for (i = 0; (state) && ((state + i)->odd != -1); i++)
-	{
-		lfsr_rollback_word(state+i, uid^nt, 0);
-		crypto1_get_lfsr(state + i, &key_recovered);
-		*(state_s + i) = key_recovered;
-		//fprintf(fp, "%012llx\n",key_recovered);
-	}
-	//fclose(fp);
-	
-	if(!state)
-		return 1;
-	
-	qsort(state_s, i, sizeof(*state_s), compar_state);
-	*(state_s + i) = -1;
-	
-	//Create the intersection:
-	if (par_info == 0 )
-		if ( last_keylist != NULL)
-		{
-			int64_t *p1, *p2, *p3;
-			p1 = p3 = last_keylist; 
-			p2 = state_s;
-			while ( *p1 != -1 && *p2 != -1 ) {
-				if (compar_state(p1, p2) == 0) {
-					printf("p1:%"llx" p2:%"llx" p3:%"llx" key:%012"llx"\n",(uint64_t)(p1-last_keylist),(uint64_t)(p2-state_s),(uint64_t)(p3-last_keylist),*p1);
-					*p3++ = *p1++;
-					p2++;
-				}
-				else {
-					while (compar_state(p1, p2) == -1) ++p1;
-					while (compar_state(p1, p2) == 1) ++p2;
-				}
-			}
-			key_count = p3 - last_keylist;;
-		}
-		else
-			key_count = 0;
-	else
-	{
-		last_keylist = state_s;
-		key_count = i;
-	}
-	
-	printf("key_count:%d\n", key_count);
 
-	// The list may still contain several key candidates. Test each of them with mfCheckKeys
-	for (i = 0; i < key_count; i++) {
-		uint8_t keyBlock[6];
-		uint64_t key64;
-		key64 = *(last_keylist + i);
-		num_to_bytes(key64, 6, keyBlock);
-		key64 = 0;
-		if (!mfCheckKeys(0, 0, 1, keyBlock, &key64)) {
-			*key = key64;
-			free(last_keylist);
-			last_keylist = NULL;
-			if (par_info ==0)
-				free(state);
-			return 0;
+	key_count = recoverKeys(uid, nt, nr, ks3x, par, par_info==0, &keys);
+	if (key_count < 0)
+		goto out;
+	card->round[card->rounds++ % KEYLIST_ROUNDS] = round;
+
+	if (par_info == 0) {
+		// every round has the key in its candidates, it is in the intersection of all of them
+		uint32_t n = card->keys ? intersectKeys(card->keys, card->count, keys, key_count) : 0;
+		if (n != 0) {
+			free(keys);
+			card->count = n;
+		} else {
+			if (card->keys != NULL) PrintAndLog("No key in common with the earlier rounds, starting over");
+			free(card->keys);
+			card->keys = keys;
+			card->count = key_count;
+			card->special = 0;
 		}
-	}	
+		card->special++;
+		printf("key_count:%d after %d rounds\n", card->count, card->special);
+		// the first round alone leaves far too many to test
+		if (card->special > 1)
+			res = checkKeys(card->keys, card->count, key);
+	} else {
+		printf("key_count:%d\n", key_count);
+		res = checkKeys(keys, key_count, key);
+		free(keys);
+	}
 
-	
-	free(last_keylist);
-	last_keylist = state_s;
-	
-	return 1;
+	if (res == 0)
+		keylistForget(card);
+out:
+	pthread_mutex_unlock(&keylists_lock);
+	return res;
 }
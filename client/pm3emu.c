@@ -0,0 +1,154 @@
+//-----------------------------------------------------------------------------
+// This code is licensed to you under the terms of the GNU GPL, version 2 or,
+// at your option, any later version. See the LICENSE.txt file for the text of
+// the license.
+//-----------------------------------------------------------------------------
+// Standalone device emulator, serves devemu on a pty or a TCP port
+//-----------------------------------------------------------------------------
+
+#define _XOPEN_SOURCE 600
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "devemu.h"
+
+#ifndef _WIN32
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "sleep.h"
+
+struct connection {
+  int fd;
+  devemu *emu;
+  volatile bool run;
+};
+
+// host -> emulator
+static void *reader(void *arg) {
+  struct connection *conn = arg;
+  uint8_t buf[4096];
+
+  while (conn->run) {
+    ssize_t n = read(conn->fd, buf, sizeof(buf));
+    if (n > 0) {
+      devemu_write(conn->emu, buf, n);
+    } else if (n == 0 || errno != EINTR) {
+      // a pty reports EIO while no client has it open
+      if (n < 0 && errno == EIO) {
+        msleep(100);
+        continue;
+      }
+      conn->run = false;
+    }
+  }
+  return NULL;
+}
+
+// emulator -> host, until the connection goes away
+static void serve(int fd, const char *script) {
+  struct connection conn = { fd, devemu_open(script), true };
+  pthread_t reader_thread;
+  uint8_t buf[4096];
+
+  if (conn.emu == NULL) {
+    fprintf(stderr, "Cannot start the emulator\n");
+    exit(1);
+  }
+  pthread_create(&reader_thread, NULL, &reader, &conn);
+  while (conn.run) {
+    size_t n = devemu_read(conn.emu, buf, sizeof(buf), 100);
+    for (size_t pos = 0; pos < n && conn.run; ) {
+      ssize_t res = write(fd, buf + pos, n - pos);
+      if (res > 0) {
+        pos += res;
+      } else if (errno != EINTR && errno != EAGAIN) {
+        conn.run = false;
+      }
+    }
+  }
+  shutdown(fd, SHUT_RDWR);
+  pthread_join(reader_thread, NULL);
+  devemu_close(conn.emu);
+}
+
+static int serve_pty(const char *script) {
+  struct termios ti;
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+  if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+    perror("pty");
+    return 1;
+  }
+  tcgetattr(fd, &ti);
+  cfmakeraw(&ti);
+  tcsetattr(fd, TCSANOW, &ti);
+  printf("Emulated device on %s\n", ptsname(fd));
+  fflush(stdout);
+  serve(fd, script);
+  return 0;
+}
+
+static int serve_tcp(int port, const char *script) {
+  struct sockaddr_in addr;
+  int one = 1;
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (s < 0 || bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 1) != 0) {
+    perror("tcp");
+    return 1;
+  }
+  printf("Emulated device on tcp port %d\n", port);
+  fflush(stdout);
+  for (;;) {
+    int fd = accept(s, NULL, NULL);
+    if (fd < 0) continue;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // every connection gets a freshly started device
+    serve(fd, script);
+    close(fd);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  const char *script = NULL;
+  int port = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:p:h")) != -1) {
+    switch (opt) {
+      case 's': script = optarg; break;
+      case 'p': port = atoi(optarg); break;
+      default:
+        printf("syntax: %s [-s <script>] [-p <tcp port>]\n\n", argv[0]);
+        printf("\tEmulates a Proxmark3 on a pty, or on a TCP port with -p.\n");
+        printf("\tConnect with 'proxmark3 <pty>' or 'proxmark3 tcp:<host>:<port>'.\n");
+        printf("\tSee devemu.h for the script syntax.\n");
+        return 1;
+    }
+  }
+  return port ? serve_tcp(port, script) : serve_pty(script);
+}
+
+#else
+
+int main(int argc, char **argv) {
+  fprintf(stderr, "%s: not supported on Windows\n", argv[0]);
+  return 1;
+}
+
+#endif
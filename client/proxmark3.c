@@ -25,44 +25,166 @@
 #include "sleep.h"
 #include "cmdparser.h"
 #include "cmdmain.h"
+#include "crc16.h"
+#include "data.h"
+#include "util.h"
+#include "devemu.h"
 
 // a global mutex to prevent interlaced printing from different threads
 pthread_mutex_t print_lock;
 
-static serial_port sp;
-static UsbCommand txcmd;
-volatile static bool txcmd_pending = false;
+// Outgoing commands are queued per device by any thread (console, Lua,
+// workers) and drained by the device's uart_sender thread, so producers
+// never spin.
+#define TX_BUFFER_SIZE 64
+#define TX_TIMEOUT_MS 5000
 
-void SendCommand(UsbCommand *c) {
+// Bytes from the device land in a ring and are parsed where they are.
+// Only a frame that wraps around the end is put together in rx_frame first.
+#define RX_RING_SIZE 0x10000  // must be a power of two
+#define RX_MAX_FRAME MAX(sizeof(UsbCommand), sizeof(UsbFrameHeader) + USB_CMD_DATA_SIZE)
+
+typedef struct {
+  int index;
+  char name[128];
+  char log_prefix[8];   // "[n] ", used while more than one device is open
+  serial_port sp;
+  UsbCommand txBuffer[TX_BUFFER_SIZE];
+  size_t tx_head;   // next free slot
+  size_t tx_count;  // number of queued commands
+  pthread_mutex_t txBufferMutex;
+  pthread_cond_t txBufferSig;    // queue not empty
+  pthread_cond_t txBufferSpace;  // queue not full
+  bool tx_run;
+  commstats_t txstats;
+  byte_t rx_ring[RX_RING_SIZE];
+  size_t rx_head;  // total bytes received
+  size_t rx_tail;  // total bytes parsed
+  byte_t rx_frame[RX_MAX_FRAME];
+  volatile bool rx_run;
+  pthread_t reader_thread;
+  pthread_t sender_thread;
+} pm3_device;
+
+// Devices are only ever added while running, so a device pointer stays
+// valid until CloseDevices() at the very end.
+static pthread_mutex_t devicesMutex = PTHREAD_MUTEX_INITIALIZER;
+static pm3_device *devices[MAX_DEVICES];
+static volatile int device_count;
+static volatile int selected_device;
+static __thread int thread_device = -1;
+
+int CurrentDevice(void) {
+  return (thread_device >= 0) ? thread_device : selected_device;
+}
+
+// NULL when offline
+static pm3_device *currentDevice(void) {
+  int dev = CurrentDevice();
+  return (dev < device_count) ? devices[dev] : NULL;
+}
+
+int GetDeviceCount(void) {
+  return device_count;
+}
+
+const char *GetDeviceName(int dev) {
+  return (dev >= 0 && dev < device_count) ? devices[dev]->name : NULL;
+}
+
+/**
+ * @brief Makes dev the device the console talks to. Threads bound to a
+ * device with SetThreadDevice() are not affected.
+ * @return false if there is no such device
+ */
+bool SelectDevice(int dev) {
+  if (dev < 0 || dev >= device_count) return false;
+  selected_device = dev;
+  return true;
+}
+
+/**
+ * @brief Binds the calling thread to a device, -1 makes it follow the
+ * console's selection again.
+ * @return the previous binding, to restore it later
+ */
+int SetThreadDevice(int dev) {
+  int prev = thread_device;
+  thread_device = dev;
+  return prev;
+}
+
+uint32_t SendCommandTagged(UsbCommand *c) {
 #if 0
   printf("Sending %d bytes\n", sizeof(UsbCommand));
 #endif
-/*
-  if (txcmd_pending) {
-    ERR("Sending command failed, previous command is still pending");
-  }
-*/
-  if(offline)
+  pm3_device *dev = currentDevice();
+  if(offline || dev == NULL)
     {
       PrintAndLog("Sending bytes to proxmark failed - offline");
-      return;
+      return 0;
+    }
+
+  uint32_t tag = NoteCommandSent(c);
+
+  pthread_mutex_lock(&dev->txBufferMutex);
+  if (dev->tx_count == TX_BUFFER_SIZE) {
+    // Block until the sender thread made room, but don't hang forever
+    // when the pm3 unit is unresponsive or disconnected.
+    struct timespec ts;
+    deadline(&ts, TX_TIMEOUT_MS);
+    dev->txstats.full_waits++;
+    while (dev->tx_count == TX_BUFFER_SIZE && dev->tx_run) {
+      if (pthread_cond_timedwait(&dev->txBufferSpace, &dev->txBufferMutex, &ts) != 0) break;
+    }
+    if (dev->tx_count == TX_BUFFER_SIZE || !dev->tx_run) {
+      dev->txstats.dropped++;
+      pthread_mutex_unlock(&dev->txBufferMutex);
+      PrintAndLog("Sending bytes to proxmark failed - send queue full");
+      return 0;
     }
-  /**
-	The while-loop below causes hangups at times, when the pm3 unit is unresponsive
-	or disconnected. The main console thread is alive, but comm thread just spins here.
-	Not good.../holiman
-	**/
-  while(txcmd_pending);
-  txcmd = *c;
-  txcmd_pending = true;
+  }
+  dev->txBuffer[dev->tx_head] = *c;
+  if (TaggedCommandsSupported()) {
+    dev->txBuffer[dev->tx_head].cmd = USB_CMD_ID(c->cmd) | ((uint64_t)tag << USB_CMD_TAG_SHIFT);
+  }
+  dev->tx_head = (dev->tx_head + 1) % TX_BUFFER_SIZE;
+  dev->tx_count++;
+  dev->txstats.queued++;
+  if (dev->tx_count > dev->txstats.max_depth) dev->txstats.max_depth = dev->tx_count;
+  if (dev->txstats.first_us == 0) dev->txstats.first_us = usclock();
+  pthread_cond_signal(&dev->txBufferSig);
+  pthread_mutex_unlock(&dev->txBufferMutex);
+  return tag;
 }
 
-struct receiver_arg {
-  int run;
-};
+void SendCommand(UsbCommand *c) {
+  SendCommandTagged(c);
+}
+
+void GetCommStats(commstats_t *stats) {
+  pm3_device *dev = currentDevice();
+  memset(stats, 0, sizeof(commstats_t));
+  if (dev != NULL) {
+    pthread_mutex_lock(&dev->txBufferMutex);
+    *stats = dev->txstats;
+    stats->depth = dev->tx_count;
+    pthread_mutex_unlock(&dev->txBufferMutex);
+  }
+  GetResponseStats(stats);
+}
+
+void ResetCommStats(void) {
+  pm3_device *dev = currentDevice();
+  if (dev != NULL) {
+    pthread_mutex_lock(&dev->txBufferMutex);
+    memset(&dev->txstats, 0, sizeof(dev->txstats));
+    pthread_mutex_unlock(&dev->txBufferMutex);
+  }
+  ResetResponseStats();
+}
 
 struct main_loop_arg {
-  int usb_present;
   char *script_cmds_file;
 };
 
@@ -81,34 +203,132 @@ struct main_loop_arg {
 //  return NULL;
 //}
 
-byte_t rx[0x1000000];
-byte_t* prx = rx;
+/**
+ * @brief parseFrame decodes the frame at the start of buf, which is either a
+ * full UsbCommand or a compact frame (see UsbFrameHeader).
+ * @param cmd receives the decoded command, unused data bytes are zeroed
+ * @param valid set to false if a compact frame failed its CRC check
+ * @return the number of bytes the frame occupies, 0 if it is incomplete
+ */
+static size_t parseFrame(byte_t *buf, size_t len, UsbCommand *cmd, bool *valid) {
+  UsbFrameHeader hdr;
+
+  *valid = true;
+  if (len < sizeof(uint32_t)) return 0;
+  memcpy(&hdr.magic, buf, sizeof(uint32_t));
+  if (hdr.magic != USB_FRAME_MAGIC) {
+    if (len < sizeof(UsbCommand)) return 0;
+    memcpy(cmd, buf, sizeof(UsbCommand));
+    return sizeof(UsbCommand);
+  }
+
+  if (len < sizeof(UsbFrameHeader)) return 0;
+  memcpy(&hdr, buf, sizeof(UsbFrameHeader));
+  if (hdr.length > USB_CMD_DATA_SIZE) {
+    // garbage, skip the magic and resynchronize on the next frame
+    *valid = false;
+    return sizeof(uint32_t);
+  }
+  if (len < sizeof(UsbFrameHeader) + hdr.length) return 0;
+
+  uint16_t crc = hdr.crc;
+  ((UsbFrameHeader*)buf)->crc = 0;
+  if (update_crc16_buffer(USB_FRAME_CRC_INIT, buf, sizeof(UsbFrameHeader) + hdr.length) != crc) {
+    *valid = false;
+  }
+  cmd->cmd = hdr.cmd;
+  memcpy(cmd->arg, hdr.arg, sizeof(cmd->arg));
+  memcpy(cmd->d.asBytes, buf + sizeof(UsbFrameHeader), hdr.length);
+  memset(cmd->d.asBytes + hdr.length, 0, USB_CMD_DATA_SIZE - hdr.length);
+  return sizeof(UsbFrameHeader) + hdr.length;
+}
+
+/**
+ * @brief Dispatches everything complete in the device's receive ring. Each
+ * frame is decoded straight into a response entry that UsbCommandReceived()
+ * takes over, a trailing partial frame stays in the ring for the next read.
+ */
+static void parseReceived(pm3_device *dev) {
+  UsbCommand *rxcmd = NULL;
+  bool valid;
+
+  while (dev->rx_tail != dev->rx_head) {
+    size_t avail = dev->rx_head - dev->rx_tail;
+    byte_t *p = dev->rx_ring + (dev->rx_tail & (RX_RING_SIZE - 1));
+    size_t contiguous = MIN(avail, RX_RING_SIZE - (dev->rx_tail & (RX_RING_SIZE - 1)));
+
+    // raw data of a bulk transfer isn't framed
+    size_t bulk = BulkBytesExpected();
+    if (bulk) {
+      bulk = MIN(bulk, contiguous);
+      BulkDataReceived(p, bulk);
+      pthread_mutex_lock(&dev->txBufferMutex);
+      dev->txstats.rx_bytes += bulk;
+      dev->txstats.rx_bulk_bytes += bulk;
+      pthread_mutex_unlock(&dev->txBufferMutex);
+      dev->rx_tail += bulk;
+      continue;
+    }
+
+    size_t len = contiguous;
+    if (contiguous < MIN(avail, RX_MAX_FRAME)) {
+      // the frame wraps around the end of the ring
+      len = MIN(avail, RX_MAX_FRAME);
+      memcpy(dev->rx_frame, p, contiguous);
+      memcpy(dev->rx_frame + contiguous, dev->rx_ring, len - contiguous);
+      p = dev->rx_frame;
+    }
+
+    if (rxcmd == NULL) rxcmd = AllocResponse();
+    size_t used = parseFrame(p, len, rxcmd, &valid);
+    if (used == 0) break;
+    pthread_mutex_lock(&dev->txBufferMutex);
+    dev->txstats.rx_bytes += used;
+    if (!valid) {
+      dev->txstats.rx_errors++;
+    } else if (used == sizeof(UsbCommand)) {
+      dev->txstats.rx_frames++;
+    } else {
+      dev->txstats.rx_compact_frames++;
+    }
+    pthread_mutex_unlock(&dev->txBufferMutex);
+    dev->rx_tail += used;
+    if (valid) {
+      UsbCommandReceived(rxcmd);
+      rxcmd = NULL;
+    }
+  }
+  if (rxcmd != NULL) ReleaseResponse(rxcmd);
+}
 
 static void *uart_receiver(void *targ) {
-  struct receiver_arg *arg = (struct receiver_arg*)targ;
+  pm3_device *dev = (pm3_device*)targ;
   size_t rxlen;
-  size_t cmd_count;
-  
-  while (arg->run) {
-    rxlen = sizeof(UsbCommand);
-    if (uart_receive(sp,prx,&rxlen)) {
-      prx += rxlen;
-      if (((prx-rx) % sizeof(UsbCommand)) != 0) {
-        continue;
-      }
-      cmd_count = (prx-rx) / sizeof(UsbCommand);
-      //      printf("received %d bytes, which represents %d commands\n",(prx-rx), cmd_count);
-      for (size_t i=0; i<cmd_count; i++) {
-        UsbCommandReceived((UsbCommand*)(rx+(i*sizeof(UsbCommand))));
-      }
+
+  // everything received is dispatched to this device's queues
+  SetThreadDevice(dev->index);
+  while (dev->rx_run) {
+    SetLogPrefix(device_count > 1 ? dev->log_prefix : NULL);
+    // read into the free space up to the end of the ring
+    size_t free = RX_RING_SIZE - (dev->rx_head - dev->rx_tail);
+    rxlen = MIN(free, RX_RING_SIZE - (dev->rx_head & (RX_RING_SIZE - 1)));
+    if (rxlen == 0) {
+      // can't happen unless a single frame outgrew the ring
+      pthread_mutex_lock(&dev->txBufferMutex);
+      dev->txstats.rx_full++;
+      pthread_mutex_unlock(&dev->txBufferMutex);
+      dev->rx_tail = dev->rx_head;
+      continue;
     }
-    prx = rx;
-    
-    if(txcmd_pending) {
-      if (!uart_send(sp,(byte_t*)&txcmd,sizeof(UsbCommand))) {
-        PrintAndLog("Sending bytes to proxmark failed");
-      }
-      txcmd_pending = false;
+    if (uart_receive(dev->sp, dev->rx_ring + (dev->rx_head & (RX_RING_SIZE - 1)), &rxlen)) {
+      dev->rx_head += rxlen;
+      pthread_mutex_lock(&dev->txBufferMutex);
+      dev->txstats.rx_max_buffered = MAX(dev->txstats.rx_max_buffered, dev->rx_head - dev->rx_tail);
+      pthread_mutex_unlock(&dev->txBufferMutex);
+      parseReceived(dev);
+      pthread_mutex_lock(&dev->txBufferMutex);
+      dev->txstats.rx_buffered = dev->rx_head - dev->rx_tail;
+      pthread_mutex_unlock(&dev->txBufferMutex);
     }
   }
   
@@ -116,17 +336,138 @@ static void *uart_receiver(void *targ) {
   return NULL;
 }
 
+static void *uart_sender(void *targ) {
+  pm3_device *dev = (pm3_device*)targ;
+  UsbCommand txcmd;
+  uint64_t start;
+
+  SetThreadDevice(dev->index);
+  pthread_mutex_lock(&dev->txBufferMutex);
+  while (true) {
+    while (dev->tx_count == 0 && dev->tx_run) {
+      pthread_cond_wait(&dev->txBufferSig, &dev->txBufferMutex);
+    }
+    if (dev->tx_count == 0) break;
+
+    txcmd = dev->txBuffer[(dev->tx_head + TX_BUFFER_SIZE - dev->tx_count) % TX_BUFFER_SIZE];
+    dev->tx_count--;
+    pthread_cond_signal(&dev->txBufferSpace);
+    pthread_mutex_unlock(&dev->txBufferMutex);
+
+    start = usclock();
+    bool sent = uart_send(dev->sp,(byte_t*)&txcmd,sizeof(UsbCommand));
+    if (!sent) {
+      SetLogPrefix(device_count > 1 ? dev->log_prefix : NULL);
+      PrintAndLog("Sending bytes to proxmark failed");
+    }
+
+    pthread_mutex_lock(&dev->txBufferMutex);
+    if (sent) {
+      dev->txstats.sent++;
+      dev->txstats.bytes += sizeof(UsbCommand);
+      dev->txstats.busy_us += usclock() - start;
+      dev->txstats.last_us = usclock();
+    } else {
+      dev->txstats.errors++;
+    }
+  }
+  pthread_mutex_unlock(&dev->txBufferMutex);
+
+  pthread_exit(NULL);
+  return NULL;
+}
+
+/**
+ * @brief Connects to another device, starts its receiver and sender threads
+ * and asks it what it supports.
+ * @param port anything uart_open() understands
+ * @return the new device's number, -1 if it couldn't be opened
+ */
+int OpenDevice(const char *port) {
+  pthread_mutex_lock(&devicesMutex);
+  if (device_count == MAX_DEVICES) {
+    pthread_mutex_unlock(&devicesMutex);
+    printf("ERROR: no more than %d devices can be connected\n", MAX_DEVICES);
+    return -1;
+  }
+  serial_port sp = uart_open(port);
+  if (sp == INVALID_SERIAL_PORT) {
+    pthread_mutex_unlock(&devicesMutex);
+    printf("ERROR: invalid serial port %s\n", port);
+    return -1;
+  } else if (sp == CLAIMED_SERIAL_PORT) {
+    pthread_mutex_unlock(&devicesMutex);
+    printf("ERROR: serial port %s is claimed by another process\n", port);
+    return -1;
+  }
+
+  pm3_device *dev = calloc(1, sizeof(pm3_device));
+  if (dev == NULL) {
+    pthread_mutex_unlock(&devicesMutex);
+    uart_close(sp);
+    printf("ERROR: cannot allocate memory for device %s\n", port);
+    return -1;
+  }
+  dev->index = device_count;
+  snprintf(dev->name, sizeof(dev->name), "%s", port);
+  snprintf(dev->log_prefix, sizeof(dev->log_prefix), "[%d] ", dev->index);
+  dev->sp = sp;
+  pthread_mutex_init(&dev->txBufferMutex, NULL);
+  pthread_cond_init(&dev->txBufferSig, NULL);
+  pthread_cond_init(&dev->txBufferSpace, NULL);
+  dev->tx_run = true;
+  dev->rx_run = true;
+  devices[dev->index] = dev;
+  device_count++;
+  offline = 0;
+  pthread_mutex_unlock(&devicesMutex);
+
+  pthread_create(&dev->reader_thread, NULL, &uart_receiver, dev);
+  pthread_create(&dev->sender_thread, NULL, &uart_sender, dev);
+
+  int prev = SetThreadDevice(dev->index);
+  CheckDeviceCapabilities();
+  SetThreadDevice(prev);
+  return dev->index;
+}
+
+// An older client connecting after us wouldn't understand compact frames
+static void restoreFrameFormat(pm3_device *dev) {
+  int prev = SetThreadDevice(dev->index);
+  if (GetFrameFormat() != USB_FRAME_FORMAT_LEGACY) {
+    UsbCommand c = {CMD_SET_FRAME_FORMAT, {USB_FRAME_FORMAT_LEGACY, 0, 0}};
+    uart_send(dev->sp,(byte_t*)&c,sizeof(UsbCommand));
+  }
+  SetThreadDevice(prev);
+}
+
+/**
+ * @brief Stops the threads of all devices, once the sender flushed whatever
+ * is still queued, and closes their ports.
+ */
+void CloseDevices(void) {
+  for (int i = 0; i < device_count; i++) {
+    pm3_device *dev = devices[i];
+    if (dev->sp == NULL) continue;
+    dev->rx_run = false;
+    // exit() may be called from one of the device's own threads; joining
+    // it fails right away then, which is fine as it does no more I/O
+    pthread_join(dev->reader_thread, NULL);
+    pthread_mutex_lock(&dev->txBufferMutex);
+    dev->tx_run = false;
+    pthread_cond_broadcast(&dev->txBufferSig);
+    pthread_cond_broadcast(&dev->txBufferSpace);
+    pthread_mutex_unlock(&dev->txBufferMutex);
+    pthread_join(dev->sender_thread, NULL);
+    restoreFrameFormat(dev);
+    uart_close(dev->sp);
+    dev->sp = NULL;
+  }
+}
+
 static void *main_loop(void *targ) {
   struct main_loop_arg *arg = (struct main_loop_arg*)targ;
-  struct receiver_arg rarg;
   char *cmd = NULL;
-  pthread_t reader_thread;
-  
-  if (arg->usb_present == 1) {
-    rarg.run=1;
-    // pthread_create(&reader_thread, NULL, &usb_receiver, &rarg);
-    pthread_create(&reader_thread, NULL, &uart_receiver, &rarg);
-  }
   
   FILE *script_file = NULL;
   char script_cmd_buf[256];
@@ -195,10 +536,7 @@ static void *main_loop(void *targ) {
   
 	write_history(".history");
   
-  if (arg->usb_present == 1) {
-    rarg.run = 0;
-    pthread_join(reader_thread, NULL);
-  }
+  CloseDevices();
   
   if (script_file)
   {
@@ -233,8 +571,9 @@ int main(int argc, char* argv[]) {
 	srand(time(0));
   
 	if (argc < 2) {
-		printf("syntax: %s <port>\n\n",argv[0]);
+		printf("syntax: %s <port>[,<port>...]\n\n",argv[0]);
 		printf("\tLinux example:'%s /dev/ttyACM0'\n\n", argv[0]);
+		printf("\tSeveral devices:'%s /dev/ttyACM0,/dev/ttyACM1', see 'dev help'\n\n", argv[0]);
 		printf("help:   %s -h\n\n", argv[0]);
 		printf("\tDump all interactive help at once\n");
 		printf("markdown:   %s -m\n\n", argv[0]);
@@ -242,7 +581,7 @@ int main(int argc, char* argv[]) {
 		return 1;
 	}
 	if (strcmp(argv[1], "-h") == 0) {
-		printf("syntax: %s <port>\n\n",argv[0]);
+		printf("syntax: %s <port>[,<port>...]\n\n",argv[0]);
 		printf("\tLinux example:'%s /dev/ttyACM0'\n\n", argv[0]);
 		dumpAllHelp(0);
 		return 0;
@@ -253,11 +592,13 @@ int main(int argc, char* argv[]) {
 	}
 	// Make sure to initialize
 	struct main_loop_arg marg = {
-		.usb_present = 0,
 		.script_cmds_file = NULL
 	};
 	pthread_t main_loop_t;
 
+	// create a mutex to avoid interlacing print commands from our different threads
+	pthread_mutex_init(&print_lock, NULL);
+
 /*
   usb_init();
   if (!OpenProxmark(1)) {
@@ -270,19 +611,18 @@ int main(int argc, char* argv[]) {
   }
 */
   
-	sp = uart_open(argv[1]);
-	if (sp == INVALID_SERIAL_PORT) {
-		printf("ERROR: invalid serial port\n");
-		marg.usb_present = 0;
-		offline = 1;
-	} else if (sp == CLAIMED_SERIAL_PORT) {
-		printf("ERROR: serial port is claimed by another process\n");
-		marg.usb_present = 0;
-		offline = 1;
-	} else {
-		marg.usb_present = 1;
-		offline = 0;
+	// one or more ports, separated by commas
+	offline = 1;
+	uart_set_emulator(&devemu_uart);
+	char *ports = malloc(strlen(argv[1]) + 1);
+	strcpy(ports, argv[1]);
+	for (char *port = strtok(ports, ","); port != NULL; port = strtok(NULL, ",")) {
+		OpenDevice(port);
 	}
+	free(ports);
+	// on exit() without CloseDevices(), e.g. after 'quit'; the sender must
+	// be done before the frame format is restored
+	atexit(CloseDevices);
 
 	// If the user passed the filename of the 'script' to execute, get it
 	if (argc > 2 && argv[2]) {
@@ -299,9 +639,6 @@ int main(int argc, char* argv[]) {
 		marg.script_cmds_file = argv[2];
 	}
 
-	// create a mutex to avoid interlacing print commands from our different threads
-	pthread_mutex_init(&print_lock, NULL);
-
 	pthread_create(&main_loop_t, NULL, &main_loop, &marg);
 	InitGraphics(argc, argv);
 
@@ -313,9 +650,6 @@ int main(int argc, char* argv[]) {
 //    CloseProxmark();
 //  }
 
-	// Clean up the port
-	uart_close(sp);
-  
 	// clean up mutex
 	pthread_mutex_destroy(&print_lock);
   
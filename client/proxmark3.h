@@ -14,6 +14,8 @@
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
+#include <stddef.h>
+#include <stdbool.h>
 #define llx PRIx64
 #define lli PRIi64
 #define hhu PRIu8
@@ -22,6 +24,52 @@
 
 #define PROXPROMPT "proxmark3> "
 
+// statistics of the communication with the device, see 'hw stats'
+typedef struct {
+  uint64_t queued;     // commands accepted by SendCommand()
+  uint64_t sent;       // commands written to the port
+  uint64_t bytes;      // bytes written to the port
+  uint64_t errors;     // failed writes
+  uint64_t dropped;    // commands rejected because the queue stayed full
+  uint64_t full_waits; // times a producer had to wait for room
+  uint64_t busy_us;    // time spent writing to the port
+  uint64_t first_us;   // usclock() of the first queued command
+  uint64_t last_us;    // usclock() of the last completed write
+  size_t depth;        // commands currently queued
+  size_t max_depth;    // high-water mark of the queue
+  uint64_t rx_bytes;          // bytes received
+  uint64_t rx_frames;         // full UsbCommand frames received
+  uint64_t rx_compact_frames; // compact frames received
+  uint64_t rx_bulk_bytes;     // raw bytes received in bulk transfers
+  uint64_t rx_errors;         // compact frames dropped because of a bad CRC
+  size_t rx_buffered;         // received bytes not parsed yet
+  size_t rx_max_buffered;     // high-water mark of the receive ring
+  uint64_t rx_full;           // reads that found the receive ring full
+  uint64_t resp_queued;       // responses stored for WaitForResponse()
+  size_t resp_depth;          // responses currently waiting to be taken
+  size_t resp_max_depth;      // high-water mark of the response queue
+  uint64_t resp_full_waits;   // times the receiver waited for the queue to drain
+  uint64_t resp_overflows;    // oldest responses dropped because the queue stayed full
+} commstats_t;
+
+// Several devices can be connected at once, each with its own port, send
+// queue, receive ring and response queue. Devices are numbered in the order
+// they were opened. Everything that talks to "the" device acts on
+// CurrentDevice(): the thread's own device if it is bound to one (receiver
+// threads, 'dev' workers), otherwise the one selected on the console.
+#define MAX_DEVICES 8
+
+int OpenDevice(const char *port);
+void CloseDevices(void);
+int GetDeviceCount(void);
+const char *GetDeviceName(int dev);
+int CurrentDevice(void);
+bool SelectDevice(int dev);
+int SetThreadDevice(int dev);
+
 void SendCommand(UsbCommand *c);
+uint32_t SendCommandTagged(UsbCommand *c);
+void GetCommStats(commstats_t *stats);
+void ResetCommStats(void);
 
 #endif
@@ -16,7 +16,9 @@
 #include "cmdmain.h"
 #include "scripting.h"
 #include "util.h"
+#include "sleep.h"
 #include "nonce2key/nonce2key.h"
+#include "mfkeystore.h"
 #include "../common/iso15693tools.h"
 /**
  * The following params expected:
@@ -118,6 +120,248 @@ static int returnToLuaWithError(lua_State *L, const char* fmt, ...)
     return 2;
 }
 
+// A command sent with core.SendAsync(). Its response is picked up with
+// future:wait() or future:poll(), from the device the command went to.
+// The tags of at most 64 commands are tracked, see PENDING_TAGS, so don't
+// keep more futures than that waiting.
+#define FUTURE_METATABLE "pm3.future"
+typedef struct {
+    uint32_t tag;
+    uint32_t resp_cmd;
+    int device;
+    bool done;
+} lua_future;
+
+// core.SendBatch() keeps this many commands in flight
+#define BATCH_WINDOW 32
+#define BATCH_TIMEOUT_MS 2500
+
+// Pushes a response as a string and gives the entry back, nil if there is none
+static void pushResponse(lua_State *L, const UsbCommand *resp)
+{
+    if (resp == NULL) {
+        lua_pushnil(L);
+        return;
+    }
+    lua_pushlstring(L, (const char *)resp, sizeof(UsbCommand));
+    ReleaseResponse(resp);
+}
+
+static bool isUsbCommand(lua_State *L, int index)
+{
+    size_t size;
+    return lua_type(L, index) == LUA_TSTRING && lua_tolstring(L, index, &size) && size == sizeof(UsbCommand);
+}
+
+/**
+ * @brief Sends a command without waiting for its response, so the script can
+ * do other work meanwhile. The following params expected:
+ *  UsbCommand c
+ *  uint32_t response command, CMD_ACK if omitted
+ * @param L
+ * @return a future, or nil and an error message
+ */
+static int l_SendAsync(lua_State *L)
+{
+    UsbCommand c;
+
+    luaL_argcheck(L, isUsbCommand(L, 1), 1, "UsbCommand expected");
+    memcpy(&c, lua_tostring(L, 1), sizeof(UsbCommand));
+    uint32_t resp_cmd = luaL_optunsigned(L, 2, CMD_ACK);
+
+    uint32_t tag = SendCommandTagged(&c);
+    if (tag == 0) return returnToLuaWithError(L, "Sending the command failed");
+
+    lua_future *f = (lua_future *)lua_newuserdata(L, sizeof(lua_future));
+    f->tag = tag;
+    f->resp_cmd = resp_cmd;
+    f->device = CurrentDevice();
+    f->done = false;
+    luaL_setmetatable(L, FUTURE_METATABLE);
+    return 1;
+}
+
+/**
+ * @brief future:wait([ms_timeout]) waits for the response, for ever if no
+ * timeout is given. A future can only be waited for once.
+ * @param L
+ * @return the response, or nil (and an error message) if there is none
+ */
+static int l_future_wait(lua_State *L)
+{
+    lua_future *f = (lua_future *)luaL_checkudata(L, 1, FUTURE_METATABLE);
+    size_t ms_timeout = luaL_optunsigned(L, 2, -1);
+
+    if (f->done) return returnToLuaWithError(L, "The response was already taken");
+    int prev = SetThreadDevice(f->device);
+    const UsbCommand *resp = WaitForResponseRef(f->resp_cmd, f->tag, ms_timeout);
+    SetThreadDevice(prev);
+    // after a timeout the command isn't in flight any more either
+    f->done = true;
+    pushResponse(L, resp);
+    return 1;
+}
+
+/**
+ * @brief future:poll() takes the response if it has arrived, without waiting.
+ * @param L
+ * @return the response, or nil if it isn't there yet
+ */
+static int l_future_poll(lua_State *L)
+{
+    lua_future *f = (lua_future *)luaL_checkudata(L, 1, FUTURE_METATABLE);
+
+    if (f->done) return returnToLuaWithError(L, "The response was already taken");
+    int prev = SetThreadDevice(f->device);
+    const UsbCommand *resp = PollResponseRef(f->resp_cmd, f->tag);
+    SetThreadDevice(prev);
+    if (resp != NULL) f->done = true;
+    pushResponse(L, resp);
+    return 1;
+}
+
+// A future nobody waited for: its response, now or later, is stale
+static int l_future_gc(lua_State *L)
+{
+    lua_future *f = (lua_future *)luaL_checkudata(L, 1, FUTURE_METATABLE);
+
+    if (!f->done) {
+        int prev = SetThreadDevice(f->device);
+        ReleaseResponse(WaitForResponseRef(f->resp_cmd, f->tag, 0));
+        SetThreadDevice(prev);
+        f->done = true;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sends a list of commands, keeping up to BATCH_WINDOW of them in
+ * flight, and collects their responses in order. The following params expected:
+ *  table of UsbCommand
+ *  uint32_t response command, CMD_ACK if omitted
+ *  function callback(i, response), optional
+ *  size_t ms_timeout per response, BATCH_TIMEOUT_MS if omitted
+ * The callback gets each response (nil if none arrived in time) as soon as
+ * it is in, while the following commands are already on their way, so the
+ * script can work on it without holding up the device. Returning false
+ * from the callback stops sending the remaining commands.
+ * @param L
+ * @return without a callback, a table with the responses (false where none
+ * arrived); the number of responses received
+ */
+static int l_SendBatch(lua_State *L)
+{
+    uint32_t tags[BATCH_WINDOW];
+    size_t sent = 0, answered = 0, i;
+    bool stop = false;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    uint32_t resp_cmd = luaL_optunsigned(L, 2, CMD_ACK);
+    bool callback = !lua_isnoneornil(L, 3);
+    if (callback) luaL_checktype(L, 3, LUA_TFUNCTION);
+    size_t ms_timeout = luaL_optunsigned(L, 4, BATCH_TIMEOUT_MS);
+    size_t n = lua_rawlen(L, 1);
+
+    // check everything before the first command goes out
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        if (!isUsbCommand(L, -1)) return luaL_error(L, "command %d is not a UsbCommand", (int)i);
+        lua_pop(L, 1);
+    }
+    if (!callback) lua_createtable(L, n, 0);
+    int results = lua_gettop(L);
+
+    for (i = 0; i < sent || (!stop && i < n); i++) {
+        // keep the window full
+        while (!stop && sent < n && sent < i + BATCH_WINDOW) {
+            UsbCommand c;
+            lua_rawgeti(L, 1, sent + 1);
+            memcpy(&c, lua_tostring(L, -1), sizeof(UsbCommand));
+            lua_pop(L, 1);
+            tags[sent % BATCH_WINDOW] = SendCommandTagged(&c);
+            sent++;
+        }
+
+        uint32_t tag = tags[i % BATCH_WINDOW];
+        const UsbCommand *resp = tag ? WaitForResponseRef(resp_cmd, tag, ms_timeout) : NULL;
+        if (resp != NULL) answered++;
+        if (!callback) {
+            if (resp != NULL) {
+                pushResponse(L, resp);
+            } else {
+                lua_pushboolean(L, false);
+            }
+            lua_rawseti(L, results, i + 1);
+            continue;
+        }
+
+        lua_pushvalue(L, 3);
+        lua_pushinteger(L, i + 1);
+        pushResponse(L, resp);
+        if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+            // don't leave the commands still in flight behind
+            for (size_t j = i + 1; j < sent; j++) {
+                ReleaseResponse(WaitForResponseRef(resp_cmd, tags[j % BATCH_WINDOW], 0));
+            }
+            return lua_error(L);
+        }
+        if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) stop = true;
+        lua_pop(L, 1);
+    }
+
+    lua_pushinteger(L, answered);
+    return callback ? 1 : 2;
+}
+
+/**
+ * @brief A clock for profiling scripts
+ * @param L
+ * @return seconds, with microsecond resolution, since an arbitrary point in time
+ */
+static int l_clock(lua_State *L)
+{
+    lua_pushnumber(L, usclock() / 1e6);
+    return 1;
+}
+
+/**
+ * @brief The communication statistics of the current device, see 'hw stats'
+ * @param L
+ * @return table of counters, named like the fields of commstats_t
+ */
+static int l_stats(lua_State *L)
+{
+    commstats_t st;
+    GetCommStats(&st);
+
+    lua_newtable(L);
+#define PUSH_STAT(name) lua_pushnumber(L, (lua_Number)st.name); lua_setfield(L, -2, #name)
+    PUSH_STAT(queued);
+    PUSH_STAT(sent);
+    PUSH_STAT(bytes);
+    PUSH_STAT(errors);
+    PUSH_STAT(dropped);
+    PUSH_STAT(busy_us);
+    PUSH_STAT(max_depth);
+    PUSH_STAT(rx_bytes);
+    PUSH_STAT(rx_frames);
+    PUSH_STAT(rx_compact_frames);
+    PUSH_STAT(rx_bulk_bytes);
+    PUSH_STAT(rx_errors);
+    PUSH_STAT(resp_queued);
+    PUSH_STAT(resp_max_depth);
+    PUSH_STAT(resp_overflows);
+#undef PUSH_STAT
+    return 1;
+}
+
+static int l_resetStats(lua_State *L)
+{
+    ResetCommStats();
+    ResetLatencyStats();
+    return 0;
+}
+
 static int l_nonce2key(lua_State *L){
 
     size_t size;
@@ -160,6 +404,52 @@ static int l_nonce2key(lua_State *L){
 
     return 2; //Two return values
 }
+static int getUid(lua_State *L, int arg, uint8_t *uid)
+{
+    const char *s = luaL_checkstring(L, arg);
+    int len = 0;
+    while (len < 10 && isxdigit((unsigned char)s[2 * len]) && isxdigit((unsigned char)s[2 * len + 1])) {
+        sscanf(s + 2 * len, "%2hhx", &uid[len]);
+        len++;
+    }
+    return len;
+}
+
+/**
+ * @brief core.mfKeyStoreGet(uid, sector, keytype) looks up a key found before
+ * on the card with this uid (hex), keytype 0 is key A and 1 key B
+ * @return the key as 12 hex digits, or nil
+ */
+static int l_mfKeyStoreGet(lua_State *L)
+{
+    uint8_t uid[10];
+    uint64_t key;
+    int uidlen = getUid(L, 1, uid);
+    if (uidlen == 0 || mfKeyStoreGet(uid, uidlen, luaL_checkint(L, 2), luaL_checkint(L, 3), &key)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    char hex[13];
+    sprintf(hex, "%012"llx, key);
+    lua_pushstring(L, hex);
+    return 1;
+}
+
+/**
+ * @brief core.mfKeyStorePut(uid, sector, keytype, key, source) remembers a key,
+ * uid and key in hex
+ */
+static int l_mfKeyStorePut(lua_State *L)
+{
+    uint8_t uid[10];
+    int uidlen = getUid(L, 1, uid);
+    uint64_t key = strtoull(luaL_checkstring(L, 4), NULL, 16);
+    if (uidlen == 0) return returnToLuaWithError(L, "Wrong uid");
+    lua_pushboolean(L, mfKeyStorePut(uid, uidlen, luaL_checkint(L, 2), luaL_checkint(L, 3), key,
+                                     luaL_optstring(L, 5, "script")) == 0);
+    return 1;
+}
+
 //static int l_PrintAndLog(lua_State *L){ return CmdHF14AMfDump(luaL_checkstring(L, 1));}
 static int l_clearCommandBuffer(lua_State *L){
     clearCommandBuffer();
@@ -214,6 +504,41 @@ static int l_CmdConsole(lua_State *L)
     return 0;
 }
 
+/**
+ * @brief Lists the connected devices, e.g. "for i, port in pairs(core.devices())"
+ * @param L
+ * @return table of port names indexed by device number, and the current device
+ */
+static int l_devices(lua_State *L)
+{
+    lua_newtable(L);
+    for (int i = 0; i < GetDeviceCount(); i++) {
+        lua_pushstring(L, GetDeviceName(i));
+        lua_rawseti(L, -2, i);
+    }
+    lua_pushinteger(L, CurrentDevice());
+    return 2;
+}
+
+/**
+ * @brief Makes the commands of the script go to another device. This only
+ * binds the script's thread, 'script run' restores the binding afterwards.
+ * @param L
+ * @return true, or nil and an error message if there is no such device
+ */
+static int l_selectDevice(lua_State *L)
+{
+    int dev = luaL_checkint(L, 1);
+    if (dev < 0 || dev >= GetDeviceCount()) {
+        lua_pushnil(L);
+        lua_pushstring(L, "No such device");
+        return 2;
+    }
+    SetThreadDevice(dev);
+    lua_pushboolean(L, true);
+    return 1;
+}
+
 static int l_iso15693_crc(lua_State *L)
 {
     //    uint16_t Iso15693Crc(uint8_t *v, int n);
@@ -261,9 +586,32 @@ int set_pm3_libraries(lua_State *L)
         {"clearCommandBuffer",          l_clearCommandBuffer},
         {"console",                      l_CmdConsole},
         {"iso15693_crc",                 l_iso15693_crc},
+        {"devices",                     l_devices},
+        {"selectDevice",                l_selectDevice},
+        {"SendAsync",                   l_SendAsync},
+        {"SendBatch",                   l_SendBatch},
+        {"clock",                       l_clock},
+        {"stats",                       l_stats},
+        {"resetStats",                  l_resetStats},
+        {"mfKeyStoreGet",               l_mfKeyStoreGet},
+        {"mfKeyStorePut",               l_mfKeyStorePut},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg future_methods[] = {
+        {"wait",                        l_future_wait},
+        {"poll",                        l_future_poll},
         {NULL, NULL}
     };
 
+    // metatable of the futures returned by core.SendAsync()
+    luaL_newmetatable(L, FUTURE_METATABLE);
+    luaL_newlib(L, future_methods);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_future_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     lua_pushglobaltable(L);
     // Core library is in this table. Contains '
     //this is 'pm3' table
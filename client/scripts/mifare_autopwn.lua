@@ -19,6 +19,9 @@ Arguments:
 Output files from this operation:
 	<uid>.eml 		- emulator file
 	<uid>.html 		- html file containing card data
+	mfkeys.txt		- the key store, every key found is added to it (see 'hf mf keystore'). A card
+					  seen before skips the darkside attack, and nested only attacks the sectors
+					  whose keys are still unknown.
 	dumpkeys.bin	- keys are dumped here. OBS! This file is volatile, as other commands overwrite it sometimes.
 	dumpdata.bin	- card data in binary form. OBS! This file is volatile, as other commands (hf mf dump) overwrite it. 
 
@@ -182,15 +185,21 @@ function main(args)
 			print("Card found, commencing crack", uid)
 			-- Crack it
 			local key, cnt
-			res,err = mfcrack()
-			if not res then return oops(err) end
-			-- The key is actually 8 bytes, so a 
-			-- 6-byte key is sent as 00XXXXXX
-			-- This means we unpack it as first
-			-- two bytes, then six bytes actual key data
-			-- We can discard first and second return values
-			_,_,key = bin.unpack("H2H6",res)
-			print("Key ", key)
+			key = core.mfKeyStoreGet(uid, 0, 0)
+			if key then
+				print("Key from the key store ", key)
+			else
+				res,err = mfcrack()
+				if not res then return oops(err) end
+				-- The key is actually 8 bytes, so a 
+				-- 6-byte key is sent as 00XXXXXX
+				-- This means we unpack it as first
+				-- two bytes, then six bytes actual key data
+				-- We can discard first and second return values
+				_,_,key = bin.unpack("H2H6",res)
+				print("Key ", key)
+				core.mfKeyStorePut(uid, 0, 0, key, "darkside")
+			end
 
 			-- Use nested attack
 			nested(key,sak)
@@ -0,0 +1,94 @@
+local cmds = require('commands')
+local getopt = require('getopt')
+
+usage = "script run pipeline.lua [-n <count>]"
+author = "Proxmark3 contributors"
+desc =[[
+This script shows how to keep several commands in flight instead of waiting
+for each response before sending the next command. It times the same number
+of CMD_DEVICE_INFO round trips done one at a time, with core.SendBatch and
+with futures from core.SendAsync.
+
+Arguments:
+	-n <count>	number of commands, default 200
+]]
+
+local function oneByOne(command, count)
+	for i = 1, count do
+		core.SendCommand(command)
+		if not core.WaitForResponseTimeout(cmds.CMD_DEVICE_INFO, 1000) then
+			return nil, "Timeout at command " .. i
+		end
+	end
+	return count
+end
+
+local function batch(command, count)
+	local list = {}
+	for i = 1, count do list[i] = command end
+	local responses, received = core.SendBatch(list, cmds.CMD_DEVICE_INFO)
+	return received
+end
+
+-- The callback runs while the next commands are already on their way;
+-- this is where host side work (crypto, parsing) overlaps with the device.
+local function batchWithCallback(command, count)
+	local list = {}
+	for i = 1, count do list[i] = command end
+	local flags = 0
+	local received = core.SendBatch(list, cmds.CMD_DEVICE_INFO, function(i, response)
+		if response then
+			local _, cmd, arg0 = bin.unpack('LL', response)
+			flags = arg0
+		end
+	end)
+	return received
+end
+
+-- Up to 16 futures waiting at any time, well below the 64 the core tracks
+local function futures(command, count)
+	local pending, received = {}, 0
+	for i = 1, count do
+		pending[#pending + 1] = core.SendAsync(command, cmds.CMD_DEVICE_INFO)
+		if #pending == 16 or i == count then
+			for _, f in ipairs(pending) do
+				if f:wait(1000) then received = received + 1 end
+			end
+			pending = {}
+		end
+	end
+	return received
+end
+
+local function timeIt(name, fn, command, count)
+	local start = core.clock()
+	local received, err = fn(command, count)
+	local elapsed = core.clock() - start
+	if not received then
+		print(("%-20s %s"):format(name, err))
+		return
+	end
+	print(("%-20s %4d/%d responses in %7.1f ms, %6.0f round trips/s"):format(
+		name, received, count, elapsed * 1000, received / elapsed))
+end
+
+local function main(args)
+	local count = 200
+	for o, a in getopt.getopt(args, 'hn:') do
+		if o == "h" then print(desc) return end
+		if o == "n" then count = tonumber(a) end
+	end
+
+	local command = Command:new{cmd = cmds.CMD_DEVICE_INFO}:getBytes()
+	core.clearCommandBuffer()
+	core.resetStats()
+	timeIt("one by one", oneByOne, command, count)
+	timeIt("SendBatch", batch, command, count)
+	timeIt("SendBatch callback", batchWithCallback, command, count)
+	timeIt("SendAsync futures", futures, command, count)
+
+	local stats = core.stats()
+	print(("%d commands sent, %d bytes received"):format(stats.sent, stats.rx_bytes))
+end
+
+main(args)
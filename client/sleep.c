@@ -24,5 +24,37 @@ void nsleep(uint64_t n) {
   while (nanosleep(&timeout, &timeout) && errno == EINTR);
 }
 
+// monotonic time in microseconds, for timing and statistics
+uint64_t usclock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+#else
+
+#include "sleep.h"
+#include <time.h>
+#include <sys/time.h>
+
 #endif // _WIN32
 
+// absolute (wall clock) deadline ms milliseconds from now, as used by
+// pthread_cond_timedwait()
+void deadline(struct timespec *ts, uint32_t ms) {
+#ifndef _WIN32
+  clock_gettime(CLOCK_REALTIME, ts);
+#else
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  ts->tv_sec = now.tv_sec;
+  ts->tv_nsec = now.tv_usec * 1000;
+#endif
+  ts->tv_sec += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000;
+  if (ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
@@ -15,13 +15,20 @@
 # include <windows.h>
 # define sleep(n) Sleep(1000 * n)
 # define msleep(n) Sleep(n)
+# define usclock() ((uint64_t)GetTickCount() * 1000)
 #else
 # include <inttypes.h>
 # include <unistd.h>
   void nsleep(uint64_t n);
+  uint64_t usclock(void);
 # define msleep(n) nsleep(1000000 * n)
 # define usleep(n) nsleep(1000 * n)
 #endif // _WIN32
 
+#define msclock() (usclock() / 1000)
+
+struct timespec;
+void deadline(struct timespec *ts, uint32_t ms);
+
 #endif // SLEEP_H__
 
@@ -31,17 +31,35 @@
  *
  */
 
+// getaddrinfo() and friends are not part of C99
+#define _DEFAULT_SOURCE
 #include "uart.h"
 
+#ifndef MIN
+# define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+static const uart_emulator *emulator;
+
+void uart_set_emulator(const uart_emulator *e) {
+  emulator = e;
+}
+
 // Test if we are dealing with unix operating systems
 #ifndef _WIN32
 
 #include <termios.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 typedef struct termios term_info;
 typedef struct {
-  int fd;           // Serial port file descriptor
+  uart_transport transport;
+  int fd;           // Serial port or socket file descriptor
   term_info tiOld;  // Terminal info before using the port
   term_info tiNew;  // Terminal info during the transaction
+  void *emu;        // Emulated device, UART_EMULATOR only
 } serial_port_unix;
 
 // Set time-out on 30 miliseconds
@@ -50,11 +68,80 @@ const struct timeval timeout = {
   .tv_usec = 30000  // 30000 micro seconds
 };
 
+static serial_port uart_open_tcp(const char* pcAddress)
+{
+  char host[256];
+  const char *port = strrchr(pcAddress, ':');
+  struct addrinfo hints, *res, *ai;
+  int one = 1;
+
+  if (port == NULL || port == pcAddress || (size_t)(port - pcAddress) >= sizeof(host)) return INVALID_SERIAL_PORT;
+  memcpy(host, pcAddress, port - pcAddress);
+  host[port - pcAddress] = '\0';
+  port++;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0) return INVALID_SERIAL_PORT;
+
+  serial_port_unix* sp = calloc(1, sizeof(serial_port_unix));
+  if (sp == 0) {
+    freeaddrinfo(res);
+    return INVALID_SERIAL_PORT;
+  }
+  sp->transport = UART_TCP;
+  sp->fd = -1;
+  for (ai = res; ai != NULL && sp->fd == -1; ai = ai->ai_next) {
+    sp->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sp->fd == -1) continue;
+    if (connect(sp->fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+      close(sp->fd);
+      sp->fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  if (sp->fd == -1) {
+    free(sp);
+    return INVALID_SERIAL_PORT;
+  }
+  // Commands are small and latency matters more than packet count
+  setsockopt(sp->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(sp->fd, F_SETFL, O_NONBLOCK);
+  return sp;
+}
+
+static serial_port uart_open_emulator(const char* pcScript)
+{
+  if (emulator == NULL) return INVALID_SERIAL_PORT;
+  serial_port_unix* sp = calloc(1, sizeof(serial_port_unix));
+  if (sp == 0) return INVALID_SERIAL_PORT;
+  sp->transport = UART_EMULATOR;
+  sp->fd = -1;
+  sp->emu = emulator->open(pcScript);
+  if (sp->emu == NULL) {
+    free(sp);
+    return INVALID_SERIAL_PORT;
+  }
+  return sp;
+}
+
 serial_port uart_open(const char* pcPortName)
 {
-  serial_port_unix* sp = malloc(sizeof(serial_port_unix));
+  if (strncmp(pcPortName, UART_TCP_PREFIX, strlen(UART_TCP_PREFIX)) == 0) {
+    return uart_open_tcp(pcPortName + strlen(UART_TCP_PREFIX));
+  }
+  if (strcmp(pcPortName, UART_EMULATOR_NAME) == 0) {
+    return uart_open_emulator(NULL);
+  }
+  if (strncmp(pcPortName, UART_EMULATOR_NAME ":", strlen(UART_EMULATOR_NAME) + 1) == 0) {
+    return uart_open_emulator(pcPortName + strlen(UART_EMULATOR_NAME) + 1);
+  }
+
+  serial_port_unix* sp = calloc(1, sizeof(serial_port_unix));
   if (sp == 0) return INVALID_SERIAL_PORT;
   
+  sp->transport = UART_SERIAL;
   sp->fd = open(pcPortName, O_RDWR | O_NOCTTY | O_NDELAY | O_NONBLOCK);
   if(sp->fd == -1) {
     uart_close(sp);
@@ -111,6 +198,16 @@ serial_port uart_open(const char* pcPortName)
 
 void uart_close(const serial_port sp) {
   serial_port_unix* spu = (serial_port_unix*)sp;
+  if (spu->transport == UART_EMULATOR) {
+    emulator->close(spu->emu);
+    free(sp);
+    return;
+  }
+  if (spu->transport == UART_TCP) {
+    close(spu->fd);
+    free(sp);
+    return;
+  }
   tcflush(spu->fd,TCIOFLUSH);
   tcsetattr(spu->fd,TCSANOW,&(spu->tiOld));
   struct flock fl;
@@ -124,9 +221,14 @@ void uart_close(const serial_port sp) {
   free(sp);
 }
 
+uart_transport uart_get_transport(const serial_port sp) {
+  return ((serial_port_unix*)sp)->transport;
+}
+
 bool uart_set_speed(serial_port sp, const uint32_t uiPortSpeed) {
   const serial_port_unix* spu = (serial_port_unix*)sp;
   speed_t stPortSpeed;
+  if (spu->transport != UART_SERIAL) return true;
   switch (uiPortSpeed) {
     case 0: stPortSpeed = B0; break;
     case 50: stPortSpeed = B50; break;
@@ -172,6 +274,7 @@ uint32_t uart_get_speed(const serial_port sp) {
   struct termios ti;
   uint32_t uiPortSpeed;
   const serial_port_unix* spu = (serial_port_unix*)sp;
+  if (spu->transport != UART_SERIAL) return 0;
   if (tcgetattr(spu->fd,&ti) == -1) return 0;
   // Set port speed (Input)
   speed_t stPortSpeed = cfgetispeed(&ti);
@@ -214,6 +317,7 @@ uint32_t uart_get_speed(const serial_port sp) {
 bool uart_set_parity(serial_port sp, serial_port_parity spp) {
   struct termios ti;
   const serial_port_unix* spu = (serial_port_unix*)sp;
+  if (spu->transport != UART_SERIAL) return true;
   if (tcgetattr(spu->fd,&ti) == -1) return false;
   switch(spp) {
     case SP_INVALID: return false;
@@ -227,6 +331,7 @@ bool uart_set_parity(serial_port sp, serial_port_parity spp) {
 serial_port_parity uart_get_parity(const serial_port sp) {
   struct termios ti;
   const serial_port_unix* spu = (serial_port_unix*)sp;
+  if (spu->transport != UART_SERIAL) return SP_NONE;
   if (tcgetattr(spu->fd,&ti) == -1) return SP_INVALID;
   
   if (ti.c_cflag & PARENB) {
@@ -252,7 +357,14 @@ bool uart_receive(const serial_port sp, byte_t* pbtRx, size_t* pszRxLen) {
   int byteCount;
   fd_set rfds;
   struct timeval tv;
+  // On input *pszRxLen is the size of the buffer, like on windows
+  size_t szRxMax = *pszRxLen;
   
+  if (((serial_port_unix*)sp)->transport == UART_EMULATOR) {
+    *pszRxLen = emulator->read(((serial_port_unix*)sp)->emu, pbtRx, szRxMax, timeout.tv_usec / 1000);
+    return (*pszRxLen != 0);
+  }
+
   // Reset the output count
   *pszRxLen = 0;
   
@@ -283,7 +395,8 @@ bool uart_receive(const serial_port sp, byte_t* pbtRx, size_t* pszRxLen) {
     res = ioctl(((serial_port_unix*)sp)->fd, FIONREAD, &byteCount);
     if (res < 0) return false;
 
-    // There is something available, read the data
+    // There is something available, read as much of it as fits
+    byteCount = MIN((size_t)byteCount, szRxMax - *pszRxLen);
     res = read(((serial_port_unix*)sp)->fd,pbtRx+(*pszRxLen),byteCount);
 
     // Stop if the OS has some troubles reading the data
@@ -304,6 +417,11 @@ bool uart_send(const serial_port sp, const byte_t* pbtTx, const size_t szTxLen)
   size_t szPos = 0;
   fd_set rfds;
   struct timeval tv;
+
+  if (((serial_port_unix*)sp)->transport == UART_EMULATOR) {
+    emulator->write(((serial_port_unix*)sp)->emu, pbtTx, szTxLen);
+    return true;
+  }
   
   while (szPos < szTxLen) {
     // Reset file descriptor
@@ -401,6 +519,10 @@ void uart_close(const serial_port sp) {
   free(sp);
 }
 
+uart_transport uart_get_transport(const serial_port sp) {
+  return UART_SERIAL;
+}
+
 bool uart_set_speed(serial_port sp, const uint32_t uiPortSpeed) {
   serial_port_windows* spw;
   spw = (serial_port_windows*)sp;
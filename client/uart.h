@@ -65,13 +65,34 @@ typedef enum {
   SP_ODD     = 0x03  // odd parity
 } serial_port_parity;
 
+typedef enum {
+  UART_SERIAL,       // serial port or pty, the default
+  UART_TCP,          // "tcp:<host>:<port>", e.g. a device emulator on another machine
+  UART_EMULATOR      // "emu" or "emu:<script>", in-process device emulator, see devemu.h
+} uart_transport;
+
+#define UART_TCP_PREFIX     "tcp:"
+#define UART_EMULATOR_NAME  "emu"
+
 // Define shortcut to types to make code more readable
 typedef void* serial_port;
 #define INVALID_SERIAL_PORT (void*)(~1)
 #define CLAIMED_SERIAL_PORT (void*)(~2)
 
+// The in-process device emulator lives outside of uart.c, so programs that
+// don't need it, like the flasher, don't link it. Those that do plug it in
+// with uart_set_emulator() before opening UART_EMULATOR_NAME.
+typedef struct {
+  void *(*open)(const char *script);
+  void (*close)(void *emu);
+  void (*write)(void *emu, const byte_t *data, size_t len);
+  size_t (*read)(void *emu, byte_t *data, size_t len, uint32_t timeout_ms);
+} uart_emulator;
+void uart_set_emulator(const uart_emulator *emulator);
+
 serial_port uart_open(const char* pcPortName);
 void uart_close(const serial_port sp);
+uart_transport uart_get_transport(const serial_port sp);
 
 bool uart_set_speed(serial_port sp, const uint32_t uiPortSpeed);
 uint32_t uart_get_speed(const serial_port sp);
@@ -25,6 +25,8 @@ int flushAfterWrite = 0;  //buzzy
 extern pthread_mutex_t print_lock;
 
 static char *logfilename = "proxmark3.log";
+// tells the output of several devices apart, see SetLogPrefix()
+static __thread const char *log_prefix;
 
 void PrintAndLog(char *fmt, ...)
 {
@@ -55,6 +57,7 @@ void PrintAndLog(char *fmt, ...)
 		rl_redisplay();
 	}
 	
+	if (log_prefix) printf("%s", log_prefix);
 	va_start(argptr, fmt);
 	va_copy(argptr2, argptr);
 	vprintf(fmt, argptr);
@@ -71,6 +74,7 @@ void PrintAndLog(char *fmt, ...)
 	}
 	
 	if (logging && logfile) {
+		if (log_prefix) fprintf(logfile, "%s", log_prefix);
 		vfprintf(logfile, fmt, argptr2);
 		fprintf(logfile,"\n");
 		fflush(logfile);
@@ -90,3 +94,9 @@ void SetLogFilename(char *fn)
 {
   logfilename = fn;
 }
+
+// Everything the calling thread prints starts with prefix, NULL for none
+void SetLogPrefix(const char *prefix)
+{
+  log_prefix = prefix;
+}
@@ -17,6 +17,7 @@ void ShowGraphWindow(void);
 void RepaintGraphWindow(void);
 void PrintAndLog(char *fmt, ...);
 void SetLogFilename(char *fn);
+void SetLogPrefix(const char *prefix);
 
 extern double CursorScaleFactor;
 extern int PlotGridX, PlotGridY, PlotGridXdefault, PlotGridYdefault;
@@ -33,9 +33,56 @@
 #include "cmd.h"
 #include "string.h"
 #include "proxmark3.h"
+#ifdef WITH_COMPACT_FRAMES
+#include "crc16.h"
+#endif
 
 //static UsbCommand txcmd;
 
+// tag of the command currently being handled, echoed in every frame we send
+static uint32_t cmd_tag;
+
+void cmd_set_tag(uint32_t tag) {
+  cmd_tag = tag;
+}
+
+uint32_t cmd_get_tag(void) {
+  return cmd_tag;
+}
+
+#ifdef WITH_COMPACT_FRAMES
+// whether responses go out as compact frames instead of full UsbCommands
+static bool cmd_compact_frames;
+
+void cmd_set_frame_format(uint32_t format) {
+  cmd_compact_frames = (format == USB_FRAME_FORMAT_COMPACT);
+}
+
+static bool cmd_send_compact(uint64_t cmd, uint32_t arg0, uint32_t arg1, uint32_t arg2, void* data, size_t len) {
+  struct {
+    UsbFrameHeader hdr;
+    byte_t data[USB_CMD_DATA_SIZE];
+  } PACKED frame;
+
+  len = (data) ? MIN(len,USB_CMD_DATA_SIZE) : 0;
+
+  frame.hdr.magic = USB_FRAME_MAGIC;
+  frame.hdr.length = len;
+  frame.hdr.crc = 0;
+  frame.hdr.cmd = cmd;
+  frame.hdr.arg[0] = arg0;
+  frame.hdr.arg[1] = arg1;
+  frame.hdr.arg[2] = arg2;
+  for (size_t i=0; i<len; i++) {
+    frame.data[i] = ((byte_t*)data)[i];
+  }
+  frame.hdr.crc = update_crc16_buffer(USB_FRAME_CRC_INIT, (byte_t*)&frame, sizeof(UsbFrameHeader) + len);
+
+  // Send frame and make sure all bytes are transmitted
+  return (usb_write((byte_t*)&frame, sizeof(UsbFrameHeader) + len) == 0);
+}
+#endif
+
 bool cmd_receive(UsbCommand* cmd) {
  
   // Check if there is a usb packet available
@@ -54,12 +101,18 @@ bool cmd_receive(UsbCommand* cmd) {
 bool cmd_send(uint32_t cmd, uint32_t arg0, uint32_t arg1, uint32_t arg2, void* data, size_t len) {
   UsbCommand txcmd;
 
+#ifdef WITH_COMPACT_FRAMES
+  if (cmd_compact_frames) {
+    return cmd_send_compact(cmd | ((uint64_t)cmd_tag << USB_CMD_TAG_SHIFT), arg0, arg1, arg2, data, len);
+  }
+#endif
+
   for (size_t i=0; i<sizeof(UsbCommand); i++) {
     ((byte_t*)&txcmd)[i] = 0x00;
   }
   
   // Compose the outgoing command frame
-  txcmd.cmd = cmd;
+  txcmd.cmd = cmd | ((uint64_t)cmd_tag << USB_CMD_TAG_SHIFT);
   txcmd.arg[0] = arg0;
   txcmd.arg[1] = arg1;	
   txcmd.arg[2] = arg2;
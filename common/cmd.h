@@ -38,6 +38,11 @@
 #include "usb_cdc.h"
 
 bool cmd_receive(UsbCommand* cmd);
+void cmd_set_tag(uint32_t tag);
+uint32_t cmd_get_tag(void);
+#ifdef WITH_COMPACT_FRAMES
+void cmd_set_frame_format(uint32_t format);
+#endif
 bool cmd_send(uint32_t cmd, uint32_t arg0, uint32_t arg1, uint32_t arg2, void* data, size_t len);
 
 #endif // _PROXMARK_CMD_H_
@@ -20,3 +20,11 @@ unsigned short update_crc16( unsigned short crc, unsigned char c )
 
   return ((crc >> 8) ^ tcrc)&0xffff;
 }
+
+unsigned short update_crc16_buffer( unsigned short crc, const unsigned char *data, unsigned int len )
+{
+  while (len--) {
+    crc = update_crc16(crc, *data++);
+  }
+  return crc;
+}
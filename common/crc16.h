@@ -10,5 +10,6 @@
 #define __CRC16_H
 
 unsigned short update_crc16(unsigned short crc, unsigned char c);
+unsigned short update_crc16_buffer(unsigned short crc, const unsigned char *data, unsigned int len);
 
 #endif
@@ -33,6 +33,7 @@
  */
 
 #include "usb_cdc.h"
+#include "cmd.h"
 #include "config_gpio.h"
 
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
@@ -370,6 +371,38 @@ uint32_t usb_write(const byte_t* data, const size_t len) {
 	return length;
 }
 
+//*----------------------------------------------------------------------------
+//* \fn    usb_write_idle
+//* \brief Check whether endpoint 2 can take the next packet
+//*----------------------------------------------------------------------------
+bool usb_write_idle() {
+  if (!usb_check()) return false;
+  if (pUdp->UDP_CSR[AT91C_EP_IN] & AT91C_UDP_TXPKTRDY) return false;
+  if (pUdp->UDP_CSR[AT91C_EP_IN] & AT91C_UDP_TXCOMP) {
+    pUdp->UDP_CSR[AT91C_EP_IN] &= ~(AT91C_UDP_TXCOMP);
+    while (pUdp->UDP_CSR[AT91C_EP_IN] & AT91C_UDP_TXCOMP);
+  }
+  return true;
+}
+
+//*----------------------------------------------------------------------------
+//* \fn    usb_write_packet
+//* \brief Queue at most one packet on endpoint 2 without waiting,
+//*        returns the number of bytes taken (0 if the endpoint is busy)
+//*----------------------------------------------------------------------------
+uint32_t usb_write_packet(const byte_t* data, const size_t len) {
+  uint32_t cpt;
+
+  if (!len) return 0;
+  if (!usb_write_idle()) return 0;
+
+  cpt = MIN(len, AT91C_EP_IN_SIZE-1);
+  for (uint32_t i = 0; i < cpt; i++) pUdp->UDP_FDR[AT91C_EP_IN] = data[i];
+  pUdp->UDP_CSR[AT91C_EP_IN] |= AT91C_UDP_TXPKTRDY;
+
+  return cpt;
+}
+
 //*----------------------------------------------------------------------------
 //* \fn    AT91F_USB_SendData
 //* \brief Send Data through the control endpoint
@@ -480,6 +513,10 @@ void AT91F_CDC_Enumerate() {
 		break;
 	case STD_SET_CONFIGURATION:
 		btConfiguration = wValue;
+#ifdef WITH_COMPACT_FRAMES
+		// a new host starts out with the frames every client understands
+		cmd_set_frame_format(USB_FRAME_FORMAT_LEGACY);
+#endif
 		AT91F_USB_SendZlp(pUdp);
 		pUdp->UDP_GLBSTATE  = (wValue) ? AT91C_UDP_CONFG : AT91C_UDP_FADDEN;
 		pUdp->UDP_CSR[1] = (wValue) ? (AT91C_UDP_EPEDS | AT91C_UDP_EPTYPE_BULK_OUT) : 0;
@@ -558,6 +595,10 @@ void AT91F_CDC_Enumerate() {
 		break;
 	case SET_CONTROL_LINE_STATE:
 		btConnection = wValue;
+#ifdef WITH_COMPACT_FRAMES
+		// the port was opened or closed, the next client may not know compact frames
+		cmd_set_frame_format(USB_FRAME_FORMAT_LEGACY);
+#endif
 		AT91F_USB_SendZlp(pUdp);
 		break;
 	default:
@@ -43,6 +43,8 @@ bool usb_check();
 bool usb_poll();
 uint32_t usb_read(byte_t* data, size_t len);
 uint32_t usb_write(const byte_t* data, const size_t len);
+bool usb_write_idle();
+uint32_t usb_write_packet(const byte_t* data, const size_t len);
 
 #endif // _USB_CDC_H_
 
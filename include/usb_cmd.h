@@ -34,6 +34,32 @@ typedef struct {
   } d;
 } PACKED UsbCommand;
 
+// The upper 32 bits of UsbCommand.cmd may carry a tag chosen by the client.
+// The firmware echoes the tag of the command it is handling in every frame it
+// sends, so responses can be matched to the operation that caused them.
+// Tag 0 means untagged.
+#define USB_CMD_TAG_SHIFT 32
+#define USB_CMD_ID(cmd)   ((uint32_t)((cmd) & 0xffffffff))
+#define USB_CMD_TAG(cmd)  ((uint32_t)((uint64_t)(cmd) >> USB_CMD_TAG_SHIFT))
+
+// Compact frame, sent by the firmware instead of a full UsbCommand once the
+// client asked for it with CMD_SET_FRAME_FORMAT. Only the used part of the
+// data is transmitted. The magic can't be confused with the start of a
+// UsbCommand, whose first bytes hold a 16 bit command ID.
+#define USB_FRAME_MAGIC 0x66334d50 // "PM3f"
+#define USB_FRAME_CRC_INIT 0xffff
+typedef struct {
+  uint32_t magic;
+  uint16_t length;  // number of data bytes following the header
+  uint16_t crc;     // CRC-16 over the header (with crc = 0) and the data
+  uint64_t cmd;
+  uint64_t arg[3];
+} PACKED UsbFrameHeader;
+
+// Frame formats for CMD_SET_FRAME_FORMAT
+#define USB_FRAME_FORMAT_LEGACY  0
+#define USB_FRAME_FORMAT_COMPACT 1
+
 // For the bootloader
 #define CMD_DEVICE_INFO                                                   0x0000
 #define CMD_SETUP_WRITE                                                   0x0001
@@ -52,6 +78,10 @@ typedef struct {
 #define CMD_BUFF_CLEAR                                                    0x0105
 #define CMD_READ_MEM                                                      0x0106
 #define CMD_VERSION                                                       0x0107
+#define CMD_SET_FRAME_FORMAT                                              0x0108
+#define CMD_USB_BENCHMARK                                                 0x0109
+#define CMD_DOWNLOAD_BIGBUF_BULK                                          0x010A
+#define CMD_BULK_DATA                                                     0x010B
 
 // For low-frequency tags
 #define CMD_READ_TI_TYPE                                                  0x0202
@@ -82,6 +112,8 @@ typedef struct {
 #define CMD_IO_DEMOD_FSK                                                  0x021A
 #define CMD_IO_CLONE_TAG                                                  0x021B
 #define CMD_EM410X_DEMOD  																								0x021C
+#define CMD_STREAM_RAW_ADC_SAMPLES_125K                                   0x021D
+#define CMD_STREAMED_RAW_ADC_SAMPLES_125K                                 0x021E
 
 /* CMD_SET_ADC_MUX: ext1 is 0 for lopkd, 1 for loraw, 2 for hipkd, 3 for hiraw */
 
@@ -153,6 +185,7 @@ typedef struct {
 #define CMD_MIFAREU_WRITEBL_COMPAT					  0x0722
 #define CMD_MIFAREU_WRITEBL						  0x0723
 #define CMD_MIFARE_CHKKEYS                                                0x0623
+#define CMD_MIFARE_CHKKEYS_SECTORS                                        0x0624
 
 #define CMD_MIFARE_SNIFFER                                                0x0630
 
@@ -186,6 +219,32 @@ typedef struct {
 /* Set if this device understands the extend start flash command */
 #define DEVICE_INFO_FLAG_UNDERSTANDS_START_FLASH 	(1<<4)
 
+/* Set if the OS echoes the tag in the upper bits of UsbCommand.cmd */
+#define DEVICE_INFO_FLAG_UNDERSTANDS_CMD_TAG     	(1<<5)
+
+/* Set if the OS can send compact frames, see CMD_SET_FRAME_FORMAT */
+#define DEVICE_INFO_FLAG_UNDERSTANDS_COMPACT_FRAMES	(1<<6)
+
+/* Set if the OS understands CMD_DOWNLOAD_BIGBUF_BULK: it answers with a
+   CMD_BULK_DATA frame (arg0 = offset, arg1 = length), followed by length raw
+   bytes without any framing, followed by CMD_ACK (arg0 = length,
+   arg1 = CRC-16 of the data, see USB_FRAME_CRC_INIT) */
+#define DEVICE_INFO_FLAG_UNDERSTANDS_BULK_DOWNLOAD	(1<<7)
+
+/* Set if the OS understands CMD_STREAM_RAW_ADC_SAMPLES_125K (arg0 = divisor,
+   arg1 = number of samples or 0 for unlimited): samples are sent as compact
+   CMD_STREAMED_RAW_ADC_SAMPLES_125K frames (arg0 = block sequence number,
+   arg1 = number of samples, arg2 = samples dropped so far) until the sample
+   count is reached, the button is pressed or any command arrives. The stream
+   ends with CMD_ACK (arg0 = samples sent, arg1 = samples dropped,
+   arg2 = blocks sent) */
+#define DEVICE_INFO_FLAG_UNDERSTANDS_LF_STREAM		(1<<8)
+
+/* Set if the OS understands CMD_MIFARE_CHKKEYS_SECTORS: one key list checked
+   against the sectors in arg0 with key A and in arg1 with key B (bit n =
+   sector n), see MifareChkKeysSectors() */
+#define DEVICE_INFO_FLAG_UNDERSTANDS_CHKKEYS_SECTORS	(1<<9)
+
 /* CMD_START_FLASH may have three arguments: start of area to flash,
    end of area to flash, optional magic.
    The bootrom will not allow to overwrite itself unless this magic
@@ -0,0 +1,268 @@
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+#define llx PRIx64
+
+// Batch key recovery: the authentications of many sessions, mfkey32 and
+// mfkey64 alike, recovered on a pool of threads. Built on the crapto1 of the
+// client, for its reusable recovery contexts.
+#include "nonce2key/crapto1.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+typedef struct {
+  int n;            // 6 for mfkey32, 5 for mfkey64
+  uint32_t v[6];    // uid nt {nr_0} {ar_0} {nr_1} {ar_1}, or uid nt {nr} {ar} {at}
+  int line;         // where it was first seen
+  int found;
+  uint64_t key;
+} session;
+
+static session *sessions;
+static int session_count, session_size;
+static int next_session;  // next one to recover, shared by the workers
+static int lineno;        // counted over all the input
+
+static int cpu_count(void) {
+#ifdef _WIN32
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+#endif
+}
+
+static uint64_t msclock(void) {
+  struct timeval t;
+  gettimeofday(&t, NULL);
+  return (uint64_t)t.tv_sec * 1000 + t.tv_usec / 1000;
+}
+
+// One session per line: 6 or 5 hex values, as the arguments of mfkey32 or
+// mfkey64. Anything before a word ending in "mfkey32" or "mfkey64" is
+// skipped, so the log of the client can be read as it is. Returns -1 for
+// empty lines and comments.
+static int parse_line(char *line, session *s) {
+  char *p = strstr(line, "mfkey32");
+  if (!p) p = strstr(line, "mfkey64");
+  if (p) line = p + 7;
+  else if (line[strspn(line, " \t\r\n")] == 0 || line[strspn(line, " \t")] == '#') return -1;
+
+  memset(s, 0, sizeof(*s));
+  for (p = line; s->n < 6; s->n++) {
+    char *end;
+    while (isspace((unsigned char)*p)) p++;
+    if (!isxdigit((unsigned char)*p)) break;
+    s->v[s->n] = strtoul(p, &end, 16);
+    if (end == p || (*end && !isspace((unsigned char)*end))) return 0;
+    p = end;
+  }
+  while (isspace((unsigned char)*p)) p++;
+  return (s->n == 5 || s->n == 6) && (*p == 0 || *p == '#');
+}
+
+static int read_sessions(FILE *f, const char *name) {
+  char line[1024];
+  int bad = 0;
+  session s;
+
+  while (fgets(line, sizeof(line), f)) {
+    int res = parse_line(line, &s);
+    lineno++;
+    if (res <= 0) {
+      bad += res == 0;
+      continue;
+    }
+    if (session_count == session_size) {
+      int size = session_size ? session_size * 2 : 256;
+      session *p = realloc(sessions, size * sizeof(session));
+      if (!p) return 1;
+      sessions = p;
+      session_size = size;
+    }
+    s.line = lineno;
+    sessions[session_count++] = s;
+  }
+  if (bad) fprintf(stderr, "%s: %d lines without a session ignored\n", name, bad);
+  return 0;
+}
+
+static int compare_sessions(const void *a, const void *b) {
+  const session *x = a, *y = b;
+  if (x->n != y->n) return x->n - y->n;
+  for (int i = 0; i < x->n; i++)
+    if (x->v[i] != y->v[i]) return x->v[i] < y->v[i] ? -1 : 1;
+  return x->line - y->line;
+}
+
+static int compare_lines(const void *a, const void *b) {
+  return ((const session *)a)->line - ((const session *)b)->line;
+}
+
+// the same session captured more than once is recovered once, the first
+// one stays
+static int dedup_sessions(void) {
+  int i, n = 0;
+
+  qsort(sessions, session_count, sizeof(session), compare_sessions);
+  for (i = 0; i < session_count; i++)
+    if (n == 0 || sessions[i].n != sessions[n - 1].n ||
+        memcmp(sessions[i].v, sessions[n - 1].v, sessions[i].n * sizeof(uint32_t)))
+      sessions[n++] = sessions[i];
+  qsort(sessions, n, sizeof(session), compare_lines);
+  i = session_count - n;
+  session_count = n;
+  return i;
+}
+
+static void recover32(struct Crypto1Recovery *ctx, session *s) {
+  uint32_t uid = s->v[0], nt = s->v[1], nr0_enc = s->v[2], ar0_enc = s->v[3], nr1_enc = s->v[4], ar1_enc = s->v[5];
+  struct Crypto1State *t;
+
+  for (t = lfsr_recovery32_ctx(ctx, ar0_enc ^ prng_successor(nt, 64), 0); t->odd | t->even; ++t) {
+    lfsr_rollback_word(t, 0, 0);
+    lfsr_rollback_word(t, nr0_enc, 1);
+    lfsr_rollback_word(t, uid ^ nt, 0);
+    crypto1_get_lfsr(t, &s->key);
+    crypto1_word(t, uid ^ nt, 0);
+    crypto1_word(t, nr1_enc, 1);
+    if (ar1_enc == (crypto1_word(t, 0, 0) ^ prng_successor(nt, 64))) {
+      s->found = 1;
+      break;
+    }
+  }
+}
+
+static void recover64(session *s) {
+  uint32_t uid = s->v[0], nt = s->v[1], nr_enc = s->v[2], ar_enc = s->v[3], at_enc = s->v[4];
+  struct Crypto1State *revstate;
+
+  revstate = lfsr_recovery64(ar_enc ^ prng_successor(nt, 64), at_enc ^ prng_successor(nt, 96));
+  if (!revstate) return;
+  lfsr_rollback_word(revstate, 0, 0);
+  lfsr_rollback_word(revstate, 0, 0);
+  lfsr_rollback_word(revstate, nr_enc, 1);
+  lfsr_rollback_word(revstate, uid ^ nt, 0);
+  crypto1_get_lfsr(revstate, &s->key);
+  crypto1_destroy(revstate);
+  s->found = 1;
+}
+
+// takes sessions until none are left, with a recovery context of the pool
+// that it keeps for all of them; takes none if it gets no context
+static void *worker(void *arg) {
+  struct Crypto1Recovery *ctx = lfsr_recovery_acquire();
+  int i;
+
+  (void)arg;
+  if (!ctx) return NULL;
+  lfsr_recovery_threads(ctx, 1);
+  while ((i = __sync_fetch_and_add(&next_session, 1)) < session_count) {
+    if (sessions[i].n == 6)
+      recover32(ctx, &sessions[i]);
+    else
+      recover64(&sessions[i]);
+  }
+  lfsr_recovery_release(ctx);
+  return NULL;
+}
+
+static int compare_keys(const void *a, const void *b) {
+  const session *x = a, *y = b;
+  if (x->found != y->found) return y->found - x->found;
+  if (x->v[0] != y->v[0]) return x->v[0] < y->v[0] ? -1 : 1;
+  if (x->key != y->key) return x->key < y->key ? -1 : 1;
+  return x->line - y->line;
+}
+
+int main (int argc, char *argv[]) {
+  pthread_t thread[256];
+  int threads = 0, started = 0, dups, found = 0, i, files = 0;
+  uint64_t start, ms;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-h") || (argv[i][0] == '-' && argv[i][1])) {
+      printf("MIFARE Classic key recovery - many reader authentications at once\n\n");
+      printf(" syntax: %s [-t <threads>] [<file>|- ...]\n\n", argv[0]);
+      printf(" One session per line, the arguments of mfkey32 or mfkey64:\n");
+      printf("   <uid> <nt> <{nr_0}> <{ar_0}> <{nr_1}> <{ar_1}>\n");
+      printf("   <uid> <nt> <{nr}> <{ar}> <{at}>\n");
+      printf(" The '../tools/mfkey/mfkey32 ...' lines of 'hf mf sim' in a client log work as they are.\n");
+      printf(" Reads stdin without files, uses one thread per core without -t.\n");
+      return 1;
+    } else {
+      FILE *f = strcmp(argv[i], "-") ? fopen(argv[i], "r") : stdin;
+      if (!f) {
+        fprintf(stderr, "%s: cannot open\n", argv[i]);
+        return 1;
+      }
+      if (read_sessions(f, argv[i])) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+      }
+      if (f != stdin) fclose(f);
+      files++;
+    }
+  }
+  if (!files && read_sessions(stdin, "stdin")) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  dups = dedup_sessions();
+
+  if (threads <= 0) threads = cpu_count();
+  if (threads > session_count) threads = session_count;
+  if (threads > (int)(sizeof(thread) / sizeof(thread[0]))) threads = sizeof(thread) / sizeof(thread[0]);
+  start = msclock();
+  for (i = 0; i < threads; i++)
+    if (!pthread_create(&thread[started], NULL, worker, NULL)) started++;
+  if (!started) worker(NULL);
+  for (i = 0; i < started; i++)
+    pthread_join(thread[i], NULL);
+  ms = msclock() - start;
+  lfsr_recovery_pool_free();
+  // a worker without a recovery context takes no sessions
+  if (next_session < session_count) {
+    fprintf(stderr, "out of memory for the key recovery\n");
+    return 1;
+  }
+
+  printf("line  | uid      | nt       | key\n");
+  printf("------+----------+----------+-------------\n");
+  for (i = 0; i < session_count; i++) {
+    session *s = &sessions[i];
+    if (s->found)
+      printf("%5d | %08x | %08x | %012"llx"\n", s->line, s->v[0], s->v[1], s->key);
+    else
+      printf("%5d | %08x | %08x | not found\n", s->line, s->v[0], s->v[1]);
+    found += s->found;
+  }
+
+  // every key once per card
+  qsort(sessions, session_count, sizeof(session), compare_keys);
+  printf("\nuid      | key          | sessions\n");
+  printf("---------+--------------+---------\n");
+  for (i = 0; i < session_count && sessions[i].found; ) {
+    int j = i;
+    while (j < session_count && sessions[j].found && sessions[j].v[0] == sessions[i].v[0] && sessions[j].key == sessions[i].key) j++;
+    printf("%08x | %012"llx" | %8d\n", sessions[i].v[0], sessions[i].key, j - i);
+    i = j;
+  }
+
+  printf("\n%d sessions (%d duplicates skipped), %d keys found in %.3f s on %d threads, %.1f keys/s\n",
+         session_count, dups, found, ms / 1000.0, started ? started : 1, ms ? found * 1000.0 / ms : 0.0);
+  free(sessions);
+  return found == session_count ? 0 : 2;
+}
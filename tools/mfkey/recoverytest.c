@@ -0,0 +1,231 @@
+// Checks of the key recovery in the crapto1 of the client: the threaded
+// recovery against the one on a single thread, the batch functions against
+// the scalar ones, the nested intersection and the darkside recovery.
+// 'hf mf bench' only times them. Exits with 1 if any check fails.
+#include "nonce2key/crapto1.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failed;
+
+static void check(int ok, const char *what, int n) {
+  printf("  %-44s %s\n", what, ok ? "ok" : "FAILED");
+  if (!ok) {
+    printf("    in case %d\n", n);
+    failed = 1;
+  }
+}
+
+static uint32_t rand32(void) {
+  return (uint32_t)rand() << 16 ^ rand();
+}
+
+static uint64_t rand48(void) {
+  return ((uint64_t)rand() << 32 ^ (uint64_t)rand() << 16 ^ rand()) & 0xffffffffffffULL;
+}
+
+static int compare_keys(const void *a, const void *b) {
+  return *(uint64_t*)a < *(uint64_t*)b ? -1 : *(uint64_t*)a > *(uint64_t*)b;
+}
+
+static uint32_t statelist_len(struct Crypto1State *sl) {
+  struct Crypto1State *s;
+  for (s = sl; s->odd || s->even; s++);
+  return s - sl;
+}
+
+// whether one of the n states rolled back over in is key
+static int key_in(struct Crypto1State *sl, uint32_t n, uint32_t in, uint64_t key) {
+  uint64_t found;
+  for (uint32_t i = 0; i < n; i++) {
+    struct Crypto1State s = sl[i];
+    if (in) lfsr_rollback_word(&s, in, 0);
+    crypto1_get_lfsr(&s, &found);
+    if (found == key) return 1;
+  }
+  return 0;
+}
+
+// lfsr_recovery32 on several threads gives the lists one thread gives
+static void test_recovery(int keys) {
+  struct Crypto1Recovery *ctx[2] = {lfsr_recovery_create(), lfsr_recovery_create()};
+  int same = 1, found = 1, k = 0;
+
+  if (!ctx[0] || !ctx[1]) {
+    check(0, "allocating recovery contexts", 0);
+    goto out;
+  }
+  lfsr_recovery_threads(ctx[0], 1);
+  lfsr_recovery_threads(ctx[1], 4);
+  for (k = 0; k < keys && same && found; k++) {
+    uint64_t key = rand48();
+    uint32_t in = rand32() ^ rand32(), len[2];
+    struct Crypto1State *s = crypto1_create(key), *sl[2];
+    uint32_t ks1 = crypto1_word(s, in, 0);
+    crypto1_destroy(s);
+    for (int i = 0; i < 2; i++) {
+      sl[i] = lfsr_recovery32_ctx(ctx[i], ks1, in);
+      len[i] = statelist_len(sl[i]);
+    }
+    same = len[0] == len[1] && !memcmp(sl[0], sl[1], len[0] * sizeof(*s));
+    found = key_in(sl[1], len[1], in, key);
+  }
+  check(same, "threaded lfsr_recovery32 gives the same lists", k);
+  check(found, "lfsr_recovery32 finds the key", k);
+out:
+  lfsr_recovery_destroy(ctx[0]);
+  lfsr_recovery_destroy(ctx[1]);
+  lfsr_recovery_pool_free();
+}
+
+// the batch functions leave every state and keystream word the same
+static void test_batch(void) {
+  const size_t n = 1000;  // not a multiple of the lanes, and above BATCH_MIN
+  struct Crypto1State a[1000], b[1000];
+  uint32_t ksa[1000], ksb[1000], in = rand32();
+  static const char *names[] = {"lfsr_rollback_word_batch", "lfsr_rollback_word_batch fb",
+    "crypto1_word_batch", "crypto1_word_batch encrypted"};
+  char what[64];
+
+  for (size_t i = 0; i < n; i++) {
+    a[i].odd = rand32();
+    a[i].even = rand32();
+  }
+  memcpy(b, a, sizeof(a));
+  for (int fn = 0; fn < 4; fn++) {
+    int fb = fn & 1, same;
+    for (size_t i = 0; i < n; i++) {
+      if (fn < 2)
+        lfsr_rollback_word(a + i, in, fb);
+      else
+        ksa[i] = crypto1_word(a + i, in, fb);
+    }
+    if (fn < 2)
+      lfsr_rollback_word_batch(b, n, in, fb);
+    else
+      crypto1_word_batch(b, n, in, fb, ksb);
+    same = !memcmp(a, b, sizeof(a)) && (fn < 2 || !memcmp(ksa, ksb, sizeof(ksa)));
+    snprintf(what, sizeof(what), "%s (%s)", names[fn], crypto1_batch_backend());
+    check(same, what, fn);
+  }
+}
+
+// The candidates of the intersection against the keys both lists give
+// when every state is rolled back
+static void test_intersect(int pairs) {
+  struct Crypto1Recovery *ctx[2] = {lfsr_recovery_create(), lfsr_recovery_create()};
+  uint64_t *keys[2] = {malloc(sizeof(uint64_t) << 18), malloc(sizeof(uint64_t) << 18)};
+  int same = 1, found = 1, p = 0;
+
+  if (!ctx[0] || !ctx[1] || !keys[0] || !keys[1]) {
+    check(0, "allocating recovery contexts", 0);
+    goto out;
+  }
+  for (p = 0; p < pairs && same && found; p++) {
+    uint64_t key = rand48(), cand;
+    uint32_t uid = rand32(), len[2], in[2], n, m = 0, i, j;
+    struct Crypto1State *sl[2], *s;
+
+    for (i = 0; i < 2; i++) {
+      in[i] = rand32() ^ uid;
+      s = crypto1_create(key);
+      sl[i] = lfsr_recovery32_ctx(ctx[i], crypto1_word(s, in[i], 0), in[i]);
+      crypto1_destroy(s);
+      len[i] = statelist_len(sl[i]);
+      for (j = 0; j < len[i]; j++) {
+        struct Crypto1State t = sl[i][j];
+        lfsr_rollback_word(&t, in[i], 0);
+        crypto1_get_lfsr(&t, &keys[i][j]);
+      }
+      qsort(keys[i], len[i], sizeof(uint64_t), compare_keys);
+    }
+    // the keys in both lists, once each
+    for (i = j = 0; i < len[0] && j < len[1]; ) {
+      if (keys[0][i] < keys[1][j]) {
+        i++;
+      } else if (keys[0][i] > keys[1][j]) {
+        j++;
+      } else {
+        if (!m || keys[0][m - 1] != keys[0][i]) keys[0][m++] = keys[0][i];
+        i++;
+        j++;
+      }
+    }
+    n = lfsr_nested_intersect(sl, len, in);
+    same = n == m;
+    for (i = 0; i < n && same; i++) {
+      crypto1_get_lfsr(sl[0] + i, &cand);
+      same = bsearch(&cand, keys[0], m, sizeof(uint64_t), compare_keys) != NULL;
+    }
+    found = key_in(sl[0], n, 0, key);
+  }
+  check(same, "lfsr_nested_intersect gives the common keys", p);
+  check(found, "lfsr_nested_intersect keeps the key", p);
+out:
+  free(keys[0]);
+  free(keys[1]);
+  lfsr_recovery_destroy(ctx[0]);
+  lfsr_recovery_destroy(ctx[1]);
+  lfsr_recovery_pool_free();
+}
+
+// lfsr_common_prefix on several threads gives the states one thread gives,
+// with and without parities, on nonces like ReaderMifare() gets them
+static void test_darkside(int rounds) {
+  int same = 1, found = 1, r = 0, prev = lfsr_prefix_threads(0);
+
+  for (r = 0; r < rounds && same && found; r++) {
+    uint8_t no_par = r & 1, ks[8], par[8][8];
+    uint64_t key = rand48();
+    uint32_t uid = rand32(), nt = rand32(), nr = rand32() & 0xffffff1f, len[2];
+    struct Crypto1State *sl[2], *s;
+
+    for (int diff = 0; diff < 8; diff++) {
+      uint32_t nr_diff = nr | diff << 5;
+      s = crypto1_create(key);
+      crypto1_word(s, uid ^ nt, 0);
+      for (int i = 0; i < 8; i++) {
+        uint8_t c = i < 4 ? nr_diff >> (24 - 8 * i) : 0;
+        uint8_t plain = c ^ crypto1_byte(s, c, i < 4);
+        par[diff][i] = no_par ? 0 : !parity(plain) ^ filter(s->odd);
+      }
+      ks[diff] = 0;
+      for (int i = 0; i < 4; i++)
+        ks[diff] |= crypto1_bit(s, 0, 0) << i;
+      crypto1_destroy(s);
+    }
+    for (int m = 0; m < 2; m++) {
+      lfsr_prefix_threads(m ? 4 : 1);
+      sl[m] = lfsr_common_prefix(nr, 0, ks, par, no_par);
+      for (s = sl[m]; s && s->odd != -1; s++);
+      len[m] = s - sl[m];
+    }
+    same = sl[0] && sl[1] && len[0] == len[1] && !memcmp(sl[0], sl[1], len[0] * sizeof(*s));
+    // an empty list, or without parities one that misses the key, makes
+    // the attack retry with another nonce; with parities any state is it
+    if (!no_par && len[1]) found = key_in(sl[1], len[1], uid ^ nt, key);
+    free(sl[0]);
+    free(sl[1]);
+  }
+  lfsr_prefix_threads(prev);
+  check(same, "threaded lfsr_common_prefix gives the same states", r);
+  check(found, "lfsr_common_prefix with parities finds the key", r);
+}
+
+int main(int argc, char *argv[]) {
+  int n = argc > 1 ? atoi(argv[1]) : 4;
+
+  if (n <= 0) {
+    printf("syntax: %s [<count>]\n", argv[0]);
+    return 1;
+  }
+  srand(n);
+  printf("key recovery checks, %d keys each:\n", n);
+  test_recovery(n);
+  test_batch();
+  test_intersect(n);
+  test_darkside(n);
+  printf(failed ? "FAILED\n" : "all ok\n");
+  return failed;
+}